@@ -0,0 +1,652 @@
+// Sound
+// The four PSG channels and the two Direct Sound FIFOs are sampled at the host output rate. Nothing
+// runs per sample while the CPU executes: a scheduler event every AUDIO_BATCH_CYCLES mixes the samples
+// played since the last batch, and writes to the sound or timer registers mix up to the current cycle
+// first, so every sample sees the registers as they were when it played.
+//
+// Each channel is rendered into a line of 16 bit samples, then the lines are weighted, summed,
+// biased and clamped like the hardware's 10 bit output eight samples at a time with simd.h. The
+// channels are point sampled at the host rate, which holds each FIFO sample until the next timer
+// overflow the way the hardware's PWM output does, so there is no separate resampling pass.
+//
+// Finished samples go into a single producer / single consumer ring that the host audio callback
+// drains. The emulation thread publishes a whole chunk with one atomic store, and keeps the ring near
+// a target fill level by stretching or shrinking the sample period by up to 0.5%. The target grows
+// when the callback runs dry and slowly shrinks back while it does not.
+
+#ifndef AUDIO_H_
+#define AUDIO_H_
+
+#include "memory.h"
+#include "scheduler.h"
+#include "simd.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdint.h> // for uint16_t
+#include <string.h> // for memset
+
+// I/O register offsets
+#define AUDIO_SOUND1CNT_L 0x060 // Channel 1 sweep
+#define AUDIO_SOUND1CNT_H 0x062 // Channel 1 duty, length and envelope
+#define AUDIO_SOUND1CNT_X 0x064 // Channel 1 frequency and control
+#define AUDIO_SOUND2CNT_L 0x068 // Channel 2 duty, length and envelope
+#define AUDIO_SOUND2CNT_H 0x06C // Channel 2 frequency and control
+#define AUDIO_SOUND3CNT_L 0x070 // Channel 3 wave RAM selection
+#define AUDIO_SOUND3CNT_H 0x072 // Channel 3 length and volume
+#define AUDIO_SOUND3CNT_X 0x074 // Channel 3 frequency and control
+#define AUDIO_SOUND4CNT_L 0x078 // Channel 4 length and envelope
+#define AUDIO_SOUND4CNT_H 0x07C // Channel 4 frequency and control
+#define AUDIO_SOUNDCNT_L 0x080 // PSG volume and enables
+#define AUDIO_SOUNDCNT_H 0x082 // Direct Sound control and mixing
+#define AUDIO_SOUNDCNT_X 0x084 // Master enable and PSG channel status
+#define AUDIO_SOUNDBIAS 0x088 // Output bias level
+#define AUDIO_WAVE_RAM 0x090 // The channel 3 bank that is not playing, 16 bytes
+#define AUDIO_FIFO_A 0x0A0
+#define AUDIO_FIFO_B 0x0A4
+#define AUDIO_REGISTERS_END 0x0A8
+
+// SOUNDCNT_X bits
+#define AUDIO_MASTER_ENABLE 0x0080
+
+#define AUDIO_DEFAULT_RATE 32768 // Output rate without a host device, the hardware's default
+#define AUDIO_BATCH_CYCLES 8192 // Cycles between two mixing events, half a millisecond
+#define AUDIO_CHUNK 64 // Samples mixed at a time, a multiple of SIMD_LANES
+#define AUDIO_RING_SIZE 8192 // Stereo frames in the ring, a power of two
+#define AUDIO_FIFO_SIZE 32 // Bytes in each Direct Sound FIFO
+#define AUDIO_FIFO_REQUEST 16 // The FIFO asks for more data when it holds this many bytes or fewer
+#define AUDIO_SEQUENCER_CYCLES 32768 // The length, envelope and sweep units are clocked at 512 Hz
+#define AUDIO_CALM_BATCHES 4096 // Batches without an underrun before the target shrinks, 2 seconds
+
+// Samples from the emulator to the host
+typedef struct audio_ring {
+    uint32_t frames[AUDIO_RING_SIZE]; // Signed 16 bit stereo, left in the low half
+    volatile uint32_t head; // Next frame to write, only written by the producer
+    volatile uint32_t tail; // Next frame to read, only written by the consumer
+    volatile uint32_t underruns; // Frames the consumer had to make up, only written by the consumer
+    uint32_t last; // Frame repeated when the ring runs dry, consumer only
+    uint32_t rate; // Host sample rate
+    uint32_t minimum; // Lowest fill target, about one host buffer
+} audio_ring_t;
+
+// `rate` is the host sample rate and `buffer` the number of frames the host asks for at a time
+void audio_ring_init(audio_ring_t* ring, uint32_t rate, uint32_t buffer)
+{
+    memset(ring, 0, sizeof(audio_ring_t));
+    ring->rate = rate;
+    ring->minimum = buffer < AUDIO_RING_SIZE / 4 ? buffer : AUDIO_RING_SIZE / 4;
+}
+
+// Consumer side, fill `out` with `count` frames
+// If the ring runs dry the last frame is repeated and counted as an underrun
+void audio_ring_read(audio_ring_t* ring, uint32_t* out, uint32_t count)
+{
+    uint32_t tail = ring->tail;
+    uint32_t available = atomic_load32(&ring->head) - tail;
+    uint32_t n = available < count ? available : count;
+
+    for (uint32_t i = 0; i < n; i++) {
+        out[i] = ring->frames[(tail + i) & (AUDIO_RING_SIZE - 1)];
+    }
+    if (n > 0) {
+        ring->last = out[n - 1];
+        atomic_store32(&ring->tail, tail + n);
+    }
+
+    if (n < count) {
+        for (uint32_t i = n; i < count; i++) {
+            out[i] = ring->last;
+        }
+        atomic_store32(&ring->underruns, ring->underruns + (count - n));
+    }
+}
+
+// Producer side, frames that do not fit are dropped
+static void audio_ring_write(audio_ring_t* ring, const uint32_t* frames, uint32_t count)
+{
+    uint32_t head = ring->head;
+    uint32_t space = AUDIO_RING_SIZE - (head - atomic_load32(&ring->tail));
+    uint32_t n = count < space ? count : space;
+
+    for (uint32_t i = 0; i < n; i++) {
+        ring->frames[(head + i) & (AUDIO_RING_SIZE - 1)] = frames[i];
+    }
+    atomic_store32(&ring->head, head + n);
+}
+
+// PSG channel state
+typedef struct audio_channel {
+    uint8_t on; // Playing, reported in SOUNDCNT_X
+    uint8_t volume; // Envelope volume, 0-15
+    uint8_t envelope_timer; // Envelope clocks until the volume changes
+    uint8_t sweep_timer; // Sweep clocks until the frequency changes, channel 1 only
+    uint16_t length; // Length clocks until the channel stops, when the length is enabled
+    uint16_t lfsr; // Noise shift register, channel 4 only
+    uint8_t position; // Duty step (0-7) or wave sample (0-63)
+    uint64_t phase; // Time into the current step, in 1/65536 cycles
+} audio_channel_t;
+
+typedef struct audio_fifo {
+    int8_t samples[AUDIO_FIFO_SIZE];
+    uint8_t read; // Index of the oldest sample
+    uint8_t count;
+    int8_t level; // Sample being played
+} audio_fifo_t;
+
+// Called when FIFO `fifo` (0 for A) can take another 16 bytes, this is where sound DMA starts
+typedef void (*audio_fifo_request_t)(void* context, int fifo);
+
+typedef struct audio {
+    memory_t* memory;
+    scheduler_t* scheduler;
+    timers_t* timers; // Timers 0 and 1 pace the FIFOs
+    audio_ring_t* ring; // NULL when nothing plays the samples
+
+    audio_fifo_request_t fifo_request; // NULL until something refills the FIFOs
+    void* fifo_context;
+
+    audio_channel_t channels[4];
+    audio_fifo_t fifos[2];
+    uint8_t wave_ram[2][16]; // Both channel 3 banks, the I/O block only shows the one not playing
+
+    uint64_t time; // Time of the last sample, in 1/65536 cycles
+    uint64_t step; // Time between two samples, adjusted to keep the ring near `target`
+    uint64_t base_step; // Time between two samples at the nominal rate
+    uint32_t speed; // Emulated time per host time, 1 unless fast forwarding, see audio_set_speed
+    uint64_t fifo_time; // Cycle up to which timer overflows have been played from the FIFOs
+    uint64_t sequencer; // Time into the current frame sequencer step
+    uint8_t sequencer_step; // 0-7
+
+    uint32_t target; // Frames the ring should hold
+    uint32_t underruns; // Ring underrun count at the last adjustment
+    uint32_t calm; // Batches since the target last changed
+
+    uint16_t lines[6][AUDIO_CHUNK]; // Signed samples of PSG 1-4, FIFO A and FIFO B for the chunk
+    uint32_t out[AUDIO_CHUNK]; // Mixed stereo frames of the chunk
+} audio_t;
+
+void audio_batch(void* context, uint64_t when);
+
+static inline uint16_t audio_io16(const audio_t* audio, uint32_t offset)
+{
+    return memory_io_read16(audio->memory, offset);
+}
+
+// Set where the samples go, NULL when nothing plays them
+// The rate is taken from the ring. Without one the time still moves at AUDIO_DEFAULT_RATE, but no
+// samples are produced, see audio_skip
+void audio_set_output(audio_t* audio, audio_ring_t* ring)
+{
+    uint32_t rate = ring != NULL ? ring->rate : AUDIO_DEFAULT_RATE;
+    audio->ring = ring;
+    audio->base_step = ((uint64_t)16777216 << 16) / rate * (audio->speed > 0 ? audio->speed : 1);
+    audio->step = audio->base_step;
+    audio->target = ring != NULL ? 2 * ring->minimum : 0;
+    audio->underruns = ring != NULL ? atomic_load32(&ring->underruns) : 0;
+    audio->calm = 0;
+}
+
+// Spread the samples over `speed` times as much emulated time while the emulator runs that many
+// times faster than real time, so the host still gets its rate. Only one sample in `speed` is
+// produced, the channels are point sampled anyway and keep their state.
+void audio_set_speed(audio_t* audio, uint32_t speed)
+{
+    audio->speed = speed;
+    audio_set_output(audio, audio->ring);
+}
+
+// Power on state, `now` is the current CPU cycle
+void audio_reset(audio_t* audio, memory_t* memory, scheduler_t* scheduler, timers_t* timers, uint64_t now)
+{
+    audio->memory = memory;
+    audio->scheduler = scheduler;
+    audio->timers = timers;
+    memset(audio->channels, 0, sizeof(audio->channels));
+    memset(audio->fifos, 0, sizeof(audio->fifos));
+    memset(audio->wave_ram, 0, sizeof(audio->wave_ram));
+    audio_set_output(audio, audio->ring);
+
+    audio->time = now << 16;
+    audio->fifo_time = now;
+    audio->sequencer = 0;
+    audio->sequencer_step = 0;
+
+    memory_io_write16(memory, AUDIO_SOUNDBIAS, 0x200);
+    scheduler_schedule(scheduler, SCHEDULER_EVENT_AUDIO, now + AUDIO_BATCH_CYCLES, audio_batch, audio);
+}
+
+// Registers of each PSG channel: length and envelope, then frequency and control
+static const uint32_t audio_envelope_registers[4] = { AUDIO_SOUND1CNT_H, AUDIO_SOUND2CNT_L, AUDIO_SOUND3CNT_H, AUDIO_SOUND4CNT_L };
+static const uint32_t audio_control_registers[4] = { AUDIO_SOUND1CNT_X, AUDIO_SOUND2CNT_H, AUDIO_SOUND3CNT_X, AUDIO_SOUND4CNT_H };
+
+// Duty cycles of the square channels, one bit per step
+static const uint8_t audio_duty_patterns[4] = { 0x01, 0x81, 0x87, 0x7E };
+
+// Length, sweep and envelope clocks, at 256, 128 and 64 Hz
+static void audio_sequencer_clock(audio_t* audio)
+{
+    uint8_t step = audio->sequencer_step;
+    audio->sequencer_step = (step + 1) & 7;
+
+    for (int n = 0; n < 4; n++) {
+        audio_channel_t* channel = &audio->channels[n];
+        if (!channel->on) {
+            continue;
+        }
+
+        uint16_t envelope = audio_io16(audio, audio_envelope_registers[n]);
+        uint16_t control = audio_io16(audio, audio_control_registers[n]);
+
+        if ((step & 1) == 0 && (control & 0x4000) && channel->length > 0 && --channel->length == 0) {
+            channel->on = 0;
+            continue;
+        }
+
+        if (n == 0 && (step & 3) == 2) {
+            // Sweep: time in bits 4-6, decrease in bit 3, shift in bits 0-2
+            uint16_t sweep = audio_io16(audio, AUDIO_SOUND1CNT_L);
+            uint8_t time = (sweep >> 4) & 0x7;
+            if (time != 0 && --channel->sweep_timer == 0) {
+                channel->sweep_timer = time;
+                uint32_t frequency = control & 0x7FF;
+                uint32_t delta = frequency >> (sweep & 0x7);
+                uint32_t next = (sweep & 0x8) ? frequency - delta : frequency + delta;
+                if (next > 0x7FF) {
+                    channel->on = 0;
+                    continue;
+                }
+                if (sweep & 0x7) {
+                    memory_io_write16(audio->memory, AUDIO_SOUND1CNT_X, (uint16_t)((control & ~0x7FF) | next));
+                }
+            }
+        }
+
+        if (n != 2 && step == 7) {
+            // Envelope: step time in bits 8-10, increase in bit 11
+            uint8_t time = (envelope >> 8) & 0x7;
+            if (time != 0 && --channel->envelope_timer == 0) {
+                channel->envelope_timer = time;
+                if ((envelope & 0x800) && channel->volume < 15) {
+                    channel->volume++;
+                } else if (!(envelope & 0x800) && channel->volume > 0) {
+                    channel->volume--;
+                }
+            }
+        }
+    }
+}
+
+// Move a channel forward by `dt`, returns the number of whole steps of `period` cycles it went through
+static inline uint64_t audio_advance(audio_channel_t* channel, uint64_t period, uint64_t dt)
+{
+    uint64_t length = period << 16;
+    channel->phase += dt;
+    uint64_t steps = channel->phase / length;
+    channel->phase -= steps * length;
+    return steps;
+}
+
+// Output of PSG channel `n` for the next sample, -15 to 15
+static int audio_psg_sample(audio_t* audio, int n, uint64_t dt)
+{
+    audio_channel_t* channel = &audio->channels[n];
+    if (!channel->on) {
+        return 0;
+    }
+
+    uint16_t envelope = audio_io16(audio, audio_envelope_registers[n]);
+    uint16_t control = audio_io16(audio, audio_control_registers[n]);
+
+    switch (n) {
+    case 0:
+    case 1: {
+        // One duty step every (2048 - frequency) * 16 cycles
+        uint64_t steps = audio_advance(channel, (2048 - (uint64_t)(control & 0x7FF)) * 16, dt);
+        channel->position = (uint8_t)((channel->position + steps) & 7);
+        int high = (audio_duty_patterns[(envelope >> 6) & 0x3] >> channel->position) & 1;
+        return high ? channel->volume : -channel->volume;
+    }
+
+    case 2: {
+        // One 4 bit sample every (2048 - frequency) * 8 cycles, from one bank or both
+        uint16_t select = audio_io16(audio, AUDIO_SOUND3CNT_L);
+        uint32_t samples = (select & 0x20) ? 64 : 32;
+        uint64_t steps = audio_advance(channel, (2048 - (uint64_t)(control & 0x7FF)) * 8, dt);
+        channel->position = (uint8_t)((channel->position + steps) % samples);
+
+        uint32_t bank = (((select >> 6) & 1) + channel->position / 32) & 1;
+        uint8_t byte = audio->wave_ram[bank][(channel->position % 32) / 2];
+        int sample = (channel->position & 1) ? byte & 0xF : byte >> 4;
+        int value = sample * 2 - 15;
+
+        // Volume in bits 13-14 (0%, 100%, 50%, 25%), bit 15 forces 75%
+        if (envelope & 0x8000) {
+            return value * 3 / 4;
+        }
+        switch ((envelope >> 13) & 0x3) {
+        case 0:
+            return 0;
+        case 1:
+            return value;
+        case 2:
+            return value / 2;
+        default:
+            return value / 4;
+        }
+    }
+
+    default: {
+        // The shift register is clocked every 64 * ratio << shift cycles, with ratio 0 counting
+        // as 0.5, and never with shifts of 14 and 15
+        uint32_t shift = (control >> 4) & 0xF;
+        uint32_t ratio = control & 0x7;
+        if (shift < 14) {
+            uint64_t steps = audio_advance(channel, (ratio != 0 ? 64 * (uint64_t)ratio : 32) << shift, dt);
+            for (uint64_t i = 0; i < steps; i++) {
+                uint16_t bit = (channel->lfsr ^ (channel->lfsr >> 1)) & 1;
+                channel->lfsr = (uint16_t)((channel->lfsr >> 1) | (bit << 14));
+                if (control & 0x8) {
+                    channel->lfsr = (uint16_t)((channel->lfsr & ~0x40) | (bit << 6));
+                }
+            }
+        }
+        return (channel->lfsr & 1) ? -channel->volume : channel->volume;
+    }
+    }
+}
+
+// Play the next sample of a FIFO
+static void audio_fifo_pop(audio_t* audio, int n)
+{
+    audio_fifo_t* fifo = &audio->fifos[n];
+    if (fifo->count > 0) {
+        fifo->level = fifo->samples[fifo->read];
+        fifo->read = (fifo->read + 1) % AUDIO_FIFO_SIZE;
+        fifo->count--;
+    }
+
+    if (fifo->count <= AUDIO_FIFO_REQUEST && audio->fifo_request != NULL) {
+        audio->fifo_request(audio->fifo_context, n);
+    }
+}
+
+static void audio_fifo_push(audio_fifo_t* fifo, int8_t sample)
+{
+    if (fifo->count < AUDIO_FIFO_SIZE) {
+        fifo->samples[(fifo->read + fifo->count) % AUDIO_FIFO_SIZE] = sample;
+        fifo->count++;
+    }
+}
+
+// Sum the channel lines into stereo frames
+static void audio_mix(audio_t* audio, int count)
+{
+    uint16_t soundcnt_l = audio_io16(audio, AUDIO_SOUNDCNT_L);
+    uint16_t soundcnt_h = audio_io16(audio, AUDIO_SOUNDCNT_H);
+    uint16_t bias = audio_io16(audio, AUDIO_SOUNDBIAS) & 0x3FF;
+    int master = (audio_io16(audio, AUDIO_SOUNDCNT_X) & AUDIO_MASTER_ENABLE) != 0;
+
+    // Weights at 4 times the 10 bit output scale: PSG channels are multiplied by the side's master
+    // volume plus one and 1, 2 or 4 for 25%, 50% and 100%, FIFO samples by 2 or 4 for 50% and 100%
+    uint16_t weights[2][6];
+    for (int side = 0; side < 2; side++) {
+        uint16_t psg = (uint16_t)((((soundcnt_l >> (side ? 4 : 0)) & 0x7) + 1) << ((soundcnt_h & 0x3) < 2 ? (soundcnt_h & 0x3) : 2));
+        for (int n = 0; n < 4; n++) {
+            weights[side][n] = master && (soundcnt_l & (0x100 << (n + (side ? 4 : 0)))) ? psg : 0;
+        }
+        for (int n = 0; n < 2; n++) {
+            uint16_t volume = (soundcnt_h & (0x4 << n)) ? 16 : 8;
+            weights[side][4 + n] = master && (soundcnt_h & (0x100 << (n * 4 + side))) ? volume : 0;
+        }
+    }
+
+    // The sum stays within +-6016, so lanes never overflow and the offset keeps them positive for
+    // the clamp, then the 10 bit result is centered and scaled to 16 bits
+    simd_u16_t offset = simd_set1((uint16_t)(4 * (0x1000 + bias)));
+    simd_u16_t low = simd_set1(0x1000);
+    simd_u16_t high = simd_set1(0x13FF);
+    simd_u16_t center = simd_set1(0x1200);
+
+    for (int i = count; i < (count + SIMD_LANES - 1) / SIMD_LANES * SIMD_LANES; i++) {
+        for (int n = 0; n < 6; n++) {
+            audio->lines[n][i] = 0;
+        }
+    }
+
+    for (int i = 0; i < count; i += SIMD_LANES) {
+        simd_u16_t sides[2];
+        for (int side = 0; side < 2; side++) {
+            simd_u16_t sum = offset;
+            for (int n = 0; n < 6; n++) {
+                sum = simd_add(sum, simd_mul(simd_load(&audio->lines[n][i]), simd_set1(weights[side][n])));
+            }
+            simd_u16_t level = simd_min(simd_max(simd_shr(sum, 2), low), high);
+            sides[side] = simd_shl(simd_sub(level, center), 6);
+        }
+
+        // Side 0 is the right one, as in SOUNDCNT_L, frames hold the left one in the low half
+        simd_store_interleaved(&audio->out[i], sides[1], sides[0]);
+    }
+
+    if (audio->ring != NULL) {
+        audio_ring_write(audio->ring, audio->out, (uint32_t)count);
+    }
+}
+
+// Move to the last sample up to `end` without producing any, for when nothing plays them
+// Only what the game can see keeps going: the frame sequencer (lengths, envelopes and sweeps show
+// in SOUNDCNT_X) and the FIFOs with their DMA requests. The PSG waveforms are not generated.
+static void audio_skip(audio_t* audio, uint64_t end)
+{
+    uint64_t dt = (end - audio->time) / audio->step * audio->step;
+    audio->time += dt;
+
+    audio->sequencer += dt;
+    while (audio->sequencer >= (uint64_t)AUDIO_SEQUENCER_CYCLES << 16) {
+        audio->sequencer -= (uint64_t)AUDIO_SEQUENCER_CYCLES << 16;
+        audio_sequencer_clock(audio);
+    }
+
+    uint64_t cycle = audio->time >> 16;
+    uint16_t soundcnt_h = audio_io16(audio, AUDIO_SOUNDCNT_H);
+    for (int n = 0; n < 2; n++) {
+        uint64_t overflows = timer_overflows(audio->timers, (soundcnt_h >> (10 + 4 * n)) & 1, audio->fifo_time, cycle);
+        for (; overflows > 0; overflows--) {
+            audio_fifo_pop(audio, n);
+        }
+    }
+    audio->fifo_time = cycle;
+}
+
+// Play every sample up to cycle `now`
+void audio_sync(audio_t* audio, uint64_t now)
+{
+    uint64_t end = now << 16;
+    if (audio->ring == NULL) {
+        if (audio->time + audio->step <= end) {
+            audio_skip(audio, end);
+        }
+        return;
+    }
+
+    while (audio->time + audio->step <= end) {
+        int count = 0;
+        for (; count < AUDIO_CHUNK && audio->time + audio->step <= end; count++) {
+            uint64_t dt = audio->step;
+            audio->time += dt;
+
+            audio->sequencer += dt;
+            while (audio->sequencer >= (uint64_t)AUDIO_SEQUENCER_CYCLES << 16) {
+                audio->sequencer -= (uint64_t)AUDIO_SEQUENCER_CYCLES << 16;
+                audio_sequencer_clock(audio);
+            }
+
+            for (int n = 0; n < 4; n++) {
+                audio->lines[n][count] = (uint16_t)audio_psg_sample(audio, n, dt);
+            }
+
+            // FIFO A uses the timer in bit 10 of SOUNDCNT_H, FIFO B the one in bit 14
+            uint64_t cycle = audio->time >> 16;
+            uint16_t soundcnt_h = audio_io16(audio, AUDIO_SOUNDCNT_H);
+            for (int n = 0; n < 2; n++) {
+                uint64_t overflows = timer_overflows(audio->timers, (soundcnt_h >> (10 + 4 * n)) & 1, audio->fifo_time, cycle);
+                for (; overflows > 0; overflows--) {
+                    audio_fifo_pop(audio, n);
+                }
+                audio->lines[4 + n][count] = (uint16_t)audio->fifos[n].level;
+            }
+            audio->fifo_time = cycle;
+        }
+
+        audio_mix(audio, count);
+    }
+}
+
+// Scheduler event, mix the batch and steer the ring towards its target
+void audio_batch(void* context, uint64_t when)
+{
+    audio_t* audio = (audio_t*)context;
+    audio_sync(audio, when);
+    scheduler_schedule(audio->scheduler, SCHEDULER_EVENT_AUDIO, when + AUDIO_BATCH_CYCLES, audio_batch, audio);
+
+    audio_ring_t* ring = audio->ring;
+    if (ring == NULL) {
+        return;
+    }
+
+    // The target grows by half when the host ran dry, and shrinks by an eighth after a calm period
+    uint32_t underruns = atomic_load32(&ring->underruns);
+    if (underruns != audio->underruns) {
+        audio->underruns = underruns;
+        audio->target += audio->target / 2;
+        if (audio->target > AUDIO_RING_SIZE / 2) {
+            audio->target = AUDIO_RING_SIZE / 2;
+        }
+        audio->calm = 0;
+    } else if (++audio->calm >= AUDIO_CALM_BATCHES) {
+        audio->calm = 0;
+        audio->target -= audio->target / 8;
+        if (audio->target < ring->minimum) {
+            audio->target = ring->minimum;
+        }
+    }
+
+    // Samples are spaced further apart while the ring is above the target, and closer below it
+    int64_t fill = (int64_t)(ring->head - atomic_load32(&ring->tail));
+    int64_t error = fill - (int64_t)audio->target;
+    if (error > (int64_t)audio->target) {
+        error = (int64_t)audio->target;
+    } else if (error < -(int64_t)audio->target) {
+        error = -(int64_t)audio->target;
+    }
+    audio->step = (uint64_t)((int64_t)audio->base_step + (int64_t)audio->base_step / 200 * error / (int64_t)(audio->target > 0 ? audio->target : 1));
+}
+
+// Start PSG channel `n`
+static void audio_trigger(audio_t* audio, int n)
+{
+    audio_channel_t* channel = &audio->channels[n];
+    uint16_t envelope = audio_io16(audio, audio_envelope_registers[n]);
+
+    channel->on = 1;
+    channel->position = 0;
+    channel->phase = 0;
+    channel->volume = (uint8_t)(envelope >> 12);
+    channel->envelope_timer = (envelope >> 8) & 0x7;
+    if (channel->length == 0) {
+        channel->length = n == 2 ? 256 : 64;
+    }
+
+    if (n == 0) {
+        uint8_t time = (audio_io16(audio, AUDIO_SOUND1CNT_L) >> 4) & 0x7;
+        channel->sweep_timer = time != 0 ? time : 8;
+    } else if (n == 2) {
+        // Without its DAC enabled in SOUND3CNT_L the wave channel stays silent
+        channel->on = (audio_io16(audio, AUDIO_SOUND3CNT_L) & 0x80) != 0;
+    } else if (n == 3) {
+        channel->lfsr = (audio_io16(audio, AUDIO_SOUND4CNT_H) & 0x8) ? 0x7F : 0x7FFF;
+    }
+}
+
+// Bring SOUNDCNT_X up to date before it is read
+void audio_read(audio_t* audio, uint64_t now)
+{
+    audio_sync(audio, now);
+
+    uint16_t status = audio_io16(audio, AUDIO_SOUNDCNT_X) & ~0xF;
+    for (int n = 0; n < 4; n++) {
+        status |= audio->channels[n].on << n;
+    }
+    memory_io_write16(audio->memory, AUDIO_SOUNDCNT_X, status);
+}
+
+// `size` bytes of sound registers were written at `offset`
+void audio_write(audio_t* audio, uint32_t offset, int size, uint64_t now)
+{
+    memory_t* memory = audio->memory;
+
+    // FIFO writes only queue samples, so they do not need the samples before them mixed
+    if (offset >= AUDIO_FIFO_A) {
+        for (int i = 0; i < size; i++) {
+            audio_fifo_push(&audio->fifos[(offset + i - AUDIO_FIFO_A) / 4], (int8_t)memory->io[offset + i]);
+        }
+        return;
+    }
+
+    audio_sync(audio, now);
+
+    for (uint32_t address = offset; address < offset + (uint32_t)size; address++) {
+        uint8_t value = (uint8_t)memory->io[address];
+
+        // Lengths are loaded when written, the wave channel has 8 length bits and the others 6
+        for (int n = 0; n < 4; n++) {
+            if (address == audio_envelope_registers[n]) {
+                audio->channels[n].length = n == 2 ? 256 - value : 64 - (value & 0x3F);
+            }
+        }
+
+        // Bit 15 of the control registers restarts the channel and always reads as 0
+        for (int n = 0; n < 4; n++) {
+            if (address == audio_control_registers[n] + 1 && (value & 0x80)) {
+                memory->io[address] = (char)(value & 0x7F);
+                audio_trigger(audio, n);
+            }
+        }
+
+        switch (address) {
+        case AUDIO_SOUND3CNT_L:
+            // The CPU sees the bank that is not selected for playing
+            memcpy(&memory->io[AUDIO_WAVE_RAM], audio->wave_ram[!((value >> 6) & 1)], 16);
+            if (!(value & 0x80)) {
+                audio->channels[2].on = 0;
+            }
+            break;
+
+        case AUDIO_SOUNDCNT_H + 1:
+            // Bits 11 and 15 empty the FIFOs and read as 0
+            for (int n = 0; n < 2; n++) {
+                if (value & (0x08 << (n * 4))) {
+                    audio->fifos[n].count = 0;
+                    audio->fifos[n].level = 0;
+                }
+            }
+            memory->io[address] = (char)(value & 0x77);
+            break;
+
+        case AUDIO_SOUNDCNT_X:
+            if (!(value & AUDIO_MASTER_ENABLE)) {
+                memset(audio->channels, 0, sizeof(audio->channels));
+            }
+            break;
+
+        default:
+            if (address >= AUDIO_WAVE_RAM && address < AUDIO_WAVE_RAM + 16) {
+                uint32_t bank = !((audio_io16(audio, AUDIO_SOUND3CNT_L) >> 6) & 1);
+                audio->wave_ram[bank][address - AUDIO_WAVE_RAM] = value;
+            }
+            break;
+        }
+    }
+}
+
+#endif // AUDIO_H_
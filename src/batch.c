@@ -0,0 +1,217 @@
+// Headless batch runner
+// Runs every cartridge given on the command line for a number of frames, as many times as asked,
+// with each run on its own instance. The runs are tasks on a work stealing pool with one thread per
+// processor by default. Instances share the read only BIOS and cartridge mappings and nothing else,
+// so runs on different threads never touch the same writable memory.
+//
+// Usage: gbabatch [-b bios] [-j threads] [-n runs per cartridge] [-f frames] [-s skip] [-r] [-i] <rom>...
+// -r only runs the PPU timing, without drawing the frames, -s draws one frame out of every skip + 1
+// The cartridges start right away unless -i asks to run the BIOS intro first, which needs -b
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file.h"
+#include "gba.h"
+#include "pool.h"
+#include "thread.h"
+#include "turbo.h"
+
+#define BATCH_FRAMES 600 // Frames per run by default, 10 seconds of GBA time
+
+// Frames the GBA shows per second, about 59.73
+#define BATCH_GBA_FPS ((double)GBA_CYCLES_PER_SECOND / PPU_FRAME_CYCLES)
+
+typedef struct batch_run {
+    uint32_t rom; // Index in batch_t::roms
+    uint32_t frames; // Frames completed
+    uint64_t time_ns; // Time spent running the frames
+    int result; // GBA_RUN_* of the last frame, -1 if the instance could not be created
+} batch_run_t;
+
+typedef struct batch {
+    file_map_t bios;
+    file_map_t* roms;
+    const char** rom_paths;
+    uint32_t rom_count;
+    uint32_t frames;
+    uint32_t skip; // Frames skipped after each drawn one
+    int render;
+    int intro;
+    batch_run_t* runs;
+} batch_t;
+
+// Pool task, run `task` from start to finish on a fresh instance
+static int batch_run(void* context, uint32_t task)
+{
+    batch_t* batch = (batch_t*)context;
+    batch_run_t* run = &batch->runs[task];
+    const file_map_t* rom = &batch->roms[run->rom];
+
+    // gba_t is too large for a thread stack
+    gba_t* gba = (gba_t*)malloc(sizeof(gba_t));
+    if (gba == NULL || gba_init(gba)) {
+        free(gba);
+        run->result = -1;
+        return 1;
+    }
+
+    gba_attach_images(gba, batch->bios.data, rom->data, (uint32_t)rom->size);
+    if (!batch->render) {
+        ppu_set_framebuffer(&gba->ppu, NULL, 0);
+    }
+    gba->fast_boot = !batch->intro;
+    gba_reset(gba);
+
+    turbo_t turbo;
+    turbo_init(&turbo, batch->skip, batch->skip);
+
+    uint64_t start = thread_time_ns();
+    run->result = GBA_RUN_FRAME;
+    while (run->frames < batch->frames && run->result == GBA_RUN_FRAME) {
+        if (batch->render) {
+            ppu_set_framebuffer(&gba->ppu, turbo_draw(&turbo) ? gba->framebuffer : NULL, PPU_WIDTH);
+        }
+        run->result = gba_run_frame(gba);
+        run->frames += run->result == GBA_RUN_FRAME;
+    }
+    run->time_ns = thread_time_ns() - start;
+
+    gba_free(gba);
+    free(gba);
+    return run->result == GBA_RUN_ERROR;
+}
+
+static double batch_fps(uint64_t frames, uint64_t time_ns)
+{
+    return time_ns > 0 ? (double)frames * 1e9 / (double)time_ns : 0.0;
+}
+
+static void batch_usage(const char* program)
+{
+    printf("Usage: %s [-b bios] [-j threads] [-n runs per cartridge] [-f frames] [-s skip] [-r] [-i] <rom>...\n", program);
+    printf("  -b  BIOS image, for -i and the calls bios.h does not run natively\n");
+    printf("  -j  Threads to run on, one per processor by default\n");
+    printf("  -n  Runs of each cartridge, 1 by default\n");
+    printf("  -f  Frames per run, %d by default\n", BATCH_FRAMES);
+    printf("  -s  Frames skipped after each drawn one, 0 by default\n");
+    printf("  -r  Only run the PPU timing, without drawing the frames\n");
+    printf("  -i  Run the BIOS intro before each cartridge\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* bios_path = NULL;
+    uint32_t threads = thread_cpu_count();
+    uint32_t copies = 1;
+
+    static batch_t batch;
+    batch.frames = BATCH_FRAMES;
+    batch.render = 1;
+    batch.rom_paths = (const char**)calloc(argc, sizeof(const char*));
+    if (batch.rom_paths == NULL) {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        const char* option = argv[i];
+        if (option[0] != '-') {
+            batch.rom_paths[batch.rom_count++] = option;
+        } else if (strcmp(option, "-r") == 0) {
+            batch.render = 0;
+        } else if (strcmp(option, "-i") == 0) {
+            batch.intro = 1;
+        } else if (i + 1 < argc && strcmp(option, "-b") == 0) {
+            bios_path = argv[++i];
+        } else if (i + 1 < argc && strcmp(option, "-j") == 0) {
+            threads = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && strcmp(option, "-n") == 0) {
+            copies = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && strcmp(option, "-f") == 0) {
+            batch.frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && strcmp(option, "-s") == 0) {
+            batch.skip = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else {
+            batch_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((batch.intro && bios_path == NULL) || batch.rom_count == 0 || threads == 0 || copies == 0) {
+        batch_usage(argv[0]);
+        return 1;
+    }
+
+    // Build the instruction decode tables, they are shared by every instance
+    cpu_init_tables();
+
+    // Map every image once, the instances read them through the same mappings
+    if (bios_path == NULL) {
+        // No BIOS, batch.bios stays empty and the instances boot straight into the cartridge
+    } else if (file_map_open(&batch.bios, bios_path)) {
+        printf("Failed to open BIOS file %s\n", bios_path);
+        return 1;
+    } else if (batch.bios.size != MEMORY_BIOS_SIZE) {
+        printf("Invalid BIOS file %s\n", bios_path);
+        return 1;
+    }
+
+    batch.roms = (file_map_t*)calloc(batch.rom_count, sizeof(file_map_t));
+    batch.runs = (batch_run_t*)calloc((size_t)batch.rom_count * copies, sizeof(batch_run_t));
+    if (batch.roms == NULL || batch.runs == NULL) {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+
+    for (uint32_t r = 0; r < batch.rom_count; r++) {
+        if (file_map_open(&batch.roms[r], batch.rom_paths[r])) {
+            printf("Failed to open ROM file %s\n", batch.rom_paths[r]);
+            return 1;
+        } else if (gba_check_rom_header(batch.roms[r].data, batch.roms[r].size)) {
+            printf("Invalid ROM file %s\n", batch.rom_paths[r]);
+            return 1;
+        }
+    }
+
+    // Runs of the same cartridge are spread over the task list, so threads start on different ones
+    uint32_t count = batch.rom_count * copies;
+    for (uint32_t task = 0; task < count; task++) {
+        batch.runs[task].rom = task % batch.rom_count;
+    }
+
+    uint64_t start = thread_time_ns();
+    int failed = pool_run(threads, count, batch_run, &batch);
+    uint64_t elapsed = thread_time_ns() - start;
+    if (failed < 0) {
+        printf("Failed to start the threads\n");
+        return 1;
+    }
+
+    printf("%8s  %-32s %8s %9s %9s  %s\n", "run", "rom", "frames", "seconds", "fps", "result");
+    uint64_t total = 0;
+    for (uint32_t task = 0; task < count; task++) {
+        const batch_run_t* run = &batch.runs[task];
+        const char* result = run->result == GBA_RUN_FRAME ? "ok"
+            : run->result == GBA_RUN_ENDED                ? "ended"
+            : run->result == GBA_RUN_ERROR                ? "error"
+                                                          : "no memory";
+        printf("%8u  %-32s %8u %9.3f %9.1f  %s\n", task, batch.rom_paths[run->rom], run->frames, run->time_ns / 1e9,
+            batch_fps(run->frames, run->time_ns), result);
+        total += run->frames;
+    }
+
+    double fps = batch_fps(total, elapsed);
+    printf("%u runs on %u threads: %llu frames in %.3f s, %.1f fps (%.1fx real time)\n", count, threads,
+        (unsigned long long)total, elapsed / 1e9, fps, fps / BATCH_GBA_FPS);
+
+    for (uint32_t r = 0; r < batch.rom_count; r++) {
+        file_map_close(&batch.roms[r]);
+    }
+    file_map_close(&batch.bios);
+    free(batch.roms);
+    free(batch.runs);
+    free(batch.rom_paths);
+    return failed != 0;
+}
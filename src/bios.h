@@ -0,0 +1,429 @@
+// High level BIOS
+// The software interrupts that games call all the time (division, square root, arc tangent, memory
+// copies, decompression and affine matrix set up) are done in C instead of running the BIOS code.
+// They read and write guest memory through the bus, so watched pages see the writes as usual. The
+// Halt and IntrWait calls put the bus in Halt, IntrWait goes round again each time the CPU wakes
+// until one of the interrupts it waits for was acknowledged in the BIOS interrupt flags.
+//
+// Any other call enters the BIOS through the SWI vector, or does nothing when no BIOS is mapped.
+
+#ifndef BIOS_H_
+#define BIOS_H_
+
+#include "bus.h"
+
+#include <stdint.h> // for uint32_t
+#include <string.h> // for memset
+
+// bios_swi results
+#define BIOS_SWI_NONE 0 // Not done here, enter the BIOS
+#define BIOS_SWI_DONE 1 // Done, carry on after the SWI instruction
+#define BIOS_SWI_WAIT 2 // Halted, run the SWI instruction again once the CPU wakes
+
+// Interrupt flags the interrupt handler sets for IntrWait, a mirror of 03FFFFF8
+#define BIOS_IRQ_FLAGS 0x03007FF8
+
+// The BIOS interrupt dispatcher calls the handler at the address in BIOS_IRQ_HANDLER, which returns
+// to BIOS_IRQ_RETURN, see gba_irq_enter
+#define BIOS_IRQ_HANDLER 0x03007FFC
+#define BIOS_IRQ_RETURN 0x00000138
+#define BIOS_IRQ_STACK 0x03007FA0 // IRQ mode stack the BIOS sets up
+#define BIOS_SVC_STACK 0x03007FE0 // Supervisor mode stack
+#define BIOS_USER_STACK 0x03007F00 // User and System mode stack
+
+// CpuSet / CpuFastSet control bits in r2
+#define BIOS_SET_COUNT 0x001FFFFF
+#define BIOS_SET_FILL 0x01000000 // Copy the first source unit to every destination unit
+#define BIOS_SET_WORD 0x04000000 // 32 bit units, CpuFastSet always uses them
+
+// Sine in 1.14 fixed point for the first quarter of a 256 step turn, see bios_sin
+static const int16_t bios_sine[65] = {
+    0, 402, 804, 1205, 1606, 2006, 2404, 2801, 3196, 3590, 3981, 4370, 4756,
+    5139, 5520, 5897, 6270, 6639, 7005, 7366, 7723, 8076, 8423, 8765, 9102, 9434,
+    9760, 10080, 10394, 10702, 11003, 11297, 11585, 11866, 12140, 12406, 12665, 12916, 13160,
+    13395, 13623, 13842, 14053, 14256, 14449, 14635, 14811, 14978, 15137, 15286, 15426, 15557,
+    15679, 15791, 15893, 15986, 16069, 16143, 16207, 16261, 16305, 16340, 16364, 16379, 16384,
+};
+
+// Sine and cosine of `angle` turns / 256, 1.14 fixed point
+static inline int32_t bios_sin(uint32_t angle)
+{
+    angle &= 0xFF;
+    int32_t value = bios_sine[(angle & 0x40) ? 0x40 - (angle & 0x3F) : (angle & 0x3F)];
+    return (angle & 0x80) ? -value : value;
+}
+
+static inline int32_t bios_cos(uint32_t angle)
+{
+    return bios_sin(angle + 0x40);
+}
+
+// Signed division, r0 / r1 into r0 (quotient), r1 (remainder) and r3 (absolute quotient)
+// The BIOS never returns from a division by 0, this gives the sign of the numerator instead
+static void bios_div(uint32_t* r, int32_t numerator, int32_t denominator)
+{
+    int64_t quotient;
+    int64_t remainder;
+    if (denominator == 0) {
+        quotient = numerator < 0 ? -1 : 1;
+        remainder = numerator;
+    } else {
+        quotient = (int64_t)numerator / denominator;
+        remainder = (int64_t)numerator % denominator;
+    }
+    r[0] = (uint32_t)quotient;
+    r[1] = (uint32_t)remainder;
+    r[3] = (uint32_t)(quotient < 0 ? -quotient : quotient);
+}
+
+// Integer square root of an unsigned 32 bit value
+static uint32_t bios_sqrt(uint32_t value)
+{
+    uint32_t root = 0;
+    for (uint32_t bit = 1u << 30; bit != 0; bit >>= 2) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return root;
+}
+
+// Arc tangent of a 1.14 fixed point tangent between -1 and 1, in 1/65536 turns
+// The polynomial and its rounding are the BIOS's own
+static int32_t bios_arctan(int32_t tangent)
+{
+    int32_t a = -((tangent * tangent) >> 14);
+    int32_t b = ((0xA9 * a) >> 14) + 0x390;
+    b = ((b * a) >> 14) + 0x91C;
+    b = ((b * a) >> 14) + 0xFB6;
+    b = ((b * a) >> 14) + 0x16AA;
+    b = ((b * a) >> 14) + 0x2081;
+    b = ((b * a) >> 14) + 0x3651;
+    b = ((b * a) >> 14) + 0xA2F9;
+    return (tangent * b) >> 16;
+}
+
+// Angle of the vector (x, y), 1.14 fixed point, in 1/65536 turns from 0 to 0xFFFF
+static uint32_t bios_arctan2(int32_t x, int32_t y)
+{
+    if (y == 0) {
+        return x >= 0 ? 0 : 0x8000;
+    }
+    if (x == 0) {
+        return y >= 0 ? 0x4000 : 0xC000;
+    }
+
+    int32_t angle;
+    if (y >= 0) {
+        if (x >= 0 && x >= y) {
+            angle = bios_arctan((y * 0x4000) / x);
+        } else if (x < 0 && -x >= y) {
+            angle = bios_arctan((y * 0x4000) / x) + 0x8000;
+        } else {
+            angle = 0x4000 - bios_arctan((x * 0x4000) / y);
+        }
+    } else {
+        if (x <= 0 && -x > -y) {
+            angle = bios_arctan((y * 0x4000) / x) + 0x8000;
+        } else if (x > 0 && x >= -y) {
+            angle = bios_arctan((y * 0x4000) / x) + 0x10000;
+        } else {
+            angle = 0xC000 - bios_arctan((x * 0x4000) / y);
+        }
+    }
+    return (uint32_t)angle & 0xFFFF;
+}
+
+// CpuSet, halfword or word copies and fills of r2 bits 0-20 units
+static void bios_cpu_set(bus_t* bus, uint32_t source, uint32_t dest, uint32_t control)
+{
+    uint32_t count = control & BIOS_SET_COUNT;
+    int size = (control & BIOS_SET_WORD) ? 4 : 2;
+    uint32_t step = (control & BIOS_SET_FILL) ? 0 : (uint32_t)size;
+
+    for (uint32_t i = 0; i < count; i++, source += step, dest += (uint32_t)size) {
+        if (size == 4) {
+            bus_write32(bus, dest, bus_read32(bus, source));
+        } else {
+            bus_write16(bus, dest, bus_read16(bus, source));
+        }
+    }
+}
+
+// CpuFastSet, word copies and fills in blocks of 8 words, the count is rounded up to a whole block
+static void bios_cpu_fast_set(bus_t* bus, uint32_t source, uint32_t dest, uint32_t control)
+{
+    uint32_t count = ((control & BIOS_SET_COUNT) + 7) & ~7u;
+    uint32_t step = (control & BIOS_SET_FILL) ? 0 : 4;
+
+    for (uint32_t i = 0; i < count; i++, source += step, dest += 4) {
+        bus_write32(bus, dest, bus_read32(bus, source));
+    }
+}
+
+// Output of the decompression calls
+// The VRAM versions can only store halfwords, so bytes are paired before they are written
+typedef struct bios_output {
+    bus_t* bus;
+    uint32_t address;
+    int halfwords;
+    uint8_t pending; // Low byte of the halfword being assembled
+    uint8_t window[4096]; // The last bytes written, LZ77 copies from up to 4096 bytes back
+    uint32_t written;
+} bios_output_t;
+
+static void bios_output_byte(bios_output_t* out, uint8_t value)
+{
+    out->window[out->written & 0xFFF] = value;
+    if (!out->halfwords) {
+        bus_write8(out->bus, out->address++, value);
+    } else if (out->written & 1) {
+        bus_write16(out->bus, out->address, (uint16_t)(out->pending | (value << 8)));
+        out->address += 2;
+    } else {
+        out->pending = value;
+    }
+    out->written++;
+}
+
+// LZ77UnComp, `size` bytes from the stream after the 4 byte header
+static void bios_lz77(bus_t* bus, uint32_t source, uint32_t dest, int halfwords)
+{
+    bios_output_t out;
+    uint32_t size = bus_read32(bus, source) >> 8;
+    source += 4;
+
+    out.bus = bus;
+    out.address = dest;
+    out.halfwords = halfwords;
+    out.written = 0;
+    memset(out.window, 0, sizeof(out.window));
+
+    while (out.written < size) {
+        uint8_t flags = bus_read8(bus, source++);
+        for (int bit = 7; bit >= 0 && out.written < size; bit--) {
+            if (!((flags >> bit) & 1)) {
+                bios_output_byte(&out, bus_read8(bus, source++));
+                continue;
+            }
+
+            // Three or more bytes copied from `distance` bytes back
+            uint8_t high = bus_read8(bus, source++);
+            uint8_t low = bus_read8(bus, source++);
+            uint32_t length = (high >> 4) + 3;
+            uint32_t distance = (((uint32_t)(high & 0xF) << 8) | low) + 1;
+            for (uint32_t i = 0; i < length && out.written < size; i++) {
+                bios_output_byte(&out, out.window[(out.written - distance) & 0xFFF]);
+            }
+        }
+    }
+}
+
+// RLUnComp, `size` bytes from the stream after the 4 byte header
+static void bios_run_length(bus_t* bus, uint32_t source, uint32_t dest, int halfwords)
+{
+    bios_output_t out;
+    uint32_t size = bus_read32(bus, source) >> 8;
+    source += 4;
+
+    out.bus = bus;
+    out.address = dest;
+    out.halfwords = halfwords;
+    out.written = 0;
+    memset(out.window, 0, sizeof(out.window));
+
+    while (out.written < size) {
+        uint8_t flag = bus_read8(bus, source++);
+        if (flag & 0x80) {
+            // A run of one byte
+            uint8_t value = bus_read8(bus, source++);
+            for (uint32_t i = 0; i < (uint32_t)(flag & 0x7F) + 3 && out.written < size; i++) {
+                bios_output_byte(&out, value);
+            }
+        } else {
+            for (uint32_t i = 0; i < (uint32_t)(flag & 0x7F) + 1 && out.written < size; i++) {
+                bios_output_byte(&out, bus_read8(bus, source++));
+            }
+        }
+    }
+}
+
+// HuffUnComp, `size` bytes of 4 or 8 bit symbols, written a word at a time
+// The tree follows the header, each node holds the offset to its pair of children in bits 0-5 and
+// flags the children that are leaves in bits 7 (left) and 6 (right). The bit stream follows the tree
+// in words, read from bit 31 down.
+static void bios_huffman(bus_t* bus, uint32_t source, uint32_t dest)
+{
+    uint32_t header = bus_read32(bus, source);
+    uint32_t bits = header & 0xF;
+    uint32_t size = header >> 8;
+    uint32_t root = source + 5;
+    uint32_t stream = source + 4 + ((uint32_t)bus_read8(bus, source + 4) + 1) * 2;
+
+    if (bits != 4 && bits != 8) {
+        return;
+    }
+
+    uint32_t node = root;
+    uint32_t word = 0;
+    uint32_t filled = 0; // Bits of `word` that hold symbols
+    for (uint32_t written = 0; written < size;) {
+        uint32_t code = bus_read32(bus, stream);
+        stream += 4;
+
+        for (int bit = 31; bit >= 0 && written < size; bit--) {
+            uint8_t value = bus_read8(bus, node);
+            uint32_t right = (code >> bit) & 1;
+            uint32_t child = (node & ~1u) + (value & 0x3F) * 2 + 2 + right;
+            if (!((value >> (7 - right)) & 1)) {
+                node = child;
+                continue;
+            }
+
+            // A leaf, its byte is the symbol
+            word |= (uint32_t)(bus_read8(bus, child) & ((1u << bits) - 1)) << filled;
+            filled += bits;
+            node = root;
+            if (filled == 32) {
+                bus_write32(bus, dest, word);
+                dest += 4;
+                written += 4;
+                word = 0;
+                filled = 0;
+            }
+        }
+    }
+}
+
+// BgAffineSet, r2 background matrices and reference points from rotation, scaling and centres
+// Source: 32 bit texture centre x and y (8 fractional bits), 16 bit screen centre x and y, 16 bit
+// scale x and y (8 fractional bits) and a 16 bit angle. Destination: PA-PD and the reference point.
+static void bios_bg_affine_set(bus_t* bus, uint32_t source, uint32_t dest, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++, source += 20, dest += 16) {
+        int32_t ox = (int32_t)bus_read32(bus, source);
+        int32_t oy = (int32_t)bus_read32(bus, source + 4);
+        int32_t cx = (int16_t)bus_read16(bus, source + 8);
+        int32_t cy = (int16_t)bus_read16(bus, source + 10);
+        int32_t sx = (int16_t)bus_read16(bus, source + 12);
+        int32_t sy = (int16_t)bus_read16(bus, source + 14);
+        uint32_t angle = bus_read16(bus, source + 16) >> 8;
+
+        int32_t sine = bios_sin(angle);
+        int32_t cosine = bios_cos(angle);
+        int32_t pa = (cosine * sx) >> 14;
+        int32_t pb = -((sine * sx) >> 14);
+        int32_t pc = (sine * sy) >> 14;
+        int32_t pd = (cosine * sy) >> 14;
+
+        bus_write16(bus, dest, (uint16_t)pa);
+        bus_write16(bus, dest + 2, (uint16_t)pb);
+        bus_write16(bus, dest + 4, (uint16_t)pc);
+        bus_write16(bus, dest + 6, (uint16_t)pd);
+        bus_write32(bus, dest + 8, (uint32_t)(ox - (pa * cx + pb * cy)));
+        bus_write32(bus, dest + 12, (uint32_t)(oy - (pc * cx + pd * cy)));
+    }
+}
+
+// ObjAffineSet, r2 sprite matrices from 16 bit scale x and y and a 16 bit angle (8 byte entries)
+// PA-PD are written `stride` bytes apart, 2 for a plain array and 8 for OAM
+static void bios_obj_affine_set(bus_t* bus, uint32_t source, uint32_t dest, uint32_t count, uint32_t stride)
+{
+    for (uint32_t i = 0; i < count; i++, source += 8, dest += stride * 4) {
+        int32_t sx = (int16_t)bus_read16(bus, source);
+        int32_t sy = (int16_t)bus_read16(bus, source + 2);
+        uint32_t angle = bus_read16(bus, source + 4) >> 8;
+
+        int32_t sine = bios_sin(angle);
+        int32_t cosine = bios_cos(angle);
+        bus_write16(bus, dest, (uint16_t)((cosine * sx) >> 14));
+        bus_write16(bus, dest + stride, (uint16_t)(-((sine * sx) >> 14)));
+        bus_write16(bus, dest + stride * 2, (uint16_t)((sine * sy) >> 14));
+        bus_write16(bus, dest + stride * 3, (uint16_t)((cosine * sy) >> 14));
+    }
+}
+
+// IntrWait, r0 set discards the flags raised before the call, r1 holds the interrupts to wait for
+// bus->intr_wait tells the passes after a wake up from the first one
+static int bios_intr_wait(bus_t* bus, uint32_t* r)
+{
+    uint16_t flags = bus_read16(bus, BIOS_IRQ_FLAGS);
+    if (r[0] != 0 && !bus->intr_wait) {
+        flags &= (uint16_t)~r[1];
+    }
+
+    if (flags & r[1]) {
+        bus_write16(bus, BIOS_IRQ_FLAGS, (uint16_t)(flags & ~r[1]));
+        bus->intr_wait = 0;
+        return BIOS_SWI_DONE;
+    }
+
+    // The BIOS turns IME on, or the interrupts would never reach the handler
+    bus_write16(bus, BIOS_IRQ_FLAGS, flags);
+    bus_write16(bus, BUS_IO + IRQ_IME, 1);
+    bus->intr_wait = 1;
+    bus->halted = 1;
+    return BIOS_SWI_WAIT;
+}
+
+// Run software interrupt `number` with the registers in `r` (r0-r15)
+// Returns one of the BIOS_SWI_* results
+int bios_swi(bus_t* bus, uint32_t* r, uint8_t number)
+{
+    switch (number) {
+    case 0x02: // Halt
+        bus->halted = 1;
+        return BIOS_SWI_DONE;
+    case 0x04: // IntrWait
+        return bios_intr_wait(bus, r);
+    case 0x05: // VBlankIntrWait
+        r[0] = 1;
+        r[1] = 0x0001;
+        return bios_intr_wait(bus, r);
+    case 0x06: // Div
+        bios_div(r, (int32_t)r[0], (int32_t)r[1]);
+        return BIOS_SWI_DONE;
+    case 0x07: // DivArm
+        bios_div(r, (int32_t)r[1], (int32_t)r[0]);
+        return BIOS_SWI_DONE;
+    case 0x08: // Sqrt
+        r[0] = bios_sqrt(r[0]);
+        return BIOS_SWI_DONE;
+    case 0x09: // ArcTan
+        r[0] = (uint32_t)bios_arctan((int16_t)r[0]);
+        return BIOS_SWI_DONE;
+    case 0x0A: // ArcTan2
+        r[0] = bios_arctan2((int16_t)r[0], (int16_t)r[1]);
+        return BIOS_SWI_DONE;
+    case 0x0B: // CpuSet
+        bios_cpu_set(bus, r[0], r[1], r[2]);
+        return BIOS_SWI_DONE;
+    case 0x0C: // CpuFastSet
+        bios_cpu_fast_set(bus, r[0], r[1], r[2]);
+        return BIOS_SWI_DONE;
+    case 0x0E: // BgAffineSet
+        bios_bg_affine_set(bus, r[0], r[1], r[2]);
+        return BIOS_SWI_DONE;
+    case 0x0F: // ObjAffineSet
+        bios_obj_affine_set(bus, r[0], r[1], r[2], r[3]);
+        return BIOS_SWI_DONE;
+    case 0x11: // LZ77UnCompWram
+    case 0x12: // LZ77UnCompVram
+        bios_lz77(bus, r[0], r[1], number == 0x12);
+        return BIOS_SWI_DONE;
+    case 0x13: // HuffUnComp
+        bios_huffman(bus, r[0], r[1]);
+        return BIOS_SWI_DONE;
+    case 0x14: // RLUnCompWram
+    case 0x15: // RLUnCompVram
+        bios_run_length(bus, r[0], r[1], number == 0x15);
+        return BIOS_SWI_DONE;
+    default:
+        return BIOS_SWI_NONE;
+    }
+}
+
+#endif // BIOS_H_
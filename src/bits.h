@@ -28,6 +28,28 @@ static inline uint32_t rotr32(uint32_t n, unsigned int c)
     return (n >> c) | (n << ((-c) & mask));
 }
 
+// Number of set bits, used for register lists
+static inline unsigned int popcount16(uint16_t n)
+{
+    unsigned int count = 0;
+    for (; n != 0; n &= n - 1) {
+        count++;
+    }
+    return count;
+}
+
+// Number of trailing zero bits, `n` must not be 0
+static inline unsigned int ctz32(uint32_t n)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, n);
+    return (unsigned int)index;
+#else
+    return (unsigned int)__builtin_ctz(n);
+#endif
+}
+
 // Sign extend
 static inline int32_t sign_extend(int32_t x, unsigned int b)
 {
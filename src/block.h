@@ -0,0 +1,785 @@
+// Decoded basic block cache
+// The first time a PC is executed, the straight line run of instructions up to the next branch is
+// decoded into a block of ops (handler plus instruction). Later visits replay the ops without
+// fetching or decoding. Common pairs of Thumb instructions are fused into a single op, see
+// block_thumb_fuse. Blocks decoded from WRAM/IWRAM are invalidated when their code line is
+// written (see bus_watch_code), blocks from BIOS and ROM live until the cache is flushed.
+
+#ifndef BLOCK_H_
+#define BLOCK_H_
+
+#include "bus.h"
+#include "cpu.h"
+#include "trace.h"
+
+#include <stdint.h> // for uint32_t
+#include <stdlib.h> // for calloc
+#include <string.h> // for memset
+
+#define BLOCK_CACHE_SIZE 4096 // Number of blocks, must be a power of 2
+#define BLOCK_MAX_OPS 32 // Longest block that is decoded
+#define BLOCK_IDLE_MAX_OPS 8 // Longest loop that is checked for idling
+#define BLOCK_IDLE_FLAGS (1 << 16) // Condition flags in the register masks of the idle loop check
+
+// Instruction level text tracing needs every instruction to go through the interpreter
+#ifndef GBA_BLOCK_CACHE
+#define GBA_BLOCK_CACHE (GBA_TRACE_LEVEL < TRACE_LEVEL_INSTRUCTION)
+#endif
+
+// Native code for a block, see jit.h
+// Returns 1 if the instructions were executed, 0 if there was an error
+typedef int (*block_native_t)(cpu_t* cpu);
+
+// Two Thumb instructions run as one op, the first in the low halfword of `pair`
+// Entered with the PC at the first instruction, leaves it at the second one (or at the branch
+// target - 2), so that the caller steps past the pair like cpu_step steps past one instruction
+typedef int (*block_pair_handler_t)(cpu_t* cpu, uint32_t pair);
+
+typedef struct block_op {
+    union {
+        cpu_arm_handler_t arm;
+        cpu_thumb_handler_t thumb;
+        block_pair_handler_t pair;
+    } handler;
+    uint32_t instruction;
+    uint8_t cycles; // Cost of the instruction, see cpu_arm_cycles
+    uint8_t length; // Instructions in the op, 2 for a fused pair
+} block_op_t;
+
+typedef struct block {
+    uint32_t pc; // Address of the first instruction
+    uint8_t thumb; // 1 if the block holds Thumb instructions
+    uint8_t count; // Number of ops, 0 if the entry is empty
+    uint8_t length; // Number of instructions, more than count when pairs were fused
+    uint8_t idle; // 1 if looping on the block does nothing until memory changes, see block_detect_idle
+    int16_t line; // Code line the block was decoded from, -1 for BIOS and ROM
+    uint32_t generation; // Generation of the code line when the block was decoded
+    uint32_t hits; // Number of times the block was replayed
+    block_native_t native; // Compiled block, NULL until the JIT compiles it
+    block_op_t ops[BLOCK_MAX_OPS];
+} block_t;
+
+typedef struct block_cache {
+    block_t blocks[BLOCK_CACHE_SIZE];
+} block_cache_t;
+
+// Allocate an empty cache
+// Returns NULL if the cache could not be allocated
+block_cache_t* block_cache_create(void)
+{
+    return (block_cache_t*)calloc(1, sizeof(block_cache_t));
+}
+
+void block_cache_destroy(block_cache_t* cache)
+{
+    free(cache);
+}
+
+// Drop every block, needed when the BIOS or cartridge changes
+void block_cache_flush(block_cache_t* cache)
+{
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        cache->blocks[i].count = 0;
+    }
+}
+
+// Return 1 if code can be executed from the block at `address` through the cache
+// VRAM and the other regions fall back to the interpreter
+static inline int block_cacheable(uint32_t address)
+{
+    switch ((address >> 24) & 0xF) {
+    case 0x0: // BIOS
+    case 0x2: // WRAM
+    case 0x3: // IWRAM
+    case 0x8: // ROM (wait states 0-2)
+    case 0x9:
+    case 0xA:
+    case 0xB:
+    case 0xC:
+    case 0xD:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Return 1 if the ARM instruction can change the PC, which ends the block
+// Anything else that changes the PC is still caught when the block is replayed
+int block_arm_ends_block(cpu_arm_handler_t handler, cpu_arm_instruction_t instruction)
+{
+    uint8_t instruction_type = (instruction >> 26) & 0x3;
+
+    if (handler == cpu_arm_branch || handler == cpu_arm_branch_exchange || handler == cpu_arm_software_interrupt
+        || handler == cpu_arm_coprocessor || handler == cpu_arm_unhandled) {
+        return 1;
+    }
+
+    // Data processing and single data transfer with rd = PC
+    if (instruction_type <= 0x1 && ((instruction >> 12) & 0xF) == 0xF) {
+        return 1;
+    }
+
+    // Block data transfer with PC in the register list
+    if (handler == cpu_arm_block_data_transfer && (instruction & 0x8000)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Return 1 if the Thumb instruction can change the PC, which ends the block
+int block_thumb_ends_block(cpu_thumb_handler_t handler, cpu_thumb_instruction_t instruction)
+{
+    if (handler == cpu_thumb_conditional_branch || handler == cpu_thumb_unconditional_branch
+        || handler == cpu_thumb_long_branch_with_link || handler == cpu_thumb_software_interrupt
+        || handler == cpu_thumb_hi_bx) {
+        return 1;
+    }
+
+    // Hi register operations with rd = PC
+    if ((handler == cpu_thumb_hi_add || handler == cpu_thumb_hi_mov) && (instruction & 0x87) == 0x87) {
+        return 1;
+    }
+
+    // POP with PC
+    if (handler == cpu_thumb_push_pop && (instruction & 0x0900) == 0x0900) {
+        return 1;
+    }
+
+    return 0;
+}
+
+// Registers read and written by an ARM instruction that may appear in an idle loop
+// Returns 0 if the instruction has other side effects (stores, writeback, PSR transfers, ...)
+int block_arm_idle_op(cpu_arm_handler_t handler, cpu_arm_instruction_t instruction, uint32_t* reads, uint32_t* writes)
+{
+    uint8_t rn = (instruction >> 16) & 0xF;
+    uint8_t rd = (instruction >> 12) & 0xF;
+
+    *reads = (instruction >> 28) != 0xE ? BLOCK_IDLE_FLAGS : 0;
+    *writes = 0;
+
+    if (handler == cpu_arm_branch) {
+        return ((instruction >> 24) & 0x1) == 0; // No link
+    }
+
+    // Data processing with an immediate operand, the register shifter is not needed
+    if (((instruction >> 25) & 0x7) == 0x1) {
+        uint8_t opcode = (instruction >> 21) & 0xF;
+        uint8_t s = (instruction >> 20) & 0x1;
+        if (handler != cpu_arm_data_processing_handlers[CPU_ARM_OPERAND_IMM][opcode][s] || rd == 15) {
+            return 0;
+        }
+        if (opcode != 0xD && opcode != 0xF) {
+            *reads |= 1 << rn;
+        }
+        if (opcode == 0x5 || opcode == 0x6 || opcode == 0x7) {
+            *reads |= BLOCK_IDLE_FLAGS; // ADC, SBC, RSC
+        }
+        if (opcode < 0x8 || opcode > 0xB) {
+            *writes |= 1 << rd;
+        }
+        if (s) {
+            *writes |= BLOCK_IDLE_FLAGS;
+        }
+        return 1;
+    }
+
+    // Pre-indexed load with an immediate offset and no writeback
+    if (handler == cpu_arm_single_data_transfer && (instruction & 0x03300000) == 0x01100000 && rd != 15) {
+        *reads |= 1 << rn;
+        *writes |= 1 << rd;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Registers read and written by a Thumb instruction that may appear in an idle loop
+// Returns 0 if the instruction has other side effects
+int block_thumb_idle_op(cpu_thumb_handler_t handler, cpu_thumb_instruction_t instruction, uint32_t* reads, uint32_t* writes)
+{
+    uint32_t rd = 1 << (instruction & 0x7);
+    uint32_t rs = 1 << ((instruction >> 3) & 0x7);
+    uint32_t ro = 1 << ((instruction >> 6) & 0x7);
+    uint32_t rd_high = 1 << ((instruction >> 8) & 0x7);
+    uint8_t l = (instruction >> 11) & 0x1;
+
+    *reads = 0;
+    *writes = 0;
+
+    if (handler == cpu_thumb_unconditional_branch) {
+        return 1;
+    }
+    if (handler == cpu_thumb_conditional_branch) {
+        *reads = BLOCK_IDLE_FLAGS;
+        return 1;
+    }
+
+    // Loads
+    if ((handler == cpu_thumb_load_store_immediate_offset || handler == cpu_thumb_load_store_halfword) && l) {
+        *reads = rs;
+        *writes = rd;
+        return 1;
+    }
+    if (handler == cpu_thumb_load_store_register_offset && l) {
+        *reads = rs | ro;
+        *writes = rd;
+        return 1;
+    }
+    if (handler == cpu_thumb_load_store_sign_extended && (instruction & 0x0C00) != 0) {
+        *reads = rs | ro;
+        *writes = rd;
+        return 1;
+    }
+    if (handler == cpu_thumb_pc_relative_load) {
+        *writes = rd_high;
+        return 1;
+    }
+    if (handler == cpu_thumb_load_store_sp_relative && l) {
+        *reads = 1 << 13;
+        *writes = rd_high;
+        return 1;
+    }
+
+    // Tests and the logical operations
+    if (handler == cpu_thumb_mov_immediate) {
+        *writes = rd_high | BLOCK_IDLE_FLAGS;
+        return 1;
+    }
+    if (handler == cpu_thumb_cmp_immediate) {
+        *reads = rd_high;
+        *writes = BLOCK_IDLE_FLAGS;
+        return 1;
+    }
+    if (handler == cpu_thumb_lsl_immediate || handler == cpu_thumb_lsr_immediate) {
+        *reads = rs;
+        *writes = rd | BLOCK_IDLE_FLAGS;
+        return 1;
+    }
+    if (handler == cpu_thumb_alu_tst || handler == cpu_thumb_alu_cmp || handler == cpu_thumb_alu_cmn) {
+        *reads = rd | rs;
+        *writes = BLOCK_IDLE_FLAGS;
+        return 1;
+    }
+    if (handler == cpu_thumb_alu_and || handler == cpu_thumb_alu_eor || handler == cpu_thumb_alu_orr
+        || handler == cpu_thumb_alu_bic) {
+        *reads = rd | rs;
+        *writes = rd | BLOCK_IDLE_FLAGS;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Registers the address of a load in an idle loop is computed from, 0 if the op does not read memory
+// With `r` (indexed like cpu_registers_t::r) the address and size of the load are returned too.
+// Literal loads only read the code, which invalidates the block when it is written.
+uint32_t block_idle_load(uint8_t thumb, uint32_t instruction, const uint32_t* r, uint32_t* address, int* size)
+{
+    uint32_t base = 0;
+    uint32_t offset = 0;
+    int bytes;
+
+    if (!thumb) {
+        // Pre-indexed load with an immediate offset, the only ARM load block_arm_idle_op accepts
+        uint8_t rn = (instruction >> 16) & 0xF;
+        if ((instruction & 0x0C000000) != 0x04000000 || rn == 15) {
+            return 0;
+        }
+        base = 1 << rn;
+        offset = (instruction >> 23) & 0x1 ? instruction & 0xFFF : 0 - (instruction & 0xFFF);
+        bytes = (instruction >> 22) & 0x1 ? 1 : 4;
+    } else {
+        cpu_thumb_handler_t handler = cpu_thumb_table[CPU_THUMB_TABLE_INDEX(instruction)];
+        uint8_t offset5 = (instruction >> 6) & 0x1F;
+        uint32_t rs = 1 << ((instruction >> 3) & 0x7);
+        uint32_t ro = 1 << ((instruction >> 6) & 0x7);
+
+        if (handler == cpu_thumb_load_store_immediate_offset) {
+            base = rs;
+            bytes = (instruction >> 12) & 0x1 ? 1 : 4;
+            offset = (uint32_t)offset5 * (uint32_t)bytes;
+        } else if (handler == cpu_thumb_load_store_halfword) {
+            base = rs;
+            offset = (uint32_t)offset5 << 1;
+            bytes = 2;
+        } else if (handler == cpu_thumb_load_store_register_offset) {
+            base = rs | ro;
+            bytes = (instruction >> 10) & 0x1 ? 1 : 4;
+        } else if (handler == cpu_thumb_load_store_sign_extended) {
+            base = rs | ro;
+            bytes = (instruction & 0x0C00) == 0x0400 ? 1 : 2; // LDSB, or LDRH and LDSH
+        } else if (handler == cpu_thumb_load_store_sp_relative) {
+            base = 1 << 13;
+            offset = (instruction & 0xFF) << 2;
+            bytes = 4;
+        } else {
+            return 0;
+        }
+    }
+
+    if (r != NULL) {
+        *size = bytes;
+        *address = offset;
+        for (int n = 0; n < 16; n++) {
+            *address += (base >> n) & 0x1 ? r[n] : 0;
+        }
+    }
+    return base;
+}
+
+// Return 1 if the `size` bytes at `address` are I/O registers that only change at device events
+// Memory is left out, and so are the registers a device computes when they are read (the timer
+// counters, SOUNDCNT_X), see bus_set_io_hooks
+int block_idle_source(const bus_t* bus, uint32_t address, int size)
+{
+    if ((address & 0xFF000000) != BUS_IO) {
+        return 0;
+    }
+
+    uint32_t offset = (address - BUS_IO) & ~(uint32_t)(size - 1);
+    for (uint32_t index = offset / 2; index <= (offset + (uint32_t)size - 1) / 2; index++) {
+        if (index >= BUS_IO_REGISTERS || bus->io[index].read != NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Return 1 if the block is a short loop that only loads and tests values, e.g. polling DISPSTAT
+// for VBlank. When such a block branches back to its own start, every further iteration sees the
+// same memory and does the same thing until a device changes memory at its next event.
+// Registers written by the loop must be written before they are read in each iteration.
+// Where the loads read is only known at run time, block_idle_at checks it with block_idle_source.
+int block_detect_idle(const block_t* block)
+{
+    uint32_t reads[BLOCK_IDLE_MAX_OPS];
+    uint32_t writes[BLOCK_IDLE_MAX_OPS];
+    uint32_t written = 0;
+
+    if (block->count > BLOCK_IDLE_MAX_OPS) {
+        return 0;
+    }
+
+    for (int i = 0; i < block->count; i++) {
+        const block_op_t* op = &block->ops[i];
+        int ok = block->thumb
+            ? block_thumb_idle_op(op->handler.thumb, (cpu_thumb_instruction_t)op->instruction, &reads[i], &writes[i])
+            : block_arm_idle_op(op->handler.arm, op->instruction, &reads[i], &writes[i]);
+        if (!ok) {
+            return 0;
+        }
+        written |= writes[i];
+    }
+
+    // The loop has to end in the branch back
+    const block_op_t* last = &block->ops[block->count - 1];
+    if (block->thumb ? last->handler.thumb != cpu_thumb_conditional_branch && last->handler.thumb != cpu_thumb_unconditional_branch
+                     : last->handler.arm != cpu_arm_branch) {
+        return 0;
+    }
+
+    // Values carried over from the previous iteration
+    uint32_t defined = 0;
+    for (int i = 0; i < block->count; i++) {
+        if (reads[i] & written & ~defined) {
+            return 0;
+        }
+        defined |= writes[i];
+    }
+
+    // The load addresses are computed from the registers at the end of an iteration, so they may
+    // not depend on a register that is written again after the load
+    uint32_t later = 0;
+    for (int i = block->count - 1; i >= 0; i--) {
+        if (block_idle_load(block->thumb, block->ops[i].instruction, NULL, NULL, NULL) & later) {
+            return 0;
+        }
+        later |= writes[i];
+    }
+
+    return 1;
+}
+
+// Fused Thumb pairs
+// The flags the first instruction sets stay visible to the code after the pair, but they are
+// only recorded (see cpu_flags_t), the pair itself does not read them back.
+
+// Return 1 if `cond` passes for the flags of the subtraction a - b, without resolving them
+static inline int block_compare(uint32_t a, uint32_t b, uint8_t cond)
+{
+    uint32_t result = a - b;
+
+    switch (cond) {
+    case 0x0: // EQ
+        return a == b;
+    case 0x1: // NE
+        return a != b;
+    case 0x2: // CS/HS
+        return a >= b;
+    case 0x3: // CC/LO
+        return a < b;
+    case 0x4: // MI
+        return (int32_t)result < 0;
+    case 0x5: // PL
+        return (int32_t)result >= 0;
+    case 0x6: // VS
+        return (int32_t)((a ^ b) & (a ^ result)) < 0;
+    case 0x7: // VC
+        return (int32_t)((a ^ b) & (a ^ result)) >= 0;
+    case 0x8: // HI
+        return a > b;
+    case 0x9: // LS
+        return a <= b;
+    case 0xA: // GE
+        return (int32_t)a >= (int32_t)b;
+    case 0xB: // LT
+        return (int32_t)a < (int32_t)b;
+    case 0xC: // GT
+        return (int32_t)a > (int32_t)b;
+    case 0xD: // LE
+        return (int32_t)a <= (int32_t)b;
+    default:
+        return 1;
+    }
+}
+
+// Conditional branch after a compare, taken from the address of the branch (PC + 2)
+static inline void block_compare_branch(cpu_t* cpu, uint32_t a, uint32_t b, uint32_t branch)
+{
+    cpu_flags_add(cpu, a, ~b, 1);
+    if (block_compare(a, b, (branch >> 8) & 0xF)) {
+        cpu->registers.pc += 4 + (uint32_t)sign_extend((branch & 0xFF) << 1, 9);
+    } else {
+        cpu->registers.pc += 2;
+    }
+}
+
+// CMP rd, #offset8 then Bcc
+int block_thumb_cmp_immediate_branch(cpu_t* cpu, uint32_t pair)
+{
+    block_compare_branch(cpu, cpu->registers.r[(pair >> 8) & 0x7], pair & 0xFF, pair >> 16);
+    return 1;
+}
+
+// CMP rd, rs then Bcc
+int block_thumb_cmp_register_branch(cpu_t* cpu, uint32_t pair)
+{
+    block_compare_branch(cpu, cpu->registers.r[pair & 0x7], cpu->registers.r[(pair >> 3) & 0x7], pair >> 16);
+    return 1;
+}
+
+// The two halves of BL, LR only gets its final value
+int block_thumb_long_branch_with_link(cpu_t* cpu, uint32_t pair)
+{
+    uint32_t next = cpu->registers.pc + 4;
+    uint32_t offset = (uint32_t)sign_extend((int32_t)((pair & 0x7FF) << 12), 23) + ((pair >> 15) & 0xFFE);
+
+    cpu->registers.lr = next | 0x1;
+    cpu->registers.pc = next + offset - 2;
+    return 1;
+}
+
+// LSL rd, rs, #n then LSR rd, rd, #n, which clears the top n bits
+// The last bit the LSR shifts out is one the LSL shifted in, so C is always cleared
+int block_thumb_zero_extend(cpu_t* cpu, uint32_t pair)
+{
+    uint8_t amount = (pair >> 6) & 0x1F;
+    uint8_t rd = pair & 0x7;
+
+    cpu->registers.r[rd] = (cpu->registers.r[(pair >> 3) & 0x7] << amount) >> amount;
+    cpu_set_carry(cpu, 0);
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+    cpu->registers.pc += 2;
+    return 1;
+}
+
+// ADD rd, rs, rn / #offset3 then LDR / LDRB rt, [rd, #offset5], the usual table lookup
+int block_thumb_add_load(cpu_t* cpu, uint32_t pair)
+{
+    uint32_t value = (pair >> 6) & 0x7;
+    uint32_t operand = (pair & 0x0400) ? value : cpu->registers.r[value];
+    uint32_t address = cpu_flags_add(cpu, cpu->registers.r[(pair >> 3) & 0x7], operand, 0);
+    uint32_t load = pair >> 16;
+    uint32_t offset = (load >> 6) & 0x1F;
+
+    cpu->registers.r[pair & 0x7] = address;
+    if (load & 0x1000) {
+        cpu->registers.r[load & 0x7] = bus_read8(cpu->bus, address + offset);
+    } else {
+        cpu->registers.r[load & 0x7] = bus_read32(cpu->bus, address + (offset << 2));
+    }
+    cpu->registers.pc += 2;
+    return 1;
+}
+
+// Handler that runs the two Thumb instructions as one op, NULL if they are not fused
+block_pair_handler_t block_thumb_pair(const block_op_t* first, const block_op_t* second)
+{
+    cpu_thumb_handler_t a = first->handler.thumb;
+    cpu_thumb_handler_t b = second->handler.thumb;
+    uint32_t x = first->instruction;
+    uint32_t y = second->instruction;
+
+    if (a == cpu_thumb_long_branch_with_link && b == cpu_thumb_long_branch_with_link) {
+        return (x & 0x0800) == 0 && (y & 0x0800) != 0 ? block_thumb_long_branch_with_link : NULL;
+    }
+
+    // BEQ to BLE, condition 0xE is undefined
+    if (b == cpu_thumb_conditional_branch && ((y >> 8) & 0xF) < 0xE) {
+        if (a == cpu_thumb_cmp_immediate) {
+            return block_thumb_cmp_immediate_branch;
+        }
+        if (a == cpu_thumb_alu_cmp) {
+            return block_thumb_cmp_register_branch;
+        }
+        return NULL;
+    }
+
+    // The LSR shifts the result of the LSL in place by the same non zero amount
+    uint8_t rd = x & 0x7;
+    if (a == cpu_thumb_lsl_immediate && b == cpu_thumb_lsr_immediate) {
+        return (y & 0x7) == rd && ((y >> 3) & 0x7) == rd && ((x ^ y) & 0x07C0) == 0 && (x & 0x07C0) != 0
+            ? block_thumb_zero_extend
+            : NULL;
+    }
+
+    // ADD and a word or byte load from the sum
+    if (a == cpu_thumb_add_subtract && (x & 0x0200) == 0 && b == cpu_thumb_load_store_immediate_offset
+        && (y & 0x0800) != 0 && ((y >> 3) & 0x7) == rd) {
+        return block_thumb_add_load;
+    }
+
+    return NULL;
+}
+
+// Fuse the pairs of a decoded Thumb block, see block_thumb_pair
+void block_thumb_fuse(block_t* block)
+{
+    int count = 0;
+
+    for (int i = 0; i < block->count; i++) {
+        block_op_t op = block->ops[i];
+        block_pair_handler_t pair = i + 1 < block->count ? block_thumb_pair(&op, &block->ops[i + 1]) : NULL;
+
+        if (pair != NULL) {
+            op.handler.pair = pair;
+            op.instruction |= block->ops[i + 1].instruction << 16;
+            op.cycles += block->ops[i + 1].cycles;
+            op.length = 2;
+            i++;
+        }
+        block->ops[count++] = op;
+    }
+
+    block->count = (uint8_t)count;
+}
+
+// Instruction `index` of the block, counting each instruction of the fused pairs
+uint32_t block_instruction(const block_t* block, int index)
+{
+    for (int i = 0; i < block->count; i++) {
+        const block_op_t* op = &block->ops[i];
+        if (index < op->length) {
+            return op->length > 1 ? (op->instruction >> (16 * index)) & 0xFFFF : op->instruction;
+        }
+        index -= op->length;
+    }
+
+    return 0;
+}
+
+// Decode the block starting at `pc` into `block`
+void block_decode(bus_t* bus, block_t* block, uint32_t pc, uint8_t thumb)
+{
+    block->pc = pc;
+    block->thumb = thumb;
+    block->count = 0;
+    block->line = (int16_t)bus_code_line(pc);
+    block->generation = 0;
+    block->hits = 0;
+    block->native = NULL;
+
+    if (block->line >= 0) {
+        bus_watch_code(bus, block->line);
+        block->generation = bus->code_generation[block->line];
+    }
+
+    // Blocks stop at the end of the code line so that one generation covers the whole block
+    uint32_t address = pc;
+    while (block->count < BLOCK_MAX_OPS && ((address ^ pc) >> BUS_CODE_LINE_SHIFT) == 0) {
+        block_op_t* op = &block->ops[block->count++];
+
+        if (thumb) {
+            cpu_thumb_instruction_t instruction = bus_read16(bus, address);
+            op->handler.thumb = cpu_thumb_table[CPU_THUMB_TABLE_INDEX(instruction)];
+            op->instruction = instruction;
+            op->cycles = cpu_thumb_cycles(instruction);
+            op->length = 1;
+            address += 2;
+
+            // The first half of a BL only sets LR, the block goes on when the second half follows
+            // so that the pair can be fused
+            if (block_thumb_ends_block(op->handler.thumb, instruction)
+                && ((instruction & 0xF800) != 0xF000 || block->count == BLOCK_MAX_OPS
+                    || ((address ^ pc) >> BUS_CODE_LINE_SHIFT) != 0 || (bus_read16(bus, address) & 0xF800) != 0xF800)) {
+                break;
+            }
+        } else {
+            cpu_arm_instruction_t instruction = bus_read32(bus, address);
+            op->handler.arm = cpu_arm_table[CPU_ARM_TABLE_INDEX(instruction)];
+            op->instruction = instruction;
+            op->cycles = cpu_arm_cycles(instruction);
+            op->length = 1;
+            address += 4;
+
+            if (block_arm_ends_block(op->handler.arm, instruction)) {
+                break;
+            }
+        }
+    }
+
+    // Idle loops are detected on the single instructions, fusing does not change what they do
+    block->length = block->count;
+    block->idle = (uint8_t)block_detect_idle(block);
+    if (thumb) {
+        block_thumb_fuse(block);
+    }
+}
+
+// Find the block at PC, decoding it first if needed
+// Returns NULL when the PC is not cacheable and the instruction has to be interpreted
+block_t* block_lookup(block_cache_t* cache, cpu_t* cpu)
+{
+    uint32_t pc = cpu->registers.pc;
+
+#if GBA_TRACE_RING
+    if (cpu->trace != NULL) {
+        return NULL;
+    }
+#endif
+
+    if (!GBA_BLOCK_CACHE || !block_cacheable(pc)) {
+        return NULL;
+    }
+
+    bus_t* bus = cpu->bus;
+    uint8_t thumb = (cpu->registers.cpsr & 0x20) == 0;
+    block_t* block = &cache->blocks[(pc >> 1) & (BLOCK_CACHE_SIZE - 1)];
+
+    if (block->count == 0 || block->pc != pc || block->thumb != thumb
+        || (block->line >= 0 && block->generation != bus->code_generation[block->line])) {
+        block_decode(bus, block, pc, thumb);
+    }
+
+    return block;
+}
+
+// Return 1 if the PC is the start of a decoded idle loop, see block_detect_idle
+// The loop must have gone round once: its loads are checked with the registers it left behind,
+// which the next iteration computes again
+int block_idle_at(block_cache_t* cache, cpu_t* cpu)
+{
+    uint32_t pc = cpu->registers.pc;
+    block_t* block = &cache->blocks[(pc >> 1) & (BLOCK_CACHE_SIZE - 1)];
+
+    if (!block->idle || block->count == 0 || block->pc != pc || block->thumb != ((cpu->registers.cpsr & 0x20) == 0)
+        || (block->line >= 0 && block->generation != cpu->bus->code_generation[block->line])) {
+        return 0;
+    }
+
+    for (int i = 0; i < block->length; i++) {
+        uint32_t address;
+        int size;
+        if (block_idle_load(block->thumb, block_instruction(block, i), cpu->registers.r, &address, &size)
+            && !block_idle_source(cpu->bus, address, size)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Replay the ops of a block, the PC must be at the start of the block
+// Return 1 if the instructions were executed, 0 if there was an error
+int block_replay(cpu_t* cpu, block_t* block)
+{
+    bus_t* bus = cpu->bus;
+    uint32_t pc = cpu->registers.pc;
+
+    // Leave the block when an instruction changes the PC, or when code that was decoded is
+    // overwritten (which may be the rest of this block)
+    uint32_t code_writes = bus->code_writes;
+    uint64_t cycles = cpu->cycles;
+    int result = 1;
+
+    if (block->thumb) {
+        for (int i = 0; i < block->count; i++) {
+            const block_op_t* op = &block->ops[i];
+            if (op->length > 1) {
+                if (!op->handler.pair(cpu, op->instruction)) {
+                    result = 0;
+                    break;
+                }
+                pc += 2; // The PC is left at the second instruction
+            } else if (!op->handler.thumb(cpu, (cpu_thumb_instruction_t)op->instruction)) {
+                result = 0;
+                break;
+            }
+
+            cycles += op->cycles;
+            if (cpu->registers.pc != pc) {
+                cpu->registers.pc += 2;
+                cycles += CPU_CYCLES_REFILL;
+                break;
+            }
+
+            cpu->registers.pc += 2;
+            pc += 2;
+
+            if (bus->code_writes != code_writes) {
+                break;
+            }
+        }
+    } else {
+        for (int i = 0; i < block->count; i++) {
+            if (cpu_check_condition(cpu, block->ops[i].instruction)) {
+                if (!block->ops[i].handler.arm(cpu, block->ops[i].instruction)) {
+                    result = 0;
+                    break;
+                }
+            }
+
+            cycles += block->ops[i].cycles;
+            if (cpu->registers.pc != pc) {
+                cpu->registers.pc += 4;
+                cycles += CPU_CYCLES_REFILL;
+                break;
+            }
+
+            cpu->registers.pc += 4;
+            pc += 4;
+
+            if (bus->code_writes != code_writes) {
+                break;
+            }
+        }
+    }
+
+    cpu->cycles = cycles;
+    return result;
+}
+
+// Execute the block at PC, or a single interpreted instruction when the PC is not cacheable
+// Return 1 if the instructions were executed, 0 if there was an error
+int block_cache_execute(block_cache_t* cache, cpu_t* cpu)
+{
+    block_t* block = block_lookup(cache, cpu);
+    if (block == NULL) {
+        return cpu_step(cpu);
+    }
+
+    return block_replay(cpu, block);
+}
+
+#endif // BLOCK_H_
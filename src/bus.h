@@ -0,0 +1,587 @@
+// This module maps GBA addresses onto the host buffers in memory_t
+// The address space is split into 16 KByte pages, each page has a host pointer and a mask
+// so a RAM/ROM access is one table lookup and one dereference. Pages without a host pointer
+// (I/O registers, unmapped memory, writes to ROM) go through the slow handlers.
+
+#ifndef BUS_H_
+#define BUS_H_
+
+#include "irq.h"
+#include "memory.h"
+
+#include <stdint.h> // for uint32_t
+#include <stdlib.h> // for malloc
+#include <string.h> // for memset
+
+#define BUS_PAGE_SHIFT 14
+#define BUS_PAGE_SIZE (1 << BUS_PAGE_SHIFT) // 16 KBytes
+
+// Region base addresses
+#define BUS_BIOS 0x00000000
+#define BUS_WRAM 0x02000000
+#define BUS_WRAM_CHIP 0x03000000
+#define BUS_IO 0x04000000
+#define BUS_PALETTE 0x05000000
+#define BUS_VRAM 0x06000000
+#define BUS_OAM 0x07000000
+#define BUS_ROM 0x08000000
+#define BUS_ROM_SIZE 0x02000000 // Size of each ROM wait state region
+#define BUS_SRAM 0x0E000000
+#define BUS_END 0x10000000 // Nothing is mapped at or above this address
+
+// Only the low 28 address bits are decoded, which keeps the page tables small
+// Addresses above BUS_END wrap around instead of reading as unmapped memory
+#define BUS_PAGE_COUNT (BUS_END >> BUS_PAGE_SHIFT)
+#define BUS_PAGE_INDEX(address) (((address) & (BUS_END - 1)) >> BUS_PAGE_SHIFT)
+
+// Code tracking for the block cache
+// WRAM and IWRAM are split into 256 byte lines. Once a block is decoded from a line, writes to
+// the line bump its generation, which invalidates every block decoded from it.
+#define BUS_CODE_LINE_SHIFT 8
+#define BUS_CODE_LINE_SIZE (1 << BUS_CODE_LINE_SHIFT)
+#define BUS_CODE_LINES ((262144 + 32768) >> BUS_CODE_LINE_SHIFT) // WRAM followed by IWRAM
+
+// VRAM tracking for the PPU tile cache
+// VRAM is split into 32 byte blocks, the size of a 4bpp tile. Writes set the block's dirty bit,
+// and the PPU drops its decoded copy of the tile before it draws the next line.
+#define BUS_VRAM_BLOCK_SHIFT 5
+#define BUS_VRAM_BLOCKS (98304 >> BUS_VRAM_BLOCK_SHIFT)
+
+// OAM tracking for the PPU sprite lists, writes to the first two attributes of an OAM entry (its
+// position, shape and size) set the entry's dirty bit
+#define BUS_OAM_ENTRIES 128
+
+// Write tracking for snapshots, see rewind.h
+// Writable memory other than the I/O registers is split into units of at most a page. Once
+// bus_track_writes has armed the pages, the first write to a unit sets its bit in `written` and
+// stops watching every page that maps it, so later writes take the fast path again.
+#define BUS_UNIT_WRAM 0 // 16 units
+#define BUS_UNIT_WRAM_CHIP 16 // 2 units
+#define BUS_UNIT_PALETTE 18
+#define BUS_UNIT_VRAM 19 // 6 units, in memory_t::vram order
+#define BUS_UNIT_OAM 25
+#define BUS_UNIT_SRAM 26 // 4 units
+#define BUS_UNITS 30
+#define BUS_UNITS_ALL ((1u << BUS_UNITS) - 1)
+
+// I/O registers the bus handles itself
+#define BUS_IO_HALTCNT 0x301 // Writing it stops the CPU until an interrupt is requested
+
+// Page watch bits, writes to a page with watch bits set are passed to bus_write_watched
+#define BUS_WATCH_CODE 0x1 // The page has lines with decoded code
+#define BUS_WATCH_VRAM 0x2 // The page is VRAM, writes mark blocks in vram_dirty
+#define BUS_WATCH_OAM 0x4 // The page is OAM, writes mark entries in oam_dirty
+#define BUS_WATCH_STATE 0x8 // The page's unit has not been written since bus_track_writes
+
+// Device hooks for the I/O registers, `offset` is relative to BUS_IO and `size` is the access size
+typedef void (*bus_io_hook_t)(void* context, uint32_t offset, int size);
+
+// I/O registers, one entry per halfword of memory_t::io
+// Registers without hooks are plain storage, an access to them never leaves the bus
+#define BUS_IO_REGISTERS (sizeof(((memory_t*)0)->io) / 2)
+
+typedef struct bus_io_register {
+    bus_io_hook_t read; // Called before the register is read so the device can bring it up to date
+    bus_io_hook_t write; // Called after a write was stored
+    void* context;
+    uint16_t write_mask; // Bits a write stores, the others are read only
+    uint16_t clear_mask; // Read only bits that a write of 1 clears, the IF acknowledge
+} bus_io_register_t;
+
+typedef struct bus_page {
+    uint8_t* base; // Host pointer for the page, NULL to use the slow handler
+    uint32_t mask; // Mask applied to the address before adding it to base
+    uint32_t watch; // BUS_WATCH_* bits, only used in the write table
+} bus_page_t;
+
+typedef struct bus {
+    bus_page_t read[BUS_PAGE_COUNT];
+    bus_page_t write[BUS_PAGE_COUNT];
+    memory_t* memory;
+
+    uint32_t code_lines[BUS_CODE_LINES / 32]; // Bitmap of lines that blocks were decoded from
+    uint32_t code_generation[BUS_CODE_LINES]; // Bumped when a line in code_lines is written
+    uint32_t code_writes; // Bumped on every write to a line in code_lines, and when the CPU halts
+
+    uint32_t vram_dirty[BUS_VRAM_BLOCKS / 32]; // Bitmap of VRAM blocks written since the PPU last looked
+    uint32_t oam_dirty[BUS_OAM_ENTRIES / 32]; // Bitmap of OAM entries moved or resized since the PPU last looked
+    uint32_t written; // Bitmap of BUS_UNIT_* units written since bus_track_writes
+
+    uint8_t halted; // Set by a write to HALTCNT, cleared by the run loop when an interrupt is requested
+    uint8_t intr_wait; // Set while the BIOS IntrWait call waits, see bios_intr_wait
+
+    bus_io_register_t io[BUS_IO_REGISTERS]; // See bus_set_io_hooks and bus_set_io_mask
+} bus_t;
+
+// Point the pages in [start, end) at a host buffer of `size` bytes, repeating it to fill the range
+// Buffers smaller than a page are mirrored inside each page by the mask
+void bus_map(bus_page_t* table, uint32_t start, uint32_t end, char* buffer, uint32_t size)
+{
+    for (uint32_t address = start; address < end; address += BUS_PAGE_SIZE) {
+        bus_page_t* page = &table[BUS_PAGE_INDEX(address)];
+
+        if (size < BUS_PAGE_SIZE) {
+            page->base = (uint8_t*)buffer;
+            page->mask = size - 1;
+        } else {
+            page->base = (uint8_t*)buffer + ((address - start) % size);
+            page->mask = BUS_PAGE_SIZE - 1;
+        }
+    }
+}
+
+// Give the I/O halfwords in [start, end) device hooks, NULL for none, bus_init clears them
+void bus_set_io_hooks(bus_t* bus, uint32_t start, uint32_t end, bus_io_hook_t read, bus_io_hook_t write, void* context)
+{
+    for (uint32_t offset = start; offset < end && offset / 2 < BUS_IO_REGISTERS; offset += 2) {
+        bus->io[offset / 2].read = read;
+        bus->io[offset / 2].write = write;
+        bus->io[offset / 2].context = context;
+    }
+}
+
+// Set which bits of the I/O halfword at `offset` a write stores and which a write of 1 clears
+void bus_set_io_mask(bus_t* bus, uint32_t offset, uint16_t write_mask, uint16_t clear_mask)
+{
+    bus->io[offset / 2].write_mask = write_mask;
+    bus->io[offset / 2].clear_mask = clear_mask;
+}
+
+// Write hook of HALTCNT, the BIOS Halt, IntrWait and VBlankIntrWait functions all end up here
+// Stop mode (bit 7 set) is treated like Halt
+// Blocks leave on a code_writes change, so the halt takes effect after this instruction
+static void bus_io_halt(void* context, uint32_t offset, int size)
+{
+    bus_t* bus = (bus_t*)context;
+    if (offset + (uint32_t)size > BUS_IO_HALTCNT) {
+        bus->halted = 1;
+        bus->code_writes++;
+    }
+}
+
+// Build the page tables for the given memory
+void bus_init(bus_t* bus, memory_t* memory)
+{
+    memset(bus, 0, sizeof(bus_t));
+    bus->memory = memory;
+
+    // Every I/O register is writable plain storage until the devices say otherwise
+    for (uint32_t i = 0; i < BUS_IO_REGISTERS; i++) {
+        bus->io[i].write_mask = 0xFFFF;
+    }
+    bus_set_io_mask(bus, IRQ_IF, 0, 0x3FFF);
+    bus_set_io_hooks(bus, BUS_IO_HALTCNT - 1, BUS_IO_HALTCNT + 1, NULL, bus_io_halt, bus);
+
+    // BIOS, read only
+    if (memory->bios != NULL) {
+        bus_map(bus->read, BUS_BIOS, BUS_BIOS + MEMORY_BIOS_SIZE, memory->bios, MEMORY_BIOS_SIZE);
+    }
+
+    // On-board and on-chip work RAM, mirrored through their 16 MByte regions
+    bus_map(bus->read, BUS_WRAM, BUS_WRAM_CHIP, memory->wram, sizeof(memory->wram));
+    bus_map(bus->write, BUS_WRAM, BUS_WRAM_CHIP, memory->wram, sizeof(memory->wram));
+    bus_map(bus->read, BUS_WRAM_CHIP, BUS_IO, memory->wram_chip, sizeof(memory->wram_chip));
+    bus_map(bus->write, BUS_WRAM_CHIP, BUS_IO, memory->wram_chip, sizeof(memory->wram_chip));
+
+    // Palette RAM and OAM, 1 KByte mirrored
+    bus_map(bus->read, BUS_PALETTE, BUS_VRAM, memory->palette, sizeof(memory->palette));
+    bus_map(bus->write, BUS_PALETTE, BUS_VRAM, memory->palette, sizeof(memory->palette));
+    bus_map(bus->read, BUS_OAM, BUS_ROM, memory->oam, sizeof(memory->oam));
+    bus_map(bus->write, BUS_OAM, BUS_ROM, memory->oam, sizeof(memory->oam));
+
+    // VRAM is mirrored every 128 KBytes, and the last 32 KBytes of each mirror repeat 10000-17FFF
+    for (uint32_t mirror = BUS_VRAM; mirror < BUS_OAM; mirror += 0x20000) {
+        bus_map(bus->read, mirror, mirror + sizeof(memory->vram), memory->vram, sizeof(memory->vram));
+        bus_map(bus->write, mirror, mirror + sizeof(memory->vram), memory->vram, sizeof(memory->vram));
+        bus_map(bus->read, mirror + 0x18000, mirror + 0x20000, memory->vram + 0x10000, 0x8000);
+        bus_map(bus->write, mirror + 0x18000, mirror + 0x20000, memory->vram + 0x10000, 0x8000);
+    }
+    for (uint32_t address = BUS_VRAM; address < BUS_OAM; address += BUS_PAGE_SIZE) {
+        bus->write[BUS_PAGE_INDEX(address)].watch |= BUS_WATCH_VRAM;
+    }
+
+    for (uint32_t address = BUS_OAM; address < BUS_ROM; address += BUS_PAGE_SIZE) {
+        bus->write[BUS_PAGE_INDEX(address)].watch |= BUS_WATCH_OAM;
+    }
+
+    // Whatever the PPU decoded or a snapshot copied belongs to the previous memory
+    memset(bus->vram_dirty, 0xFF, sizeof(bus->vram_dirty));
+    memset(bus->oam_dirty, 0xFF, sizeof(bus->oam_dirty));
+    bus->written = BUS_UNITS_ALL;
+
+    // Game Pak ROM, read only, the three wait state regions all show the same ROM
+    // Only whole pages are mapped, the tail of the ROM and the space past it use the slow handler
+    uint32_t rom_pages = memory->rom_size & ~(BUS_PAGE_SIZE - 1);
+    for (uint32_t mirror = BUS_ROM; mirror < BUS_SRAM; mirror += BUS_ROM_SIZE) {
+        if (rom_pages > 0) {
+            bus_map(bus->read, mirror, mirror + rom_pages, memory->rom, rom_pages);
+        }
+    }
+
+    // Game Pak SRAM, mirrored through its 32 MByte region
+    bus_map(bus->read, BUS_SRAM, BUS_END, memory->sram, sizeof(memory->sram));
+    bus_map(bus->write, BUS_SRAM, BUS_END, memory->sram, sizeof(memory->sram));
+}
+
+// Allocate a bus for the given memory
+// Returns NULL if the page tables could not be allocated
+bus_t* bus_create(memory_t* memory)
+{
+    bus_t* bus = (bus_t*)malloc(sizeof(bus_t));
+    if (bus == NULL) {
+        return NULL;
+    }
+
+    bus_init(bus, memory);
+    return bus;
+}
+
+void bus_destroy(bus_t* bus)
+{
+    free(bus);
+}
+
+// Call the read or write hooks of the I/O registers an access covers
+// A hook that covers both halfwords of a word access is called once for the whole word
+static inline void bus_io_call(bus_t* bus, uint32_t offset, int size, int write)
+{
+    uint32_t index = offset / 2;
+    if (index >= BUS_IO_REGISTERS) {
+        return;
+    }
+
+    const bus_io_register_t* first = &bus->io[index];
+    bus_io_hook_t hook = write ? first->write : first->read;
+    if (size == 4 && index + 1 < BUS_IO_REGISTERS) {
+        const bus_io_register_t* second = &bus->io[index + 1];
+        bus_io_hook_t next = write ? second->write : second->read;
+        if (next != hook || second->context != first->context) {
+            if (hook != NULL) {
+                hook(first->context, offset, 2);
+            }
+            if (next != NULL) {
+                next(second->context, offset + 2, 2);
+            }
+            return;
+        }
+    }
+
+    if (hook != NULL) {
+        hook(first->context, offset, size);
+    }
+}
+
+// Slow path for reads from pages without a host pointer
+// `size` is the access size in bytes (1, 2 or 4), the address is already aligned to it
+uint32_t bus_read_slow(bus_t* bus, uint32_t address, int size)
+{
+    address &= BUS_END - 1;
+
+    if ((address & 0xFF000000) == BUS_IO) {
+        // I/O registers are only decoded in the first 1 KByte and are not mirrored
+        uint32_t offset = address - BUS_IO;
+        uint32_t value = 0;
+
+        bus_io_call(bus, offset, size, 0);
+        for (int i = 0; i < size; i++) {
+            if (offset + i < sizeof(bus->memory->io)) {
+                value |= (uint32_t)(uint8_t)bus->memory->io[offset + i] << (i * 8);
+            }
+        }
+
+        return value;
+    }
+
+    if (address >= BUS_ROM && address < BUS_SRAM) {
+        uint32_t offset = address & (BUS_ROM_SIZE - 1);
+        uint32_t value = 0;
+
+        for (int i = 0; i < size; i++) {
+            if (offset + i < bus->memory->rom_size) {
+                value |= (uint32_t)(uint8_t)bus->memory->rom[offset + i] << (i * 8);
+            } else {
+                // Past the end of the cartridge the bus returns the halfword address
+                uint32_t halfword = ((offset + i) >> 1) & 0xFFFF;
+                value |= ((halfword >> (((offset + i) & 1) * 8)) & 0xFF) << (i * 8);
+            }
+        }
+
+        return value;
+    }
+
+    // Unmapped memory
+    return 0;
+}
+
+// Slow path for writes to pages without a host pointer
+// `size` is the access size in bytes (1, 2 or 4), the address is already aligned to it
+void bus_write_slow(bus_t* bus, uint32_t address, uint32_t value, int size)
+{
+    address &= BUS_END - 1;
+
+    if ((address & 0xFF000000) == BUS_IO) {
+        uint32_t offset = address - BUS_IO;
+
+        // Each halfword keeps its read only bits, a byte write only touches its half
+        for (uint32_t index = offset / 2; index < (offset + size + 1) / 2 && index < BUS_IO_REGISTERS; index++) {
+            const bus_io_register_t* reg = &bus->io[index];
+            uint16_t lanes = size == 1 ? (uint16_t)(0xFF << ((offset & 1) * 8)) : 0xFFFF;
+            uint16_t data = size == 1 ? (uint16_t)(value << ((offset & 1) * 8)) : (uint16_t)(value >> ((index * 2 - offset) * 8));
+            uint16_t stored = reg->write_mask & lanes;
+            uint16_t cleared = reg->clear_mask & lanes & data;
+            uint16_t old = memory_io_read16(bus->memory, index * 2);
+            memory_io_write16(bus->memory, index * 2, (uint16_t)((old & ~(stored | cleared)) | (data & stored)));
+        }
+
+        bus_io_call(bus, offset, size, 1);
+    }
+
+    // Writes to BIOS, ROM and unmapped memory are ignored
+}
+
+// Return the code line for an address, or -1 if code at the address is never invalidated
+static inline int bus_code_line(uint32_t address)
+{
+    switch ((address >> 24) & 0xF) {
+    case 0x2:
+        return (address & 0x3FFFF) >> BUS_CODE_LINE_SHIFT;
+    case 0x3:
+        return (0x40000 + (address & 0x7FFF)) >> BUS_CODE_LINE_SHIFT;
+    default:
+        return -1;
+    }
+}
+
+// Start watching the code line `line` for writes
+void bus_watch_code(bus_t* bus, int line)
+{
+    bus->code_lines[line >> 5] |= 1u << (line & 31);
+
+    // Find the page the line is in
+    uint32_t region = BUS_WRAM;
+    uint32_t size = sizeof(bus->memory->wram);
+    uint32_t offset = (uint32_t)line << BUS_CODE_LINE_SHIFT;
+    if (offset >= size) {
+        offset -= size;
+        region = BUS_WRAM_CHIP;
+        size = sizeof(bus->memory->wram_chip);
+    }
+    offset &= ~(BUS_PAGE_SIZE - 1);
+
+    // Page watch bits are never cleared, so if the first mirror is watched they all are
+    if (bus->write[BUS_PAGE_INDEX(region + offset)].watch & BUS_WATCH_CODE) {
+        return;
+    }
+
+    // Watch every mirror of the page
+    for (uint32_t address = region + offset; address < region + 0x1000000; address += size) {
+        bus->write[BUS_PAGE_INDEX(address)].watch |= BUS_WATCH_CODE;
+    }
+}
+
+// Offset of a VRAM address in memory_t::vram, following the mirroring set up by bus_init
+static inline uint32_t bus_vram_offset(uint32_t address)
+{
+    uint32_t offset = address & 0x1FFFF;
+    return offset >= 0x18000 ? offset - 0x8000 : offset;
+}
+
+// Unit of a writable address, -1 for the I/O registers and read only memory
+static inline int bus_unit(uint32_t address)
+{
+    switch ((address >> 24) & 0xF) {
+    case 0x2:
+        return BUS_UNIT_WRAM + (int)((address & 0x3FFFF) >> BUS_PAGE_SHIFT);
+    case 0x3:
+        return BUS_UNIT_WRAM_CHIP + (int)((address & 0x7FFF) >> BUS_PAGE_SHIFT);
+    case 0x5:
+        return BUS_UNIT_PALETTE;
+    case 0x6:
+        return BUS_UNIT_VRAM + (int)(bus_vram_offset(address) >> BUS_PAGE_SHIFT);
+    case 0x7:
+        return BUS_UNIT_OAM;
+    case 0xE:
+    case 0xF:
+        return BUS_UNIT_SRAM + (int)((address & 0xFFFF) >> BUS_PAGE_SHIFT);
+    default:
+        return -1;
+    }
+}
+
+// Clear `written` and watch every writable page for its first write
+void bus_track_writes(bus_t* bus)
+{
+    bus->written = 0;
+    for (uint32_t index = BUS_PAGE_INDEX(BUS_WRAM); index < BUS_PAGE_COUNT; index++) {
+        if (bus->write[index].base != NULL) {
+            bus->write[index].watch |= BUS_WATCH_STATE;
+        }
+    }
+}
+
+// First write to a unit since bus_track_writes, stop watching its pages in every mirror
+static void bus_mark_written(bus_t* bus, uint32_t address)
+{
+    int unit = bus_unit(address);
+    if (unit < 0) {
+        return;
+    }
+    bus->written |= 1u << unit;
+
+    // The pages of a unit all point at the same host memory, and SRAM mirrors span two regions
+    const uint8_t* base = bus->write[BUS_PAGE_INDEX(address)].base;
+    uint32_t start = address & 0x0F000000;
+    uint32_t end = unit >= BUS_UNIT_SRAM ? BUS_END : start + 0x01000000;
+    if (unit >= BUS_UNIT_SRAM) {
+        start = BUS_SRAM;
+    }
+    for (uint32_t index = BUS_PAGE_INDEX(start); index < BUS_PAGE_INDEX(end - 1) + 1; index++) {
+        if (bus->write[index].base == base) {
+            bus->write[index].watch &= ~BUS_WATCH_STATE;
+        }
+    }
+}
+
+// Called after a fast path write to a watched page
+void bus_write_watched(bus_t* bus, uint32_t address)
+{
+    if (bus->write[BUS_PAGE_INDEX(address)].watch & BUS_WATCH_STATE) {
+        bus_mark_written(bus, address);
+    }
+
+    switch ((address >> 24) & 0xF) {
+    case 0x6: {
+        // Accesses are aligned so they never cross a block
+        uint32_t block = bus_vram_offset(address) >> BUS_VRAM_BLOCK_SHIFT;
+        bus->vram_dirty[block >> 5] |= 1u << (block & 31);
+        return;
+    }
+    case 0x7: {
+        // The third attribute and the rotation/scaling parameter do not move the sprite
+        uint32_t entry = (address & 0x3FF) >> 3;
+        if ((address & 0x7) < 4) {
+            bus->oam_dirty[entry >> 5] |= 1u << (entry & 31);
+        }
+        return;
+    }
+    }
+
+    int line = bus_code_line(address);
+    if (line < 0) {
+        return;
+    }
+
+    // Accesses are aligned so they never cross a line
+    uint32_t bit = 1u << (line & 31);
+    if (bus->code_lines[line >> 5] & bit) {
+        bus->code_lines[line >> 5] &= ~bit;
+        bus->code_generation[line]++;
+        bus->code_writes++;
+    }
+}
+
+// Fast paths
+// The GBA forces halfword and word accesses to be aligned, so the low address bits are dropped
+
+static inline uint8_t bus_read8(bus_t* bus, uint32_t address)
+{
+    const bus_page_t* page = &bus->read[BUS_PAGE_INDEX(address)];
+    if (page->base != NULL) {
+        return page->base[address & page->mask];
+    }
+    return (uint8_t)bus_read_slow(bus, address, 1);
+}
+
+static inline uint16_t bus_read16(bus_t* bus, uint32_t address)
+{
+    address &= ~1u;
+    const bus_page_t* page = &bus->read[BUS_PAGE_INDEX(address)];
+    if (page->base != NULL) {
+        return *(uint16_t*)&page->base[address & page->mask];
+    }
+    return (uint16_t)bus_read_slow(bus, address, 2);
+}
+
+static inline uint32_t bus_read32(bus_t* bus, uint32_t address)
+{
+    address &= ~3u;
+    const bus_page_t* page = &bus->read[BUS_PAGE_INDEX(address)];
+    if (page->base != NULL) {
+        return *(uint32_t*)&page->base[address & page->mask];
+    }
+    return bus_read_slow(bus, address, 4);
+}
+
+static inline void bus_write8(bus_t* bus, uint32_t address, uint8_t value)
+{
+    const bus_page_t* page = &bus->write[BUS_PAGE_INDEX(address)];
+    if (page->base != NULL) {
+        page->base[address & page->mask] = value;
+        if (page->watch) {
+            bus_write_watched(bus, address);
+        }
+        return;
+    }
+    bus_write_slow(bus, address, value, 1);
+}
+
+static inline void bus_write16(bus_t* bus, uint32_t address, uint16_t value)
+{
+    address &= ~1u;
+    const bus_page_t* page = &bus->write[BUS_PAGE_INDEX(address)];
+    if (page->base != NULL) {
+        *(uint16_t*)&page->base[address & page->mask] = value;
+        if (page->watch) {
+            bus_write_watched(bus, address);
+        }
+        return;
+    }
+    bus_write_slow(bus, address, value, 2);
+}
+
+static inline void bus_write32(bus_t* bus, uint32_t address, uint32_t value)
+{
+    address &= ~3u;
+    const bus_page_t* page = &bus->write[BUS_PAGE_INDEX(address)];
+    if (page->base != NULL) {
+        *(uint32_t*)&page->base[address & page->mask] = value;
+        if (page->watch) {
+            bus_write_watched(bus, address);
+        }
+        return;
+    }
+    bus_write_slow(bus, address, value, 4);
+}
+
+// Bulk paths for block transfers and DMA
+// Host pointer to the `size` bytes from `address` in one of the page tables, or NULL if they are not
+// all in one page with a host pointer, in which case the caller goes one access at a time
+static inline uint8_t* bus_span(bus_page_t* table, uint32_t address, uint32_t size)
+{
+    bus_page_t* page = &table[BUS_PAGE_INDEX(address)];
+    uint32_t offset = address & page->mask;
+    if (page->base == NULL || offset + size > page->mask + 1) {
+        return NULL;
+    }
+    return &page->base[offset];
+}
+
+// `count` consecutive words from `address`, see bus_span
+static inline uint32_t* bus_span32(bus_page_t* table, uint32_t address, uint32_t count)
+{
+    return (uint32_t*)bus_span(table, address & ~3u, count * 4);
+}
+
+// Called after the `size` bytes from `address` were written through bus_span, which keeps them in
+// one page
+static inline void bus_span_written(bus_t* bus, uint32_t address, uint32_t size)
+{
+    address &= ~3u;
+    if (bus->write[BUS_PAGE_INDEX(address)].watch) {
+        for (uint32_t i = 0; i < size; i += 4) {
+            bus_write_watched(bus, address + i);
+        }
+    }
+}
+
+#endif // BUS_H_
@@ -3,17 +3,27 @@
 #ifndef __CPU_H__
 #define __CPU_H__
 
+#include "bios.h"
 #include "bits.h"
-#include "memory.h"
+#include "bus.h"
+#include "trace.h"
 
 #include <limits.h> // for CHAR_BIT
 #include <memory.h>
 #include <stdint.h> // for uint32_t
-#include <stdio.h> // for printf
 
 typedef uint32_t cpu_arm_instruction_t;
 typedef uint16_t cpu_thumb_instruction_t;
 
+// Register banks, User and System share one, see cpu_mode_bank
+#define CPU_BANK_USER 0
+#define CPU_BANK_FIQ 1
+#define CPU_BANK_IRQ 2
+#define CPU_BANK_SUPERVISOR 3
+#define CPU_BANK_ABORT 4
+#define CPU_BANK_UNDEFINED 5
+#define CPU_BANKS 6
+
 typedef struct cpu_registers {
     uint32_t r[13]; // General Purpose Registers
     uint32_t sp; // Stack Pointer
@@ -27,7 +37,12 @@ typedef struct cpu_registers {
     // 28: V (Overflow)
     // 4-0: Mode bits
     uint32_t cpsr; // Current Program Status Register
-    uint32_t spsr; // Saved Program Status Register
+    uint32_t spsr; // Saved Program Status Register of the current mode
+
+    // Banked registers of the modes that are not current, swapped in by cpu_switch_bank
+    uint32_t bank_high[2][5]; // R8-R12, [1] for FIQ and [0] for every other mode
+    uint32_t bank_sp_lr[CPU_BANKS][2]; // R13 and R14 of each bank
+    uint32_t bank_spsr[CPU_BANKS];
 } cpu_registers_t;
 
 // ARM Processor Mode constants
@@ -98,17 +113,96 @@ enum cpu_mode {
     UNDEFINED = 0x1B, // 11011
 };
 
+// Lazy condition flags
+// Flag setting instructions only record their result (and operands for arithmetic),
+// the NZCV bits in cpsr are computed by cpu_flags_resolve when something reads them
+#define CPU_FLAGS_NZ 0x1 // N and Z are pending, computed from result
+#define CPU_FLAGS_CV 0x2 // C and V are pending, computed from op1 + op2 + carry_in
+
+typedef struct cpu_flags {
+    uint32_t result; // Result of the last flag setting instruction
+    uint32_t op1; // First operand of the last arithmetic instruction
+    uint32_t op2; // Second operand, subtraction records ~op2 since a - b = a + ~b + 1
+    uint32_t carry_in; // Carry into the last arithmetic instruction
+    uint8_t pending; // CPU_FLAGS_* bits that are not in cpsr yet
+} cpu_flags_t;
+
 typedef struct cpu {
     cpu_registers_t registers;
-    char* memory;
-    // memory_t* memory_struct;
+    cpu_flags_t flags;
+    bus_t* bus; // Memory bus, all loads and stores go through it
+    uint64_t cycles; // Cycles executed since reset, see cpu_arm_cycles
+#if GBA_TRACE_RING
+    trace_ring_t* trace; // Instruction trace, NULL when not recording
+#endif
 } cpu_t;
 
-int cpu_check_condition(uint32_t cpsr, cpu_arm_instruction_t instruction)
+// Write any pending condition flags into cpsr
+static inline void cpu_flags_resolve(cpu_t* cpu)
 {
-    uint8_t cond = (instruction >> 28) & 0xF;
+    if (cpu->flags.pending == 0) {
+        return;
+    }
+
+    uint32_t cpsr = cpu->registers.cpsr;
+
+    if (cpu->flags.pending & CPU_FLAGS_NZ) {
+        cpsr = (cpsr & ~0xC0000000) | (cpu->flags.result & 0x80000000) | ((uint32_t)(cpu->flags.result == 0) << 30);
+    }
+
+    if (cpu->flags.pending & CPU_FLAGS_CV) {
+        // Recompute the sum, result may have been replaced by a later logical instruction
+        uint32_t op1 = cpu->flags.op1;
+        uint32_t op2 = cpu->flags.op2;
+        uint64_t sum = (uint64_t)op1 + op2 + cpu->flags.carry_in;
+        uint32_t carry = (uint32_t)(sum >> 32);
+        uint32_t overflow = (~(op1 ^ op2) & (op1 ^ (uint32_t)sum)) >> 31;
+        cpsr = (cpsr & ~0x30000000) | (carry << 29) | (overflow << 28);
+    }
+
+    cpu->registers.cpsr = cpsr;
+    cpu->flags.pending = 0;
+}
+
+// Record N and Z for a logical operation, C and V are unchanged
+static inline void cpu_set_flags_logical(cpu_t* cpu, uint32_t result)
+{
+    cpu->flags.result = result;
+    cpu->flags.pending |= CPU_FLAGS_NZ;
+}
 
-    printf("Condition: cond=0x%X result=", cond);
+// Add op1 + op2 + carry_in and record NZCV for it
+// Subtractions pass ~op2 and a carry in of 1 (or the C flag for SBC/RSC)
+static inline uint32_t cpu_flags_add(cpu_t* cpu, uint32_t op1, uint32_t op2, uint32_t carry_in)
+{
+    uint32_t result = op1 + op2 + carry_in;
+
+    cpu->flags.result = result;
+    cpu->flags.op1 = op1;
+    cpu->flags.op2 = op2;
+    cpu->flags.carry_in = carry_in;
+    cpu->flags.pending = CPU_FLAGS_NZ | CPU_FLAGS_CV;
+
+    return result;
+}
+
+static inline uint32_t cpu_get_carry(cpu_t* cpu)
+{
+    cpu_flags_resolve(cpu);
+    return get_cpsr_carry(cpu->registers.cpsr);
+}
+
+static inline void cpu_set_carry(cpu_t* cpu, uint32_t value)
+{
+    cpu_flags_resolve(cpu);
+    set_cpsr_carry(&cpu->registers, value);
+}
+
+// Returns 1 if the condition passes for the given NZCV flags, 0 if it does not
+// Only used to build cpu_condition_table, the interpreter reads the table instead
+int cpu_evaluate_condition(uint8_t nzcv, uint8_t cond)
+{
+    uint32_t cpsr = (uint32_t)nzcv << 28;
 
     switch (cond) {
     case 0x0: // EQ
@@ -148,1421 +242,2159 @@ int cpu_check_condition(uint32_t cpsr, cpu_arm_instruction_t instruction)
     }
 }
 
-// Returns 1 if the instruction was executed, 0 if it was not
-int cpu_process_arm_instruction(cpu_t* cpu, cpu_arm_instruction_t instruction)
+// Condition lookup table, indexed by the NZCV nibble (CPSR bits 31-28) and the condition code
+// Filled in by cpu_init_tables
+uint8_t cpu_condition_table[16][16];
+
+int cpu_check_condition(cpu_t* cpu, cpu_arm_instruction_t instruction)
 {
-    // Get a string of the current mode
-    char* mode;
-    switch (get_cpsr_mode(cpu->registers.cpsr)) {
-    case ARM_MODE_USER:
-        mode = "USER";
-        break;
-    case ARM_MODE_FIQ:  
-        mode = "FIQ";
-        break;
-    case ARM_MODE_IRQ:
-        mode = "IRQ";
-        break;
-    case ARM_MODE_SUPERVISOR:
-        mode = "SUPERVISOR";
-        break;
-    case ARM_MODE_ABORT:
-        mode = "ABORT";
-        break;
-    case ARM_MODE_UNDEFINED:
-        mode = "UNDEFINED";
-        break;
-    default:
-        mode = "UNKNOWN";
-        break;
+    uint8_t cond = (instruction >> 28) & 0xF;
+
+    // AL passes whatever the flags are, so the flags stay pending
+    if (cond == 0xE) {
+        return 1;
     }
 
-    // Print the PC and instruction
-    printf("[ARM][%s] SP=0x%X, PC=0x%X, Instruction=0x%X, ", mode, cpu->registers.sp, cpu->registers.pc, instruction);
+    cpu_flags_resolve(cpu);
+    return cpu_condition_table[cpu->registers.cpsr >> 28][cond];
+}
 
-    // if (cpu->registers.sp != 0) {
-    //     printf("SP not 0\n");
-    //     return 0;
-    // }
+// Register bank of each value of the mode bits, the invalid ones use the User bank
+static const uint8_t cpu_mode_bank[32] = {
+    [0x11] = CPU_BANK_FIQ,
+    [0x12] = CPU_BANK_IRQ,
+    [0x13] = CPU_BANK_SUPERVISOR,
+    [0x17] = CPU_BANK_ABORT,
+    [0x1B] = CPU_BANK_UNDEFINED,
+};
 
-    // Check the condition to see if we should execute the instruction
-    if (!cpu_check_condition(cpu->registers.cpsr, instruction)) {
-        printf("false\n");
-        return 1;
-    }
-    printf("true\n");
+// Swap the banked registers of the current mode for those of `mode`, and set the mode bits
+// Always the same copies: R13, R14 and SPSR, and R8-R12 from the FIQ or the shared set
+static inline void cpu_switch_bank(cpu_registers_t* registers, uint32_t mode)
+{
+    uint8_t from = cpu_mode_bank[get_cpsr_mode(registers->cpsr)];
+    uint8_t to = cpu_mode_bank[mode & 0x1F];
 
-    // Decode the instruction
-    uint8_t instruction_type = (instruction >> 26) & 0x3; // Operation (0x0 = data processing, 0x1 = load/store, 0x2 = branch, 0x3 = coprocessor)
-    uint8_t i = (instruction >> 25) & 0x1; // Immediate Operand (0 = register, 1 = immediate)
+    memcpy(registers->bank_high[from == CPU_BANK_FIQ], &registers->r[8], sizeof(registers->bank_high[0]));
+    registers->bank_sp_lr[from][0] = registers->sp;
+    registers->bank_sp_lr[from][1] = registers->lr;
+    registers->bank_spsr[from] = registers->spsr;
 
-    switch (instruction_type) {
-    case 0x0: {
-        // If bits 27-4 are 0001 0010 1111 1111 1111 0001 this is a Branch and Exchange instruction
-        if ((instruction & 0xFFFFFF0) == 0x12FFF10) {
-            // Branch and Exchange
-            uint8_t rn = (instruction >> 0) & 0xF; // Register
-
-            // Determine if the mode is ARM or Thumb and set the PC and mode accordingly
-            if (cpu->registers.r[rn] & 0x1) {
-                // Thumb
-                cpu->registers.pc = cpu->registers.r[rn] & 0xFFFFFFFE;
-                cpu->registers.pc -= 2; // TODO: this is a hack to make the PC correct
-                cpu->registers.cpsr &= ~0x20;
-                printf("BX: rs=%d, pc=%d, mode=THUMB\n", cpu->registers.r[rn], cpu->registers.pc);
-            } else {
-                // ARM
-                cpu->registers.pc = cpu->registers.r[rn] & 0xFFFFFFFC;
-                cpu->registers.pc -= 4; // TODO: this is a hack to make the PC correct
-                cpu->registers.cpsr |= 0x20;
-                printf("BX: rs=%d, pc=%d, mode=ARM\n", cpu->registers.r[rn], cpu->registers.pc);
-            }
-            return 1;
-        }
+    memcpy(&registers->r[8], registers->bank_high[to == CPU_BANK_FIQ], sizeof(registers->bank_high[0]));
+    registers->sp = registers->bank_sp_lr[to][0];
+    registers->lr = registers->bank_sp_lr[to][1];
+    registers->spsr = registers->bank_spsr[to];
 
-        // If i is 1 or bit 7 is 0, this is a Data Processing or PSR Transfer instruction
-        if (i == 1 || ((instruction >> 7) & 0x1) == 0) {
-            // Data Processing
-            uint8_t opcode = (instruction >> 21) & 0xF;
-            uint8_t s = (instruction >> 20) & 0x1; // Set Condition Codes (0 = no, 1 = yes)
-            uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
-            uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
-            uint32_t src2; // Source 2 (either a register or an immediate value)
-
-            // Get the second operand based on the value of i
-            // i = 0: Register Operand
-            // i = 1: Immediate Operand
-            if (i == 0) {
-                uint8_t shift_value = cpu->registers.r[instruction & 0xF]; // Second Operand Register
-                uint8_t shift_type = (instruction >> 5) & 0x3; // Shift Type
-                uint8_t shift_amount;
-
-                // Register Operand
-                if ((instruction >> 4) & 0x1) {
-                    // Shift by Register
-                    uint8_t rs = (instruction >> 8) & 0xF; // Shift Amount Register
-                    shift_amount = cpu->registers.r[rs] & 0xFF; // Shift Amount
-                } else {
-                    // Shift by Immediate
-                    shift_amount = (instruction >> 7) & 0x1F; // Shift Amount
-                }
+    set_cpsr_mode(registers, mode);
+}
 
-                // Shift the value
-                switch (shift_type) {
-                case 0x0: // Logical Shift Left
-                    // Shifts left by the shift amount, filling the low bits with 0s
-                    // Sets the carry flag to the last bit shifted out
-                    // If the shift amount is more than 32, the result is 0 and the carry flag is set to 0
-                    if (shift_amount > 32) {
-                        src2 = 0;
-                        if (s && rd != 15) {
-                            set_cpsr_carry(&cpu->registers, 0);
-                        }
-                    } else {
-                        src2 = cpu->registers.r[shift_value] << shift_amount;
-                        if (s && rd != 15) {
-                            // TODO: there may be a special case for LSL #0 where the carry flag is preserved
-                            set_cpsr_carry(&cpu->registers, (cpu->registers.r[shift_value] >> (32 - shift_amount)) & 0x1);
-                        }
-                    }
-                    break;
-                case 0x1: // Logical Shift Right
-                    // Shifts right by the shift amount, filling the high bits with 0s
-                    // Sets the carry flag to the last bit shifted out
-                    // If the shift amount is more than 32, the result is 0 and the carry flag is set to 0
-                    if (shift_amount > 32) {
-                        src2 = 0;
-                        if (s && rd != 15) {
-                            set_cpsr_carry(&cpu->registers, 0);
-                        }
-                    } else {
-                        src2 = cpu->registers.r[shift_value] >> shift_amount;
-                        if (s && rd != 15) {
-                            set_cpsr_carry(&cpu->registers, (cpu->registers.r[shift_value] >> (shift_amount - 1)) & 0x1);
-                        }
-                    }
-                    break;
-                case 0x2: // Arithmetic Shift Right
-                    // Shifts right by the shift amount, filling the high bits with the sign bit
-                    // Sets the carry flag to the last bit shifted out
-                    // If the shift amount is 32 or more, the result and carry flag are set to the sign bit
-                    if (shift_amount >= 32) {
-                        src2 = sign_extend(cpu->registers.r[shift_value] >> 31, 32 - shift_amount);
-                        if (s && rd != 15) {
-                            set_cpsr_carry(&cpu->registers, (cpu->registers.r[shift_value] >> 31) & 0x1);
-                        }
-                    } else {
-                        src2 = sign_extend(cpu->registers.r[shift_value] >> shift_amount, 32 - shift_amount);
-                        if (s && rd != 15) {
-                            set_cpsr_carry(&cpu->registers, (cpu->registers.r[shift_value] >> (shift_amount - 1)) & 0x1);
-                        }
-                    }
-                    break;
-                case 0x3: // Rotate Right
-                    // If the shift amount is 0, this is a RRX (Rotate Right Extended)
-                    // Otherwise, this is a ROR (Rotate Right)
-                    if (shift_amount == 0) {
-                        // Rotate Right Extended
-                        // Shifts right by 1 bit, filling the high bit with the carry flag
-                        // Sets the carry flag to the last bit shifted out
-                        src2 = (cpu->registers.r[shift_value] >> 1) | (get_cpsr_carry(cpu->registers.cpsr) << 31);
-                        if (s && rd != 15) {
-                            set_cpsr_carry(&cpu->registers, cpu->registers.r[shift_value] & 0x1);
-                        }
-                    } else {
-                        // Rotate Right
-                        // Shifts right by the shift amount, filling the high bits with the low bits
-                        // Sets the carry flag to the last bit shifted out
-                        src2 = rotl32(cpu->registers.r[shift_value], shift_amount);
-                        if (s && rd != 15) {
-                            set_cpsr_carry(&cpu->registers, (cpu->registers.r[shift_value] >> (shift_amount - 1)) & 0x1);
-                        }
-                    }
-                    break;
-                }
-                printf("Register offset: shift_value=%d, shift_type=%d, shift_amount=%d, src2=%d\n", shift_value, shift_type, shift_amount, src2);
-            } else {
-                // Immediate Operand
-                uint8_t rotate = (instruction >> 8) & 0xF; // Rotate
-                uint32_t imm = instruction & 0xFF; // Immediate Value, zero-extended to 32 bits
+// Replace cpsr with `value`, switching banks if the mode changes
+// The condition flags come from `value`, so any pending ones are dropped
+static inline void cpu_write_cpsr(cpu_t* cpu, uint32_t value)
+{
+    cpu->flags.pending = 0;
+    cpu_switch_bank(&cpu->registers, value);
+    cpu->registers.cpsr = value;
+}
 
-                // Rotate the immediate value
-                src2 = rotr32(imm, rotate * 2);
-                printf("Immediate offset: rotate=%d, imm=%X, src2=%X\n", rotate, imm, src2);
-            }
+// Enter exception `mode` at `vector` in ARM state with IRQs disabled, returning to `lr`
+static inline void cpu_exception_enter(cpu_t* cpu, uint32_t mode, uint32_t vector, uint32_t lr)
+{
+    cpu_flags_resolve(cpu);
+    uint32_t cpsr = cpu->registers.cpsr;
+
+    cpu_switch_bank(&cpu->registers, mode);
+    cpu->registers.spsr = cpsr;
+    cpu->registers.lr = lr;
+    cpu->registers.cpsr |= 0x20 | 0x80;
+    cpu->registers.pc = vector;
+}
 
-            // Perform the operation
-            switch (opcode) {
-            case 0b0000: // AND (Logical AND)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                cpu->registers.r[rd] = cpu->registers.r[rn] & src2;
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                printf("AND: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
-                break;
-            case 0b0001: // EOR (Logical Exclusive OR)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                cpu->registers.r[rd] = cpu->registers.r[rn] ^ src2;
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                printf("EOR: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
-                break;
-            case 0b0010: // SUB (Arithmetic Subtraction)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                // Sets the c flag if there was no borrow
-                // Sets the v flag if there was overflow
-                cpu->registers.r[rd] = cpu->registers.r[rn] - src2;
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                set_cpsr_carry(&cpu->registers, cpu->registers.r[rn] >= src2);
-                set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rn] ^ src2) & (cpu->registers.r[rn] ^ cpu->registers.r[rd]) & 0x80000000);
-                printf("SUB: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
-                break;
-            case 0b0011: // RSB (Reverse Subtract)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                // Sets the c flag if there was no borrow
-                // Sets the v flag if there was overflow
-                cpu->registers.r[rd] = src2 - cpu->registers.r[rn];
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                set_cpsr_carry(&cpu->registers, src2 >= cpu->registers.r[rn]);
-                set_cpsr_overflow(&cpu->registers, (src2 ^ cpu->registers.r[rn]) & (src2 ^ cpu->registers.r[rd]) & 0x80000000);
-                printf("RSB: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
-                break;
-            case 0b0100: // ADD (Addition)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                // Sets the c flag if there was no borrow
-                // Sets the v flag if there was overflow
-                cpu->registers.r[rd] = cpu->registers.r[rn] + src2;
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                set_cpsr_carry(&cpu->registers, cpu->registers.r[rn] >= src2);
-                set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rn] ^ src2) & (cpu->registers.r[rn] ^ cpu->registers.r[rd]) & 0x80000000);
-                printf("ADD: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
-                break;
-            case 0b0101: // ADC (Add with Carry)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                // Sets the c flag if there was no borrow
-                // Sets the v flag if there was overflow
-                cpu->registers.r[rd] = cpu->registers.r[rn] + src2 + get_cpsr_carry(cpu->registers.cpsr);
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                set_cpsr_carry(&cpu->registers, cpu->registers.r[rn] >= src2);
-                set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rn] ^ src2) & (cpu->registers.r[rn] ^ cpu->registers.r[rd]) & 0x80000000);
-                printf("ADC: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
-                break;
-            case 0b0110: // SBC (Subtract with Carry)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                // Sets the c flag if there was no borrow
-                // Sets the v flag if there was overflow
-                cpu->registers.r[rd] = cpu->registers.r[rn] - src2 - !get_cpsr_carry(cpu->registers.cpsr);
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                set_cpsr_carry(&cpu->registers, cpu->registers.r[rn] >= src2);
-                set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rn] ^ src2) & (cpu->registers.r[rn] ^ cpu->registers.r[rd]) & 0x80000000);
-                printf("SBC: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
-                break;
-            case 0b0111: // RSC (Reverse Subtract with Carry)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                // Sets the c flag if there was no borrow
-                // Sets the v flag if there was overflow
-                cpu->registers.r[rd] = src2 - cpu->registers.r[rn] - !get_cpsr_carry(cpu->registers.cpsr);
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                set_cpsr_carry(&cpu->registers, src2 >= cpu->registers.r[rn]);
-                set_cpsr_overflow(&cpu->registers, (src2 ^ cpu->registers.r[rn]) & (src2 ^ cpu->registers.r[rd]) & 0x80000000);
-                printf("RSC: rn=%d, src2=%d, rd=%d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
-                break;
-            case 0b1000: // TST (Test)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                uint32_t tst_result = cpu->registers.r[rn] & src2;
-                set_cpsr_zero(&cpu->registers, tst_result == 0);
-                set_cpsr_negative(&cpu->registers, tst_result < 0);
-                printf("TST: rn=%d, src2=%d, tst_result=%d\n", cpu->registers.r[rn], src2, tst_result);
-                break;
-            case 0b1001:
-                // If the S bit is not set, this is a MSR (Move to PSR) instruction
-                // If the S bit is set, this is a TEQ (Test Equivalence) instruction
-                if (!s) {
-                    // MSR (Move to PSR)
-                    uint8_t pd = (instruction >> 22) & 0x1; // Destination (0 = CPSR, 1 = SPSR_<current mode>)
-                    uint8_t rm = instruction & 0xF; // Operand
-
-                    if (pd == 0) {
-                        // CPSR
-                        // If in user mode, only the condition flags can be modified (bits 31-28)
-                        // If in any other mode, all flags can be modified
-                        printf("MSR: pd=%d, rm=%d, cpsr=0x%X, user_mode=%s\n", pd, rm, cpu->registers.cpsr, get_cpsr_mode(cpu->registers.cpsr) == ARM_MODE_USER ? "true" : "false");
-                        if (get_cpsr_mode(cpu->registers.cpsr) == ARM_MODE_USER) {
-                            cpu->registers.cpsr = (cpu->registers.cpsr & ~0xF0000000) | (cpu->registers.r[rm] & 0xF0000000);
-                        } else {
-                            cpu->registers.cpsr = cpu->registers.r[rm];
-                        }
-                        printf("MSR: pd=%d, rm=%d, cpsr=0x%X, user_mode=%s\n", pd, rm, cpu->registers.cpsr, get_cpsr_mode(cpu->registers.cpsr) == ARM_MODE_USER ? "true" : "false");
-                    } else {
-                        // SPSR_<current mode>
-                        cpu->registers.spsr = cpu->registers.r[rm];
-                        printf("MSR: pd=%d, rm=%d, spsr=0x%X\n", pd, rm, cpu->registers.spsr);
-                    }
-                } else {
-                    // TEQ (Test Equivalence)
-                    // Sets the z flag if the result is 0
-                    // Sets the n flag if the result is negative
-                    uint32_t teq_result = cpu->registers.r[rn] ^ src2;
-                    set_cpsr_zero(&cpu->registers, teq_result == 0);
-                    set_cpsr_negative(&cpu->registers, teq_result < 0);
-                    printf("TEQ: rn=%d (0x%X), src2=%d, teq_result=%X\n", rn, cpu->registers.r[rn], src2, teq_result);
-                }
-                break;
-            case 0b1010: // CMP (Compare)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                // Sets the c flag if there was no borrow
-                // Sets the v flag if there was overflow
-                uint32_t cmp_result = cpu->registers.r[rn] - src2;
-                set_cpsr_zero(&cpu->registers, cmp_result == 0);
-                set_cpsr_negative(&cpu->registers, cmp_result < 0);
-                set_cpsr_carry(&cpu->registers, cpu->registers.r[rn] >= src2);
-                set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rn] ^ src2) & (cpu->registers.r[rn] ^ cmp_result) & 0x80000000);
-                printf("CMP: rn=%d (0x%X), src2=%d, cmp_result=%d\n", rn, cpu->registers.r[rn], src2, cmp_result);
-                break;
-            case 0b1011: // CMN (Compare Negated)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                // Sets the c flag if there was no borrow
-                // Sets the v flag if there was overflow
-                uint32_t cmn_result = cpu->registers.r[rn] + src2;
-                set_cpsr_zero(&cpu->registers, cmn_result == 0);
-                set_cpsr_negative(&cpu->registers, cmn_result < 0);
-                set_cpsr_carry(&cpu->registers, cpu->registers.r[rn] >= src2);
-                set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rn] ^ src2) & (cpu->registers.r[rn] ^ cmn_result) & 0x80000000);
-                printf("CMN: rn=%d, src2=%d, cmn_result=%d\n", cpu->registers.r[rn], src2, cmn_result);
-                break;
-            case 0b1100: // ORR (Logical (inclusive) OR)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                cpu->registers.r[rd] = cpu->registers.r[rn] | src2;
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                printf("ORR: rn=%d, src2=%d, rd=%d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
-                break;
-            case 0b1101: // MOV (Move)(Logical operation)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                cpu->registers.r[rd] = src2;
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                printf("MOV: src2=0x%X, rd=%d (0x%X)\n", src2, rd, cpu->registers.r[rd]);
-                break;
-            case 0b1110: // BIC (Bit Clear)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                cpu->registers.r[rd] = cpu->registers.r[rn] & ~src2;
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                printf("BIC: rn=%d, src2=%d, rd=%d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
-                break;
-            case 0b1111: // MVN (Move Not)(Logical operation)
-                // Sets the z flag if the result is 0
-                // Sets the n flag if the result is negative
-                cpu->registers.r[rd] = ~src2;
-                set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                printf("MVN: src2=%d, rd=%d\n", src2, cpu->registers.r[rd]);
-                break;
-            default:
-                printf("Unhandled opcode: %d\n", opcode);
-                return 0;
-            }
-        }
-        break;
+// Leave an exception for `address`, restoring cpsr and the banks of the interrupted mode from SPSR
+static inline void cpu_exception_return(cpu_t* cpu, uint32_t address)
+{
+    cpu_write_cpsr(cpu, cpu->registers.spsr);
+    cpu->registers.pc = address & ((cpu->registers.cpsr & 0x20) ? ~3u : ~1u);
+}
+
+// Get a string of the current mode
+const char* cpu_get_mode_name(uint32_t cpsr)
+{
+    switch (get_cpsr_mode(cpsr)) {
+    case ARM_MODE_USER:
+        return "USER";
+    case ARM_MODE_FIQ:
+        return "FIQ";
+    case ARM_MODE_IRQ:
+        return "IRQ";
+    case ARM_MODE_SUPERVISOR:
+        return "SUPERVISOR";
+    case ARM_MODE_ABORT:
+        return "ABORT";
+    case ARM_MODE_UNDEFINED:
+        return "UNDEFINED";
+    default:
+        return "UNKNOWN";
     }
-    case 0x1: {
-        // Single Data Transfer
-        uint8_t p = (instruction >> 24) & 0x1; // Pre/Post Indexing (0 = post, 1 = pre)
-        uint8_t u = (instruction >> 23) & 0x1; // Up/Down (0 = down, 1 = up)
-        uint8_t b = (instruction >> 22) & 0x1; // Byte/Word (0 = word, 1 = byte)
-        uint8_t w = (instruction >> 21) & 0x1; // Writeback (0 = no, 1 = yes)
-        uint8_t l = (instruction >> 20) & 0x1; // Load/Store (0 = store, 1 = load)
-        uint8_t rn = (instruction >> 16) & 0xF; // Base Register
-        uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
-        uint32_t offset; // Offset (either a register or an immediate value)
-
-        // Get the offset based on the value of i
-        // i = 0: Immediate Operand
-        // i = 1: Register Operand
-        if (i == 1) {
-            uint8_t shift_value = cpu->registers.r[instruction & 0xF]; // Second Operand Register
-            uint8_t shift_type = (instruction >> 5) & 0x3; // Shift Type
-            uint8_t shift_amount;
-
-            // Register Operand
-            if ((instruction >> 4) & 0x1) {
-                // Shift by Register
-                uint8_t rs = (instruction >> 8) & 0xF; // Shift Amount Register
-                shift_amount = cpu->registers.r[rs] & 0xFF; // Shift Amount
-                printf("Register offset: shift_value=%d, shift_type=%d, rs=%d (0x%X) shift_amount=%d\n", shift_value, shift_type, rs, cpu->registers.r[rs], shift_amount);
-            } else {
-                // Shift by Immediate
-                shift_amount = (instruction >> 7) & 0x1F; // Shift Amount
-                printf("Register offset: shift_value=%d, shift_type=%d, shift_amount=%d\n", shift_value, shift_type, shift_amount);
-            }
+}
 
-            // Shift the value
-            switch (shift_type) {
-            case 0x0: // Logical Shift Left
-                // Shifts left by the shift amount, filling the low bits with 0s
-                // Sets the carry flag to the last bit shifted out
-                // If the shift amount is more than 32, the result is 0 and the carry flag is set to 0
-                if (shift_amount > 32) {
-                    offset = 0;
-                    // if (s && rd != 15) {
-                    //     set_cpsr_carry(&cpu->registers, 0);
-                    // }
-                } else {
-                    offset = cpu->registers.r[shift_value] << shift_amount;
-                    // if (s && rd != 15) {
-                    //     // TODO: there may be a special case for LSL #0 where the carry flag is preserved
-                    //     set_cpsr_carry(&cpu->registers, (cpu->registers.r[shift_value] >> (32 - shift_amount)) & 0x1);
-                    // }
-                }
-                break;
-            case 0x1: // Logical Shift Right
-                // Shifts right by the shift amount, filling the high bits with 0s
-                // Sets the carry flag to the last bit shifted out
-                // If the shift amount is more than 32, the result is 0 and the carry flag is set to 0
-                if (shift_amount > 32) {
-                    offset = 0;
-                    // if (s && rd != 15) {
-                    //     set_cpsr_carry(&cpu->registers, 0);
-                    // }
-                } else {
-                    offset = cpu->registers.r[shift_value] >> shift_amount;
-                    // if (s && rd != 15) {
-                    //     set_cpsr_carry(&cpu->registers, (cpu->registers.r[shift_value] >> (shift_amount - 1)) & 0x1);
-                    // }
-                }
-                break;
-            case 0x2: // Arithmetic Shift Right
-                // Shifts right by the shift amount, filling the high bits with the sign bit
-                // Sets the carry flag to the last bit shifted out
-                // If the shift amount is 32 or more, the result and carry flag are set to the sign bit
-                if (shift_amount >= 32) {
-                    offset = sign_extend(cpu->registers.r[shift_value] >> 31, 32 - shift_amount);
-                    // if (s && rd != 15) {
-                    //     set_cpsr_carry(&cpu->registers, (cpu->registers.r[shift_value] >> 31) & 0x1);
-                    // }
-                } else {
-                    offset = sign_extend(cpu->registers.r[shift_value] >> shift_amount, 32 - shift_amount);
-                    // if (s && rd != 15) {
-                    //     set_cpsr_carry(&cpu->registers, (cpu->registers.r[shift_value] >> (shift_amount - 1)) & 0x1);
-                    // }
-                }
-                break;
-            case 0x3: // Rotate Right
-                // If the shift amount is 0, this is a RRX (Rotate Right Extended)
-                // Otherwise, this is a ROR (Rotate Right)
-                if (shift_amount == 0) {
-                    // Rotate Right Extended
-                    // Shifts right by 1 bit, filling the high bit with the carry flag
-                    // Sets the carry flag to the last bit shifted out
-                    offset = (cpu->registers.r[shift_value] >> 1) | (get_cpsr_carry(cpu->registers.cpsr) << 31);
-                    // if (s && rd != 15) {
-                    //     set_cpsr_carry(&cpu->registers, cpu->registers.r[shift_value] & 0x1);
-                    // }
-                } else {
-                    // Rotate Right
-                    // Shifts right by the shift amount, filling the high bits with the low bits
-                    // Sets the carry flag to the last bit shifted out
-                    offset = rotl32(cpu->registers.r[shift_value], shift_amount);
-                    // if (s && rd != 15) {
-                    //     set_cpsr_carry(&cpu->registers, (cpu->registers.r[shift_value] >> (shift_amount - 1)) & 0x1);
-                    // }
-                }
-                break;
-            }
-        } else {
-            // Immediate Operand
-            offset = instruction & 0xFFF; // Immediate Value
-            printf("Immediate offset: %X\n", offset);
-        }
+// ARM instruction handler
+// Returns 1 if the instruction was executed, 0 if it was not
+typedef int (*cpu_arm_handler_t)(cpu_t* cpu, cpu_arm_instruction_t instruction);
 
-        // Calculate the address
-        uint32_t address = cpu->registers.r[rn];
+// ARM decode table, indexed by bits 27-20 and 7-4 of the instruction (see CPU_ARM_TABLE_INDEX)
+// Filled in by cpu_init_tables
+cpu_arm_handler_t cpu_arm_table[4096];
 
-        // If R15 is the base register, add 8 to the address
-        if (rn == 15) {
-            // Add 12 if this is a store instruction
-            if (l == 0) {
-                address += 12;
-            } else {
-                address += 8;
-            }
-        }
+#define CPU_ARM_TABLE_INDEX(instruction) ((((instruction) >> 16) & 0xFF0) | (((instruction) >> 4) & 0xF))
 
-        if (p == 1) {
-            // Pre-Indexing
-            if (u == 1) {
-                // Up
-                address += offset;
-            } else {
-                // Down
-                address -= offset;
-            }
-        }
+// Barrel shifter
+// Each function applies one shift type to `value`, and writes the last bit shifted out to the C flag
+// when `carry` is set. The immediate forms take the 5 bit amount of the instruction, where 0 means
+// 32 (LSR, ASR) or RRX (ROR). The register forms take the bottom byte of the shift register, where
+// 0 leaves the value and C alone and amounts of 32 and more shift every bit out.
+static inline uint32_t cpu_shift_lsl_imm(cpu_t* cpu, uint32_t value, uint32_t amount, int carry)
+{
+    if (amount == 0) {
+        return value;
+    }
+    if (carry) {
+        cpu_set_carry(cpu, (value >> (32 - amount)) & 0x1);
+    }
+    return value << amount;
+}
 
-        // Perform the operation
-        if (l == 1) {
-            // Load
-            if (b == 1) {
-                // Byte
-                cpu->registers.r[rd] = cpu->memory[address];
-            } else {
-                // Word
-                cpu->registers.r[rd] = *(uint32_t*)&cpu->memory[address];
-            }
-        } else {
-            // Store
-            if (b == 1) {
-                // Byte
-                cpu->memory[address] = cpu->registers.r[rd];
-            } else {
-                // Word
-                *(uint32_t*)&cpu->memory[address] = cpu->registers.r[rd];
-            }
+static inline uint32_t cpu_shift_lsr_imm(cpu_t* cpu, uint32_t value, uint32_t amount, int carry)
+{
+    if (amount == 0) {
+        if (carry) {
+            cpu_set_carry(cpu, value >> 31);
         }
+        return 0;
+    }
+    if (carry) {
+        cpu_set_carry(cpu, (value >> (amount - 1)) & 0x1);
+    }
+    return value >> amount;
+}
 
-        // Post-Indexing
-        if (p == 0) {
-            if (u == 1) {
-                // Up
-                address += offset;
-            } else {
-                // Down
-                address -= offset;
-            }
+static inline uint32_t cpu_shift_asr_imm(cpu_t* cpu, uint32_t value, uint32_t amount, int carry)
+{
+    if (amount == 0) {
+        if (carry) {
+            cpu_set_carry(cpu, value >> 31);
         }
+        return (uint32_t)((int32_t)value >> 31);
+    }
+    if (carry) {
+        cpu_set_carry(cpu, (value >> (amount - 1)) & 0x1);
+    }
+    return (uint32_t)((int32_t)value >> amount);
+}
 
-        printf("Single Data Transfer: p=%d, u=%d, b=%d, w=%d, l=%d, rn=%d (0x%X), rd=%d (0x%X), offset=0x%X, address=0x%X\n", p, u, b, w, l, rn, cpu->registers.r[rn], rd, cpu->registers.r[rd], offset, address);
-        fflush(stdout);
-
-        // Writeback
-        if (w == 1 || p == 0) {
-            cpu->registers.r[rn] = address;
+static inline uint32_t cpu_shift_ror_imm(cpu_t* cpu, uint32_t value, uint32_t amount, int carry)
+{
+    if (amount == 0) {
+        // RRX, shifts right by 1 bit and fills the high bit with the carry flag
+        uint32_t result = (value >> 1) | (cpu_get_carry(cpu) << 31);
+        if (carry) {
+            cpu_set_carry(cpu, value & 0x1);
         }
-
-        return 1;
+        return result;
     }
-    case 0x2: {
-        if (i == 1) {
-            // Branch/Branch with Link
-            uint8_t l = (instruction >> 24) & 0x1; // Link (0 = no, 1 = yes)
-            int32_t offset = instruction & 0xFFFFFF; // Offset
-
-            // Save the return address in the link register if we're branching with link
-            if (l == 1) {
-                cpu->registers.lr = cpu->registers.pc + 4;
-            }
+    if (carry) {
+        cpu_set_carry(cpu, (value >> (amount - 1)) & 0x1);
+    }
+    return rotr32(value, amount);
+}
 
-            // Shift the offset to the left by 2 bits
-            offset = offset << 2;
+static inline uint32_t cpu_shift_lsl_reg(cpu_t* cpu, uint32_t value, uint32_t amount, int carry)
+{
+    if (amount < 32) {
+        return cpu_shift_lsl_imm(cpu, value, amount, carry);
+    }
+    if (carry) {
+        cpu_set_carry(cpu, amount == 32 ? value & 0x1 : 0);
+    }
+    return 0;
+}
 
-            // Sign extend the offset
-            int32_t signed_offset = sign_extend(offset, 26);
+static inline uint32_t cpu_shift_lsr_reg(cpu_t* cpu, uint32_t value, uint32_t amount, int carry)
+{
+    if (amount == 0) {
+        return value;
+    }
+    if (amount < 32) {
+        return cpu_shift_lsr_imm(cpu, value, amount, carry);
+    }
+    if (carry) {
+        cpu_set_carry(cpu, amount == 32 ? value >> 31 : 0);
+    }
+    return 0;
+}
 
-            // Add the offset to the PC
-            cpu->registers.pc += signed_offset + 4;
+static inline uint32_t cpu_shift_asr_reg(cpu_t* cpu, uint32_t value, uint32_t amount, int carry)
+{
+    if (amount == 0) {
+        return value;
+    }
+    // ASR #0 in the immediate form is ASR #32, which is what every amount from 32 up does
+    return cpu_shift_asr_imm(cpu, value, amount < 32 ? amount : 0, carry);
+}
 
-            printf("Branch: offset=0x%X, link=%d, new_pc=0x%X\n", signed_offset, l, cpu->registers.pc);
-        } else {
-            // Block Data Transfer
-            uint8_t p = (instruction >> 24) & 0x1; // Pre/Post Indexing (0 = post, 1 = pre)
-            uint8_t u = (instruction >> 23) & 0x1; // Up/Down (0 = down, 1 = up)
-            uint8_t s = (instruction >> 22) & 0x1; // PSR/Force User Mode (0 = do not load PSR or force user mode, 1 = load PSR or force user mode)
-            uint8_t w = (instruction >> 21) & 0x1; // Writeback (0 = no, 1 = yes)
-            uint8_t l = (instruction >> 20) & 0x1; // Load/Store (0 = store, 1 = load)
-            uint8_t rn = (instruction >> 16) & 0xF; // Base Register
-            uint16_t register_list = instruction & 0xFFFF; // Register List
-
-            // Starting address
-            uint32_t address = cpu->registers.r[rn];
-
-            // Loop through each register in the register list
-            for (int i = 0; i < 16; i++) {
-                if ((register_list >> i) & 0x1) {
-                    // Pre-Indexing
-                    if (p == 1) {
-                        if (u == 1) {
-                            // Up
-                            address += 4;
-                        } else {
-                            // Down
-                            address -= 4;
-                        }
-                    }
-
-                    // Load or store the register
-                    if (l == 1) {
-                        // Load
-                        cpu->registers.r[i] = *(uint32_t*)&cpu->memory[address];
-
-                        // Transfer SPRSP_<mode> to CPSR if we're loading the PC and S is set
-                        if (i == 15 && s == 1) {
-                            cpu->registers.cpsr = cpu->registers.spsr;
-                        }
-                    } else {
-                        // Store
-                        // TODO: Take registers from User bank if S is set
-                        *(uint32_t*)&cpu->memory[address] = cpu->registers.r[i];
-                    }
-
-                    // Post-Indexing
-                    if (p == 0) {
-                        if (u == 1) {
-                            // Up
-                            address += 4;
-                        } else {
-                            // Down
-                            address -= 4;
-                        }
-                    }
-                }
-            }
+static inline uint32_t cpu_shift_ror_reg(cpu_t* cpu, uint32_t value, uint32_t amount, int carry)
+{
+    if (amount == 0) {
+        return value;
+    }
+    if ((amount & 0x1F) == 0) {
+        // Rotating by a multiple of 32 leaves the value, and the bit that went round last is bit 31
+        if (carry) {
+            cpu_set_carry(cpu, value >> 31);
+        }
+        return value;
+    }
+    return cpu_shift_ror_imm(cpu, value, amount & 0x1F, carry);
+}
 
-            printf("Block Data Transfer: p=%d, u=%d, s=%d, w=%d, l=%d, rn=%d (0x%X), register_list=0x%X, address=0x%X\n", p, u, s, w, l, rn, cpu->registers.r[rn], register_list, address);
-            fflush(stdout);
+// Second operand forms of the data processing instructions
+// Each form has its own handlers in the decode table, told apart by bit 25 (immediate), bits 6-5
+// (shift type) and bit 4 (shift by register)
+#define CPU_ARM_OPERAND_IMM 0 // Rotated 8 bit immediate
+#define CPU_ARM_OPERAND_LSL_IMM 1 // Register shifted by an immediate amount
+#define CPU_ARM_OPERAND_LSR_IMM 2
+#define CPU_ARM_OPERAND_ASR_IMM 3
+#define CPU_ARM_OPERAND_ROR_IMM 4
+#define CPU_ARM_OPERAND_LSL_REG 5 // Register shifted by the amount in another register
+#define CPU_ARM_OPERAND_LSR_REG 6
+#define CPU_ARM_OPERAND_ASR_REG 7
+#define CPU_ARM_OPERAND_ROR_REG 8
+#define CPU_ARM_OPERANDS 9
+
+// 1 for the logical opcodes (AND, EOR, TST, TEQ, ORR, MOV, BIC, MVN), which take C from the shifter
+#define CPU_ARM_LOGICAL(opcode) ((0xF303 >> (opcode)) & 0x1)
+
+#define CPU_ARM_OPERAND_FORM(instruction) \
+    (((instruction) >> 25) & 0x1 ? CPU_ARM_OPERAND_IMM : 1 + (((instruction) >> 5) & 0x3) + (((instruction) >> 2) & 0x4))
+
+// Get the second operand of a Data Processing instruction in each of the forms
+// With `carry` set the shifter carry goes to the C flag, only the logical operations with the S bit ask
+// for it since the arithmetic ones compute C themselves
+static inline uint32_t cpu_arm_operand_imm(cpu_t* cpu, cpu_arm_instruction_t instruction, int carry)
+{
+    uint32_t rotate = (instruction >> 7) & 0x1E; // Twice the rotate field
+    uint32_t value = rotr32(instruction & 0xFF, rotate);
+    if (carry && rotate != 0) {
+        cpu_set_carry(cpu, value >> 31);
+    }
+    return value;
+}
 
-            // Writeback
-            if (w == 1 || p == 0) {
-                cpu->registers.r[rn] = address;
-            }
-        }
-        break;
+#define CPU_ARM_OPERAND_SHIFT_IMM(type) \
+    static inline uint32_t cpu_arm_operand_##type##_imm(cpu_t* cpu, cpu_arm_instruction_t instruction, int carry) \
+    { \
+        return cpu_shift_##type##_imm(cpu, cpu->registers.r[instruction & 0xF], (instruction >> 7) & 0x1F, carry); \
     }
-    case 0x3: {
-        printf("Coprocessor\n");
-        return 0;
-        break;
+
+#define CPU_ARM_OPERAND_SHIFT_REG(type) \
+    static inline uint32_t cpu_arm_operand_##type##_reg(cpu_t* cpu, cpu_arm_instruction_t instruction, int carry) \
+    { \
+        return cpu_shift_##type##_reg(cpu, cpu->registers.r[instruction & 0xF], cpu->registers.r[(instruction >> 8) & 0xF] & 0xFF, carry); \
     }
+
+CPU_ARM_OPERAND_SHIFT_IMM(lsl)
+CPU_ARM_OPERAND_SHIFT_IMM(lsr)
+CPU_ARM_OPERAND_SHIFT_IMM(asr)
+CPU_ARM_OPERAND_SHIFT_IMM(ror)
+CPU_ARM_OPERAND_SHIFT_REG(lsl)
+CPU_ARM_OPERAND_SHIFT_REG(lsr)
+CPU_ARM_OPERAND_SHIFT_REG(asr)
+CPU_ARM_OPERAND_SHIFT_REG(ror)
+
+// Data processing operations
+// Each takes the second operand already through the shifter and `s` as a constant, the handlers in
+// the decode table are generated from them below
+static inline int cpu_arm_and(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // AND (Logical AND)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    cpu->registers.r[rd] = cpu->registers.r[rn] & src2;
+    if (s) {
+        cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
     }
+    TRACE_DETAIL("AND: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
+    return 1;
+}
 
+static inline int cpu_arm_eor(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // EOR (Logical Exclusive OR)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    cpu->registers.r[rd] = cpu->registers.r[rn] ^ src2;
+    if (s) {
+        cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+    }
+    TRACE_DETAIL("EOR: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
     return 1;
 }
 
-int cpu_process_thumb_instruction(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+static inline int cpu_arm_sub(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
 {
-    // Print the PC and instruction
-    printf("[THUMB] SP=0x%X, PC=0x%X, Instruction=0x%X, ", cpu->registers.sp, cpu->registers.pc, instruction);
+    // SUB (Arithmetic Subtraction)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    // Sets the c flag if there was no borrow
+    // Sets the v flag if there was overflow
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    uint32_t op1 = cpu->registers.r[rn];
+
+    cpu->registers.r[rd] = s ? cpu_flags_add(cpu, op1, ~src2, 1) : op1 - src2;
+    TRACE_DETAIL("SUB: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
+    return 1;
+}
 
-    // if (cpu->registers.sp != 0) {
-    //     printf("SP not 0\n");
-    //     return 0;
-    // }
+static inline int cpu_arm_rsb(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // RSB (Reverse Subtract)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    // Sets the c flag if there was no borrow
+    // Sets the v flag if there was overflow
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    uint32_t op1 = cpu->registers.r[rn];
+
+    cpu->registers.r[rd] = s ? cpu_flags_add(cpu, src2, ~op1, 1) : src2 - op1;
+    TRACE_DETAIL("RSB: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
+    return 1;
+}
 
-    // Decode the instruction
-    uint8_t instruction_type = (instruction >> 13) & 0x7;
+static inline int cpu_arm_add(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // ADD (Addition)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    // Sets the c flag if there was no borrow
+    // Sets the v flag if there was overflow
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    uint32_t op1 = cpu->registers.r[rn];
+
+    cpu->registers.r[rd] = s ? cpu_flags_add(cpu, op1, src2, 0) : op1 + src2;
+    TRACE_DETAIL("ADD: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
+    return 1;
+}
 
-    switch (instruction_type) {
-    case 0b000: {
-        // Shift by Immediate
-        uint8_t opcode = (instruction >> 11) & 0x3;
+static inline int cpu_arm_adc(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // ADC (Add with Carry)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    // Sets the c flag if there was no borrow
+    // Sets the v flag if there was overflow
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    uint32_t carry = cpu_get_carry(cpu);
+    uint32_t op1 = cpu->registers.r[rn];
+
+    cpu->registers.r[rd] = s ? cpu_flags_add(cpu, op1, src2, carry) : op1 + src2 + carry;
+    TRACE_DETAIL("ADC: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
+    return 1;
+}
 
-        switch (opcode) {
-        case 0x0: { // LSL (Logical Shift Left)
-            uint8_t offset5 = (instruction >> 6) & 0x1F;
-            uint8_t rs = (instruction >> 3) & 0x7;
-            uint8_t rd = (instruction >> 0) & 0x7;
+static inline int cpu_arm_sbc(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // SBC (Subtract with Carry)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    // Sets the c flag if there was no borrow
+    // Sets the v flag if there was overflow
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    uint32_t carry = cpu_get_carry(cpu);
+    uint32_t op1 = cpu->registers.r[rn];
+
+    cpu->registers.r[rd] = s ? cpu_flags_add(cpu, op1, ~src2, carry) : op1 - src2 - !carry;
+    TRACE_DETAIL("SBC: rn = %d, src2 = %d, rd = %d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
+    return 1;
+}
 
-            cpu->registers.r[rd] = cpu->registers.r[rs] << offset5;
+static inline int cpu_arm_rsc(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // RSC (Reverse Subtract with Carry)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    // Sets the c flag if there was no borrow
+    // Sets the v flag if there was overflow
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    uint32_t carry = cpu_get_carry(cpu);
+    uint32_t op1 = cpu->registers.r[rn];
+
+    cpu->registers.r[rd] = s ? cpu_flags_add(cpu, src2, ~op1, carry) : src2 - op1 - !carry;
+    TRACE_DETAIL("RSC: rn=%d, src2=%d, rd=%d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
+    return 1;
+}
 
-            // Set CPSR condition codes
-            set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-            set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
+static inline int cpu_arm_tst(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2)
+{
+    // TST (Test)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+
+    uint32_t tst_result = cpu->registers.r[rn] & src2;
+    cpu_set_flags_logical(cpu, tst_result);
+    TRACE_DETAIL("TST: rn=%d, src2=%d, tst_result=%d\n", cpu->registers.r[rn], src2, tst_result);
+    return 1;
+}
 
-            printf("LSL: rs=%d, offset5=%d, rd=%d\n", cpu->registers.r[rs], offset5, cpu->registers.r[rd]);
-            break;
-        }
-        case 0x1: { // LSR (Logical Shift Right)
-            uint8_t offset5 = (instruction >> 6) & 0x1F;
-            uint8_t rs = (instruction >> 3) & 0x7;
-            uint8_t rd = (instruction >> 0) & 0x7;
+int cpu_arm_mrs(cpu_t* cpu, cpu_arm_instruction_t instruction)
+{
+    // MRS (Move PSR to Register)
+    // Opcodes 0b1000 and 0b1010 with the S bit clear
+    uint8_t ps = (instruction >> 22) & 0x1; // Source (0 = CPSR, 1 = SPSR_<current mode>)
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    if (ps == 0) {
+        cpu_flags_resolve(cpu);
+        cpu->registers.r[rd] = cpu->registers.cpsr;
+    } else {
+        cpu->registers.r[rd] = cpu->registers.spsr;
+    }
 
-            cpu->registers.r[rd] = cpu->registers.r[rs] >> offset5;
+    TRACE_DETAIL("MRS: ps=%d, rd=%d (0x%X)\n", ps, rd, cpu->registers.r[rd]);
+    return 1;
+}
 
-            // Set CPSR condition codes
-            set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-            set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
+int cpu_arm_msr(cpu_t* cpu, cpu_arm_instruction_t instruction)
+{
+    // MSR (Move to PSR)
+    // Opcodes 0b1001 and 0b1011 with the S bit clear
+    // Bits 19-16 select the fields that are written: flags (f), status (s), extension (x), control (c)
+    uint8_t i = (instruction >> 25) & 0x1; // Operand (0 = register rm, 1 = rotated immediate)
+    uint8_t pd = (instruction >> 22) & 0x1; // Destination (0 = CPSR, 1 = SPSR_<current mode>)
+    uint8_t fields = (instruction >> 16) & 0xF;
+    uint32_t operand = i ? cpu_arm_operand_imm(cpu, instruction, 0) : cpu->registers.r[instruction & 0xF];
+    uint32_t mask = ((fields & 0x1) ? 0x000000FF : 0) | ((fields & 0x2) ? 0x0000FF00 : 0)
+        | ((fields & 0x4) ? 0x00FF0000 : 0) | ((fields & 0x8) ? 0xFF000000 : 0);
+
+    // The new value replaces the condition flags, so bring cpsr up to date before the partial write
+    cpu_flags_resolve(cpu);
+
+    if (pd == 0) {
+        // CPSR
+        // If in user mode, only the condition flags can be modified (bits 31-28)
+        // The state bit is never written, BX is the only way to change it
+        TRACE_DETAIL("MSR: pd=%d, fields=%X, cpsr=0x%X, user_mode=%s\n", pd, fields, cpu->registers.cpsr, get_cpsr_mode(cpu->registers.cpsr) == ARM_MODE_USER ? "true" : "false");
+        if (get_cpsr_mode(cpu->registers.cpsr) == ARM_MODE_USER) {
+            mask &= 0xF0000000;
+        }
+        mask &= ~0x20u;
 
-            printf("LSR: rs=%d, offset5=%d, rd=%d\n", cpu->registers.r[rs], offset5, cpu->registers.r[rd]);
-            break;
+        uint32_t value = (cpu->registers.cpsr & ~mask) | (operand & mask);
+        if (mask & 0xFF) {
+            // Only the control field holds the mode bits, so only it can switch banks
+            cpu_write_cpsr(cpu, value);
+        } else {
+            cpu->registers.cpsr = value;
         }
-        case 0x2: { // ASR (Arithmetic Shift Right)
-            uint8_t offset5 = (instruction >> 6) & 0x1F;
-            uint8_t rs = (instruction >> 3) & 0x7;
-            uint8_t rd = (instruction >> 0) & 0x7;
+        TRACE_DETAIL("MSR: pd=%d, fields=%X, cpsr=0x%X\n", pd, fields, cpu->registers.cpsr);
+    } else {
+        // SPSR_<current mode>
+        cpu->registers.spsr = (cpu->registers.spsr & ~mask) | (operand & mask);
+        TRACE_DETAIL("MSR: pd=%d, fields=%X, spsr=0x%X\n", pd, fields, cpu->registers.spsr);
+    }
+    return 1;
+}
 
-            cpu->registers.r[rd] = sign_extend(cpu->registers.r[rs] >> offset5, 32 - offset5);
+static inline int cpu_arm_teq(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2)
+{
+    // TEQ (Test Equivalence)
+    // Opcode 0b1001 with the S bit set
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+
+    uint32_t teq_result = cpu->registers.r[rn] ^ src2;
+    cpu_set_flags_logical(cpu, teq_result);
+    TRACE_DETAIL("TEQ: rn=%d (0x%X), src2=%d, teq_result=%X\n", rn, cpu->registers.r[rn], src2, teq_result);
+    return 1;
+}
 
-            // Set CPSR condition codes
-            set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-            set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
+static inline int cpu_arm_cmp(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2)
+{
+    // CMP (Compare)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    // Sets the c flag if there was no borrow
+    // Sets the v flag if there was overflow
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+
+    uint32_t cmp_result = cpu_flags_add(cpu, cpu->registers.r[rn], ~src2, 1);
+    TRACE_DETAIL("CMP: rn=%d (0x%X), src2=%d, cmp_result=%d\n", rn, cpu->registers.r[rn], src2, cmp_result);
+    return 1;
+}
 
-            printf("ASR: rs=%d, offset5=%d, rd=%d\n", cpu->registers.r[rs], offset5, cpu->registers.r[rd]);
-            break;
-        }
-        case 0x3: { // Add Offset to Stack Pointer
-            uint8_t i = (instruction >> 10) & 0x1;
-            uint8_t op = (instruction >> 9) & 0x1;
-            uint8_t rn_or_offset3 = (instruction >> 6) & 0x7;
-            uint8_t rs = (instruction >> 3) & 0x7;
-            uint8_t rd = (instruction >> 0) & 0x7;
-
-            // Get the operand based on the value of i
-            // i = 0: Register Operand
-            // i = 1: Immediate Operand
-            uint32_t operand;
-
-            if (i == 0) {
-                operand = cpu->registers.r[rn_or_offset3];
-            } else {
-                operand = rn_or_offset3;
-            }
+static inline int cpu_arm_cmn(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2)
+{
+    // CMN (Compare Negated)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    // Sets the c flag if there was no borrow
+    // Sets the v flag if there was overflow
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+
+    uint32_t cmn_result = cpu_flags_add(cpu, cpu->registers.r[rn], src2, 0);
+    TRACE_DETAIL("CMN: rn=%d, src2=%d, cmn_result=%d\n", cpu->registers.r[rn], src2, cmn_result);
+    return 1;
+}
 
-            // Perform the operation specified by op
-            if (op == 0) {
-                // ADD
-                cpu->registers.r[rd] = cpu->registers.r[rs] + operand;
-            } else {
-                // SUB
-                cpu->registers.r[rd] = cpu->registers.r[rs] - operand;
-            }
+static inline int cpu_arm_orr(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // ORR (Logical (inclusive) OR)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    cpu->registers.r[rd] = cpu->registers.r[rn] | src2;
+    if (s) {
+        cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+    }
+    TRACE_DETAIL("ORR: rn=%d, src2=%d, rd=%d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
+    return 1;
+}
 
-            // Set CPSR condition codes
-            set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-            set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-            set_cpsr_carry(&cpu->registers, cpu->registers.r[rs] >= operand);
-            set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rs] ^ operand) & (cpu->registers.r[rs] ^ cpu->registers.r[rd]) & 0x80000000);
+static inline int cpu_arm_mov(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // MOV (Move)(Logical operation)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    cpu->registers.r[rd] = src2;
+    if (s) {
+        cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+    }
+    TRACE_DETAIL("MOV: src2=0x%X, rd=%d (0x%X)\n", src2, rd, cpu->registers.r[rd]);
+    return 1;
+}
 
-            printf("ADD/SUB: rs=%d, operand=%d, rd=%d\n", cpu->registers.r[rs], operand, cpu->registers.r[rd]);
-            break;
-        }
-        }
+static inline int cpu_arm_bic(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // BIC (Bit Clear)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    uint8_t rn = (instruction >> 16) & 0xF; // First Operand Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    cpu->registers.r[rd] = cpu->registers.r[rn] & ~src2;
+    if (s) {
+        cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
     }
-    case 0b001: {
-        // Add/Subtract
-        uint8_t opcode = (instruction >> 11) & 0x3;
-        uint8_t rd = (instruction >> 8) & 0x7;
-        uint8_t offset8 = (instruction >> 0) & 0xFF;
-
-        switch (opcode) {
-        case 0x0: // MOV (Move)
-            cpu->registers.r[rd] = offset8;
-
-            // Set CPSR condition codes
-            set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-            set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-
-            printf("MOV: rd=%d, offset8=%d\n", cpu->registers.r[rd], offset8);
-            break;
-        case 0x1: // CMP (Compare)
-            // Set CPSR condition codes
-            set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == offset8);
-            set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < offset8);
-            set_cpsr_carry(&cpu->registers, cpu->registers.r[rd] >= offset8);
-            set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rd] ^ offset8) & (cpu->registers.r[rd] ^ (cpu->registers.r[rd] - offset8)) & 0x80000000);
-
-            printf("CMP: rd=%d, offset8=%d\n", cpu->registers.r[rd], offset8);
-            break;
-        case 0x2: // ADD (Add)
-            cpu->registers.r[rd] += offset8;
-
-            // Set CPSR condition codes
-            set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-            set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-            set_cpsr_carry(&cpu->registers, cpu->registers.r[rd] >= offset8);
-            set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rd] ^ offset8) & (cpu->registers.r[rd] ^ (cpu->registers.r[rd] - offset8)) & 0x80000000);
-
-            printf("ADD: rd=%d, offset8=%d\n", cpu->registers.r[rd], offset8);
-            break;
-        case 0x3: // SUB (Subtract)
-            cpu->registers.r[rd] -= offset8;
-
-            // Set CPSR condition codes
-            set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-            set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-            set_cpsr_carry(&cpu->registers, cpu->registers.r[rd] >= offset8);
-            set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rd] ^ offset8) & (cpu->registers.r[rd] ^ (cpu->registers.r[rd] - offset8)) & 0x80000000);
-
-            printf("SUB: rd=%d, offset8=%d\n", cpu->registers.r[rd], offset8);
-            break;
-        }
-        break;
+    TRACE_DETAIL("BIC: rn=%d, src2=%d, rd=%d\n", cpu->registers.r[rn], src2, cpu->registers.r[rd]);
+    return 1;
+}
+
+static inline int cpu_arm_mvn(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t src2, int s)
+{
+    // MVN (Move Not)(Logical operation)
+    // Sets the z flag if the result is 0
+    // Sets the n flag if the result is negative
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    cpu->registers.r[rd] = ~src2;
+    if (s) {
+        cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
     }
-    case 0b010: {
-        if (((instruction >> 12) & 0x1) == 0) {
-            if (((instruction >> 11) & 0x1) == 0) {
-                if (((instruction >> 10) & 0x1) == 0) {
-                    // ALU Operations
-                    uint8_t opcode = (instruction >> 6) & 0xF;
-                    uint8_t rs = (instruction >> 3) & 0x7;
-                    uint8_t rd = (instruction >> 0) & 0x7;
-
-                    switch (opcode) {
-                    case 0x0: // AND (Logical AND)
-                        cpu->registers.r[rd] &= cpu->registers.r[rs];
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-
-                        printf("AND: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0x1: // EOR (Logical Exclusive OR)
-                        cpu->registers.r[rd] ^= cpu->registers.r[rs];
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-
-                        printf("EOR: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0x2: // LSL (Logical Shift Left)
-                        cpu->registers.r[rd] <<= cpu->registers.r[rs];
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-
-                        printf("LSL: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0x3: // LSR (Logical Shift Right)
-                        cpu->registers.r[rd] >>= cpu->registers.r[rs];
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-
-                        printf("LSR: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0x4: // ASR (Arithmetic Shift Right)
-                        cpu->registers.r[rd] = sign_extend(cpu->registers.r[rd] >> cpu->registers.r[rs], 32 - cpu->registers.r[rs]);
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-
-                        printf("ASR: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0x5: // ADC (Add with Carry)
-                        cpu->registers.r[rd] += cpu->registers.r[rs] + get_cpsr_carry(cpu->registers.cpsr);
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                        set_cpsr_carry(&cpu->registers, cpu->registers.r[rd] >= cpu->registers.r[rs]);
-                        set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rd] ^ cpu->registers.r[rs]) & (cpu->registers.r[rd] ^ (cpu->registers.r[rd] - cpu->registers.r[rs])) & 0x80000000);
-
-                        printf("ADC: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0x6: // SBC (Subtract with Carry)
-                        cpu->registers.r[rd] -= cpu->registers.r[rs] - !get_cpsr_carry(cpu->registers.cpsr);
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                        set_cpsr_carry(&cpu->registers, cpu->registers.r[rd] >= cpu->registers.r[rs]);
-                        set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rd] ^ cpu->registers.r[rs]) & (cpu->registers.r[rd] ^ (cpu->registers.r[rd] - cpu->registers.r[rs])) & 0x80000000);
-
-                        printf("SBC: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0x7: // ROR (Rotate Right)
-                        cpu->registers.r[rd] = rotl32(cpu->registers.r[rd], cpu->registers.r[rs]);
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-
-                        printf("ROR: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0x8: // TST (Test)
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, (cpu->registers.r[rd] & cpu->registers.r[rs]) == 0);
-                        set_cpsr_negative(&cpu->registers, (cpu->registers.r[rd] & cpu->registers.r[rs]) < 0);
-
-                        printf("TST: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0x9: // NEG (Negate)
-                        cpu->registers.r[rd] = -cpu->registers.r[rs];
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-                        set_cpsr_carry(&cpu->registers, 0);
-                        set_cpsr_overflow(&cpu->registers, cpu->registers.r[rd] == 0x80000000);
-
-                        printf("NEG: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0xA: // CMP (Compare)
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == cpu->registers.r[rs]);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < cpu->registers.r[rs]);
-                        set_cpsr_carry(&cpu->registers, cpu->registers.r[rd] >= cpu->registers.r[rs]);
-                        set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rd] ^ cpu->registers.r[rs]) & (cpu->registers.r[rd] ^ (cpu->registers.r[rd] - cpu->registers.r[rs])) & 0x80000000);
-
-                        printf("CMP: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0xB: // CMN (Compare Negated)
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == -cpu->registers.r[rs]);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < -cpu->registers.r[rs]);
-                        set_cpsr_carry(&cpu->registers, cpu->registers.r[rd] >= -cpu->registers.r[rs]);
-                        set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rd] ^ -cpu->registers.r[rs]) & (cpu->registers.r[rd] ^ (cpu->registers.r[rd] - -cpu->registers.r[rs])) & 0x80000000);
-
-                        printf("CMN: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0xC: // ORR (Logical (inclusive) OR)
-                        cpu->registers.r[rd] |= cpu->registers.r[rs];
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-
-                        printf("ORR: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0xD: // MUL (Multiply)
-                        cpu->registers.r[rd] *= cpu->registers.r[rs];
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-
-                        printf("MUL: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0xE: // BIC (Bit Clear)
-                        cpu->registers.r[rd] &= ~cpu->registers.r[rs];
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-
-                        printf("BIC: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    case 0xF: // MVN (Move Not)
-                        cpu->registers.r[rd] = ~cpu->registers.r[rs];
-
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd] == 0);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd] < 0);
-
-                        printf("MVN: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
-                        break;
-                    }
-                } else {
-                    // Hi Register Operations/Branch Exchange
-                    uint8_t opcode = (instruction >> 8) & 0x3;
-                    uint8_t h1 = (instruction >> 7) & 0x1;
-                    uint8_t h2 = (instruction >> 6) & 0x1;
-                    uint8_t rs_hs = (instruction >> 3) & 0x7;
-                    uint8_t rd_hd = (instruction >> 0) & 0x7;
-
-                    switch (opcode) {
-                    case 0x0: // ADD (Add)
-                        // Does not set CPSR condition codes
-                        cpu->registers.r[rd_hd] += cpu->registers.r[rs_hs];
-                        printf("ADD: rs=%d, rd=%d\n", cpu->registers.r[rs_hs], cpu->registers.r[rd_hd]);
-                        break;
-                    case 0x1: // CMP (Compare)
-                        // Set CPSR condition codes
-                        set_cpsr_zero(&cpu->registers, cpu->registers.r[rd_hd] == cpu->registers.r[rs_hs]);
-                        set_cpsr_negative(&cpu->registers, cpu->registers.r[rd_hd] < cpu->registers.r[rs_hs]);
-                        set_cpsr_carry(&cpu->registers, cpu->registers.r[rd_hd] >= cpu->registers.r[rs_hs]);
-                        set_cpsr_overflow(&cpu->registers, (cpu->registers.r[rd_hd] ^ cpu->registers.r[rs_hs]) & (cpu->registers.r[rd_hd] ^ (cpu->registers.r[rd_hd] - cpu->registers.r[rs_hs])) & 0x80000000);
-
-                        printf("CMP: rs=%d, rd=%d\n", cpu->registers.r[rs_hs], cpu->registers.r[rd_hd]);
-                        break;
-                    case 0x2: // MOV (Move)
-                        // Does not set CPSR condition codes
-                        cpu->registers.r[rd_hd] = cpu->registers.r[rs_hs];
-                        printf("MOV: rs=%d, rd=%d\n", cpu->registers.r[rs_hs], cpu->registers.r[rd_hd]);
-                        break;
-                    case 0x3: // BX (Branch and Exchange)
-                        // Does not set CPSR condition codes
-                        // Determine if the mode is ARM or Thumb and set the PC and mode accordingly
-                        if (cpu->registers.r[rs_hs] & 0x1) {
-                            // Thumb
-                            cpu->registers.pc = cpu->registers.r[rs_hs] & 0xFFFFFFFE;
-                            cpu->registers.pc -= 2; // TODO: this is a hack to fix the PC being incremented after this instruction
-                            cpu->registers.cpsr &= ~0x20;
-                            printf("BX: rs=%d, pc=%d, mode=THUMB\n", cpu->registers.r[rs_hs], cpu->registers.pc);
-                        } else {
-                            // ARM
-                            cpu->registers.pc = cpu->registers.r[rs_hs] & 0xFFFFFFFC;
-                            cpu->registers.pc -= 4; // TODO: this is a hack to fix the PC being incremented after this instruction
-                            cpu->registers.cpsr |= 0x20;
-                            printf("BX: rs=%d, pc=%d, mode=ARM\n", cpu->registers.r[rs_hs], cpu->registers.pc);
-                        }
-                        break;
-                    }
-                }
-            } else {
-                // PC Relative Load
-                uint8_t rd = (instruction >> 8) & 0x7;
-                uint8_t offset8 = (instruction >> 0) & 0xFF;
+    TRACE_DETAIL("MVN: src2=%d, rd=%d\n", src2, cpu->registers.r[rd]);
+    return 1;
+}
 
-                cpu->registers.r[rd] = cpu->registers.pc + (offset8 << 2);
+// A data processing result written to R15 is a jump, with the S bit set it also returns from an
+// exception (MOVS PC, LR and SUBS PC, LR, #4). The PC is incremented once the instruction is done.
+static inline int cpu_arm_data_processing_pc(cpu_t* cpu, cpu_arm_instruction_t instruction, int s)
+{
+    if (((instruction >> 12) & 0xF) != 0xF) {
+        return 1;
+    }
 
-                printf("PC Relative Load: rd=%d, offset8=%d\n", cpu->registers.r[rd], offset8);
-            }
-        } else {
-            if (((instruction >> 9) & 0x1) == 0) {
-                // Load/Store with Register Offset
-                uint8_t l = (instruction >> 11) & 0x1;
-                uint8_t b = (instruction >> 10) & 0x1;
-                uint8_t ro = (instruction >> 6) & 0x7;
-                uint8_t rb = (instruction >> 3) & 0x7;
-                uint8_t rd = (instruction >> 0) & 0x7;
-
-                // Calculate the address
-                uint32_t address = cpu->registers.r[rb] + cpu->registers.r[ro];
-
-                // Perform the operation
-                if (l == 1) {
-                    // Load
-                    if (b == 1) {
-                        // Byte
-                        cpu->registers.r[rd] = cpu->memory[address];
-                    } else {
-                        // Word
-                        cpu->registers.r[rd] = *(uint32_t*)&cpu->memory[address];
-                    }
-                } else {
-                    // Store
-                    if (b == 1) {
-                        // Byte
-                        cpu->memory[address] = cpu->registers.r[rd];
-                    } else {
-                        // Word
-                        *(uint32_t*)&cpu->memory[address] = cpu->registers.r[rd];
-                    }
-                }
+    if (s) {
+        cpu_exception_return(cpu, cpu->registers.pc);
+    } else {
+        cpu->registers.pc &= ~3u;
+    }
+    cpu->registers.pc -= 4;
+    return 1;
+}
 
-                printf("Load/Store with Register Offset: l=%d, b=%d, ro=%d, rb=%d, rd=%d\n", l, b, cpu->registers.r[ro], cpu->registers.r[rb], cpu->registers.r[rd]);
-            } else {
-                // Load/Store sign-extended byte/halfword
-                uint8_t h = (instruction >> 11) & 0x1;
-                uint8_t s = (instruction >> 10) & 0x1;
-                uint8_t ro = (instruction >> 6) & 0x7;
-                uint8_t rb = (instruction >> 3) & 0x7;
-                uint8_t rd = (instruction >> 0) & 0x7;
-
-                // Calculate the address
-                uint32_t address = cpu->registers.r[rb] + cpu->registers.r[ro];
-
-                // Perform the operation
-                if (s == 1) {
-                    // Load
-                    if (h == 1) {
-                        // Halfword
-                        cpu->registers.r[rd] = sign_extend(*(int16_t*)&cpu->memory[address], 16);
-                    } else {
-                        // Byte
-                        cpu->registers.r[rd] = sign_extend(cpu->memory[address], 8);
-                    }
-                } else {
-                    // Store
-                    if (h == 1) {
-                        // Halfword
-                        *(int16_t*)&cpu->memory[address] = cpu->registers.r[rd];
-                    } else {
-                        // Byte
-                        cpu->memory[address] = cpu->registers.r[rd];
-                    }
-                }
+// Handlers for one data processing operation in one operand form, without and with the S bit
+// `logical` is 1 for the logical operations, which also take C from the shifter when S is set
+#define CPU_ARM_DATA_PROCESSING_FORM(name, form, logical) \
+    int cpu_arm_##name##_##form(cpu_t* cpu, cpu_arm_instruction_t instruction) \
+    { \
+        return cpu_arm_##name(cpu, instruction, cpu_arm_operand_##form(cpu, instruction, 0), 0) \
+            && cpu_arm_data_processing_pc(cpu, instruction, 0); \
+    } \
+    int cpu_arm_##name##s_##form(cpu_t* cpu, cpu_arm_instruction_t instruction) \
+    { \
+        return cpu_arm_##name(cpu, instruction, cpu_arm_operand_##form(cpu, instruction, logical), 1) \
+            && cpu_arm_data_processing_pc(cpu, instruction, 1); \
+    }
 
-                printf("Load/Store sign-extended byte/halfword: h=%d, s=%d, ro=%d, rb=%d, rd=%d\n", h, s, cpu->registers.r[ro], cpu->registers.r[rb], cpu->registers.r[rd]);
-            }
-        }
+// Tests and compares always set the flags, without the S bit they are PSR transfers
+#define CPU_ARM_COMPARE_FORM(name, form, logical) \
+    int cpu_arm_##name##_##form(cpu_t* cpu, cpu_arm_instruction_t instruction) \
+    { \
+        return cpu_arm_##name(cpu, instruction, cpu_arm_operand_##form(cpu, instruction, logical)); \
     }
-    case 0b011: {
-        // Load/Store with Immediate Offset
-        uint8_t b = (instruction >> 12) & 0x1;
-        uint8_t l = (instruction >> 11) & 0x1;
-        uint8_t offset5 = (instruction >> 6) & 0x1F;
-        uint8_t rb = (instruction >> 3) & 0x7;
-        uint8_t rd = (instruction >> 0) & 0x7;
-
-        // Calculate the address
-        uint32_t address = cpu->registers.r[rb] + (offset5 << 2);
-
-        // Perform the operation
-        if (l == 1) {
-            // Load
-            if (b == 1) {
-                // Byte
-                cpu->registers.r[rd] = cpu->memory[address];
+
+#define CPU_ARM_FORMS(generator, name, logical) \
+    generator(name, imm, logical) \
+    generator(name, lsl_imm, logical) \
+    generator(name, lsr_imm, logical) \
+    generator(name, asr_imm, logical) \
+    generator(name, ror_imm, logical) \
+    generator(name, lsl_reg, logical) \
+    generator(name, lsr_reg, logical) \
+    generator(name, asr_reg, logical) \
+    generator(name, ror_reg, logical)
+
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, and, 1)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, eor, 1)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, sub, 0)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, rsb, 0)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, add, 0)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, adc, 0)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, sbc, 0)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, rsc, 0)
+CPU_ARM_FORMS(CPU_ARM_COMPARE_FORM, tst, 1)
+CPU_ARM_FORMS(CPU_ARM_COMPARE_FORM, teq, 1)
+CPU_ARM_FORMS(CPU_ARM_COMPARE_FORM, cmp, 0)
+CPU_ARM_FORMS(CPU_ARM_COMPARE_FORM, cmn, 0)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, orr, 1)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, mov, 1)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, bic, 1)
+CPU_ARM_FORMS(CPU_ARM_DATA_PROCESSING_FORM, mvn, 1)
+
+// Data Processing handlers, indexed by operand form, opcode (bits 24-21) and S bit
+// Tests and compares without the S bit are PSR transfers and are special cased by cpu_arm_decode
+#define CPU_ARM_DATA_PROCESSING_ROW(form) \
+    { \
+        { cpu_arm_and_##form, cpu_arm_ands_##form }, { cpu_arm_eor_##form, cpu_arm_eors_##form }, \
+        { cpu_arm_sub_##form, cpu_arm_subs_##form }, { cpu_arm_rsb_##form, cpu_arm_rsbs_##form }, \
+        { cpu_arm_add_##form, cpu_arm_adds_##form }, { cpu_arm_adc_##form, cpu_arm_adcs_##form }, \
+        { cpu_arm_sbc_##form, cpu_arm_sbcs_##form }, { cpu_arm_rsc_##form, cpu_arm_rscs_##form }, \
+        { NULL, cpu_arm_tst_##form }, { NULL, cpu_arm_teq_##form }, \
+        { NULL, cpu_arm_cmp_##form }, { NULL, cpu_arm_cmn_##form }, \
+        { cpu_arm_orr_##form, cpu_arm_orrs_##form }, { cpu_arm_mov_##form, cpu_arm_movs_##form }, \
+        { cpu_arm_bic_##form, cpu_arm_bics_##form }, { cpu_arm_mvn_##form, cpu_arm_mvns_##form }, \
+    }
+
+cpu_arm_handler_t cpu_arm_data_processing_handlers[CPU_ARM_OPERANDS][16][2] = {
+    CPU_ARM_DATA_PROCESSING_ROW(imm),
+    CPU_ARM_DATA_PROCESSING_ROW(lsl_imm),
+    CPU_ARM_DATA_PROCESSING_ROW(lsr_imm),
+    CPU_ARM_DATA_PROCESSING_ROW(asr_imm),
+    CPU_ARM_DATA_PROCESSING_ROW(ror_imm),
+    CPU_ARM_DATA_PROCESSING_ROW(lsl_reg),
+    CPU_ARM_DATA_PROCESSING_ROW(lsr_reg),
+    CPU_ARM_DATA_PROCESSING_ROW(asr_reg),
+    CPU_ARM_DATA_PROCESSING_ROW(ror_reg),
+};
+
+int cpu_arm_branch_exchange(cpu_t* cpu, cpu_arm_instruction_t instruction)
+{
+    // Bits 27-20 and 7-4 of BX share a table slot with MSR, so check the remaining bits
+    // If bits 27-4 are 0001 0010 1111 1111 1111 0001 this is a Branch and Exchange instruction
+    if ((instruction & 0xFFFFFF0) != 0x12FFF10) {
+        return cpu_arm_msr(cpu, instruction);
+    }
+
+    // Branch and Exchange
+    uint8_t rn = (instruction >> 0) & 0xF; // Register
+
+    // Determine if the mode is ARM or Thumb and set the PC and mode accordingly
+    if (cpu->registers.r[rn] & 0x1) {
+        // Thumb
+        cpu->registers.pc = cpu->registers.r[rn] & 0xFFFFFFFE;
+        cpu->registers.pc -= 4; // cpu_step adds the size of this ARM instruction
+        cpu->registers.cpsr &= ~0x20;
+        TRACE_DETAIL("BX: rs=%d, pc=%d, mode=THUMB\n", cpu->registers.r[rn], cpu->registers.pc);
+    } else {
+        // ARM
+        cpu->registers.pc = cpu->registers.r[rn] & 0xFFFFFFFC;
+        cpu->registers.pc -= 4; // cpu_step adds the size of this ARM instruction
+        cpu->registers.cpsr |= 0x20;
+        TRACE_DETAIL("BX: rs=%d, pc=%d, mode=ARM\n", cpu->registers.r[rn], cpu->registers.pc);
+    }
+    return 1;
+}
+
+// Single Data Transfer with the offset already computed by the handler
+static inline int cpu_arm_transfer(cpu_t* cpu, cpu_arm_instruction_t instruction, uint32_t offset)
+{
+    uint8_t p = (instruction >> 24) & 0x1; // Pre/Post Indexing (0 = post, 1 = pre)
+    uint8_t u = (instruction >> 23) & 0x1; // Up/Down (0 = down, 1 = up)
+    uint8_t b = (instruction >> 22) & 0x1; // Byte/Word (0 = word, 1 = byte)
+    uint8_t w = (instruction >> 21) & 0x1; // Writeback (0 = no, 1 = yes)
+    uint8_t l = (instruction >> 20) & 0x1; // Load/Store (0 = store, 1 = load)
+    uint8_t rn = (instruction >> 16) & 0xF; // Base Register
+    uint8_t rd = (instruction >> 12) & 0xF; // Destination Register
+
+    // Calculate the address
+    uint32_t address = cpu->registers.r[rn];
+
+    // If R15 is the base register, add 8 to the address
+    if (rn == 15) {
+        // Add 12 if this is a store instruction
+        if (l == 0) {
+            address += 12;
+        } else {
+            address += 8;
+        }
+    }
+
+    if (p == 1) {
+        // Pre-Indexing
+        if (u == 1) {
+            // Up
+            address += offset;
+        } else {
+            // Down
+            address -= offset;
+        }
+    }
+
+    // Perform the operation
+    if (l == 1) {
+        // Load
+        if (b == 1) {
+            // Byte
+            cpu->registers.r[rd] = bus_read8(cpu->bus, address);
+        } else {
+            // Word
+            cpu->registers.r[rd] = bus_read32(cpu->bus, address);
+        }
+    } else {
+        // Store
+        if (b == 1) {
+            // Byte
+            bus_write8(cpu->bus, address, cpu->registers.r[rd]);
+        } else {
+            // Word
+            bus_write32(cpu->bus, address, cpu->registers.r[rd]);
+        }
+    }
+
+    // Post-Indexing
+    if (p == 0) {
+        if (u == 1) {
+            // Up
+            address += offset;
+        } else {
+            // Down
+            address -= offset;
+        }
+    }
+
+    TRACE_DETAIL("Single Data Transfer: p=%d, u=%d, b=%d, w=%d, l=%d, rn=%d (0x%X), rd=%d (0x%X), offset=0x%X, address=0x%X\n", p, u, b, w, l, rn, cpu->registers.r[rn], rd, cpu->registers.r[rd], offset, address);
+
+    // Writeback
+    if (w == 1 || p == 0) {
+        cpu->registers.r[rn] = address;
+    }
+
+    return 1;
+}
+
+// Single Data Transfer with an immediate offset
+int cpu_arm_single_data_transfer(cpu_t* cpu, cpu_arm_instruction_t instruction)
+{
+    return cpu_arm_transfer(cpu, instruction, instruction & 0xFFF);
+}
+
+// Single Data Transfer with a register offset shifted by an immediate, one handler per shift type
+#define CPU_ARM_TRANSFER_FORM(form) \
+    int cpu_arm_single_data_transfer_##form(cpu_t* cpu, cpu_arm_instruction_t instruction) \
+    { \
+        return cpu_arm_transfer(cpu, instruction, cpu_arm_operand_##form(cpu, instruction, 0)); \
+    }
+
+CPU_ARM_TRANSFER_FORM(lsl_imm)
+CPU_ARM_TRANSFER_FORM(lsr_imm)
+CPU_ARM_TRANSFER_FORM(asr_imm)
+CPU_ARM_TRANSFER_FORM(ror_imm)
+
+// Indexed by the shift type (bits 6-5)
+cpu_arm_handler_t cpu_arm_single_data_transfer_handlers[4] = {
+    cpu_arm_single_data_transfer_lsl_imm, cpu_arm_single_data_transfer_lsr_imm,
+    cpu_arm_single_data_transfer_asr_imm, cpu_arm_single_data_transfer_ror_imm,
+};
+
+int cpu_arm_branch(cpu_t* cpu, cpu_arm_instruction_t instruction)
+{
+    // Branch/Branch with Link
+    uint8_t l = (instruction >> 24) & 0x1; // Link (0 = no, 1 = yes)
+    int32_t offset = instruction & 0xFFFFFF; // Offset
+
+    // Save the return address in the link register if we're branching with link
+    if (l == 1) {
+        cpu->registers.lr = cpu->registers.pc + 4;
+    }
+
+    // Shift the offset to the left by 2 bits
+    offset = offset << 2;
+
+    // Sign extend the offset
+    int32_t signed_offset = sign_extend(offset, 26);
+
+    // Add the offset to the PC
+    cpu->registers.pc += signed_offset + 4;
+
+    TRACE_DETAIL("Branch: offset=0x%X, link=%d, new_pc=0x%X\n", signed_offset, l, cpu->registers.pc);
+    return 1;
+}
+
+// Load or store the registers in `list` from consecutive words at `address`, lowest register first
+// When all the words are in one page with a host pointer, the page is found once and the registers
+// are copied in a single pass over the set bits
+static inline void cpu_transfer_registers(cpu_t* cpu, uint32_t address, uint16_t list, int load)
+{
+    uint32_t count = popcount16(list);
+
+    if (load) {
+        const uint32_t* host = bus_span32(cpu->bus->read, address, count);
+        if (host != NULL) {
+            for (; list != 0; list &= list - 1) {
+                cpu->registers.r[ctz32(list)] = *host++;
+            }
+            return;
+        }
+        for (; list != 0; list &= list - 1, address += 4) {
+            cpu->registers.r[ctz32(list)] = bus_read32(cpu->bus, address);
+        }
+    } else {
+        uint32_t* host = bus_span32(cpu->bus->write, address, count);
+        if (host != NULL) {
+            for (uint16_t bits = list; bits != 0; bits &= bits - 1) {
+                *host++ = cpu->registers.r[ctz32(bits)];
+            }
+            bus_span_written(cpu->bus, address, count * 4);
+            return;
+        }
+        for (; list != 0; list &= list - 1, address += 4) {
+            bus_write32(cpu->bus, address, cpu->registers.r[ctz32(list)]);
+        }
+    }
+}
+
+int cpu_arm_block_data_transfer(cpu_t* cpu, cpu_arm_instruction_t instruction)
+{
+    // Block Data Transfer
+    uint8_t p = (instruction >> 24) & 0x1; // Pre/Post Indexing (0 = post, 1 = pre)
+    uint8_t u = (instruction >> 23) & 0x1; // Up/Down (0 = down, 1 = up)
+    uint8_t s = (instruction >> 22) & 0x1; // PSR/Force User Mode (0 = do not load PSR or force user mode, 1 = load PSR or force user mode)
+    uint8_t w = (instruction >> 21) & 0x1; // Writeback (0 = no, 1 = yes)
+    uint8_t l = (instruction >> 20) & 0x1; // Load/Store (0 = store, 1 = load)
+    uint8_t rn = (instruction >> 16) & 0xF; // Base Register
+    uint16_t register_list = instruction & 0xFFFF; // Register List
+
+    // The lowest register always goes to the lowest address, so a decrementing transfer starts at the
+    // bottom of the range
+    uint32_t size = popcount16(register_list) * 4;
+    uint32_t base = cpu->registers.r[rn];
+    uint32_t address = u ? base + (p ? 4 : 0) : base - size + (p ? 0 : 4);
+    uint32_t end = u ? base + size : base - size;
+
+    // With S set and no PC loaded, the transfer uses the User bank registers
+    uint32_t mode = get_cpsr_mode(cpu->registers.cpsr);
+    int user_bank = s == 1 && !(l == 1 && (register_list & 0x8000));
+
+    if (l == 1) {
+        // Write back first, so a base register in the list gets the loaded value
+        if (w == 1) {
+            cpu->registers.r[rn] = end;
+        }
+        if (user_bank) {
+            cpu_switch_bank(&cpu->registers, ARM_MODE_USER);
+        }
+        cpu_transfer_registers(cpu, address, register_list, 1);
+        if (user_bank) {
+            cpu_switch_bank(&cpu->registers, mode);
+        }
+
+        if (register_list & 0x8000) {
+            // Transfer SPSR_<mode> to CPSR if we're loading the PC and S is set, the return from an exception
+            // The PC is incremented once the instruction is done
+            if (s == 1) {
+                cpu_exception_return(cpu, cpu->registers.pc);
             } else {
-                // Word
-                cpu->registers.r[rd] = *(uint32_t*)&cpu->memory[address];
+                cpu->registers.pc &= ~3u;
+            }
+            cpu->registers.pc -= 4;
+        }
+    } else {
+        // R15 is stored as the address of the instruction plus 12
+        if (register_list & 0x8000) {
+            cpu->registers.pc += 12;
+        }
+        if (user_bank) {
+            cpu_switch_bank(&cpu->registers, ARM_MODE_USER);
+        }
+        cpu_transfer_registers(cpu, address, register_list, 0);
+        if (user_bank) {
+            cpu_switch_bank(&cpu->registers, mode);
+        }
+        if (register_list & 0x8000) {
+            cpu->registers.pc -= 12;
+        }
+        if (w == 1) {
+            cpu->registers.r[rn] = end;
+        }
+    }
+
+    TRACE_DETAIL("Block Data Transfer: p=%d, u=%d, s=%d, w=%d, l=%d, rn=%d (0x%X), register_list=0x%X, address=0x%X\n", p, u, s, w, l, rn, cpu->registers.r[rn], register_list, address);
+    return 1;
+}
+
+// Run SWI `number` for an instruction of `size` bytes, see bios_swi
+// The calls bios.h does not handle enter the BIOS at the SWI vector, and are skipped without a BIOS
+static int cpu_software_interrupt(cpu_t* cpu, uint8_t number, uint32_t size)
+{
+    switch (bios_swi(cpu->bus, cpu->registers.r, number)) {
+    case BIOS_SWI_DONE:
+        return 1;
+    case BIOS_SWI_WAIT:
+        // Run the SWI again once the CPU wakes, cpu_step adds `size` back
+        cpu->registers.pc -= size;
+        return 1;
+    default:
+        break;
+    }
+
+    if (cpu->bus->memory->bios == NULL) {
+        TRACE_EVENT("Software Interrupt 0x%02X without a BIOS\n", number);
+        return 1;
+    }
+
+    // Enter supervisor mode (SVC) with the address of the next instruction in LR
+    // Jump to the SWI vector, cpu_step adds `size`
+    cpu_exception_enter(cpu, ARM_MODE_SUPERVISOR, 0x08 - size, cpu->registers.pc + size);
+    return 1;
+}
+
+int cpu_arm_software_interrupt(cpu_t* cpu, cpu_arm_instruction_t instruction)
+{
+    // The comment field holds the call number in bits 23-16 like the Thumb form
+    uint8_t number = (instruction >> 16) & 0xFF;
+
+    TRACE_DETAIL("Software Interrupt: number=0x%02X\n", number);
+    return cpu_software_interrupt(cpu, number, 4);
+}
+
+int cpu_arm_coprocessor(cpu_t* cpu, cpu_arm_instruction_t instruction)
+{
+    (void)cpu;
+    (void)instruction;
+    TRACE_EVENT("Coprocessor\n");
+    return 0;
+}
+
+int cpu_arm_unhandled(cpu_t* cpu, cpu_arm_instruction_t instruction)
+{
+    // Multiply, Single Data Swap and Halfword Data Transfer (bits 27-25 = 000, bit 7 = 1, bit 4 = 1)
+    // These are not implemented yet and are skipped
+    (void)cpu;
+    (void)instruction;
+    return 1;
+}
+
+// Pick the handler for an ARM table slot
+// The instruction only has bits 27-20 and 7-4 set, all other bits are 0
+cpu_arm_handler_t cpu_arm_decode(cpu_arm_instruction_t instruction)
+{
+    uint8_t instruction_type = (instruction >> 26) & 0x3; // Operation (0x0 = data processing, 0x1 = load/store, 0x2 = branch, 0x3 = coprocessor)
+    uint8_t i = (instruction >> 25) & 0x1; // Immediate Operand (0 = register, 1 = immediate)
+
+    switch (instruction_type) {
+    case 0x0:
+        // Branch and Exchange (checks the remaining bits itself)
+        if ((instruction & 0xFF000F0) == 0x1200010) {
+            return cpu_arm_branch_exchange;
+        }
+
+        // If i is 1, bit 4 is 0 (shift by immediate, bit 7 is part of the amount) or bit 7 is 0 (shift by
+        // register), this is a Data Processing or PSR Transfer instruction
+        if (i == 1 || ((instruction >> 4) & 0x1) == 0 || ((instruction >> 7) & 0x1) == 0) {
+            uint8_t opcode = (instruction >> 21) & 0xF;
+            uint8_t s = (instruction >> 20) & 0x1;
+
+            // The test and compare opcodes without the S bit set are PSR transfers
+            // 0b1000 and 0b1010 are MRS (Move PSR to Register), 0b1001 and 0b1011 are MSR (Move to PSR)
+            if ((opcode & 0b1100) == 0b1000 && !s) {
+                return (opcode & 0x1) ? cpu_arm_msr : cpu_arm_mrs;
             }
+            return cpu_arm_data_processing_handlers[CPU_ARM_OPERAND_FORM(instruction)][opcode][s];
+        }
+        return cpu_arm_unhandled;
+    case 0x1:
+        // With i set the offset is a register shifted by an immediate
+        return i == 1 ? cpu_arm_single_data_transfer_handlers[(instruction >> 5) & 0x3] : cpu_arm_single_data_transfer;
+    case 0x2:
+        return i == 1 ? cpu_arm_branch : cpu_arm_block_data_transfer;
+    default:
+        // Software Interrupt (bits 27-24 = 1111), the rest is coprocessor space
+        if ((instruction & 0x0F000000) == 0x0F000000) {
+            return cpu_arm_software_interrupt;
+        }
+        return cpu_arm_coprocessor;
+    }
+}
+
+// Returns 1 if the instruction was executed, 0 if it was not
+int cpu_process_arm_instruction(cpu_t* cpu, cpu_arm_instruction_t instruction)
+{
+    // Check the condition to see if we should execute the instruction
+    int condition = cpu_check_condition(cpu, instruction);
+
+    // Print the PC and instruction
+    TRACE_INSTRUCTION("[ARM][%s] SP=0x%X, PC=0x%X, Instruction=0x%X, Condition: cond=0x%X result=%s\n", cpu_get_mode_name(cpu->registers.cpsr), cpu->registers.sp, cpu->registers.pc, instruction, instruction >> 28, condition ? "true" : "false");
+
+    if (!condition) {
+        return 1;
+    }
+
+    return cpu_arm_table[CPU_ARM_TABLE_INDEX(instruction)](cpu, instruction);
+}
+
+// Thumb instruction handler
+// Returns 1 if the instruction was executed, 0 if it was not
+typedef int (*cpu_thumb_handler_t)(cpu_t* cpu, cpu_thumb_instruction_t instruction);
+
+// Thumb decode table, indexed by the top 10 bits of the instruction (see CPU_THUMB_TABLE_INDEX)
+// Filled in by cpu_init_tables
+cpu_thumb_handler_t cpu_thumb_table[1024];
+
+#define CPU_THUMB_TABLE_INDEX(instruction) (((instruction) >> 6) & 0x3FF)
+
+int cpu_thumb_lsl_immediate(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // LSL (Logical Shift Left)
+    uint8_t offset5 = (instruction >> 6) & 0x1F;
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] = cpu_shift_lsl_imm(cpu, cpu->registers.r[rs], offset5, 1);
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("LSL: rs=%d, offset5=%d, rd=%d\n", cpu->registers.r[rs], offset5, cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_lsr_immediate(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // LSR (Logical Shift Right)
+    uint8_t offset5 = (instruction >> 6) & 0x1F;
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] = cpu_shift_lsr_imm(cpu, cpu->registers.r[rs], offset5, 1);
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("LSR: rs=%d, offset5=%d, rd=%d\n", cpu->registers.r[rs], offset5, cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_asr_immediate(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // ASR (Arithmetic Shift Right)
+    uint8_t offset5 = (instruction >> 6) & 0x1F;
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] = cpu_shift_asr_imm(cpu, cpu->registers.r[rs], offset5, 1);
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("ASR: rs=%d, offset5=%d, rd=%d\n", cpu->registers.r[rs], offset5, cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_add_subtract(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Add/Subtract
+    uint8_t i = (instruction >> 10) & 0x1;
+    uint8_t op = (instruction >> 9) & 0x1;
+    uint8_t rn_or_offset3 = (instruction >> 6) & 0x7;
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Get the operand based on the value of i
+    // i = 0: Register Operand
+    // i = 1: Immediate Operand
+    uint32_t operand;
+
+    if (i == 0) {
+        operand = cpu->registers.r[rn_or_offset3];
+    } else {
+        operand = rn_or_offset3;
+    }
+
+    // Perform the operation specified by op and set CPSR condition codes
+    if (op == 0) {
+        // ADD
+        cpu->registers.r[rd] = cpu_flags_add(cpu, cpu->registers.r[rs], operand, 0);
+    } else {
+        // SUB
+        cpu->registers.r[rd] = cpu_flags_add(cpu, cpu->registers.r[rs], ~operand, 1);
+    }
+
+    TRACE_DETAIL("ADD/SUB: rs=%d, operand=%d, rd=%d\n", cpu->registers.r[rs], operand, cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_mov_immediate(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // MOV (Move)
+    uint8_t rd = (instruction >> 8) & 0x7;
+    uint8_t offset8 = (instruction >> 0) & 0xFF;
+
+    cpu->registers.r[rd] = offset8;
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("MOV: rd=%d, offset8=%d\n", cpu->registers.r[rd], offset8);
+    return 1;
+}
+
+int cpu_thumb_cmp_immediate(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // CMP (Compare)
+    uint8_t rd = (instruction >> 8) & 0x7;
+    uint8_t offset8 = (instruction >> 0) & 0xFF;
+
+    // Set CPSR condition codes
+    cpu_flags_add(cpu, cpu->registers.r[rd], ~(uint32_t)offset8, 1);
+
+    TRACE_DETAIL("CMP: rd=%d, offset8=%d\n", cpu->registers.r[rd], offset8);
+    return 1;
+}
+
+int cpu_thumb_add_immediate(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // ADD (Add)
+    uint8_t rd = (instruction >> 8) & 0x7;
+    uint8_t offset8 = (instruction >> 0) & 0xFF;
+
+    // Set CPSR condition codes
+    cpu->registers.r[rd] = cpu_flags_add(cpu, cpu->registers.r[rd], offset8, 0);
+
+    TRACE_DETAIL("ADD: rd=%d, offset8=%d\n", cpu->registers.r[rd], offset8);
+    return 1;
+}
+
+int cpu_thumb_sub_immediate(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // SUB (Subtract)
+    uint8_t rd = (instruction >> 8) & 0x7;
+    uint8_t offset8 = (instruction >> 0) & 0xFF;
+
+    // Set CPSR condition codes
+    cpu->registers.r[rd] = cpu_flags_add(cpu, cpu->registers.r[rd], ~(uint32_t)offset8, 1);
+
+    TRACE_DETAIL("SUB: rd=%d, offset8=%d\n", cpu->registers.r[rd], offset8);
+    return 1;
+}
+
+int cpu_thumb_alu_and(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // AND (Logical AND)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] &= cpu->registers.r[rs];
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("AND: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_eor(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // EOR (Logical Exclusive OR)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] ^= cpu->registers.r[rs];
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("EOR: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_lsl(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // LSL (Logical Shift Left)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] = cpu_shift_lsl_reg(cpu, cpu->registers.r[rd], cpu->registers.r[rs] & 0xFF, 1);
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("LSL: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_lsr(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // LSR (Logical Shift Right)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] = cpu_shift_lsr_reg(cpu, cpu->registers.r[rd], cpu->registers.r[rs] & 0xFF, 1);
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("LSR: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_asr(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // ASR (Arithmetic Shift Right)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] = cpu_shift_asr_reg(cpu, cpu->registers.r[rd], cpu->registers.r[rs] & 0xFF, 1);
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("ASR: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_adc(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // ADC (Add with Carry)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Set CPSR condition codes
+    cpu->registers.r[rd] = cpu_flags_add(cpu, cpu->registers.r[rd], cpu->registers.r[rs], cpu_get_carry(cpu));
+
+    TRACE_DETAIL("ADC: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_sbc(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // SBC (Subtract with Carry)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Set CPSR condition codes
+    cpu->registers.r[rd] = cpu_flags_add(cpu, cpu->registers.r[rd], ~cpu->registers.r[rs], cpu_get_carry(cpu));
+
+    TRACE_DETAIL("SBC: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_ror(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // ROR (Rotate Right)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] = cpu_shift_ror_reg(cpu, cpu->registers.r[rd], cpu->registers.r[rs] & 0xFF, 1);
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("ROR: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_tst(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // TST (Test)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd] & cpu->registers.r[rs]);
+
+    TRACE_DETAIL("TST: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_neg(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // NEG (Negate)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Set CPSR condition codes
+    cpu->registers.r[rd] = cpu_flags_add(cpu, 0, ~cpu->registers.r[rs], 1);
+
+    TRACE_DETAIL("NEG: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_cmp(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // CMP (Compare)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Set CPSR condition codes
+    cpu_flags_add(cpu, cpu->registers.r[rd], ~cpu->registers.r[rs], 1);
+
+    TRACE_DETAIL("CMP: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_cmn(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // CMN (Compare Negated)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Set CPSR condition codes
+    cpu_flags_add(cpu, cpu->registers.r[rd], cpu->registers.r[rs], 0);
+
+    TRACE_DETAIL("CMN: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_orr(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // ORR (Logical (inclusive) OR)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] |= cpu->registers.r[rs];
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("ORR: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_mul(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // MUL (Multiply)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] *= cpu->registers.r[rs];
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("MUL: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_bic(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // BIC (Bit Clear)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] &= ~cpu->registers.r[rs];
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("BIC: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_alu_mvn(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // MVN (Move Not)
+    uint8_t rs = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    cpu->registers.r[rd] = ~cpu->registers.r[rs];
+
+    // Set CPSR condition codes
+    cpu_set_flags_logical(cpu, cpu->registers.r[rd]);
+
+    TRACE_DETAIL("MVN: rs=%d, rd=%d\n", cpu->registers.r[rs], cpu->registers.r[rd]);
+    return 1;
+}
+
+// Hi Register Operations/Branch Exchange
+// H1 and H2 select r8-r15 for the destination and source operands
+// R15 reads as the address of the instruction + 4, and writing it branches like BX without the
+// state change
+
+// Value of register `r` as an operand of a hi register operation
+static inline uint32_t cpu_thumb_hi_read(cpu_t* cpu, uint8_t r)
+{
+    return r == 15 ? cpu->registers.pc + 4 : cpu->registers.r[r];
+}
+
+// Write `value` to register `r` of a hi register operation
+static inline void cpu_thumb_hi_write(cpu_t* cpu, uint8_t r, uint32_t value)
+{
+    if (r == 15) {
+        value = (value & 0xFFFFFFFE) - 2; // cpu_step adds the size of this Thumb instruction
+    }
+    cpu->registers.r[r] = value;
+}
+
+int cpu_thumb_hi_add(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // ADD (Add)
+    // Does not set CPSR condition codes
+    uint8_t rs_hs = ((instruction >> 3) & 0x7) | ((instruction >> 3) & 0x8);
+    uint8_t rd_hd = ((instruction >> 0) & 0x7) | ((instruction >> 4) & 0x8);
+
+    cpu_thumb_hi_write(cpu, rd_hd, cpu_thumb_hi_read(cpu, rd_hd) + cpu_thumb_hi_read(cpu, rs_hs));
+    TRACE_DETAIL("ADD: rs=%d, rd=%d\n", cpu->registers.r[rs_hs], cpu->registers.r[rd_hd]);
+    return 1;
+}
+
+int cpu_thumb_hi_cmp(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // CMP (Compare)
+    uint8_t rs_hs = ((instruction >> 3) & 0x7) | ((instruction >> 3) & 0x8);
+    uint8_t rd_hd = ((instruction >> 0) & 0x7) | ((instruction >> 4) & 0x8);
+
+    // Set CPSR condition codes
+    cpu_flags_add(cpu, cpu_thumb_hi_read(cpu, rd_hd), ~cpu_thumb_hi_read(cpu, rs_hs), 1);
+
+    TRACE_DETAIL("CMP: rs=%d, rd=%d\n", cpu->registers.r[rs_hs], cpu->registers.r[rd_hd]);
+    return 1;
+}
+
+int cpu_thumb_hi_mov(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // MOV (Move)
+    // Does not set CPSR condition codes
+    uint8_t rs_hs = ((instruction >> 3) & 0x7) | ((instruction >> 3) & 0x8);
+    uint8_t rd_hd = ((instruction >> 0) & 0x7) | ((instruction >> 4) & 0x8);
+
+    cpu_thumb_hi_write(cpu, rd_hd, cpu_thumb_hi_read(cpu, rs_hs));
+    TRACE_DETAIL("MOV: rs=%d, rd=%d\n", cpu->registers.r[rs_hs], cpu->registers.r[rd_hd]);
+    return 1;
+}
+
+int cpu_thumb_hi_bx(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // BX (Branch and Exchange)
+    // Does not set CPSR condition codes
+    uint8_t rs_hs = ((instruction >> 3) & 0x7) | ((instruction >> 3) & 0x8);
+    uint32_t target = cpu_thumb_hi_read(cpu, rs_hs);
+
+    // Determine if the mode is ARM or Thumb and set the PC and mode accordingly
+    if (target & 0x1) {
+        // Thumb
+        cpu->registers.pc = target & 0xFFFFFFFE;
+        cpu->registers.pc -= 2; // cpu_step adds the size of this Thumb instruction
+        cpu->registers.cpsr &= ~0x20;
+        TRACE_DETAIL("BX: rs=%d, pc=%d, mode=THUMB\n", target, cpu->registers.pc);
+    } else {
+        // ARM
+        cpu->registers.pc = target & 0xFFFFFFFC;
+        cpu->registers.pc -= 2; // cpu_step adds the size of this Thumb instruction
+        cpu->registers.cpsr |= 0x20;
+        TRACE_DETAIL("BX: rs=%d, pc=%d, mode=ARM\n", target, cpu->registers.pc);
+    }
+    return 1;
+}
+
+int cpu_thumb_pc_relative_load(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // PC Relative Load
+    uint8_t rd = (instruction >> 8) & 0x7;
+    uint8_t offset8 = (instruction >> 0) & 0xFF;
+
+    cpu->registers.r[rd] = cpu->registers.pc + (offset8 << 2);
+
+    TRACE_DETAIL("PC Relative Load: rd=%d, offset8=%d\n", cpu->registers.r[rd], offset8);
+    return 1;
+}
+
+int cpu_thumb_load_store_register_offset(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Load/Store with Register Offset
+    uint8_t l = (instruction >> 11) & 0x1;
+    uint8_t b = (instruction >> 10) & 0x1;
+    uint8_t ro = (instruction >> 6) & 0x7;
+    uint8_t rb = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Calculate the address
+    uint32_t address = cpu->registers.r[rb] + cpu->registers.r[ro];
+
+    // Perform the operation
+    if (l == 1) {
+        // Load
+        if (b == 1) {
+            // Byte
+            cpu->registers.r[rd] = bus_read8(cpu->bus, address);
         } else {
-            // Store
-            if (b == 1) {
-                // Byte
-                cpu->memory[address] = cpu->registers.r[rd];
-            } else {
-                // Word
-                *(uint32_t*)&cpu->memory[address] = cpu->registers.r[rd];
-            }
+            // Word
+            cpu->registers.r[rd] = bus_read32(cpu->bus, address);
+        }
+    } else {
+        // Store
+        if (b == 1) {
+            // Byte
+            bus_write8(cpu->bus, address, cpu->registers.r[rd]);
+        } else {
+            // Word
+            bus_write32(cpu->bus, address, cpu->registers.r[rd]);
         }
-
-        printf("Load/Store with Immediate Offset: b=%d, l=%d, offset5=%d, rb=%d, rd=%d\n", b, l, offset5, cpu->registers.r[rb], cpu->registers.r[rd]);
-        break;
     }
-    case 0b100: {
-        if (((instruction >> 12) & 0x1) == 0) {
-            // Load/Store Halfword
-            uint8_t l = (instruction >> 10) & 0x1;
-            uint8_t offset5 = (instruction >> 6) & 0x1F;
-            uint8_t rb = (instruction >> 3) & 0x7;
-            uint8_t rd = (instruction >> 0) & 0x7;
-
-            // Calculate the address
-            uint32_t address = cpu->registers.r[rb] + (offset5 << 1);
-
-            // Perform the operation
-            if (l == 1) {
-                // Load
-                cpu->registers.r[rd] = sign_extend(*(int16_t*)&cpu->memory[address], 16);
-            } else {
-                // Store
-                *(int16_t*)&cpu->memory[address] = cpu->registers.r[rd];
-            }
 
-            printf("Load/Store Halfword: l=%d, offset5=%d, rb=%d, rd=%d\n", l, offset5, cpu->registers.r[rb], cpu->registers.r[rd]);
+    TRACE_DETAIL("Load/Store with Register Offset: l=%d, b=%d, ro=%d, rb=%d, rd=%d\n", l, b, cpu->registers.r[ro], cpu->registers.r[rb], cpu->registers.r[rd]);
+    return 1;
+}
+
+int cpu_thumb_load_store_sign_extended(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Load/Store sign-extended byte/halfword
+    uint8_t h = (instruction >> 11) & 0x1;
+    uint8_t s = (instruction >> 10) & 0x1;
+    uint8_t ro = (instruction >> 6) & 0x7;
+    uint8_t rb = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Calculate the address
+    uint32_t address = cpu->registers.r[rb] + cpu->registers.r[ro];
+
+    // Perform the operation
+    if (s == 1) {
+        // Load
+        if (h == 1) {
+            // Halfword
+            cpu->registers.r[rd] = sign_extend(bus_read16(cpu->bus, address), 16);
         } else {
-            // Load/Store SP-relative
-            uint8_t l = (instruction >> 11) & 0x1;
-            uint8_t rd = (instruction >> 8) & 0x7;
-            uint8_t offset8 = (instruction >> 0) & 0xFF;
-
-            // Calculate the address
-            uint32_t address = cpu->registers.sp + (offset8 << 2);
-
-            // Perform the operation
-            if (l == 1) {
-                // Load
-                cpu->registers.r[rd] = *(uint32_t*)&cpu->memory[address];
-            } else {
-                // Store
-                *(uint32_t*)&cpu->memory[address] = cpu->registers.r[rd];
-            }
+            // Byte
+            cpu->registers.r[rd] = sign_extend(bus_read8(cpu->bus, address), 8);
+        }
+    } else {
+        // Store
+        if (h == 1) {
+            // Halfword
+            bus_write16(cpu->bus, address, cpu->registers.r[rd]);
+        } else {
+            // Byte
+            bus_write8(cpu->bus, address, cpu->registers.r[rd]);
+        }
+    }
+
+    TRACE_DETAIL("Load/Store sign-extended byte/halfword: h=%d, s=%d, ro=%d, rb=%d, rd=%d\n", h, s, cpu->registers.r[ro], cpu->registers.r[rb], cpu->registers.r[rd]);
+    return 1;
+}
 
-            printf("Load/Store SP-relative: l=%d, rd=%d, offset8=%d\n", l, cpu->registers.r[rd], offset8);
+int cpu_thumb_load_store_immediate_offset(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Load/Store with Immediate Offset
+    uint8_t b = (instruction >> 12) & 0x1;
+    uint8_t l = (instruction >> 11) & 0x1;
+    uint8_t offset5 = (instruction >> 6) & 0x1F;
+    uint8_t rb = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Calculate the address, the offset is in words for LDR / STR and in bytes for LDRB / STRB
+    uint32_t address = cpu->registers.r[rb] + (b == 1 ? offset5 : offset5 << 2);
+
+    // Perform the operation
+    if (l == 1) {
+        // Load
+        if (b == 1) {
+            // Byte
+            cpu->registers.r[rd] = bus_read8(cpu->bus, address);
+        } else {
+            // Word
+            cpu->registers.r[rd] = bus_read32(cpu->bus, address);
+        }
+    } else {
+        // Store
+        if (b == 1) {
+            // Byte
+            bus_write8(cpu->bus, address, cpu->registers.r[rd]);
+        } else {
+            // Word
+            bus_write32(cpu->bus, address, cpu->registers.r[rd]);
         }
-        break;
     }
-    case 0b101: {
-        if (((instruction >> 12) & 0x1) == 0) {
-            // Load Address
-            uint8_t sp = (instruction >> 11) & 0x1; // 0 = PC, 1 = SP
-            uint8_t rd = (instruction >> 8) & 0x7;
-            uint8_t offset8 = (instruction >> 0) & 0xFF;
-
-            // Calculate the address
-            if (sp == 0) {
-                // PC
-                cpu->registers.r[rd] = cpu->registers.pc + (offset8 << 2);
-            } else {
-                // SP
-                cpu->registers.r[rd] = cpu->registers.sp + (offset8 << 2);
-            }
 
-            printf("Load Address: sp=%d, rd=%d, offset8=%d\n", sp, cpu->registers.r[rd], offset8);
-        } else if (((instruction >> 10) & 0x1) == 0) {
-            // Add Offset to Stack Pointer
-            uint8_t s = (instruction >> 7) & 0x1; // 0 = offset is positive, 1 = offset is negative
-            uint8_t sword7 = (instruction >> 0) & 0x7F;
+    TRACE_DETAIL("Load/Store with Immediate Offset: b=%d, l=%d, offset5=%d, rb=%d, rd=%d\n", b, l, offset5, cpu->registers.r[rb], cpu->registers.r[rd]);
+    return 1;
+}
 
-            // Calculate the offset
-            int32_t offset = s == 0 ? sword7 : -sword7;
+int cpu_thumb_load_store_halfword(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Load/Store Halfword
+    uint8_t l = (instruction >> 10) & 0x1;
+    uint8_t offset5 = (instruction >> 6) & 0x1F;
+    uint8_t rb = (instruction >> 3) & 0x7;
+    uint8_t rd = (instruction >> 0) & 0x7;
+
+    // Calculate the address
+    uint32_t address = cpu->registers.r[rb] + (offset5 << 1);
+
+    // Perform the operation
+    if (l == 1) {
+        // Load
+        cpu->registers.r[rd] = sign_extend(bus_read16(cpu->bus, address), 16);
+    } else {
+        // Store
+        bus_write16(cpu->bus, address, cpu->registers.r[rd]);
+    }
 
-            // Add the offset to the stack pointer
-            cpu->registers.sp += offset << 2;
+    TRACE_DETAIL("Load/Store Halfword: l=%d, offset5=%d, rb=%d, rd=%d\n", l, offset5, cpu->registers.r[rb], cpu->registers.r[rd]);
+    return 1;
+}
 
-            printf("Add Offset to Stack Pointer: s=%d, offset=%d\n", s, offset);
-        } else {
-            // Push/Pop Registers
-            uint8_t l = (instruction >> 11) & 0x1; // 0 = store to memory, 1 = load from memory
-            uint8_t r = (instruction >> 8) & 0x1; // 0 = do not store LR/load PC, 1 = store LR/load PC
-            uint8_t rlist = (instruction >> 0) & 0xFF; // Register list
-
-            // Calculate the address
-            uint32_t address = cpu->registers.sp;
-
-            // Perform the operation
-            if (l == 1) {
-                // Load
-                for (int i = 0; i < 8; i++) {
-                    if ((rlist >> i) & 0x1) {
-                        cpu->registers.r[i] = *(uint32_t*)&cpu->memory[address];
-                        address += 4;
-                    }
-                }
+int cpu_thumb_load_store_sp_relative(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Load/Store SP-relative
+    uint8_t l = (instruction >> 11) & 0x1;
+    uint8_t rd = (instruction >> 8) & 0x7;
+    uint8_t offset8 = (instruction >> 0) & 0xFF;
+
+    // Calculate the address
+    uint32_t address = cpu->registers.sp + (offset8 << 2);
+
+    // Perform the operation
+    if (l == 1) {
+        // Load
+        cpu->registers.r[rd] = bus_read32(cpu->bus, address);
+    } else {
+        // Store
+        bus_write32(cpu->bus, address, cpu->registers.r[rd]);
+    }
 
-                if (r == 1) {
-                    cpu->registers.pc = *(uint32_t*)&cpu->memory[address] & 0xFFFFFFFE;
-                    cpu->registers.cpsr &= ~0x20;
-                    address += 4;
-                }
-            } else {
-                // Store
-                for (int i = 0; i < 8; i++) {
-                    if ((rlist >> i) & 0x1) {
-                        *(uint32_t*)&cpu->memory[address] = cpu->registers.r[i];
-                        address += 4;
-                    }
-                }
+    TRACE_DETAIL("Load/Store SP-relative: l=%d, rd=%d, offset8=%d\n", l, cpu->registers.r[rd], offset8);
+    return 1;
+}
 
-                if (r == 1) {
-                    *(uint32_t*)&cpu->memory[address] = cpu->registers.lr;
-                    address += 4;
-                }
-            }
+int cpu_thumb_load_address(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Load Address
+    uint8_t sp = (instruction >> 11) & 0x1; // 0 = PC, 1 = SP
+    uint8_t rd = (instruction >> 8) & 0x7;
+    uint8_t offset8 = (instruction >> 0) & 0xFF;
+
+    // Calculate the address
+    if (sp == 0) {
+        // PC
+        cpu->registers.r[rd] = cpu->registers.pc + (offset8 << 2);
+    } else {
+        // SP
+        cpu->registers.r[rd] = cpu->registers.sp + (offset8 << 2);
+    }
 
-            // Update the stack pointer
-            cpu->registers.sp = address;
+    TRACE_DETAIL("Load Address: sp=%d, rd=%d, offset8=%d\n", sp, cpu->registers.r[rd], offset8);
+    return 1;
+}
+
+int cpu_thumb_add_offset_to_sp(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Add Offset to Stack Pointer
+    uint8_t s = (instruction >> 7) & 0x1; // 0 = offset is positive, 1 = offset is negative
+    uint8_t sword7 = (instruction >> 0) & 0x7F;
+
+    // Calculate the offset
+    int32_t offset = s == 0 ? sword7 : -sword7;
+
+    // Add the offset to the stack pointer
+    cpu->registers.sp += offset << 2;
+
+    TRACE_DETAIL("Add Offset to Stack Pointer: s=%d, offset=%d\n", s, offset);
+    return 1;
+}
 
-            printf("Push/Pop Registers: l=%d, r=%d, rlist=%d\n", l, r, rlist);
+int cpu_thumb_push_pop(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Push/Pop Registers
+    uint8_t l = (instruction >> 11) & 0x1; // 0 = store to memory, 1 = load from memory
+    uint8_t r = (instruction >> 8) & 0x1; // 0 = do not store LR/load PC, 1 = store LR/load PC
+    uint8_t rlist = (instruction >> 0) & 0xFF; // Register list
+
+    if (l == 1) {
+        // Pop from the top of the stack, R adds the PC after the low registers
+        uint16_t list = rlist | (r << 15);
+        uint32_t address = cpu->registers.sp;
+        cpu->registers.sp += popcount16(list) * 4;
+        cpu_transfer_registers(cpu, address, list, 1);
+
+        if (r == 1) {
+            // The PC is incremented once the instruction is done
+            cpu->registers.pc = (cpu->registers.pc & 0xFFFFFFFE) - 2;
         }
-        break;
+    } else {
+        // Push below the stack pointer (full descending stack), R adds the LR after the low registers
+        uint16_t list = rlist | (r << 14);
+        cpu->registers.sp -= popcount16(list) * 4;
+        cpu_transfer_registers(cpu, cpu->registers.sp, list, 0);
     }
-    case 0b110: {
-        if (((instruction >> 12) & 0x1) == 0) {
-            // Multiple Load/Store
-            uint8_t l = (instruction >> 11) & 0x1; // 0 = store to memory, 1 = load from memory
-            uint8_t rb = (instruction >> 8) & 0x7;
-            uint8_t rlist = (instruction >> 0) & 0xFF; // Register list
-
-            // Calculate the address
-            uint32_t address = cpu->registers.r[rb];
-
-            // Perform the operation
-            if (l == 1) {
-                // Load
-                for (int i = 0; i < 8; i++) {
-                    if ((rlist >> i) & 0x1) {
-                        cpu->registers.r[i] = *(uint32_t*)&cpu->memory[address];
-                        address += 4;
-                    }
-                }
-            } else {
-                // Store
-                for (int i = 0; i < 8; i++) {
-                    if ((rlist >> i) & 0x1) {
-                        *(uint32_t*)&cpu->memory[address] = cpu->registers.r[i];
-                        address += 4;
-                    }
-                }
-            }
 
-            // Update the base register
-            cpu->registers.r[rb] = address;
+    TRACE_DETAIL("Push/Pop Registers: l=%d, r=%d, rlist=%d\n", l, r, rlist);
+    return 1;
+}
+
+int cpu_thumb_multiple_load_store(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Multiple Load/Store
+    uint8_t l = (instruction >> 11) & 0x1; // 0 = store to memory, 1 = load from memory
+    uint8_t rb = (instruction >> 8) & 0x7;
+    uint8_t rlist = (instruction >> 0) & 0xFF; // Register list
+
+    uint32_t address = cpu->registers.r[rb];
+    uint32_t end = address + popcount16(rlist) * 4;
+
+    // Update the base register, before a load so a base in the list gets the loaded value
+    if (l == 1) {
+        cpu->registers.r[rb] = end;
+        cpu_transfer_registers(cpu, address, rlist, 1);
+    } else {
+        cpu_transfer_registers(cpu, address, rlist, 0);
+        cpu->registers.r[rb] = end;
+    }
 
-            printf("Multiple Load/Store: l=%d, rb=%d, rlist=%d\n", l, cpu->registers.r[rb], rlist);
-        } else if (((instruction >> 8) & 0xF) == 0xF) {
-            // Software Interrupt
-            uint8_t value8 = (instruction >> 0) & 0xFF;
+    TRACE_DETAIL("Multiple Load/Store: l=%d, rb=%d, rlist=%d\n", l, cpu->registers.r[rb], rlist);
+    return 1;
+}
 
-            // Move address of next instruction into LR
-            cpu->registers.lr = cpu->registers.pc + 4;
+int cpu_thumb_software_interrupt(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Software Interrupt
+    uint8_t value8 = (instruction >> 0) & 0xFF;
 
-            // Move CPSR into SPSR
-            cpu->registers.spsr = cpu->registers.cpsr;
+    TRACE_DETAIL("Software Interrupt: value8=%d\n", value8);
+    return cpu_software_interrupt(cpu, value8, 2);
+}
 
-            // Load SWI vector into PC
-            cpu->registers.pc = *(uint32_t*)&cpu->memory[0x8] & 0xFFFFFFFE;
+int cpu_thumb_conditional_branch(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Conditional Branch
+    uint8_t cond = (instruction >> 8) & 0xF;
+    uint8_t offset8 = (instruction >> 0) & 0xFF;
+
+    // Calculate the offset
+    int32_t offset = sign_extend(offset8 << 1, 9);
+
+    // Check the condition
+    cpu_flags_resolve(cpu);
+    if (cpu_condition_table[cpu->registers.cpsr >> 28][cond]) {
+        // Branch to PC + 4 + offset, less the 2 the PC is stepped by after this instruction
+        cpu->registers.pc += offset + 2;
+        TRACE_DETAIL("Conditional Branch: cond=%d, offset8=%d, branch=TRUE\n", cond, offset8);
+    } else {
+        TRACE_DETAIL("Conditional Branch: cond=%d, offset8=%d, branch=FALSE\n", cond, offset8);
+    }
+    return 1;
+}
 
-            // Switch into ARM state and enter supervisor mode (SVC)
-            cpu->registers.cpsr &= ~0x1F;
-            cpu->registers.cpsr |= 0x13;
+int cpu_thumb_unconditional_branch(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Unconditional Branch
+    uint16_t offset11 = (instruction >> 0) & 0x7FF;
 
-            printf("Software Interrupt: value8=%d\n", value8);
-        } else {
-            // Conditional Branch
-            uint8_t cond = (instruction >> 8) & 0xF;
-            uint8_t offset8 = (instruction >> 0) & 0xFF;
-
-            // Calculate the offset
-            int32_t offset = sign_extend(offset8 << 1, 9);
-
-            // Check the condition
-            if (cpu_check_condition(cpu->registers.cpsr, cond)) {
-                // Branch
-                cpu->registers.pc += offset + 4;
-                printf("Conditional Branch: cond=%d, offset8=%d, branch=TRUE\n", cond, offset8);
-            } else {
-                printf("Conditional Branch: cond=%d, offset8=%d, branch=FALSE\n", cond, offset8);
+    // Calculate the offset
+    int32_t offset = sign_extend(offset11 << 1, 12);
+
+    // Branch to PC + 4 + offset, less the 2 the PC is stepped by after this instruction
+    cpu->registers.pc += offset + 2;
+
+    TRACE_DETAIL("Unconditional Branch: offset11=%d\n", offset11);
+    return 1;
+}
+
+int cpu_thumb_long_branch_with_link(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Long Branch with Link
+    uint8_t h = (instruction >> 11) & 0x1; // 0 = offset high, 1 = offset low
+    uint32_t offset11 = (instruction >> 0) & 0x7FF;
+
+    if (h == 0) {
+        // When h = 0, the offset is the high 11 bits of the offset
+        // This is sign extended, shifted left by 12 bits and added to the PC (4 bytes ahead).
+        // The resulting address is placed in LR.
+        cpu->registers.lr = cpu->registers.pc + 4 + (uint32_t)sign_extend((int32_t)(offset11 << 12), 23);
+    } else {
+        // When h = 1, the offset field contains an 11-bit representation lower half of
+        // the target address. This is shifted left by 1 bit and added to LR. LR, which now contains
+        // the full 23-bit address, is placed in PC, the address of the instruction following the BL
+        // is placed in LR and bit 0 of LR is set.
+        uint32_t target = cpu->registers.lr + (offset11 << 1);
+        cpu->registers.lr = (cpu->registers.pc + 2) | 0x1;
+        cpu->registers.pc = target;
+        cpu->registers.pc -= 2; // cpu_step adds the size of this Thumb instruction
+    }
+
+    TRACE_DETAIL("Long Branch with Link: h=%d, offset11=%d\n", h, offset11);
+    return 1;
+}
+
+// ALU Operation handlers, indexed by opcode (bits 9-6)
+cpu_thumb_handler_t cpu_thumb_alu_handlers[16] = {
+    cpu_thumb_alu_and, cpu_thumb_alu_eor, cpu_thumb_alu_lsl, cpu_thumb_alu_lsr,
+    cpu_thumb_alu_asr, cpu_thumb_alu_adc, cpu_thumb_alu_sbc, cpu_thumb_alu_ror,
+    cpu_thumb_alu_tst, cpu_thumb_alu_neg, cpu_thumb_alu_cmp, cpu_thumb_alu_cmn,
+    cpu_thumb_alu_orr, cpu_thumb_alu_mul, cpu_thumb_alu_bic, cpu_thumb_alu_mvn,
+};
+
+// Hi Register Operation handlers, indexed by opcode (bits 9-8)
+cpu_thumb_handler_t cpu_thumb_hi_handlers[4] = {
+    cpu_thumb_hi_add, cpu_thumb_hi_cmp, cpu_thumb_hi_mov, cpu_thumb_hi_bx,
+};
+
+// Shift by Immediate handlers, indexed by opcode (bits 12-11)
+cpu_thumb_handler_t cpu_thumb_shift_handlers[4] = {
+    cpu_thumb_lsl_immediate, cpu_thumb_lsr_immediate, cpu_thumb_asr_immediate, cpu_thumb_add_subtract,
+};
+
+// Move/Compare/Add/Subtract Immediate handlers, indexed by opcode (bits 12-11)
+cpu_thumb_handler_t cpu_thumb_immediate_handlers[4] = {
+    cpu_thumb_mov_immediate, cpu_thumb_cmp_immediate, cpu_thumb_add_immediate, cpu_thumb_sub_immediate,
+};
+
+// Pick the handler for a Thumb table slot
+// The instruction only has bits 15-6 set, bits 5-0 are 0
+cpu_thumb_handler_t cpu_thumb_decode(cpu_thumb_instruction_t instruction)
+{
+    uint8_t instruction_type = (instruction >> 13) & 0x7;
+
+    switch (instruction_type) {
+    case 0b000:
+        return cpu_thumb_shift_handlers[(instruction >> 11) & 0x3];
+    case 0b001:
+        return cpu_thumb_immediate_handlers[(instruction >> 11) & 0x3];
+    case 0b010:
+        if (((instruction >> 12) & 0x1) == 0) {
+            if (((instruction >> 11) & 0x1) == 0) {
+                if (((instruction >> 10) & 0x1) == 0) {
+                    return cpu_thumb_alu_handlers[(instruction >> 6) & 0xF];
+                }
+                return cpu_thumb_hi_handlers[(instruction >> 8) & 0x3];
             }
+            return cpu_thumb_pc_relative_load;
         }
-        break;
-    }
-    case 0b111: {
+        if (((instruction >> 9) & 0x1) == 0) {
+            return cpu_thumb_load_store_register_offset;
+        }
+        return cpu_thumb_load_store_sign_extended;
+    case 0b011:
+        return cpu_thumb_load_store_immediate_offset;
+    case 0b100:
+        if (((instruction >> 12) & 0x1) == 0) {
+            return cpu_thumb_load_store_halfword;
+        }
+        return cpu_thumb_load_store_sp_relative;
+    case 0b101:
         if (((instruction >> 12) & 0x1) == 0) {
-            // Unconditional Branch
-            uint8_t offset11 = (instruction >> 0) & 0x7FF;
+            return cpu_thumb_load_address;
+        }
+        if (((instruction >> 10) & 0x1) == 0) {
+            return cpu_thumb_add_offset_to_sp;
+        }
+        return cpu_thumb_push_pop;
+    case 0b110:
+        if (((instruction >> 12) & 0x1) == 0) {
+            return cpu_thumb_multiple_load_store;
+        }
+        if (((instruction >> 8) & 0xF) == 0xF) {
+            return cpu_thumb_software_interrupt;
+        }
+        return cpu_thumb_conditional_branch;
+    default:
+        if (((instruction >> 12) & 0x1) == 0) {
+            return cpu_thumb_unconditional_branch;
+        }
+        return cpu_thumb_long_branch_with_link;
+    }
+}
 
-            // Calculate the offset
-            int32_t offset = sign_extend(offset11 << 1, 12);
+int cpu_process_thumb_instruction(cpu_t* cpu, cpu_thumb_instruction_t instruction)
+{
+    // Print the PC and instruction
+    TRACE_INSTRUCTION("[THUMB] SP=0x%X, PC=0x%X, Instruction=0x%X\n", cpu->registers.sp, cpu->registers.pc, instruction);
 
-            // Branch
-            cpu->registers.pc += offset + 4;
+    return cpu_thumb_table[CPU_THUMB_TABLE_INDEX(instruction)](cpu, instruction);
+}
 
-            printf("Unconditional Branch: offset11=%d\n", offset11);
-        } else {
-            // Long Branch with Link
-            uint8_t h = (instruction >> 11) & 0x1; // 0 = offset high, 1 = offset low
-            uint32_t offset11 = (instruction >> 0) & 0x7FF;
-
-            if (h == 0) {
-                // When h = 0, the offset is the high 11 bits of the offset
-                // This is shifted left by 12 bits and added to the current PC address.
-                // The resulting address is placed in LR.
-                cpu->registers.lr = cpu->registers.pc + (offset11 << 12);
-            } else {
-                // When h = 1, the offset field contains an 11-bit representation lower half of
-                // the target address. This is shifted left by 1 bit and added to LR. LR, which now contains
-                // the full 23-bit address, is placed in PC, the address of the instruction following the BL
-                // is placed in LR and bit 0 of LR is set.
-                cpu->registers.pc = cpu->registers.lr + (offset11 << 1);
-                cpu->registers.pc -= 2; // TODO: this is a hack to fix the PC being incremented after this instruction
-                cpu->registers.lr = cpu->registers.pc + 2;
-                cpu->registers.lr |= 0x1;
+// Instruction timing
+// Costs are in cycles with every access counted as 1 (wait states are not modelled), and do not
+// depend on the condition. CPU_CYCLES_REFILL is added on top by whoever sees the PC change.
+#define CPU_CYCLES_REFILL 2 // Pipeline refill after a branch (1S + 1N)
+
+uint8_t cpu_arm_cycles(cpu_arm_instruction_t instruction)
+{
+    switch ((instruction >> 25) & 0x7) {
+    case 0x0:
+        if ((instruction & 0x90) == 0x90) {
+            if ((instruction & 0x0FB000F0) == 0x01000090) {
+                return 4; // SWP: 1S + 2N + 1I
             }
+            if ((instruction & 0x60) == 0) {
+                return (instruction & 0x00800000) ? 3 : 2; // MULL / MUL: 1S + mI
+            }
+            return (instruction & 0x00100000) ? 3 : 2; // LDRH / STRH
+        }
+        return (instruction & 0x10) ? 2 : 1; // Data processing, +1I for a shift by register
+    case 0x1:
+        return 1; // Data processing with an immediate
+    case 0x2:
+    case 0x3:
+        return (instruction & 0x00100000) ? 3 : 2; // LDR: 1S + 1N + 1I, STR: 2N
+    case 0x4: {
+        unsigned int count = popcount16(instruction & 0xFFFF);
+        return (instruction & 0x00100000) ? count + 2 : count + 1; // LDM: nS + 1N + 1I, STM: (n-1)S + 2N
+    }
+    default:
+        return 1; // Branch, coprocessor and SWI, the refill is added when the PC changes
+    }
+}
 
-            printf("Long Branch with Link: h=%d, offset11=%d\n", h, offset11);
+uint8_t cpu_thumb_cycles(cpu_thumb_instruction_t instruction)
+{
+    switch ((instruction >> 12) & 0xF) {
+    case 0x4:
+        if ((instruction & 0x0C00) == 0x0000) {
+            switch ((instruction >> 6) & 0xF) {
+            case 0x2: // LSL
+            case 0x3: // LSR
+            case 0x4: // ASR
+            case 0x7: // ROR
+                return 2; // 1S + 1I
+            case 0xD: // MUL
+                return 2;
+            default:
+                return 1;
+            }
         }
-        break;
+        return (instruction & 0x0800) ? 3 : 1; // PC relative load, hi register operations
+    case 0x5:
+        if (instruction & 0x0200) {
+            return (instruction & 0x0C00) ? 3 : 2; // Sign extended, only STRH is a store
+        }
+        return (instruction & 0x0800) ? 3 : 2; // Load / store with a register offset
+    case 0x6:
+    case 0x7:
+    case 0x8:
+    case 0x9:
+        return (instruction & 0x0800) ? 3 : 2; // Load / store with the L bit in bit 11
+    case 0xB:
+        if ((instruction & 0x0600) == 0x0400) {
+            unsigned int count = popcount16(instruction & 0x1FF); // Bit 8 is LR / PC
+            return (instruction & 0x0800) ? count + 2 : count + 1; // POP / PUSH
+        }
+        return 1;
+    case 0xC: {
+        unsigned int count = popcount16(instruction & 0xFF);
+        return (instruction & 0x0800) ? count + 2 : count + 1; // LDMIA / STMIA
     }
     default:
-        printf("Unknown instruction: %d\n", instruction);
-        return 0;
+        return 1;
     }
+}
 
-    return 1;
+// Build the decode and condition tables
+// Must be called once at startup, before any instruction is processed
+void cpu_init_tables(void)
+{
+    for (int nzcv = 0; nzcv < 16; nzcv++) {
+        for (int cond = 0; cond < 16; cond++) {
+            cpu_condition_table[nzcv][cond] = cpu_evaluate_condition(nzcv, cond);
+        }
+    }
+
+    for (int index = 0; index < 4096; index++) {
+        cpu_arm_instruction_t instruction = ((index & 0xFF0) << 16) | ((index & 0xF) << 4);
+        cpu_arm_table[index] = cpu_arm_decode(instruction);
+    }
+
+    for (int index = 0; index < 1024; index++) {
+        cpu_thumb_instruction_t instruction = index << 6;
+        cpu_thumb_table[index] = cpu_thumb_decode(instruction);
+    }
 }
 
-// Run a program using the given CPU
-// Return 0 if the program ran successfully, 1 if there was an error
-int cpu_run(cpu_t* cpu)
+#if GBA_TRACE_RING
+// Process an instruction and record it in the trace ring
+// r0-r12, sp, lr and pc are laid out contiguously, so the register file is read as r[0]-r[15]
+int cpu_process_traced(cpu_t* cpu, uint32_t instruction, uint16_t flags)
+{
+    uint32_t pc = cpu->registers.pc;
+    uint32_t before[16];
+    memcpy(before, cpu->registers.r, sizeof(before));
+
+    int result;
+    if (flags & TRACE_RECORD_THUMB) {
+        result = cpu_process_thumb_instruction(cpu, (cpu_thumb_instruction_t)instruction);
+    } else {
+        result = cpu_process_arm_instruction(cpu, instruction);
+    }
+
+    if (!result) {
+        flags |= TRACE_RECORD_FAILED;
+    }
+
+    // Record the real flags rather than whatever is left in cpsr
+    cpu_flags_resolve(cpu);
+
+    trace_ring_record(cpu->trace, pc, instruction, flags, cpu->registers.cpsr, before, cpu->registers.r);
+    return result;
+}
+#endif
+
+// Put the CPU into its power on state
+void cpu_reset(cpu_t* cpu)
 {
     // Clear the registers
     memset(&cpu->registers, 0, sizeof(cpu_registers_t));
+    memset(&cpu->flags, 0, sizeof(cpu_flags_t));
+    cpu->cycles = 0;
 
     // Start the CPU in ARM mode
     cpu->registers.cpsr |= 0x20;
 
     // Start the CPU in user mode
     cpu->registers.cpsr |= 0x10;
+}
 
-    // Continue processing instruction until the program ends or an error occurs
-    while (cpu->registers.pc < sizeof(memory_t)) {
-        // Process an instruction based on the current mode (ARM/THUMB)
-        if (cpu->registers.cpsr & 0x20) {
-            // ARM
-            // Fetch the instruction
-            uint32_t instruction = *(uint32_t*)&cpu->memory[cpu->registers.pc];
-
-            // Process the instruction
-            if (!cpu_process_arm_instruction(cpu, instruction)) {
-                return 1;
+// Fetch, decode and execute the instruction at PC
+// Return 1 if the instruction was executed, 0 if there was an error
+int cpu_step(cpu_t* cpu)
+{
+    uint32_t pc = cpu->registers.pc;
+
+    // Process an instruction based on the current mode (ARM/THUMB)
+    if (cpu->registers.cpsr & 0x20) {
+        // ARM
+        // Fetch the instruction
+        uint32_t instruction = bus_read32(cpu->bus, cpu->registers.pc);
+
+        // Process the instruction
+#if GBA_TRACE_RING
+        if (cpu->trace != NULL) {
+            if (!cpu_process_traced(cpu, instruction, 0)) {
+                return 0;
             }
+        } else
+#endif
+        if (!cpu_process_arm_instruction(cpu, instruction)) {
+            return 0;
+        }
 
-            // Increment the PC
-            cpu->registers.pc += 4;
-        } else {
-            // THUMB
-            // Fetch the instruction
-            uint16_t instruction = *(uint16_t*)&cpu->memory[cpu->registers.pc];
+        cpu->cycles += cpu_arm_cycles(instruction);
+        if (cpu->registers.pc != pc) {
+            cpu->cycles += CPU_CYCLES_REFILL;
+        }
 
-            // Process the instruction
-            if (!cpu_process_thumb_instruction(cpu, instruction)) {
-                return 1;
+        // Increment the PC
+        cpu->registers.pc += 4;
+    } else {
+        // THUMB
+        // Fetch the instruction
+        uint16_t instruction = bus_read16(cpu->bus, cpu->registers.pc);
+
+        // Process the instruction
+#if GBA_TRACE_RING
+        if (cpu->trace != NULL) {
+            if (!cpu_process_traced(cpu, instruction, TRACE_RECORD_THUMB)) {
+                return 0;
             }
+        } else
+#endif
+        if (!cpu_process_thumb_instruction(cpu, instruction)) {
+            return 0;
+        }
 
-            // Increment the PC
-            cpu->registers.pc += 2;
+        cpu->cycles += cpu_thumb_cycles(instruction);
+        if (cpu->registers.pc != pc) {
+            cpu->cycles += CPU_CYCLES_REFILL;
         }
 
-        // Add a delay to slow down the CPU
-        // This is not needed for the emulator to work, but it makes it easier to see what is happening
-        // in the emulator
-        // usleep(1000);
+        // Increment the PC
+        cpu->registers.pc += 2;
+    }
 
-        // Check if the program has ended
-        if (cpu->registers.pc == 0) {
-            printf("Program counter is zero, program ended\n");
-            // break;
-        }
+    return 1;
+}
 
-        // Check if the program has crashed
-        if (cpu->registers.pc == 0xFFFFFFFF) {
-            printf("Program crashed\n");
-            break;
-        }
+// Check the PC for the ways a program can end
+// Return 1 while the program is still running
+int cpu_check_running(cpu_t* cpu)
+{
+    // Check if the program has crashed (nothing is mapped at or above BUS_END)
+    if (cpu->registers.pc >= BUS_END) {
+        TRACE_EVENT("Program crashed\n");
+        return 0;
+    }
+
+    // Check if the program has ended
+    if (cpu->registers.pc == 0) {
+        TRACE_EVENT("Program counter is zero, program ended\n");
+        // return 0;
+    }
+
+    // Check if the program has entered an infinite loop
+    if (cpu->registers.pc == cpu->registers.lr) {
+        TRACE_EVENT("Program entered an infinite loop\n");
+        // return 0;
+    }
+
+    return 1;
+}
+
+// Run a program using the given CPU
+// Return 0 if the program ran successfully, 1 if there was an error
+int cpu_run(cpu_t* cpu)
+{
+    cpu_reset(cpu);
 
-        // Check if the program has entered an infinite loop
-        if (cpu->registers.pc == cpu->registers.lr) {
-            printf("Program entered an infinite loop\n");
-            // break;
+    // Continue processing instruction until the program ends or an error occurs
+    while (cpu_check_running(cpu)) {
+        if (!cpu_step(cpu)) {
+            return 1;
         }
+
+        // Add a delay to slow down the CPU
+        // This is not needed for the emulator to work, but it makes it easier to see what is happening
+        // in the emulator
+        // usleep(1000);
     }
 
     return 0;
@@ -0,0 +1,315 @@
+// DMA
+// The four channels copy halfwords or words without the CPU. A channel is started by its own
+// scheduler event: right after it is enabled (immediate), or when the PPU enters VBlank or HBlank.
+// Channels 1 and 2 can also feed the sound FIFOs, which ask for more data on their own; those
+// transfers run as soon as the FIFO asks.
+//
+// A transfer that reads and writes plain memory with both addresses going up is copied (or filled,
+// when the source is fixed) a page at a time straight between the host buffers. I/O registers, the
+// cartridge SRAM and the decrementing address modes go through the bus one unit at a time. The CPU
+// is stalled for the length of the transfer by moving its cycle counter forward.
+
+#ifndef DMA_H_
+#define DMA_H_
+
+#include "bus.h"
+#include "irq.h"
+#include "memory.h"
+#include "scheduler.h"
+
+#include <stdint.h> // for uint32_t
+#include <string.h> // for memcpy
+
+// I/O register offsets
+#define DMA_SAD(n) (0x0B0u + 12u * (n)) // Source address, 32 bits, write only
+#define DMA_DAD(n) (0x0B4u + 12u * (n)) // Destination address, 32 bits, write only
+#define DMA_CNT_L(n) (0x0B8u + 12u * (n)) // Unit count, write only
+#define DMA_CNT_H(n) (0x0BAu + 12u * (n)) // Control
+#define DMA_REGISTERS_END 0x0E0
+
+// DMAxCNT_H bits
+#define DMA_DEST_CONTROL 0x0060 // Destination after each unit, see DMA_ADDRESS_*
+#define DMA_SOURCE_CONTROL 0x0180 // Source after each unit, see DMA_ADDRESS_*
+#define DMA_REPEAT 0x0200 // Restart on the next VBlank / HBlank / FIFO request
+#define DMA_WORD 0x0400 // 32 bit units instead of 16 bit ones
+#define DMA_TIMING 0x3000 // When the transfer starts, see DMA_START_*
+#define DMA_IRQ 0x4000 // Request an interrupt at the end of the transfer
+#define DMA_ENABLE 0x8000
+
+// Address control values
+#define DMA_ADDRESS_INCREMENT 0
+#define DMA_ADDRESS_DECREMENT 1
+#define DMA_ADDRESS_FIXED 2
+#define DMA_ADDRESS_RELOAD 3 // Destination only, increments and is reloaded when the transfer repeats
+
+// Start timing values
+#define DMA_START_IMMEDIATE 0
+#define DMA_START_VBLANK 1
+#define DMA_START_HBLANK 2
+#define DMA_START_SPECIAL 3 // Sound FIFO for channels 1 and 2, video capture (not emulated) for 3
+
+#define DMA_COUNT 4
+#define DMA_FIFO_WORDS 4 // Words per sound FIFO transfer, whatever the count register says
+
+// Timing in CPU cycles, without wait states like the rest of the core
+#define DMA_CYCLES_START 2 // From the enable write to the first access, and from stall to resume
+#define DMA_CYCLES_UNIT 2 // One read and one write
+
+struct dma;
+
+typedef struct dma_channel {
+    struct dma* dma;
+    int index;
+    uint16_t control; // DMAxCNT_H when the channel was enabled or last restarted
+    uint32_t source; // Internal registers, latched from the I/O block when the channel is enabled
+    uint32_t dest;
+    uint32_t count; // Units per transfer
+} dma_channel_t;
+
+typedef struct dma {
+    dma_channel_t channels[DMA_COUNT];
+    memory_t* memory;
+    bus_t* bus;
+    scheduler_t* scheduler;
+    uint64_t* clock; // CPU cycle counter, moved forward while a transfer holds the bus
+} dma_t;
+
+// Address and count masks, channel 0 only sees internal memory and channel 3 has longer counts
+static const uint32_t dma_source_mask[DMA_COUNT] = { 0x07FFFFFF, 0x0FFFFFFF, 0x0FFFFFFF, 0x0FFFFFFF };
+static const uint32_t dma_dest_mask[DMA_COUNT] = { 0x07FFFFFF, 0x07FFFFFF, 0x07FFFFFF, 0x0FFFFFFF };
+static const uint32_t dma_count_mask[DMA_COUNT] = { 0x3FFF, 0x3FFF, 0x3FFF, 0xFFFF };
+
+void dma_reset(dma_t* dma, bus_t* bus, scheduler_t* scheduler, uint64_t* clock)
+{
+    memset(dma, 0, sizeof(dma_t));
+    dma->memory = bus->memory;
+    dma->bus = bus;
+    dma->scheduler = scheduler;
+    dma->clock = clock;
+    for (int n = 0; n < DMA_COUNT; n++) {
+        dma->channels[n].dma = dma;
+        dma->channels[n].index = n;
+    }
+}
+
+static inline uint32_t dma_io32(const dma_t* dma, uint32_t offset)
+{
+    return memory_io_read16(dma->memory, offset) | ((uint32_t)memory_io_read16(dma->memory, offset + 2) << 16);
+}
+
+// Units in a transfer, a count of 0 is the largest one
+static inline uint32_t dma_units(const dma_t* dma, int n)
+{
+    uint32_t count = memory_io_read16(dma->memory, DMA_CNT_L(n)) & dma_count_mask[n];
+    return count != 0 ? count : dma_count_mask[n] + 1;
+}
+
+// Change in address after each unit, for an address control value
+static inline int32_t dma_step(uint32_t control, int32_t size)
+{
+    switch (control) {
+    case DMA_ADDRESS_DECREMENT:
+        return -size;
+    case DMA_ADDRESS_FIXED:
+        return 0;
+    default:
+        return size;
+    }
+}
+
+// Return 1 if `address` is plain memory, which transfers can go through the page tables for
+// SRAM has an 8 bit bus, so it only takes the low byte of each unit and is left to the bus
+static inline int dma_plain(uint32_t address)
+{
+    return address >= BUS_WRAM && address < BUS_SRAM && (address < BUS_IO || address >= BUS_PALETTE);
+}
+
+// Units of `size` bytes from `address` to the end of its page, or of the mirror inside the page for
+// buffers smaller than one
+static inline uint32_t dma_room(const bus_page_t* table, uint32_t address, int size)
+{
+    const bus_page_t* page = &table[BUS_PAGE_INDEX(address)];
+    uint32_t mask = page->base != NULL ? page->mask : BUS_PAGE_SIZE - 1;
+    return (mask + 1 - (address & mask)) / (uint32_t)size;
+}
+
+// Copy or fill `units` units of `size` bytes, one at a time through the bus
+static void dma_copy_slow(dma_t* dma, uint32_t source, int32_t source_step, uint32_t dest, int32_t dest_step, uint32_t units, int size)
+{
+    bus_t* bus = dma->bus;
+    for (uint32_t i = 0; i < units; i++) {
+        if (size == 4) {
+            bus_write32(bus, dest, bus_read32(bus, source));
+        } else {
+            bus_write16(bus, dest, bus_read16(bus, source));
+        }
+        source += (uint32_t)source_step;
+        dest += (uint32_t)dest_step;
+    }
+}
+
+// Run `units` units from `source` to `dest`, with the addresses aligned to `size` and moving as given
+// The increasing copies and fills of plain memory are done a page at a time through the page tables
+static void dma_copy(dma_t* dma, uint32_t source, int32_t source_step, uint32_t dest, int32_t dest_step, uint32_t units, int size)
+{
+    bus_t* bus = dma->bus;
+
+    if (dest_step != size || (source_step != size && source_step != 0)) {
+        dma_copy_slow(dma, source, source_step, dest, dest_step, units, size);
+        return;
+    }
+
+    while (units > 0) {
+        // Stop where the destination buffer ends or wraps, and the source one when it moves
+        uint32_t chunk = units;
+        uint32_t room = dma_room(bus->write, dest, size);
+        if (room < chunk) {
+            chunk = room;
+        }
+        if (source_step != 0) {
+            room = dma_room(bus->read, source, size);
+            if (room < chunk) {
+                chunk = room;
+            }
+        }
+
+        uint32_t bytes = chunk * (uint32_t)size;
+        uint8_t* to = dma_plain(dest) ? bus_span(bus->write, dest, bytes) : NULL;
+        const uint8_t* from = dma_plain(source) ? bus_span(bus->read, source, source_step != 0 ? bytes : (uint32_t)size) : NULL;
+        if (to == NULL || from == NULL || (source_step != 0 && to < from + bytes && from < to + bytes)) {
+            // Overlapping copies see the units they already wrote, like the hardware does
+            dma_copy_slow(dma, source, source_step, dest, dest_step, chunk, size);
+        } else if (source_step != 0) {
+            memcpy(to, from, bytes);
+            bus_span_written(bus, dest, bytes);
+        } else {
+            if (size == 4) {
+                uint32_t value = *(const uint32_t*)from;
+                for (uint32_t i = 0; i < chunk; i++) {
+                    ((uint32_t*)to)[i] = value;
+                }
+            } else {
+                uint16_t value = *(const uint16_t*)from;
+                for (uint32_t i = 0; i < chunk; i++) {
+                    ((uint16_t*)to)[i] = value;
+                }
+            }
+            bus_span_written(bus, dest, bytes);
+        }
+
+        source += (uint32_t)source_step * chunk;
+        dest += bytes;
+        units -= chunk;
+    }
+}
+
+// Run one transfer of channel `n` from its internal registers
+// A sound FIFO transfer moves DMA_FIFO_WORDS words to a fixed destination
+static void dma_transfer(dma_t* dma, int n, int fifo)
+{
+    dma_channel_t* channel = &dma->channels[n];
+    uint16_t control = channel->control;
+    int size = (fifo || (control & DMA_WORD)) ? 4 : 2;
+    uint32_t units = fifo ? DMA_FIFO_WORDS : channel->count;
+    int32_t source_step = dma_step((control & DMA_SOURCE_CONTROL) >> 7, size);
+    int32_t dest_step = fifo ? 0 : dma_step((control & DMA_DEST_CONTROL) >> 5, size);
+
+    // Units are aligned to their size, the internal registers keep the low bits
+    uint32_t align = ~(uint32_t)(size - 1);
+    dma_copy(dma, channel->source & align, source_step, channel->dest & align, dest_step, units, size);
+    channel->source += (uint32_t)source_step * units;
+    channel->dest += (uint32_t)dest_step * units;
+    *dma->clock += DMA_CYCLES_START + (uint64_t)units * DMA_CYCLES_UNIT;
+
+    if (control & DMA_IRQ) {
+        irq_request(dma->memory, (uint16_t)(IRQ_DMA0 << n));
+    }
+
+    // Immediate transfers never repeat
+    if ((control & DMA_REPEAT) && (control & DMA_TIMING) != 0) {
+        channel->count = dma_units(dma, n);
+        if (((control & DMA_DEST_CONTROL) >> 5) == DMA_ADDRESS_RELOAD) {
+            channel->dest = dma_io32(dma, DMA_DAD(n)) & dma_dest_mask[n];
+        }
+    } else {
+        channel->control &= ~DMA_ENABLE;
+        memory_io_write16(dma->memory, DMA_CNT_H(n), memory_io_read16(dma->memory, DMA_CNT_H(n)) & ~DMA_ENABLE);
+    }
+}
+
+// Scheduler event, the start condition of a channel was met
+void dma_event(void* context, uint64_t when)
+{
+    dma_channel_t* channel = (dma_channel_t*)context;
+    (void)when;
+    if (channel->control & DMA_ENABLE) {
+        dma_transfer(channel->dma, channel->index, 0);
+    }
+}
+
+// Schedule the channels that start with `timing` at cycle `when`
+static void dma_start(dma_t* dma, uint16_t timing, uint64_t when)
+{
+    for (int n = 0; n < DMA_COUNT; n++) {
+        dma_channel_t* channel = &dma->channels[n];
+        if ((channel->control & DMA_ENABLE) && ((channel->control & DMA_TIMING) >> 12) == timing) {
+            scheduler_schedule(dma->scheduler, (scheduler_event_id_t)(SCHEDULER_EVENT_DMA0 + n), when, dma_event, channel);
+        }
+    }
+}
+
+// PPU hook, a visible line entered HBlank (`vblank` 0) or the frame entered VBlank (`vblank` 1)
+void dma_blank(void* context, int vblank, uint64_t when)
+{
+    dma_start((dma_t*)context, vblank ? DMA_START_VBLANK : DMA_START_HBLANK, when);
+}
+
+// Sound hook, FIFO `fifo` (0 for A) can take more samples
+// The samples are needed before the sound catches up any further, so the transfer runs now
+void dma_fifo_request(void* context, int fifo)
+{
+    dma_t* dma = (dma_t*)context;
+    uint32_t address = BUS_IO + (fifo ? 0x0A4 : 0x0A0);
+
+    for (int n = 1; n <= 2; n++) {
+        dma_channel_t* channel = &dma->channels[n];
+        if ((channel->control & (DMA_ENABLE | DMA_TIMING)) == (DMA_ENABLE | DMA_TIMING) && channel->dest == address) {
+            dma_transfer(dma, n, 1);
+            return;
+        }
+    }
+}
+
+// `size` bytes of DMA registers were written at `offset`, the access is aligned to its size
+void dma_write(dma_t* dma, uint32_t offset, int size, uint64_t now)
+{
+    for (int n = 0; n < DMA_COUNT; n++) {
+        if (offset >= DMA_CNT_H(n) + 2 || offset + (uint32_t)size <= DMA_CNT_H(n)) {
+            continue;
+        }
+
+        dma_channel_t* channel = &dma->channels[n];
+        uint16_t control = memory_io_read16(dma->memory, DMA_CNT_H(n));
+        scheduler_event_id_t event = (scheduler_event_id_t)(SCHEDULER_EVENT_DMA0 + n);
+
+        if (!(control & DMA_ENABLE)) {
+            channel->control = control;
+            scheduler_cancel(dma->scheduler, event);
+            continue;
+        }
+
+        // Enabling a channel latches its addresses and count, rewriting the control of a running
+        // channel only changes how it goes on
+        if (!(channel->control & DMA_ENABLE)) {
+            channel->source = dma_io32(dma, DMA_SAD(n)) & dma_source_mask[n];
+            channel->dest = dma_io32(dma, DMA_DAD(n)) & dma_dest_mask[n];
+            channel->count = dma_units(dma, n);
+            if (((control & DMA_TIMING) >> 12) == DMA_START_IMMEDIATE) {
+                scheduler_schedule(dma->scheduler, event, now + DMA_CYCLES_START, dma_event, channel);
+            }
+        }
+        channel->control = control;
+    }
+}
+
+#endif // DMA_H_
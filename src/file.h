@@ -0,0 +1,106 @@
+// Read-only memory mapped files
+// The pages are loaded on demand and instances mapping the same file share the page cache copy
+
+#ifndef FILE_H_
+#define FILE_H_
+
+#include <stddef.h> // for size_t
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+typedef struct file_map {
+    const char* data; // Start of the mapping, NULL when nothing is mapped
+    size_t size; // Size of the file in bytes
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} file_map_t;
+
+// Map the whole file at `path` read only
+// Returns 0 on success, 1 if the file could not be opened or mapped (empty files cannot be mapped)
+int file_map_open(file_map_t* map, const char* path)
+{
+    map->data = NULL;
+    map->size = 0;
+
+#ifdef _WIN32
+    map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE) {
+        return 1;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(map->file, &size) || size.QuadPart == 0) {
+        CloseHandle(map->file);
+        return 1;
+    }
+
+    map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (map->mapping == NULL) {
+        CloseHandle(map->file);
+        return 1;
+    }
+
+    map->data = (const char*)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (map->data == NULL) {
+        CloseHandle(map->mapping);
+        CloseHandle(map->file);
+        return 1;
+    }
+
+    map->size = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 1;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return 1;
+    }
+
+    map->data = (const char*)data;
+    map->size = (size_t)st.st_size;
+#endif
+
+    return 0;
+}
+
+void file_map_close(file_map_t* map)
+{
+    if (map->data == NULL) {
+        return;
+    }
+
+#ifdef _WIN32
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#else
+    munmap((void*)map->data, map->size);
+#endif
+
+    map->data = NULL;
+    map->size = 0;
+}
+
+#endif // FILE_H_
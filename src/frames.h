@@ -0,0 +1,101 @@
+// Triple buffered frames
+// The emulation thread renders into the back buffer while the presenter shows the front buffer. When
+// a frame is finished the back buffer is swapped with the middle one, and the presenter swaps the
+// middle buffer with its front buffer when a new one is there. Neither side waits for the other: the
+// emulator can finish frames faster than they are shown (the older ones are dropped), and the
+// presenter never sees a buffer that is still being drawn.
+//
+// The buffers are either allocated here or provided by the presenter (locked streaming textures, so
+// the PPU draws straight into memory the GPU reads). The presenter may point the front buffer at new
+// memory before handing it back, which is how a texture is locked again after it was shown.
+
+#ifndef FRAMES_H_
+#define FRAMES_H_
+
+#include "thread.h"
+
+#include <stdint.h> // for uint32_t
+#include <stdlib.h> // for calloc
+#include <string.h> // for memset
+
+#define FRAMES_NEW 0x4 // Set in `middle` when it holds a frame the presenter has not taken
+
+typedef struct frames {
+    uint32_t* buffers[3]; // XRGB8888 pixels
+    uint32_t pitch[3]; // Pixels from one row of each buffer to the next
+    uint32_t back; // Buffer index owned by the producer
+    uint32_t front; // Buffer index owned by the consumer
+    volatile uint32_t middle; // Index of the third buffer, with FRAMES_NEW
+    int allocated; // 1 if frames_alloc allocated the buffers
+} frames_t;
+
+// Start with no buffers, the presenter sets them with frames_set_buffer
+void frames_init(frames_t* frames)
+{
+    memset(frames, 0, sizeof(frames_t));
+    frames->back = 0;
+    frames->middle = 1;
+    frames->front = 2;
+}
+
+// Point buffer `index` at `pixels`, only while neither thread is using it
+static inline void frames_set_buffer(frames_t* frames, uint32_t index, uint32_t* pixels, uint32_t pitch)
+{
+    frames->buffers[index] = pixels;
+    frames->pitch[index] = pitch;
+}
+
+void frames_free(frames_t* frames)
+{
+    if (frames->allocated) {
+        for (int i = 0; i < 3; i++) {
+            free(frames->buffers[i]);
+        }
+    }
+    frames_init(frames);
+}
+
+// Allocate three cleared `width` x `height` buffers
+// Returns 0 on success, 1 if an allocation failed
+int frames_alloc(frames_t* frames, uint32_t width, uint32_t height)
+{
+    frames_init(frames);
+    frames->allocated = 1;
+
+    for (int i = 0; i < 3; i++) {
+        uint32_t* pixels = (uint32_t*)calloc((size_t)width * height, sizeof(uint32_t));
+        if (pixels == NULL) {
+            frames_free(frames);
+            return 1;
+        }
+        frames_set_buffer(frames, i, pixels, width);
+    }
+
+    return 0;
+}
+
+// Producer side, hand the back buffer to the presenter and take the middle one as the new back buffer
+void frames_publish(frames_t* frames)
+{
+    frames->back = atomic_exchange32(&frames->middle, frames->back | FRAMES_NEW) & 0x3;
+}
+
+// Consumer side, 1 if a frame was published since the presenter last took one
+static inline int frames_pending(frames_t* frames)
+{
+    return (atomic_load32(&frames->middle) & FRAMES_NEW) != 0;
+}
+
+// Consumer side, make the most recent finished frame the front buffer
+// Returns 1 if there was a new frame, 0 if the front buffer is unchanged
+int frames_take(frames_t* frames)
+{
+    if (!frames_pending(frames)) {
+        return 0;
+    }
+
+    frames->front = atomic_exchange32(&frames->middle, frames->front) & 0x3;
+    return 1;
+}
+
+#endif // FRAMES_H_
@@ -1 +1,425 @@
 // Gameboy Advance Emulator
+// Ties the CPU, memory, bus and devices together, and loads the BIOS and cartridge
+
+#ifndef GBA_H_
+#define GBA_H_
+
+#include "audio.h"
+#include "block.h"
+#include "bus.h"
+#include "cpu.h"
+#include "dma.h"
+#include "file.h"
+#include "input.h"
+#include "irq.h"
+#include "jit.h"
+#include "memory.h"
+#include "ppu.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "timer.h"
+
+#include <stdint.h> // for uint8_t
+#include <stdlib.h> // for calloc
+#include <string.h> // for memset
+
+// Loader results
+#define GBA_LOAD_OK 0
+#define GBA_LOAD_OPEN_FAILED 1 // The file could not be opened or mapped
+#define GBA_LOAD_INVALID 2 // The file is not a BIOS / cartridge image
+
+#define GBA_CYCLES_PER_SECOND 16777216
+
+// gba_run_frame results
+#define GBA_RUN_FRAME 0 // A frame was completed
+#define GBA_RUN_ENDED 1 // The program ended
+#define GBA_RUN_ERROR 2 // The CPU hit an instruction it could not execute
+
+// Cartridge header
+#define GBA_ROM_HEADER_SIZE 0xC0
+#define GBA_ROM_FIXED_VALUE 0xB2 // Must be 0x96
+#define GBA_ROM_COMPLEMENT 0xBD // Checksum of bytes A0-BC
+
+typedef struct gba {
+    cpu_t cpu;
+    memory_t* memory;
+    bus_t* bus;
+    block_cache_t* blocks;
+    jit_t* jit; // NULL when the JIT is not built or could not be started
+    scheduler_t scheduler; // Device events, timestamps are in cpu.cycles
+    ppu_t ppu;
+    timers_t timers;
+    audio_t audio;
+    dma_t dma;
+    uint32_t* framebuffer; // PPU_WIDTH x PPU_HEIGHT XRGB8888, where the PPU renders unless redirected
+    file_map_t bios_file;
+    file_map_t rom_file;
+    uint64_t bios_hash; // Hashes of the mapped images for savestates, 0 until state.h needs them
+    uint64_t rom_hash;
+    uint8_t fast_boot; // Skip the BIOS intro on reset, always done without a BIOS
+#if GBA_PROFILE
+    profile_t* profile; // Guest code profile, NULL when not profiling
+#endif
+} gba_t;
+
+void gba_free(gba_t* gba)
+{
+    file_map_close(&gba->rom_file);
+    file_map_close(&gba->bios_file);
+    free(gba->framebuffer);
+    ppu_tile_cache_destroy(gba->ppu.tiles);
+    jit_destroy(gba->jit);
+    block_cache_destroy(gba->blocks);
+    bus_destroy(gba->bus);
+    free(gba->memory);
+    gba->framebuffer = NULL;
+    gba->ppu.tiles = NULL;
+    gba->jit = NULL;
+    gba->blocks = NULL;
+    gba->bus = NULL;
+    gba->memory = NULL;
+}
+
+// Allocate the memory and bus, nothing is loaded yet
+// Returns 0 on success, 1 if an allocation failed
+int gba_init(gba_t* gba)
+{
+    memset(gba, 0, sizeof(gba_t));
+
+    gba->memory = (memory_t*)calloc(1, sizeof(memory_t));
+    if (gba->memory == NULL) {
+        return 1;
+    }
+
+    gba->bus = bus_create(gba->memory);
+    gba->blocks = block_cache_create();
+    gba->framebuffer = (uint32_t*)calloc(PPU_WIDTH * PPU_HEIGHT, sizeof(uint32_t));
+    gba->ppu.tiles = ppu_tile_cache_create();
+    if (gba->bus == NULL || gba->blocks == NULL || gba->framebuffer == NULL || gba->ppu.tiles == NULL) {
+        gba_free(gba);
+        return 1;
+    }
+
+    // Without executable memory the block cache is replayed by the interpreter
+    gba->jit = jit_create();
+
+    gba->cpu.bus = gba->bus;
+    ppu_set_framebuffer(&gba->ppu, gba->framebuffer, PPU_WIDTH);
+    return 0;
+}
+
+// Check the cartridge header, only the first GBA_ROM_HEADER_SIZE bytes are read
+// Returns 0 if the header is valid
+int gba_check_rom_header(const char* rom, size_t size)
+{
+    if (size < GBA_ROM_HEADER_SIZE || size > BUS_ROM_SIZE) {
+        return 1;
+    }
+
+    const uint8_t* header = (const uint8_t*)rom;
+
+    if (header[GBA_ROM_FIXED_VALUE] != 0x96) {
+        return 1;
+    }
+
+    uint8_t checksum = 0;
+    for (int i = 0xA0; i <= 0xBC; i++) {
+        checksum -= header[i];
+    }
+    checksum -= 0x19;
+
+    return checksum != header[GBA_ROM_COMPLEMENT];
+}
+
+// Map a BIOS image into memory
+// Returns one of the GBA_LOAD_* results
+int gba_load_bios(gba_t* gba, const char* path)
+{
+    file_map_close(&gba->bios_file);
+    gba->memory->bios = NULL;
+    gba->bios_hash = 0;
+
+    if (file_map_open(&gba->bios_file, path)) {
+        bus_init(gba->bus, gba->memory);
+        block_cache_flush(gba->blocks);
+        return GBA_LOAD_OPEN_FAILED;
+    }
+
+    int result = GBA_LOAD_OK;
+    if (gba->bios_file.size != MEMORY_BIOS_SIZE) {
+        file_map_close(&gba->bios_file);
+        result = GBA_LOAD_INVALID;
+    }
+
+    gba->memory->bios = (char*)gba->bios_file.data;
+    bus_init(gba->bus, gba->memory);
+    block_cache_flush(gba->blocks);
+    return result;
+}
+
+// Map a cartridge into memory, the image is not read beyond its header until the CPU touches it
+// Returns one of the GBA_LOAD_* results
+int gba_load_rom(gba_t* gba, const char* path)
+{
+    file_map_close(&gba->rom_file);
+    gba->memory->rom = NULL;
+    gba->memory->rom_size = 0;
+    gba->rom_hash = 0;
+
+    if (file_map_open(&gba->rom_file, path)) {
+        bus_init(gba->bus, gba->memory);
+        block_cache_flush(gba->blocks);
+        return GBA_LOAD_OPEN_FAILED;
+    }
+
+    int result = GBA_LOAD_OK;
+    if (gba_check_rom_header(gba->rom_file.data, gba->rom_file.size)) {
+        file_map_close(&gba->rom_file);
+        result = GBA_LOAD_INVALID;
+    }
+
+    // The bus never writes to ROM pages, so the read only mapping is safe to point at
+    gba->memory->rom = (char*)gba->rom_file.data;
+    gba->memory->rom_size = (uint32_t)gba->rom_file.size;
+    bus_init(gba->bus, gba->memory);
+    block_cache_flush(gba->blocks);
+    return result;
+}
+
+// Use BIOS and cartridge images mapped by the caller, which must outlive `gba`
+// Instances running the same program share one read only copy this way, the images are expected to
+// have been checked like gba_load_bios and gba_load_rom do (`bios` may be NULL, `rom` too)
+void gba_attach_images(gba_t* gba, const char* bios, const char* rom, uint32_t rom_size)
+{
+    file_map_close(&gba->bios_file);
+    file_map_close(&gba->rom_file);
+    gba->memory->bios = (char*)bios;
+    gba->memory->rom = (char*)rom;
+    gba->memory->rom_size = rom != NULL ? rom_size : 0;
+    gba->bios_hash = 0;
+    gba->rom_hash = 0;
+    bus_init(gba->bus, gba->memory);
+    block_cache_flush(gba->blocks);
+}
+
+// Move the CPU forward to the next event and service it, for when the CPU has nothing to do
+void gba_skip_to_event(gba_t* gba)
+{
+    uint64_t next = scheduler_next(&gba->scheduler);
+    if (next != SCHEDULER_NEVER && gba->cpu.cycles < next) {
+        gba->cpu.cycles = next;
+    }
+
+    scheduler_run(&gba->scheduler, gba->cpu.cycles);
+}
+
+// Bus hooks of the device registers, see gba_map_io
+// Reads bring the registers up to date, writes let the devices act on what was just stored
+static void gba_timers_read(void* context, uint32_t offset, int size)
+{
+    gba_t* gba = (gba_t*)context;
+    (void)size;
+    timers_read(&gba->timers, offset, gba->cpu.cycles);
+}
+
+static void gba_timers_write(void* context, uint32_t offset, int size)
+{
+    gba_t* gba = (gba_t*)context;
+
+    // The FIFOs are paced by the timers, so the samples before the write play with the old ones
+    audio_sync(&gba->audio, gba->cpu.cycles);
+    timers_write(&gba->timers, offset, size, gba->cpu.cycles);
+}
+
+static void gba_audio_read(void* context, uint32_t offset, int size)
+{
+    gba_t* gba = (gba_t*)context;
+    (void)offset;
+    (void)size;
+    audio_read(&gba->audio, gba->cpu.cycles);
+}
+
+static void gba_audio_write(void* context, uint32_t offset, int size)
+{
+    gba_t* gba = (gba_t*)context;
+    audio_write(&gba->audio, offset, size, gba->cpu.cycles);
+}
+
+static void gba_dma_write(void* context, uint32_t offset, int size)
+{
+    gba_t* gba = (gba_t*)context;
+    dma_write(&gba->dma, offset, size, gba->cpu.cycles);
+}
+
+// Fill in the bus I/O table, the registers not listed here are plain storage
+static void gba_map_io(gba_t* gba)
+{
+    bus_t* bus = gba->bus;
+
+    // Only TMxCNT_L reads need the counter brought up to date
+    for (uint32_t n = 0; n < TIMER_COUNT; n++) {
+        bus_set_io_hooks(bus, TIMER_CNT_L(n), TIMER_CNT_L(n) + 2, gba_timers_read, gba_timers_write, gba);
+        bus_set_io_hooks(bus, TIMER_CNT_H(n), TIMER_CNT_H(n) + 2, NULL, gba_timers_write, gba);
+    }
+
+    // Channels start on DMAxCNT_H writes, the addresses and counts are only read then
+    for (uint32_t n = 0; n < DMA_COUNT; n++) {
+        bus_set_io_hooks(bus, DMA_CNT_H(n), DMA_CNT_H(n) + 2, NULL, gba_dma_write, gba);
+    }
+
+    bus_set_io_hooks(bus, AUDIO_SOUND1CNT_L, AUDIO_REGISTERS_END, NULL, gba_audio_write, gba);
+    bus_set_io_hooks(bus, AUDIO_SOUNDCNT_X, AUDIO_SOUNDCNT_X + 2, gba_audio_read, gba_audio_write, gba);
+
+    // Status bits the hardware sets
+    bus_set_io_mask(bus, PPU_DISPSTAT, (uint16_t)~(PPU_DISPSTAT_VBLANK | PPU_DISPSTAT_HBLANK | PPU_DISPSTAT_VCOUNT), 0);
+    bus_set_io_mask(bus, PPU_VCOUNT, 0, 0);
+    bus_set_io_mask(bus, INPUT_KEYINPUT, 0, 0);
+    bus_set_io_mask(bus, AUDIO_SOUNDCNT_X, (uint16_t)~0xF, 0);
+}
+
+// Leave the CPU and I/O registers as the BIOS intro does before it jumps to the cartridge
+static void gba_skip_bios(gba_t* gba)
+{
+    cpu_registers_t* registers = &gba->cpu.registers;
+    registers->sp = BIOS_USER_STACK;
+    registers->bank_sp_lr[CPU_BANK_IRQ][0] = BIOS_IRQ_STACK;
+    registers->bank_sp_lr[CPU_BANK_SUPERVISOR][0] = BIOS_SVC_STACK;
+    registers->pc = 0x08000000;
+    set_cpsr_mode(registers, ARM_MODE_SYSTEM); // Shares the User bank, so nothing to swap
+
+    // POSTFLG, set once the BIOS has run
+    gba->memory->io[0x300] = 1;
+}
+
+// Put the CPU at the reset vector and the devices in their power on state
+// The cartridge starts right away when fast_boot is set or there is no BIOS
+void gba_reset(gba_t* gba)
+{
+    cpu_reset(&gba->cpu);
+    scheduler_init(&gba->scheduler);
+    ppu_reset(&gba->ppu, gba->bus, &gba->scheduler, gba->cpu.cycles);
+    timers_reset(&gba->timers, gba->memory, &gba->scheduler);
+    audio_reset(&gba->audio, gba->memory, &gba->scheduler, &gba->timers, gba->cpu.cycles);
+    dma_reset(&gba->dma, gba->bus, &gba->scheduler, &gba->cpu.cycles);
+    gba->ppu.blank_hook = dma_blank;
+    gba->ppu.blank_context = &gba->dma;
+    gba->audio.fifo_request = dma_fifo_request;
+    gba->audio.fifo_context = &gba->dma;
+    input_reset(gba->memory);
+    gba_map_io(gba);
+    gba->bus->halted = 0;
+    gba->bus->intr_wait = 0;
+
+    if (gba->fast_boot || gba->memory->bios == NULL) {
+        gba_skip_bios(gba);
+    }
+}
+
+// Take an interrupt, running the BIOS dispatcher natively like the calls in bios.h
+// The dispatcher saves R0-R3, R12 and LR on the IRQ stack and calls the handler at BIOS_IRQ_HANDLER
+// in ARM state with R0 = 04000000, which returns to BIOS_IRQ_RETURN
+static void gba_irq_enter(gba_t* gba)
+{
+    cpu_t* cpu = &gba->cpu;
+    cpu_registers_t* registers = &cpu->registers;
+
+    // LR is the next instruction plus 4, which SUBS PC, LR, #4 returns to
+    cpu_exception_enter(cpu, ARM_MODE_IRQ, 0x18, registers->pc + 4);
+
+    uint32_t sp = registers->sp - 24;
+    uint32_t saved[6] = { registers->r[0], registers->r[1], registers->r[2], registers->r[3], registers->r[12], registers->lr };
+    for (int i = 0; i < 6; i++) {
+        bus_write32(gba->bus, sp + i * 4, saved[i]);
+    }
+    registers->sp = sp;
+    registers->r[0] = BUS_IO;
+    registers->lr = BIOS_IRQ_RETURN;
+    registers->pc = bus_read32(gba->bus, BIOS_IRQ_HANDLER) & ~3u;
+}
+
+// The handler returned to the dispatcher, restore the registers and go back to the interrupted code
+static void gba_irq_return(gba_t* gba)
+{
+    cpu_t* cpu = &gba->cpu;
+    cpu_registers_t* registers = &cpu->registers;
+
+    uint32_t sp = registers->sp;
+    for (int i = 0; i < 4; i++) {
+        registers->r[i] = bus_read32(gba->bus, sp + i * 4);
+    }
+    registers->r[12] = bus_read32(gba->bus, sp + 16);
+    registers->lr = bus_read32(gba->bus, sp + 20);
+    registers->sp = sp + 24;
+
+    cpu_exception_return(cpu, registers->lr - 4);
+}
+
+// Run until the PPU reaches VBlank, the finished frame is in the PPU's framebuffer
+// Returns one of the GBA_RUN_* results
+int gba_run_frame(gba_t* gba)
+{
+    uint32_t frame = gba->ppu.frame;
+
+    while (gba->ppu.frame == frame) {
+        if (!cpu_check_running(&gba->cpu)) {
+            return GBA_RUN_ENDED;
+        }
+
+        // A halted CPU does nothing until an enabled interrupt is requested
+        if (gba->bus->halted) {
+            if (irq_wakeup(gba->memory)) {
+                gba->bus->halted = 0;
+            } else {
+                gba_skip_to_event(gba);
+            }
+            continue;
+        }
+
+        // Interrupts are taken between blocks
+        if (gba->cpu.registers.pc == BIOS_IRQ_RETURN && get_cpsr_mode(gba->cpu.registers.cpsr) == ARM_MODE_IRQ) {
+            gba_irq_return(gba);
+        }
+        if (!(gba->cpu.registers.cpsr & 0x80) && irq_pending(gba->memory)) {
+            gba_irq_enter(gba);
+        }
+
+        uint32_t pc = gba->cpu.registers.pc;
+        int result;
+#if GBA_PROFILE
+        if (gba->profile != NULL) {
+            result = profile_execute(gba->profile, gba->jit, gba->blocks, &gba->cpu);
+        } else
+#endif
+        result = gba->jit != NULL ? jit_execute(gba->jit, gba->blocks, &gba->cpu) : block_cache_execute(gba->blocks, &gba->cpu);
+        if (!result) {
+            return GBA_RUN_ERROR;
+        }
+
+        // A polling loop that went round once will keep going round until a device changes memory
+        // Otherwise devices are only serviced once the CPU reaches the earliest deadline, a block
+        // may run a few cycles past it
+        if (gba->cpu.registers.pc == pc && block_idle_at(gba->blocks, &gba->cpu)) {
+            gba_skip_to_event(gba);
+        } else if (gba->cpu.cycles >= scheduler_next(&gba->scheduler)) {
+            scheduler_run(&gba->scheduler, gba->cpu.cycles);
+        }
+    }
+
+    return GBA_RUN_FRAME;
+}
+
+// Run from the reset vector until the program ends or an error occurs
+// Return 0 if the program ran successfully, 1 if there was an error
+int gba_run(gba_t* gba)
+{
+    gba_reset(gba);
+
+    int result;
+    do {
+        result = gba_run_frame(gba);
+    } while (result == GBA_RUN_FRAME);
+
+    return result == GBA_RUN_ERROR;
+}
+
+#endif // GBA_H_
@@ -0,0 +1,97 @@
+// Keypad input
+// The presenter thread pushes key events into a single producer / single consumer ring, and the
+// emulation thread applies them to KEYINPUT between frames. Each side only writes its own index, so
+// neither has to lock.
+
+#ifndef INPUT_H_
+#define INPUT_H_
+
+#include "memory.h"
+#include "thread.h"
+
+#include <stdint.h> // for uint16_t
+
+#define INPUT_KEYINPUT 0x130 // Key status, a bit is 0 while its key is pressed
+
+// Keys, the numbers are the KEYINPUT bits
+#define INPUT_KEY_A 0x001
+#define INPUT_KEY_B 0x002
+#define INPUT_KEY_SELECT 0x004
+#define INPUT_KEY_START 0x008
+#define INPUT_KEY_RIGHT 0x010
+#define INPUT_KEY_LEFT 0x020
+#define INPUT_KEY_UP 0x040
+#define INPUT_KEY_DOWN 0x080
+#define INPUT_KEY_R 0x100
+#define INPUT_KEY_L 0x200
+#define INPUT_KEYS 0x3FF
+
+// Events are the INPUT_KEY_* bits of the keys that changed, with INPUT_PRESSED if they went down
+#define INPUT_PRESSED 0x8000
+
+#define INPUT_QUEUE_SIZE 64 // Power of two, events beyond it are dropped until the core catches up
+
+typedef struct input_queue {
+    uint16_t events[INPUT_QUEUE_SIZE];
+    volatile uint32_t head; // Next event to write, only written by the producer
+    volatile uint32_t tail; // Next event to read, only written by the consumer
+} input_queue_t;
+
+void input_queue_init(input_queue_t* queue)
+{
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+// Producer side
+// Returns 1 if the event was queued, 0 if the queue is full
+int input_push(input_queue_t* queue, uint16_t event)
+{
+    uint32_t head = queue->head;
+    if (head - atomic_load32(&queue->tail) == INPUT_QUEUE_SIZE) {
+        return 0;
+    }
+
+    queue->events[head & (INPUT_QUEUE_SIZE - 1)] = event;
+    atomic_store32(&queue->head, head + 1);
+    return 1;
+}
+
+// Consumer side
+// Returns 1 and sets `event` if there was one, 0 if the queue is empty
+int input_pop(input_queue_t* queue, uint16_t* event)
+{
+    uint32_t tail = queue->tail;
+    if (tail == atomic_load32(&queue->head)) {
+        return 0;
+    }
+
+    *event = queue->events[tail & (INPUT_QUEUE_SIZE - 1)];
+    atomic_store32(&queue->tail, tail + 1);
+    return 1;
+}
+
+// Release every key
+void input_reset(memory_t* memory)
+{
+    memory_io_write16(memory, INPUT_KEYINPUT, INPUT_KEYS);
+}
+
+// Apply the queued events to KEYINPUT
+void input_apply(input_queue_t* queue, memory_t* memory)
+{
+    uint16_t keys = memory_io_read16(memory, INPUT_KEYINPUT);
+
+    uint16_t event;
+    while (input_pop(queue, &event)) {
+        if (event & INPUT_PRESSED) {
+            keys &= ~(event & INPUT_KEYS);
+        } else {
+            keys |= event & INPUT_KEYS;
+        }
+    }
+
+    memory_io_write16(memory, INPUT_KEYINPUT, keys);
+}
+
+#endif // INPUT_H_
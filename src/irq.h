@@ -0,0 +1,51 @@
+// Interrupt requests
+// Devices set their bit in IF, the CPU takes the interrupt when it is also enabled in IE and IME
+
+#ifndef IRQ_H_
+#define IRQ_H_
+
+#include "memory.h"
+
+#include <stdint.h> // for uint16_t
+
+// I/O register offsets
+#define IRQ_IE 0x200 // Interrupt Enable
+#define IRQ_IF 0x202 // Interrupt Request Flags
+#define IRQ_IME 0x208 // Interrupt Master Enable
+
+// IE / IF bits
+#define IRQ_VBLANK 0x0001
+#define IRQ_HBLANK 0x0002
+#define IRQ_VCOUNT 0x0004
+#define IRQ_TIMER0 0x0008
+#define IRQ_TIMER1 0x0010
+#define IRQ_TIMER2 0x0020
+#define IRQ_TIMER3 0x0040
+#define IRQ_SERIAL 0x0080
+#define IRQ_DMA0 0x0100
+#define IRQ_DMA1 0x0200
+#define IRQ_DMA2 0x0400
+#define IRQ_DMA3 0x0800
+#define IRQ_KEYPAD 0x1000
+#define IRQ_GAMEPAK 0x2000
+
+// Latch an interrupt request in IF
+static inline void irq_request(memory_t* memory, uint16_t irq)
+{
+    memory_io_write16(memory, IRQ_IF, memory_io_read16(memory, IRQ_IF) | irq);
+}
+
+// Return 1 if an interrupt requested in IF is enabled in IE, which ends Halt even when IME is off
+static inline int irq_wakeup(const memory_t* memory)
+{
+    return (memory_io_read16(memory, IRQ_IE) & memory_io_read16(memory, IRQ_IF) & 0x3FFF) != 0;
+}
+
+// Return 1 if an enabled interrupt is requested and IME lets it through, the CPU takes it unless
+// IRQs are disabled in cpsr
+static inline int irq_pending(const memory_t* memory)
+{
+    return (memory_io_read16(memory, IRQ_IME) & 0x1) && irq_wakeup(memory);
+}
+
+#endif // IRQ_H_
@@ -0,0 +1,917 @@
+// x86-64 dynamic recompiler
+// Blocks from the block cache that are replayed JIT_THRESHOLD times are compiled into native code.
+// Data processing with an immediate operand, immediate offset LDR/STR and the simple Thumb
+// arithmetic formats are compiled directly, with the bus fast paths inlined. Every other instruction
+// calls back into cpu_process_arm_instruction / cpu_process_thumb_instruction.
+//
+// Register use in compiled code:
+//   rbx        cpu_t*
+//   ebp        bus->code_writes when the block was entered (self modifying code check)
+//   r12-r15    Up to four guest registers, written back before every call into C
+//   rax-r11    Scratch
+// The bus slow handlers are called with guest registers still held in r12-r15, so they must
+// not read or write cpu->registers.
+//
+// The code memory is never writable and executable at once: the pages a block is compiled into
+// are made writable for jit_compile and executable again before the block runs, see jit_protect.
+
+#ifndef JIT_H_
+#define JIT_H_
+
+#include "block.h"
+#include "bus.h"
+#include "cpu.h"
+
+#include <stddef.h> // for offsetof
+#include <stdint.h> // for uint8_t
+#include <stdlib.h> // for malloc
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_HOST_X64 1
+#else
+#define JIT_HOST_X64 0
+#endif
+
+#ifndef GBA_JIT
+#define GBA_JIT JIT_HOST_X64
+#endif
+
+#if GBA_JIT && !JIT_HOST_X64
+#undef GBA_JIT
+#define GBA_JIT 0
+#endif
+
+#define JIT_THRESHOLD 16 // Replays before a block is compiled
+#define JIT_CODE_SIZE (4 * 1024 * 1024) // Executable memory, the JIT starts over when it is full
+#define JIT_BLOCK_MAX_CODE 16384 // More than the native code for the longest block
+#define JIT_PAGE_SIZE 4096 // Host page size, the granularity of jit_protect
+
+typedef struct jit {
+    uint8_t* code; // Code memory, see jit_protect
+    size_t used; // Bytes of code emitted so far
+} jit_t;
+
+#if GBA_JIT
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Host registers
+#define JIT_RAX 0
+#define JIT_RCX 1
+#define JIT_RDX 2
+#define JIT_RBX 3
+#define JIT_RSP 4
+#define JIT_RBP 5
+#define JIT_RSI 6
+#define JIT_RDI 7
+#define JIT_R8 8
+#define JIT_R9 9
+#define JIT_R12 12
+
+// Argument registers for calls into C
+#ifdef _WIN32
+#define JIT_ARG0 JIT_RCX
+#define JIT_ARG1 JIT_RDX
+#define JIT_ARG2 JIT_R8
+#define JIT_ARG3 JIT_R9
+#define JIT_FRAME 40 // Shadow space, a scratch slot and alignment
+#define JIT_SCRATCH 32 // Scratch slot above the shadow space
+#else
+#define JIT_ARG0 JIT_RDI
+#define JIT_ARG1 JIT_RSI
+#define JIT_ARG2 JIT_RDX
+#define JIT_ARG3 JIT_RCX
+#define JIT_FRAME 8 // A scratch slot that also aligns the stack
+#define JIT_SCRATCH 0
+#endif
+
+// x86 condition codes for jcc
+#define JIT_CC_E 0x4
+#define JIT_CC_NE 0x5
+
+// Number of guest registers that are held in host registers
+#define JIT_CACHED_REGISTERS 4
+
+// Offsets into cpu_t, r13-r15 follow r0-r12 so r[n] works for all 16 registers
+#define JIT_OFFSET_R(n) ((int32_t)(offsetof(cpu_t, registers.r) + 4 * (n)))
+#define JIT_OFFSET_PC ((int32_t)offsetof(cpu_t, registers.pc))
+#define JIT_OFFSET_FLAGS(field) ((int32_t)offsetof(cpu_t, flags.field))
+#define JIT_OFFSET_CYCLES ((int32_t)offsetof(cpu_t, cycles))
+
+typedef struct jit_emitter {
+    uint8_t* code;
+    size_t size;
+    bus_t* bus;
+    int8_t cached[16]; // Host register for each guest register, -1 if it lives in cpu->registers
+    uint8_t cached_guest[JIT_CACHED_REGISTERS]; // Guest register held in r12 + i
+    int cached_count;
+} jit_emitter_t;
+
+static inline void jit_emit8(jit_emitter_t* e, uint8_t byte)
+{
+    e->code[e->size++] = byte;
+}
+
+static inline void jit_emit32(jit_emitter_t* e, uint32_t value)
+{
+    memcpy(&e->code[e->size], &value, 4);
+    e->size += 4;
+}
+
+static inline void jit_emit64(jit_emitter_t* e, uint64_t value)
+{
+    memcpy(&e->code[e->size], &value, 8);
+    e->size += 8;
+}
+
+// REX prefix, only emitted when one of the bits is needed
+static inline void jit_rex(jit_emitter_t* e, int w, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | (((index >> 3) & 1) << 1) | ((base >> 3) & 1);
+    if (rex != 0x40) {
+        jit_emit8(e, rex);
+    }
+}
+
+// op reg, [base + disp32]
+void jit_op_mem(jit_emitter_t* e, int w, uint8_t opcode, int reg, int base, int32_t disp)
+{
+    jit_rex(e, w, reg, 0, base);
+    jit_emit8(e, opcode);
+    jit_emit8(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == JIT_RSP) {
+        jit_emit8(e, 0x24);
+    }
+    jit_emit32(e, (uint32_t)disp);
+}
+
+// op reg, [base + index], `prefix` is 0 or 0x66, `opcode2` is 0 for one byte opcodes after 0x0F
+void jit_op_index(jit_emitter_t* e, uint8_t prefix, int w, uint8_t opcode, uint8_t opcode2, int reg, int base, int index)
+{
+    if (prefix) {
+        jit_emit8(e, prefix);
+    }
+
+    // Byte stores of registers 4-7 would need a REX prefix to select spl-dil, always emit it for stores
+    uint8_t rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | (((index >> 3) & 1) << 1) | ((base >> 3) & 1);
+    if (rex != 0x40 || (opcode == 0x88 && reg >= 4)) {
+        jit_emit8(e, rex);
+    }
+
+    jit_emit8(e, opcode);
+    if (opcode2) {
+        jit_emit8(e, opcode2);
+    }
+
+    // rbp and r13 as the base need a displacement
+    if ((base & 7) == JIT_RBP) {
+        jit_emit8(e, 0x44 | ((reg & 7) << 3));
+        jit_emit8(e, ((index & 7) << 3) | (base & 7));
+        jit_emit8(e, 0);
+    } else {
+        jit_emit8(e, 0x04 | ((reg & 7) << 3));
+        jit_emit8(e, ((index & 7) << 3) | (base & 7));
+    }
+}
+
+// op dst, src (register to register)
+void jit_op_reg(jit_emitter_t* e, int w, uint8_t opcode, int src, int dst)
+{
+    jit_rex(e, w, src, 0, dst);
+    jit_emit8(e, opcode);
+    jit_emit8(e, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// Group 1 ALU operation with an immediate: /0 add, /1 or, /4 and, /5 sub, /6 xor, /7 cmp
+void jit_alu_imm(jit_emitter_t* e, int w, int ext, int dst, uint32_t imm)
+{
+    jit_rex(e, w, 0, 0, dst);
+    jit_emit8(e, 0x81);
+    jit_emit8(e, 0xC0 | (ext << 3) | (dst & 7));
+    jit_emit32(e, imm);
+}
+
+// Shift by an immediate: /4 shl, /5 shr
+void jit_shift_imm(jit_emitter_t* e, int w, int ext, int dst, uint8_t amount)
+{
+    jit_rex(e, w, 0, 0, dst);
+    jit_emit8(e, 0xC1);
+    jit_emit8(e, 0xC0 | (ext << 3) | (dst & 7));
+    jit_emit8(e, amount);
+}
+
+void jit_mov_imm32(jit_emitter_t* e, int dst, uint32_t imm)
+{
+    jit_rex(e, 0, 0, 0, dst);
+    jit_emit8(e, 0xB8 + (dst & 7));
+    jit_emit32(e, imm);
+}
+
+void jit_mov_imm64(jit_emitter_t* e, int dst, uint64_t imm)
+{
+    jit_rex(e, 1, 0, 0, dst);
+    jit_emit8(e, 0xB8 + (dst & 7));
+    jit_emit64(e, imm);
+}
+
+// mov dword [base + disp], imm32
+void jit_store_imm32(jit_emitter_t* e, int base, int32_t disp, uint32_t imm)
+{
+    jit_op_mem(e, 0, 0xC7, 0, base, disp);
+    jit_emit32(e, imm);
+}
+
+// Group 1 operation on a byte in memory with an imm8: /0 add, /1 or, /7 cmp
+void jit_alu_mem8(jit_emitter_t* e, uint8_t opcode, int ext, int base, int32_t disp, uint8_t imm)
+{
+    jit_op_mem(e, 0, opcode, ext, base, disp);
+    jit_emit8(e, imm);
+}
+
+// add qword [cpu->cycles], cycles
+void jit_add_cycles(jit_emitter_t* e, uint32_t cycles)
+{
+    if (cycles != 0) {
+        jit_op_mem(e, 1, 0x81, 0, JIT_RBX, JIT_OFFSET_CYCLES);
+        jit_emit32(e, cycles);
+    }
+}
+
+void jit_call(jit_emitter_t* e, const void* function)
+{
+    jit_mov_imm64(e, JIT_RAX, (uint64_t)(uintptr_t)function);
+    jit_emit8(e, 0xFF);
+    jit_emit8(e, 0xD0); // call rax
+}
+
+// Emit a jcc/jmp with a 32 bit displacement and return the offset to patch
+size_t jit_jump(jit_emitter_t* e, int cc)
+{
+    if (cc < 0) {
+        jit_emit8(e, 0xE9);
+    } else {
+        jit_emit8(e, 0x0F);
+        jit_emit8(e, 0x80 | cc);
+    }
+    jit_emit32(e, 0);
+    return e->size - 4;
+}
+
+// Point a jump emitted by jit_jump at the current position
+void jit_patch(jit_emitter_t* e, size_t at)
+{
+    int32_t rel = (int32_t)(e->size - (at + 4));
+    memcpy(&e->code[at], &rel, 4);
+}
+
+// Guest register access
+void jit_load_guest(jit_emitter_t* e, int host, int guest)
+{
+    if (e->cached[guest] >= 0) {
+        jit_op_reg(e, 0, 0x89, e->cached[guest], host);
+    } else {
+        jit_op_mem(e, 0, 0x8B, host, JIT_RBX, JIT_OFFSET_R(guest));
+    }
+}
+
+void jit_store_guest(jit_emitter_t* e, int guest, int host)
+{
+    if (e->cached[guest] >= 0) {
+        jit_op_reg(e, 0, 0x89, host, e->cached[guest]);
+    } else {
+        jit_op_mem(e, 0, 0x89, host, JIT_RBX, JIT_OFFSET_R(guest));
+    }
+}
+
+// Write the cached guest registers back to cpu->registers
+void jit_spill(jit_emitter_t* e)
+{
+    for (int i = 0; i < e->cached_count; i++) {
+        jit_op_mem(e, 0, 0x89, JIT_R12 + i, JIT_RBX, JIT_OFFSET_R(e->cached_guest[i]));
+    }
+}
+
+// Load the cached guest registers from cpu->registers
+void jit_reload(jit_emitter_t* e)
+{
+    for (int i = 0; i < e->cached_count; i++) {
+        jit_op_mem(e, 0, 0x8B, JIT_R12 + i, JIT_RBX, JIT_OFFSET_R(e->cached_guest[i]));
+    }
+}
+
+// Hold the guest register in a host register if one is free
+void jit_cache_guest(jit_emitter_t* e, int guest)
+{
+    if (e->cached[guest] < 0 && e->cached_count < JIT_CACHED_REGISTERS) {
+        e->cached[guest] = (int8_t)(JIT_R12 + e->cached_count);
+        e->cached_guest[e->cached_count++] = (uint8_t)guest;
+    }
+}
+
+// Compare bus->code_writes with the value on entry, and return the jne to patch
+size_t jit_check_code_writes(jit_emitter_t* e)
+{
+    jit_mov_imm64(e, JIT_RAX, (uint64_t)(uintptr_t)&e->bus->code_writes);
+    jit_op_mem(e, 0, 0x39, JIT_RBP, JIT_RAX, 0); // cmp [rax], ebp
+    return jit_jump(e, JIT_CC_NE);
+}
+
+// Compute &table[BUS_PAGE_INDEX(eax)] into rdx
+void jit_emit_page(jit_emitter_t* e, const bus_page_t* table)
+{
+    jit_op_reg(e, 0, 0x89, JIT_RAX, JIT_RCX); // mov ecx, eax
+    jit_alu_imm(e, 0, 4, JIT_RCX, BUS_END - 1); // and ecx, BUS_END - 1
+    jit_shift_imm(e, 0, 5, JIT_RCX, BUS_PAGE_SHIFT); // shr ecx, BUS_PAGE_SHIFT
+    jit_shift_imm(e, 1, 4, JIT_RCX, 4); // shl rcx, 4 (sizeof(bus_page_t))
+    jit_mov_imm64(e, JIT_RDX, (uint64_t)(uintptr_t)table);
+    jit_op_reg(e, 1, 0x01, JIT_RCX, JIT_RDX); // add rdx, rcx
+    jit_op_mem(e, 1, 0x8B, JIT_R8, JIT_RDX, offsetof(bus_page_t, base)); // mov r8, [rdx].base
+    jit_op_reg(e, 1, 0x85, JIT_R8, JIT_R8); // test r8, r8
+}
+
+// Inline bus read, the address is in eax and the value is returned in eax
+void jit_emit_read(jit_emitter_t* e, int size)
+{
+    if (size > 1) {
+        jit_alu_imm(e, 0, 4, JIT_RAX, ~(uint32_t)(size - 1));
+    }
+
+    jit_emit_page(e, e->bus->read);
+    size_t slow = jit_jump(e, JIT_CC_E);
+
+    // Fast path, base[address & mask]
+    jit_op_reg(e, 0, 0x89, JIT_RAX, JIT_RCX);
+    jit_op_mem(e, 0, 0x23, JIT_RCX, JIT_RDX, offsetof(bus_page_t, mask)); // and ecx, [rdx].mask
+    if (size == 1) {
+        jit_op_index(e, 0, 0, 0x0F, 0xB6, JIT_RAX, JIT_R8, JIT_RCX); // movzx eax, byte [r8 + rcx]
+    } else {
+        jit_op_index(e, 0, 0, 0x8B, 0, JIT_RAX, JIT_R8, JIT_RCX); // mov eax, [r8 + rcx]
+    }
+    size_t done = jit_jump(e, -1);
+
+    // Slow path, bus_read_slow(bus, address, size)
+    jit_patch(e, slow);
+    jit_op_reg(e, 0, 0x89, JIT_RAX, JIT_ARG1);
+    jit_mov_imm64(e, JIT_ARG0, (uint64_t)(uintptr_t)e->bus);
+    jit_mov_imm32(e, JIT_ARG2, (uint32_t)size);
+    jit_call(e, (const void*)bus_read_slow);
+
+    jit_patch(e, done);
+}
+
+// Inline bus write, the address is in eax and the value in r9d
+void jit_emit_write(jit_emitter_t* e, int size)
+{
+    if (size > 1) {
+        jit_alu_imm(e, 0, 4, JIT_RAX, ~(uint32_t)(size - 1));
+    }
+
+    jit_emit_page(e, e->bus->write);
+    size_t slow = jit_jump(e, JIT_CC_E);
+
+    // Fast path, base[address & mask] = value
+    jit_op_reg(e, 0, 0x89, JIT_RAX, JIT_RCX);
+    jit_op_mem(e, 0, 0x23, JIT_RCX, JIT_RDX, offsetof(bus_page_t, mask));
+    if (size == 1) {
+        jit_op_index(e, 0, 0, 0x88, 0, JIT_R9, JIT_R8, JIT_RCX); // mov [r8 + rcx], r9b
+    } else {
+        jit_op_index(e, 0, 0, 0x89, 0, JIT_R9, JIT_R8, JIT_RCX); // mov [r8 + rcx], r9d
+    }
+
+    // Watched pages also go through bus_write_watched(bus, address)
+    jit_alu_mem8(e, 0x83, 7, JIT_RDX, offsetof(bus_page_t, watch), 0); // cmp dword [rdx].watch, 0
+    size_t unwatched = jit_jump(e, JIT_CC_E);
+    jit_op_reg(e, 0, 0x89, JIT_RAX, JIT_ARG1);
+    jit_mov_imm64(e, JIT_ARG0, (uint64_t)(uintptr_t)e->bus);
+    jit_call(e, (const void*)bus_write_watched);
+    size_t done = jit_jump(e, -1);
+
+    // Slow path, bus_write_slow(bus, address, value, size)
+    jit_patch(e, slow);
+    jit_op_reg(e, 0, 0x89, JIT_RAX, JIT_ARG1);
+    jit_op_reg(e, 0, 0x89, JIT_R9, JIT_ARG2);
+    jit_mov_imm32(e, JIT_ARG3, (uint32_t)size);
+    jit_mov_imm64(e, JIT_ARG0, (uint64_t)(uintptr_t)e->bus);
+    jit_call(e, (const void*)bus_write_slow);
+
+    jit_patch(e, unwatched);
+    jit_patch(e, done);
+}
+
+// Record NZ of eax for a logical operation, see cpu_set_flags_logical
+void jit_emit_flags_logical(jit_emitter_t* e)
+{
+    jit_op_mem(e, 0, 0x89, JIT_RAX, JIT_RBX, JIT_OFFSET_FLAGS(result));
+    jit_alu_mem8(e, 0x80, 1, JIT_RBX, JIT_OFFSET_FLAGS(pending), CPU_FLAGS_NZ);
+}
+
+// Record NZCV for eax = op1 + op2 + carry_in with op1 in ecx and op2 in edx, see cpu_flags_add
+void jit_emit_flags_add(jit_emitter_t* e, uint32_t carry_in)
+{
+    jit_op_mem(e, 0, 0x89, JIT_RAX, JIT_RBX, JIT_OFFSET_FLAGS(result));
+    jit_op_mem(e, 0, 0x89, JIT_RCX, JIT_RBX, JIT_OFFSET_FLAGS(op1));
+    jit_op_mem(e, 0, 0x89, JIT_RDX, JIT_RBX, JIT_OFFSET_FLAGS(op2));
+    jit_store_imm32(e, JIT_RBX, JIT_OFFSET_FLAGS(carry_in), carry_in);
+    jit_op_mem(e, 0, 0xC6, 0, JIT_RBX, JIT_OFFSET_FLAGS(pending));
+    jit_emit8(e, CPU_FLAGS_NZ | CPU_FLAGS_CV);
+}
+
+// eax = op1 + op2 + carry_in with op1 in ecx and op2 in edx, recording flags if `s` is set
+void jit_emit_add(jit_emitter_t* e, uint32_t carry_in, int s)
+{
+    jit_op_reg(e, 0, 0x89, JIT_RCX, JIT_RAX);
+    jit_op_reg(e, 0, 0x01, JIT_RDX, JIT_RAX);
+    if (carry_in) {
+        jit_alu_imm(e, 0, 0, JIT_RAX, carry_in);
+    }
+    if (s) {
+        jit_emit_flags_add(e, carry_in);
+    }
+}
+
+// Return 1 if the ARM instruction is compiled natively rather than through the interpreter
+int jit_arm_native(cpu_arm_instruction_t instruction)
+{
+    cpu_arm_handler_t handler = cpu_arm_table[CPU_ARM_TABLE_INDEX(instruction)];
+    uint8_t rn = (instruction >> 16) & 0xF;
+    uint8_t rd = (instruction >> 12) & 0xF;
+
+    if ((instruction >> 28) != 0xE || rn == 15) {
+        return 0;
+    }
+
+    // Data processing with an immediate operand, except the ones that read the carry flag
+    if (((instruction >> 25) & 0x7) == 0x1) {
+        uint8_t opcode = (instruction >> 21) & 0xF;
+        uint8_t s = (instruction >> 20) & 0x1;
+        if (handler != cpu_arm_data_processing_handlers[CPU_ARM_OPERAND_IMM][opcode][s]) {
+            return 0; // PSR transfer
+        }
+        if (opcode == 0x5 || opcode == 0x6 || opcode == 0x7) {
+            return 0; // ADC, SBC, RSC
+        }
+        if (s && CPU_ARM_LOGICAL(opcode) && ((instruction >> 8) & 0xF) != 0) {
+            return 0; // Takes C from the rotated immediate
+        }
+        return rd != 15 || (opcode >= 0x8 && opcode <= 0xB);
+    }
+
+    // Single data transfer with an immediate offset
+    if (((instruction >> 25) & 0x7) == 0x2) {
+        return rd != 15;
+    }
+
+    return 0;
+}
+
+// Return 1 if the Thumb instruction is compiled natively rather than through the interpreter
+int jit_thumb_native(cpu_thumb_instruction_t instruction)
+{
+    cpu_thumb_handler_t handler = cpu_thumb_table[CPU_THUMB_TABLE_INDEX(instruction)];
+
+    return handler == cpu_thumb_add_subtract || handler == cpu_thumb_mov_immediate
+        || handler == cpu_thumb_cmp_immediate || handler == cpu_thumb_add_immediate
+        || handler == cpu_thumb_sub_immediate;
+}
+
+// Data processing with an immediate operand, see cpu_arm_and and friends
+void jit_emit_arm_data_processing(jit_emitter_t* e, cpu_arm_instruction_t instruction)
+{
+    uint8_t opcode = (instruction >> 21) & 0xF;
+    uint8_t s = (instruction >> 20) & 0x1;
+    uint8_t rn = (instruction >> 16) & 0xF;
+    uint8_t rd = (instruction >> 12) & 0xF;
+    uint32_t src2 = rotr32(instruction & 0xFF, ((instruction >> 8) & 0xF) * 2);
+    int write = 1;
+
+    switch (opcode) {
+    case 0x0: // AND
+    case 0x8: // TST
+    case 0xE: // BIC
+        jit_load_guest(e, JIT_RAX, rn);
+        jit_alu_imm(e, 0, 4, JIT_RAX, opcode == 0xE ? ~src2 : src2);
+        if (s) {
+            jit_emit_flags_logical(e);
+        }
+        write = opcode != 0x8;
+        break;
+    case 0x1: // EOR
+    case 0x9: // TEQ
+        jit_load_guest(e, JIT_RAX, rn);
+        jit_alu_imm(e, 0, 6, JIT_RAX, src2);
+        if (s) {
+            jit_emit_flags_logical(e);
+        }
+        write = opcode != 0x9;
+        break;
+    case 0xC: // ORR
+        jit_load_guest(e, JIT_RAX, rn);
+        jit_alu_imm(e, 0, 1, JIT_RAX, src2);
+        if (s) {
+            jit_emit_flags_logical(e);
+        }
+        break;
+    case 0xD: // MOV
+    case 0xF: // MVN
+        jit_mov_imm32(e, JIT_RAX, opcode == 0xF ? ~src2 : src2);
+        if (s) {
+            jit_emit_flags_logical(e);
+        }
+        break;
+    case 0x2: // SUB
+    case 0xA: // CMP
+        jit_load_guest(e, JIT_RCX, rn);
+        jit_mov_imm32(e, JIT_RDX, ~src2);
+        jit_emit_add(e, 1, s);
+        write = opcode != 0xA;
+        break;
+    case 0x3: // RSB
+        jit_mov_imm32(e, JIT_RCX, src2);
+        jit_load_guest(e, JIT_RDX, rn);
+        jit_emit8(e, 0xF7);
+        jit_emit8(e, 0xD2); // not edx
+        jit_emit_add(e, 1, s);
+        break;
+    default: // ADD, CMN
+        jit_load_guest(e, JIT_RCX, rn);
+        jit_mov_imm32(e, JIT_RDX, src2);
+        jit_emit_add(e, 0, s);
+        write = opcode != 0xB;
+        break;
+    }
+
+    if (write) {
+        jit_store_guest(e, rd, JIT_RAX);
+    }
+}
+
+// Single data transfer with an immediate offset, see cpu_arm_single_data_transfer
+// Returns 1 if the instruction stored to memory
+int jit_emit_arm_single_data_transfer(jit_emitter_t* e, cpu_arm_instruction_t instruction)
+{
+    uint8_t p = (instruction >> 24) & 0x1;
+    uint8_t u = (instruction >> 23) & 0x1;
+    uint8_t b = (instruction >> 22) & 0x1;
+    uint8_t w = (instruction >> 21) & 0x1;
+    uint8_t l = (instruction >> 20) & 0x1;
+    uint8_t rn = (instruction >> 16) & 0xF;
+    uint8_t rd = (instruction >> 12) & 0xF;
+    uint32_t offset = u ? (instruction & 0xFFF) : -(instruction & 0xFFF);
+
+    // The address is kept in the scratch slot, the bus may call into C
+    jit_load_guest(e, JIT_RAX, rn);
+    if (p) {
+        jit_alu_imm(e, 0, 0, JIT_RAX, offset);
+    }
+    jit_op_mem(e, 0, 0x89, JIT_RAX, JIT_RSP, JIT_SCRATCH);
+
+    if (l) {
+        jit_emit_read(e, b ? 1 : 4);
+        jit_store_guest(e, rd, JIT_RAX);
+    } else {
+        jit_load_guest(e, JIT_R9, rd);
+        jit_emit_write(e, b ? 1 : 4);
+    }
+
+    // Writeback
+    if (w || !p) {
+        jit_op_mem(e, 0, 0x8B, JIT_RAX, JIT_RSP, JIT_SCRATCH);
+        if (!p) {
+            jit_alu_imm(e, 0, 0, JIT_RAX, offset);
+        }
+        jit_store_guest(e, rn, JIT_RAX);
+    }
+
+    return !l;
+}
+
+// Thumb arithmetic, see cpu_thumb_add_subtract and cpu_thumb_mov_immediate and friends
+void jit_emit_thumb(jit_emitter_t* e, cpu_thumb_instruction_t instruction)
+{
+    cpu_thumb_handler_t handler = cpu_thumb_table[CPU_THUMB_TABLE_INDEX(instruction)];
+
+    if (handler == cpu_thumb_add_subtract) {
+        uint8_t i = (instruction >> 10) & 0x1;
+        uint8_t op = (instruction >> 9) & 0x1;
+        uint8_t rn_or_offset3 = (instruction >> 6) & 0x7;
+        uint8_t rs = (instruction >> 3) & 0x7;
+        uint8_t rd = (instruction >> 0) & 0x7;
+
+        jit_load_guest(e, JIT_RCX, rs);
+        if (i) {
+            jit_mov_imm32(e, JIT_RDX, rn_or_offset3);
+        } else {
+            jit_load_guest(e, JIT_RDX, rn_or_offset3);
+        }
+        if (op) {
+            jit_emit8(e, 0xF7);
+            jit_emit8(e, 0xD2); // not edx
+        }
+        jit_emit_add(e, op, 1);
+        jit_store_guest(e, rd, JIT_RAX);
+        return;
+    }
+
+    uint8_t rd = (instruction >> 8) & 0x7;
+    uint8_t offset8 = (instruction >> 0) & 0xFF;
+
+    if (handler == cpu_thumb_mov_immediate) {
+        jit_mov_imm32(e, JIT_RAX, offset8);
+        jit_emit_flags_logical(e);
+        jit_store_guest(e, rd, JIT_RAX);
+        return;
+    }
+
+    // ADD, SUB and CMP
+    int sub = handler != cpu_thumb_add_immediate;
+    jit_load_guest(e, JIT_RCX, rd);
+    jit_mov_imm32(e, JIT_RDX, sub ? ~(uint32_t)offset8 : offset8);
+    jit_emit_add(e, sub, 1);
+    if (handler != cpu_thumb_cmp_immediate) {
+        jit_store_guest(e, rd, JIT_RAX);
+    }
+}
+
+// Hold the registers a natively compiled Thumb instruction uses in host registers, see jit_emit_thumb
+void jit_cache_thumb(jit_emitter_t* e, cpu_thumb_instruction_t instruction)
+{
+    cpu_thumb_handler_t handler = cpu_thumb_table[CPU_THUMB_TABLE_INDEX(instruction)];
+
+    if (handler == cpu_thumb_add_subtract) {
+        jit_cache_guest(e, instruction & 0x7);
+        jit_cache_guest(e, (instruction >> 3) & 0x7);
+        if (((instruction >> 10) & 0x1) == 0) {
+            jit_cache_guest(e, (instruction >> 6) & 0x7);
+        }
+        return;
+    }
+
+    // MOV, CMP, ADD and SUB with an 8 bit immediate
+    jit_cache_guest(e, (instruction >> 8) & 0x7);
+}
+
+// Compile a block into `code`
+// Returns the size of the code
+size_t jit_compile(bus_t* bus, block_t* block, uint8_t* code)
+{
+    jit_emitter_t emitter;
+    jit_emitter_t* e = &emitter;
+    e->code = code;
+    e->size = 0;
+    e->bus = bus;
+    e->cached_count = 0;
+    memset(e->cached, -1, sizeof(e->cached));
+
+    int step = block->thumb ? 2 : 4;
+
+    // Hold the registers of the first natively compiled instructions in host registers
+    for (int i = 0; i < block->count; i++) {
+        uint32_t instruction = block->ops[i].instruction;
+
+        if (block->ops[i].length > 1) {
+            continue;
+        }
+        if (block->thumb && jit_thumb_native((cpu_thumb_instruction_t)instruction)) {
+            jit_cache_thumb(e, (cpu_thumb_instruction_t)instruction);
+        } else if (!block->thumb && jit_arm_native(instruction)) {
+            jit_cache_guest(e, (instruction >> 16) & 0xF);
+            jit_cache_guest(e, (instruction >> 12) & 0xF);
+        }
+    }
+
+    // Prologue, save the callee saved registers and keep the stack 16 byte aligned for calls
+    static const uint8_t saved[] = { JIT_RBX, JIT_RBP, 12, 13, 14, 15 };
+    for (int i = 0; i < 6; i++) {
+        jit_rex(e, 0, 0, 0, saved[i]);
+        jit_emit8(e, 0x50 + (saved[i] & 7)); // push
+    }
+    jit_emit8(e, 0x48);
+    jit_emit8(e, 0x83);
+    jit_emit8(e, 0xEC);
+    jit_emit8(e, JIT_FRAME); // sub rsp, JIT_FRAME
+    jit_op_reg(e, 1, 0x89, JIT_ARG0, JIT_RBX); // mov rbx, cpu
+    jit_mov_imm64(e, JIT_RAX, (uint64_t)(uintptr_t)&bus->code_writes);
+    jit_op_mem(e, 0, 0x8B, JIT_RBP, JIT_RAX, 0); // mov ebp, [code_writes]
+    jit_reload(e);
+
+    // Jumps to the exits, patched at the end
+    size_t branch_exits[BLOCK_MAX_OPS]; // Interpreted instruction changed the PC
+    int branch_count = 0;
+    size_t write_exits[BLOCK_MAX_OPS]; // Interpreted instruction overwrote code
+    int write_count = 0;
+    size_t store_exits[BLOCK_MAX_OPS]; // Native store overwrote code
+    uint32_t store_pcs[BLOCK_MAX_OPS];
+    uint32_t store_cycles[BLOCK_MAX_OPS];
+    int store_count = 0;
+
+    // Cycles of the native instructions since cpu->cycles was last updated
+    uint32_t cycles = 0;
+    size_t epilogue_jumps[BLOCK_MAX_OPS * 2]; // Jumps to the epilogue with the result in eax
+    int epilogue_count = 0;
+
+    uint32_t pc = block->pc;
+    for (int i = 0; i < block->count; i++, pc += step) {
+        const block_op_t* op = &block->ops[i];
+        uint32_t instruction = op->instruction;
+        cycles += op->cycles;
+
+        if (op->length == 1 && (block->thumb ? jit_thumb_native((cpu_thumb_instruction_t)instruction) : jit_arm_native(instruction))) {
+            if (block->thumb) {
+                jit_emit_thumb(e, (cpu_thumb_instruction_t)instruction);
+            } else if (((instruction >> 25) & 0x7) == 0x1) {
+                jit_emit_arm_data_processing(e, instruction);
+            } else if (jit_emit_arm_single_data_transfer(e, instruction)) {
+                // A store may have overwritten decoded code, the exit is emitted after the block
+                store_exits[store_count] = jit_check_code_writes(e);
+                store_cycles[store_count] = cycles;
+                store_pcs[store_count++] = pc + step;
+            }
+            continue;
+        }
+
+        // Everything else goes through the interpreter, which reads and writes cpu->registers
+        // A fused pair calls its handler, which leaves the PC at its second instruction
+        jit_add_cycles(e, cycles);
+        cycles = 0;
+        jit_spill(e);
+        jit_store_imm32(e, JIT_RBX, JIT_OFFSET_PC, pc);
+        jit_op_reg(e, 1, 0x89, JIT_RBX, JIT_ARG0);
+        jit_mov_imm32(e, JIT_ARG1, instruction);
+        jit_call(e, op->length > 1 ? (const void*)op->handler.pair
+                : block->thumb     ? (const void*)cpu_process_thumb_instruction
+                                   : (const void*)cpu_process_arm_instruction);
+        jit_op_reg(e, 0, 0x85, JIT_RAX, JIT_RAX); // test eax, eax
+        epilogue_jumps[epilogue_count++] = jit_jump(e, JIT_CC_E);
+        pc += (op->length - 1) * step;
+
+        // Leave when the instruction changed the PC or overwrote decoded code
+        jit_op_mem(e, 0, 0x81, 7, JIT_RBX, JIT_OFFSET_PC); // cmp dword [pc], imm32
+        jit_emit32(e, pc);
+        branch_exits[branch_count++] = jit_jump(e, JIT_CC_NE);
+        write_exits[write_count++] = jit_check_code_writes(e);
+        jit_reload(e);
+    }
+
+    // End of the block, PC is the instruction after it
+    jit_add_cycles(e, cycles);
+    jit_spill(e);
+    jit_store_imm32(e, JIT_RBX, JIT_OFFSET_PC, pc);
+    jit_mov_imm32(e, JIT_RAX, 1);
+    epilogue_jumps[epilogue_count++] = jit_jump(e, -1);
+
+    // A native store overwrote code, the guest registers are still in host registers
+    for (int i = 0; i < store_count; i++) {
+        jit_patch(e, store_exits[i]);
+        jit_add_cycles(e, store_cycles[i]);
+        jit_spill(e);
+        jit_store_imm32(e, JIT_RBX, JIT_OFFSET_PC, store_pcs[i]);
+        jit_mov_imm32(e, JIT_RAX, 1);
+        epilogue_jumps[epilogue_count++] = jit_jump(e, -1);
+    }
+
+    // The interpreter changed the PC or overwrote code, step past the instruction like cpu_step does
+    for (int i = 0; i < branch_count; i++) {
+        jit_patch(e, branch_exits[i]);
+    }
+    jit_add_cycles(e, CPU_CYCLES_REFILL);
+    for (int i = 0; i < write_count; i++) {
+        jit_patch(e, write_exits[i]);
+    }
+    jit_alu_mem8(e, 0x83, 0, JIT_RBX, JIT_OFFSET_PC, (uint8_t)step); // add dword [pc], step
+    jit_mov_imm32(e, JIT_RAX, 1);
+
+    // Epilogue, eax holds the result (0 when an interpreted instruction failed)
+    for (int i = 0; i < epilogue_count; i++) {
+        jit_patch(e, epilogue_jumps[i]);
+    }
+    jit_emit8(e, 0x48);
+    jit_emit8(e, 0x83);
+    jit_emit8(e, 0xC4);
+    jit_emit8(e, JIT_FRAME); // add rsp, JIT_FRAME
+    for (int i = 5; i >= 0; i--) {
+        jit_rex(e, 0, 0, 0, saved[i]);
+        jit_emit8(e, 0x58 + (saved[i] & 7)); // pop
+    }
+    jit_emit8(e, 0xC3); // ret
+
+    return e->size;
+}
+
+// Make the pages covering [start, start + size) of the code memory writable, or executable with
+// `executable` set, the two are exclusive
+// Returns 0 on success, 1 if the protection could not be changed
+static int jit_protect(jit_t* jit, size_t start, size_t size, int executable)
+{
+    size_t first = start & ~(size_t)(JIT_PAGE_SIZE - 1);
+    size_t end = (start + size + JIT_PAGE_SIZE - 1) & ~(size_t)(JIT_PAGE_SIZE - 1);
+    if (end > JIT_CODE_SIZE) {
+        end = JIT_CODE_SIZE;
+    }
+
+#ifdef _WIN32
+    DWORD old;
+    return !VirtualProtect(jit->code + first, end - first, executable ? PAGE_EXECUTE_READ : PAGE_READWRITE, &old);
+#else
+    return mprotect(jit->code + first, end - first, executable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE) != 0;
+#endif
+}
+
+#endif // GBA_JIT
+
+// Allocate the code memory, writable until the first block is compiled into it
+// Returns NULL when the JIT is not built or the memory could not be allocated
+jit_t* jit_create(void)
+{
+#if GBA_JIT
+    jit_t* jit = (jit_t*)malloc(sizeof(jit_t));
+    if (jit == NULL) {
+        return NULL;
+    }
+
+#ifdef _WIN32
+    jit->code = (uint8_t*)VirtualAlloc(NULL, JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    jit->code = (uint8_t*)mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        jit->code = NULL;
+    }
+#endif
+
+    if (jit->code == NULL) {
+        free(jit);
+        return NULL;
+    }
+
+    jit->used = 0;
+    return jit;
+#else
+    return NULL;
+#endif
+}
+
+void jit_destroy(jit_t* jit)
+{
+    if (jit == NULL) {
+        return;
+    }
+
+#if GBA_JIT
+#ifdef _WIN32
+    VirtualFree(jit->code, 0, MEM_RELEASE);
+#else
+    munmap(jit->code, JIT_CODE_SIZE);
+#endif
+#endif
+
+    free(jit);
+}
+
+// Execute the block at PC, compiling it once it is hot
+// Return 1 if the instructions were executed, 0 if there was an error
+int jit_execute(jit_t* jit, block_cache_t* cache, cpu_t* cpu)
+{
+    block_t* block = block_lookup(cache, cpu);
+    if (block == NULL) {
+        return cpu_step(cpu);
+    }
+
+#if GBA_JIT
+    if (block->native != NULL) {
+        return block->native(cpu);
+    }
+
+    if (++block->hits >= JIT_THRESHOLD) {
+        // Start over when the code memory is full, every compiled block is dropped
+        if (jit->used + JIT_BLOCK_MAX_CODE > JIT_CODE_SIZE) {
+            for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+                cache->blocks[i].native = NULL;
+                cache->blocks[i].hits = 0;
+            }
+            jit->used = 0;
+        }
+
+        // The block stays interpreted if its pages cannot be switched
+        uint8_t* code = jit->code + jit->used;
+        if (jit_protect(jit, jit->used, JIT_BLOCK_MAX_CODE, 0)) {
+            return block_replay(cpu, block);
+        }
+        size_t size = jit_compile(cpu->bus, block, code);
+        if (jit_protect(jit, jit->used, size, 1)) {
+            return block_replay(cpu, block);
+        }
+        jit->used += (size + 15) & ~(size_t)15;
+        block->native = (block_native_t)code;
+        return block->native(cpu);
+    }
+#else
+    (void)jit;
+#endif
+
+    return block_replay(cpu, block);
+}
+
+#endif // JIT_H_
@@ -1,118 +1,422 @@
+#include <SDL.h>
 #include <stdio.h>
-#include <windows.h>
 
-#include "cpu.h"
+#include "frames.h"
+#include "gba.h"
+#include "input.h"
+#include "rewind.h"
+#include "state.h"
+#include "thread.h"
+#include "turbo.h"
 
-// Function prototype
-LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+#define MAIN_SCALE 3 // Initial window size in GBA pixels
+#define MAIN_AUDIO_RATE 48000
+#define MAIN_AUDIO_FRAMES 1024 // Frames the audio device asks for at a time
 
-int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
+// Requests from the presenter to the emulation thread, carried out between two frames
+#define MAIN_COMMAND_NONE 0
+#define MAIN_COMMAND_SAVE 1 // Save the quick state
+#define MAIN_COMMAND_LOAD 2 // Load the quick state
+
+// Time between two GBA frames, about 16.74 ms
+#define MAIN_FRAME_NS ((uint64_t)PPU_FRAME_CYCLES * 1000000000 / GBA_CYCLES_PER_SECOND)
+
+// State shared by the presenter and the emulation thread
+typedef struct app {
+    gba_t gba; // Only touched by the emulation thread once it has started
+    frames_t frames;
+    input_queue_t input;
+    audio_ring_t audio; // Samples from the emulation thread to the audio callback
+    volatile uint32_t stop; // Set by the presenter to end the emulation thread
+    volatile uint32_t command; // MAIN_COMMAND_*, taken by the emulation thread
+    void* state; // GBA_STATE_SIZE bytes, the quick state
+    int saved; // 1 once the quick state holds a state, emulation thread only
+    volatile uint32_t rewinding; // 1 while the presenter holds the rewind key
+    volatile uint32_t fast_forward; // 1 while the presenter holds the fast forward key
+    turbo_t turbo; // Emulation thread only
+    rewind_t rewind; // Emulation thread only
+    SDL_Texture* textures[3]; // Streaming texture behind each frame buffer
+} app_t;
+
+// Lock texture `index` and make its pixels frame buffer `index`
+// Returns 0 on success, 1 if the texture could not be locked
+static int main_lock(app_t* app, uint32_t index)
+{
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(app->textures[index], NULL, &pixels, &pitch)) {
+        return 1;
+    }
+
+    frames_set_buffer(&app->frames, index, (uint32_t*)pixels, (uint32_t)pitch / sizeof(uint32_t));
+    return 0;
+}
+
+// Point the PPU at the emulation thread's back buffer
+static void main_attach(app_t* app)
+{
+    frames_t* frames = &app->frames;
+    ppu_set_framebuffer(&app->gba.ppu, frames->buffers[frames->back], frames->pitch[frames->back]);
+}
+
+// Audio device callback, runs on SDL's audio thread
+static void main_play(void* userdata, Uint8* stream, int length)
+{
+    app_t* app = (app_t*)userdata;
+    audio_ring_read(&app->audio, (uint32_t*)stream, (uint32_t)length / sizeof(uint32_t));
+}
+
+// Emulation thread, runs frames at the GBA refresh rate until the window closes or the program ends
+// The thread never waits for the presenter, frames that are not shown in time are replaced
+// Frames are skipped when the host falls behind, and while fast forwarding the thread runs as fast
+// as it can and only draws about as many frames as at normal speed, see turbo.h
+static int main_emulate(void* argument)
+{
+    app_t* app = (app_t*)argument;
+    gba_t* gba = &app->gba;
+
+    gba_reset(gba);
+    turbo_init(&app->turbo, 0, TURBO_MAX_SKIP);
+    int fast = 0;
+
+    int result = GBA_RUN_FRAME;
+    uint64_t deadline = thread_time_ns();
+    while (!atomic_load32(&app->stop)) {
+        uint32_t command = atomic_exchange32(&app->command, MAIN_COMMAND_NONE);
+        if (command == MAIN_COMMAND_SAVE) {
+            app->saved = !gba_save_state(gba, app->state, GBA_STATE_SIZE);
+        } else if (command == MAIN_COMMAND_LOAD && app->saved) {
+            gba_load_state(gba, app->state, GBA_STATE_SIZE);
+        }
+
+        // While rewinding, each frame goes back to the previous snapshot and plays one frame from it
+        int rewinding = atomic_load32(&app->rewinding) != 0;
+        if (rewinding) {
+            rewind_step(&app->rewind, gba);
+        }
+
+        // Going in or out of fast forward starts the skip ratio and the audio speed over
+        if ((atomic_load32(&app->fast_forward) != 0) != fast) {
+            fast = !fast;
+            turbo_init(&app->turbo, 0, TURBO_MAX_SKIP);
+            audio_set_speed(&gba->audio, 1);
+            deadline = thread_time_ns();
+        }
+
+        input_apply(&app->input, gba->memory);
+
+        // A skipped frame runs without a framebuffer, so the PPU only keeps its timing
+        int draw = turbo_draw(&app->turbo);
+        if (draw) {
+            main_attach(app);
+        } else {
+            ppu_set_framebuffer(&gba->ppu, NULL, 0);
+        }
+
+        result = gba_run_frame(gba);
+        if (result != GBA_RUN_FRAME) {
+            break;
+        }
+        if (!rewinding) {
+            rewind_frame(&app->rewind, gba);
+        }
+
+        if (draw) {
+            frames_publish(&app->frames);
+        }
+
+        uint64_t now = thread_time_ns();
+        if (fast) {
+            uint32_t speed = app->turbo.speed;
+            if (turbo_measure(&app->turbo, now, MAIN_FRAME_NS) != speed) {
+                audio_set_speed(&gba->audio, app->turbo.speed);
+            }
+            continue;
+        }
+
+        // If the host fell more than a frame behind, catch up from now instead of running fast
+        deadline += MAIN_FRAME_NS;
+        turbo_late(&app->turbo, now > deadline);
+        if (now > deadline + MAIN_FRAME_NS) {
+            deadline = now;
+        }
+        thread_sleep_until(deadline);
+    }
+
+    // Close the window when the program ends by itself, SDL_PushEvent is safe from any thread
+    if (result != GBA_RUN_FRAME) {
+        SDL_Event quit;
+        quit.type = SDL_QUIT;
+        SDL_PushEvent(&quit);
+    }
+
+    return result == GBA_RUN_ERROR;
+}
+
+// GBA key for a key on the keyboard, 0 if the key is not mapped
+static uint16_t main_key(SDL_Scancode key)
+{
+    switch (key) {
+    case SDL_SCANCODE_Z:
+        return INPUT_KEY_A;
+    case SDL_SCANCODE_X:
+        return INPUT_KEY_B;
+    case SDL_SCANCODE_BACKSPACE:
+        return INPUT_KEY_SELECT;
+    case SDL_SCANCODE_RETURN:
+        return INPUT_KEY_START;
+    case SDL_SCANCODE_RIGHT:
+        return INPUT_KEY_RIGHT;
+    case SDL_SCANCODE_LEFT:
+        return INPUT_KEY_LEFT;
+    case SDL_SCANCODE_UP:
+        return INPUT_KEY_UP;
+    case SDL_SCANCODE_DOWN:
+        return INPUT_KEY_DOWN;
+    case SDL_SCANCODE_S:
+        return INPUT_KEY_R;
+    case SDL_SCANCODE_A:
+        return INPUT_KEY_L;
+    default:
+        return 0;
+    }
+}
+
+int main(int argc, char* argv[])
 {
+    (void)argc;
+    (void)argv;
+
+#if GBA_TRACE_LEVEL > TRACE_LEVEL_NONE
     // Redirect stdout to a file called stdout.txt in the current directory
     freopen("stdout.txt", "w", stdout);
+#endif
 
-    // Create the CPU
-    cpu_t cpu;
-    memset(&cpu, 0, sizeof(cpu_t));
-    
-    // Create the memory (heap allocated)
-    cpu.memory = (char*)malloc(sizeof(memory_t));
-    //cpu.memory_struct = (memory_t*)cpu.memory;
+    // Build the instruction decode tables
+    cpu_init_tables();
 
+    // Create the emulator
+    static app_t app;
+    if (gba_init(&app.gba)) {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+    frames_init(&app.frames);
+    input_queue_init(&app.input);
+    app.stop = 0;
+    app.command = MAIN_COMMAND_NONE;
+    app.saved = 0;
+    app.rewinding = 0;
+    app.fast_forward = 0;
+    app.state = malloc(GBA_STATE_SIZE);
+    if (app.state == NULL || rewind_init(&app.rewind, REWIND_CAPACITY, REWIND_INTERVAL)) {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
 
     const char* rom_file = "C:\\Users\\seanf\\Desktop\\Games\\GBA\\Pokemon - Fire Red.gba";
     const char* bios_file = "C:\\Users\\seanf\\Desktop\\Games\\GBA\\gba_bios.bin";
 
-    // Read the BIOS file
-    FILE* bios = fopen(bios_file, "rb");
-    if (bios == NULL) {
-        printf("Failed to open BIOS file\n");
+    // Map the BIOS file, without one the cartridge starts right away and bios.h runs the calls it makes
+    int load = gba_load_bios(&app.gba, bios_file);
+    if (load == GBA_LOAD_OPEN_FAILED) {
+        printf("No BIOS file, starting the cartridge directly\n");
+    } else if (load == GBA_LOAD_INVALID) {
+        printf("Invalid BIOS file\n");
         return 1;
     }
 
-    // Copy the BIOS into memory
-    fread(((memory_t*)cpu.memory)->bios, sizeof(((memory_t*)cpu.memory)->bios), 1, bios);   
-    fclose(bios);
-
-    // Read the ROM file
-    FILE* rom = fopen(rom_file, "rb");
-    if (rom == NULL) {
+    // Map the ROM file
+    load = gba_load_rom(&app.gba, rom_file);
+    if (load == GBA_LOAD_OPEN_FAILED) {
         printf("Failed to open ROM file\n");
         return 1;
+    } else if (load == GBA_LOAD_INVALID) {
+        printf("Invalid ROM file\n");
+        return 1;
     }
 
-    // Copy the ROM into memory
-    fread(((memory_t*)cpu.memory)->rom, sizeof(((memory_t*)cpu.memory)->rom), 1, rom);
-    fclose(rom);
+#if GBA_TRACE_RING
+    // Keep the last instructions in memory, and write them out if the emulator crashes
+    trace_ring_t trace;
+    if (trace_ring_init(&trace, 65536)) {
+        printf("Failed to allocate the trace buffer\n");
+        return 1;
+    }
+    app.gba.cpu.trace = &trace;
+    if (trace_ring_dump_on_crash(&trace, "trace.bin")) {
+        printf("Failed to create the trace file\n");
+        return 1;
+    }
+#endif
 
-    // Run the CPU
-    cpu_run(&cpu);
+#if GBA_PROFILE
+    // Sample the guest code for the whole run, the report is written when the emulator stops
+    profile_t profile;
+    if (profile_init(&profile, PROFILE_INTERVAL)) {
+        printf("Failed to allocate the profile\n");
+        return 1;
+    }
+    app.gba.profile = &profile;
+#endif
 
-    return 0;
+    // Create the window and a renderer that waits for vsync, so presenting never tears
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO)) {
+        printf("Failed to initialize SDL: %s\n", SDL_GetError());
+        return 1;
+    }
 
-    // // Step 1: Register the window class
-    // const char CLASS_NAME[] = "MyWindowClass";
+    SDL_Window* window = SDL_CreateWindow("GBA", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+        PPU_WIDTH * MAIN_SCALE, PPU_HEIGHT * MAIN_SCALE, SDL_WINDOW_RESIZABLE);
+    SDL_Renderer* renderer = window != NULL ? SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC) : NULL;
+    if (renderer == NULL) {
+        printf("Failed to create the window: %s\n", SDL_GetError());
+        return 1;
+    }
 
-    // WNDCLASS wc = {0};
+    // The GPU scales the frame to the largest whole multiple that fits the window, without filtering
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+    SDL_RenderSetLogicalSize(renderer, PPU_WIDTH, PPU_HEIGHT);
+    SDL_RenderSetIntegerScale(renderer, SDL_TRUE);
 
-    // wc.lpfnWndProc = WindowProc;
-    // wc.hInstance = hInstance;
-    // wc.lpszClassName = CLASS_NAME;
+    // The PPU draws straight into locked streaming textures: the back and middle textures stay
+    // locked, and only the front one is unlocked to be drawn
+    for (uint32_t i = 0; i < 3; i++) {
+        app.textures[i] = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, PPU_WIDTH, PPU_HEIGHT);
+        if (app.textures[i] == NULL || main_lock(&app, i)) {
+            printf("Failed to create the frame textures: %s\n", SDL_GetError());
+            return 1;
+        }
+    }
 
-    // RegisterClass(&wc);
+    // Nothing has been drawn into the front texture yet
+    for (uint32_t y = 0; y < PPU_HEIGHT; y++) {
+        memset(&app.frames.buffers[app.frames.front][y * app.frames.pitch[app.frames.front]], 0, PPU_WIDTH * sizeof(uint32_t));
+    }
+    SDL_UnlockTexture(app.textures[app.frames.front]);
 
-    // // Step 2: Create the window
-    // HWND hwnd = CreateWindowEx(
-    //     0,                              // Optional window styles
-    //     CLASS_NAME,                     // Window class
-    //     "My Window",                    // Window text
-    //     WS_OVERLAPPEDWINDOW,            // Window style
+    // Open the audio device, the emulator still runs without one
+    SDL_AudioSpec wanted;
+    SDL_AudioSpec obtained;
+    memset(&wanted, 0, sizeof(wanted));
+    wanted.freq = MAIN_AUDIO_RATE;
+    wanted.format = AUDIO_S16SYS;
+    wanted.channels = 2;
+    wanted.samples = MAIN_AUDIO_FRAMES;
+    wanted.callback = main_play;
+    wanted.userdata = &app;
+    SDL_AudioDeviceID device = SDL_OpenAudioDevice(NULL, 0, &wanted, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (device != 0) {
+        audio_ring_init(&app.audio, (uint32_t)obtained.freq, obtained.samples);
+        audio_set_output(&app.gba.audio, &app.audio);
+        SDL_PauseAudioDevice(device, 0);
+    } else {
+        printf("Failed to open the audio device: %s\n", SDL_GetError());
+    }
 
-    //     // Size and position
-    //     CW_USEDEFAULT, CW_USEDEFAULT, CW_USEDEFAULT, CW_USEDEFAULT,
+    // Run the emulator on its own thread, this one only presents frames and forwards input
+    thread_t emulation;
+    if (thread_start(&emulation, main_emulate, &app)) {
+        printf("Failed to start the emulation thread\n");
+        return 1;
+    }
 
-    //     NULL,                           // Parent window
-    //     NULL,                           // Menu
-    //     hInstance,                      // Instance handle
-    //     NULL                            // Additional application data
-    // );
+    int running = 1;
+    while (running) {
+        int redraw = 0;
 
-    // if (hwnd == NULL) {
-    //     return 0;
-    // }
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            switch (event.type) {
+            case SDL_QUIT:
+                running = 0;
+                break;
 
-    // // Step 3: Show the window
-    // ShowWindow(hwnd, nCmdShow);
+            case SDL_WINDOWEVENT:
+                redraw = 1;
+                break;
 
-    // // Step 4: Run the message loop
-    // MSG msg = {0};
+            case SDL_KEYDOWN:
+            case SDL_KEYUP: {
+                // R rewinds while it is held
+                if (event.key.keysym.scancode == SDL_SCANCODE_R) {
+                    atomic_store32(&app.rewinding, event.type == SDL_KEYDOWN);
+                    break;
+                }
 
-    // while (GetMessage(&msg, NULL, 0, 0)) {
-    //     TranslateMessage(&msg);
-    //     DispatchMessage(&msg);
-    // }
+                // Tab fast forwards while it is held
+                if (event.key.keysym.scancode == SDL_SCANCODE_TAB) {
+                    atomic_store32(&app.fast_forward, event.type == SDL_KEYDOWN);
+                    break;
+                }
 
-    // return msg.wParam;
-}
+                // F5 saves the quick state and F8 loads it
+                if (event.type == SDL_KEYDOWN && (event.key.keysym.scancode == SDL_SCANCODE_F5 || event.key.keysym.scancode == SDL_SCANCODE_F8)) {
+                    atomic_store32(&app.command, event.key.keysym.scancode == SDL_SCANCODE_F5 ? MAIN_COMMAND_SAVE : MAIN_COMMAND_LOAD);
+                    break;
+                }
 
-// Step 5: Window procedure
-LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
-{
-    switch (uMsg) {
-    case WM_DESTROY:
-        PostQuitMessage(0);
-        return 0;
+                uint16_t key = main_key(event.key.keysym.scancode);
+                if (key != 0 && !event.key.repeat) {
+                    input_push(&app.input, key | (event.type == SDL_KEYDOWN ? INPUT_PRESSED : 0));
+                }
+                break;
+            }
+            }
+        }
 
-    case WM_PAINT: {
-        PAINTSTRUCT ps;
-        HDC hdc = BeginPaint(hwnd, &ps);
+        // The texture on screen goes back to the emulator locked, and the new frame is unlocked,
+        // which uploads it
+        if (frames_pending(&app.frames)) {
+            if (main_lock(&app, app.frames.front)) {
+                printf("Failed to lock a frame texture: %s\n", SDL_GetError());
+                break;
+            }
+            frames_take(&app.frames);
+            SDL_UnlockTexture(app.textures[app.frames.front]);
+            redraw = 1;
+        }
 
-        FillRect(hdc, &ps.rcPaint, (HBRUSH)(COLOR_WINDOW + 1));
+        if (!redraw) {
+            SDL_Delay(1);
+            continue;
+        }
 
-        EndPaint(hwnd, &ps);
+        SDL_RenderClear(renderer);
+        SDL_RenderCopy(renderer, app.textures[app.frames.front], NULL, NULL);
+        SDL_RenderPresent(renderer);
     }
-        return 0;
+
+    atomic_store32(&app.stop, 1);
+    int result = thread_join(&emulation);
+
+#if GBA_TRACE_RING
+    // Also dump the trace if the CPU stopped on an instruction it could not execute
+    if (result != 0) {
+        trace_ring_dump(&trace, "trace.bin");
+    }
+    trace_ring_free(&trace);
+#endif
+
+#if GBA_PROFILE
+    if (profile_write_files(&profile, "profile.txt", "profile.folded")) {
+        printf("Failed to write the profile\n");
+    }
+    profile_free(&profile);
+#endif
+
+    if (device != 0) {
+        SDL_CloseAudioDevice(device);
+    }
+    for (int i = 0; i < 3; i++) {
+        SDL_DestroyTexture(app.textures[i]);
     }
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
 
-    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+    rewind_free(&app.rewind);
+    free(app.state);
+    gba_free(&app.gba);
+    return result;
 }
@@ -1,7 +1,17 @@
+// Backing storage for the GBA address space, see bus.h for how addresses map onto it
+
+#ifndef MEMORY_H_
+#define MEMORY_H_
+
+#include <stdint.h> // for uint32_t
+
+#define MEMORY_BIOS_SIZE 16384
+
 typedef struct memory
 {
     // 00000000-00003FFF BIOS - System ROM (16 KBytes)
-    char bios[16384];
+    // Read only mapping of the BIOS file, MEMORY_BIOS_SIZE bytes
+    char* bios;
 
     // 02000000-0203FFFF WRAM - On-board Work RAM (256 KBytes) 2 Wait
     char wram[262144];
@@ -22,15 +32,27 @@ typedef struct memory
     char oam[1024];
 
     // 08000000-09FFFFFF Game Pak ROM/FlashROM (max 32MB) - Wait State 0
-    char rom[33554432];
-
     // 0A000000-0BFFFFFF Game Pak ROM/FlashROM (max 32MB) - Wait State 1
-    char rom2[33554432];
-
     // 0C000000-0DFFFFFF Game Pak ROM/FlashROM (max 32MB) - Wait State 2
-    char rom3[33554432];
+    // The three wait state regions are views of the same read only mapping of the cartridge
+    char* rom;
+    uint32_t rom_size;
 
     // 0E000000-0E00FFFF Game Pak SRAM (max 64 KBytes) - 8bit Bus width
     char sram[65536];
 
-} memory_t;
\ No newline at end of file
+} memory_t;
+
+// Little endian access to the 16 bit I/O registers, `offset` is relative to 04000000
+static inline uint16_t memory_io_read16(const memory_t* memory, uint32_t offset)
+{
+    return (uint16_t)((uint8_t)memory->io[offset] | ((uint8_t)memory->io[offset + 1] << 8));
+}
+
+static inline void memory_io_write16(memory_t* memory, uint32_t offset, uint16_t value)
+{
+    memory->io[offset] = (char)value;
+    memory->io[offset + 1] = (char)(value >> 8);
+}
+
+#endif // MEMORY_H_
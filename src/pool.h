@@ -0,0 +1,148 @@
+// Work stealing thread pool
+// Runs a fixed set of independent tasks, numbered 0 to count - 1, on a number of threads. The
+// tasks are dealt round robin into one deque per thread. Each thread takes tasks from the back of
+// its own deque and, once it is empty, steals from the front of the others, so a thread that drew
+// long tasks does not hold up the rest. Tasks never add tasks, so a thread stops when every deque
+// is empty.
+//
+// Each deque has its own spin lock, which is only contended while a thread is stealing from it.
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include "thread.h"
+
+#include <stdint.h> // for uint32_t
+#include <stdlib.h> // for calloc
+
+// Run task `task`, returns 0 on success
+typedef int (*pool_function_t)(void* context, uint32_t task);
+
+typedef struct pool_queue {
+    uint32_t* tasks;
+    uint32_t front; // First task not taken yet
+    uint32_t back; // One past the last task not taken yet
+    volatile uint32_t lock;
+    uint8_t padding[64]; // Keep the locks of different threads on different cache lines
+} pool_queue_t;
+
+typedef struct pool pool_t;
+
+typedef struct pool_worker {
+    pool_t* pool;
+    uint32_t index;
+    uint32_t failed; // Tasks that did not return 0
+    thread_t thread;
+} pool_worker_t;
+
+struct pool {
+    pool_function_t function;
+    void* context;
+    uint32_t threads;
+    pool_queue_t* queues;
+    pool_worker_t* workers;
+};
+
+static inline void pool_lock(pool_queue_t* queue)
+{
+    while (atomic_exchange32(&queue->lock, 1)) {
+        while (atomic_load32(&queue->lock)) {
+        }
+    }
+}
+
+static inline void pool_unlock(pool_queue_t* queue)
+{
+    atomic_store32(&queue->lock, 0);
+}
+
+// Take a task from the back (own deque) or the front (stealing) of a deque
+// Returns 1 and sets `task` if there was one, 0 if the deque is empty
+static int pool_take(pool_queue_t* queue, int steal, uint32_t* task)
+{
+    int found = 0;
+    pool_lock(queue);
+    if (queue->front < queue->back) {
+        *task = steal ? queue->tasks[queue->front++] : queue->tasks[--queue->back];
+        found = 1;
+    }
+    pool_unlock(queue);
+    return found;
+}
+
+static int pool_worker(void* argument)
+{
+    pool_worker_t* worker = (pool_worker_t*)argument;
+    pool_t* pool = worker->pool;
+
+    for (;;) {
+        uint32_t task;
+        int found = pool_take(&pool->queues[worker->index], 0, &task);
+        for (uint32_t i = 1; !found && i < pool->threads; i++) {
+            found = pool_take(&pool->queues[(worker->index + i) % pool->threads], 1, &task);
+        }
+        if (!found) {
+            return 0;
+        }
+
+        if (pool->function(pool->context, task)) {
+            worker->failed++;
+        }
+    }
+}
+
+// Run `count` tasks on `threads` threads and wait for all of them
+// Returns the number of tasks that failed, or -1 if the pool could not be started
+int pool_run(uint32_t threads, uint32_t count, pool_function_t function, void* context)
+{
+    pool_t pool;
+    pool.function = function;
+    pool.context = context;
+    pool.threads = threads > 0 ? threads : 1;
+    pool.queues = (pool_queue_t*)calloc(pool.threads, sizeof(pool_queue_t));
+    pool.workers = (pool_worker_t*)calloc(pool.threads, sizeof(pool_worker_t));
+    uint32_t* tasks = (uint32_t*)calloc(count > 0 ? count : 1, sizeof(uint32_t));
+    if (pool.queues == NULL || pool.workers == NULL || tasks == NULL) {
+        free(pool.queues);
+        free(pool.workers);
+        free(tasks);
+        return -1;
+    }
+
+    // Each deque gets a contiguous piece of `tasks`, holding every threads-th task
+    uint32_t used = 0;
+    for (uint32_t t = 0; t < pool.threads; t++) {
+        pool.queues[t].tasks = tasks + used;
+        for (uint32_t task = t; task < count; task += pool.threads) {
+            tasks[used++] = task;
+        }
+        pool.queues[t].back = (uint32_t)(tasks + used - pool.queues[t].tasks);
+    }
+
+    // The queues are filled before the first thread starts, and no task is taken twice
+    uint32_t started = 0;
+    for (; started < pool.threads; started++) {
+        pool.workers[started].pool = &pool;
+        pool.workers[started].index = started;
+        if (thread_start(&pool.workers[started].thread, pool_worker, &pool.workers[started])) {
+            break;
+        }
+    }
+
+    // If a thread could not be started, the others still finish its tasks by stealing them
+    int failed = 0;
+    for (uint32_t t = 0; t < started; t++) {
+        thread_join(&pool.workers[t].thread);
+        failed += (int)pool.workers[t].failed;
+    }
+    if (started == 0) {
+        failed = -1;
+    }
+
+    free(pool.queues);
+    free(pool.workers);
+    free(tasks);
+    return failed;
+}
+
+#endif // POOL_H_
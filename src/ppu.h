@@ -0,0 +1,841 @@
+// Picture processing unit
+// Drives the LCD timing: every scanline is 960 cycles of HDraw followed by 272 cycles of HBlank, and
+// lines 160-227 are VBlank. DISPSTAT, VCOUNT and the LCD interrupts are updated from two scheduler
+// events per line rather than by counting cycles on every instruction.
+//
+// Each visible line is rendered when its HBlank starts. The backgrounds and sprites are drawn into
+// BGR555 line buffers (PPU_TRANSPARENT where a layer has no pixel), then the layers are sorted by
+// priority, blended and converted to XRGB8888 eight pixels at a time with the helpers in simd.h.
+//
+// 4bpp tiles are expanded to one palette index per pixel the first time they are drawn and kept in
+// a tile cache. The bus marks the VRAM blocks that are written, and their tiles are dropped from the
+// cache before the next line, so a static background is only decoded once. 8bpp tiles are already
+// stored one index per byte and are read straight from VRAM.
+//
+// Sprites are kept in per-line lists in the same way: when an OAM entry is moved or resized the bus
+// marks it, and before the next line the sprite is taken off the lines it covered and put on the
+// lines it covers now. Each line only walks its own sprites.
+
+#ifndef PPU_H_
+#define PPU_H_
+
+#include "bits.h"
+#include "bus.h"
+#include "irq.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "simd.h"
+
+#include <stdint.h> // for uint16_t
+#include <stdlib.h> // for calloc
+#include <string.h> // for memcpy
+
+// I/O register offsets
+#define PPU_DISPCNT 0x000 // LCD Control
+#define PPU_DISPSTAT 0x004 // General LCD Status
+#define PPU_VCOUNT 0x006 // Vertical Counter
+#define PPU_BGCNT(n) (0x008 + 2 * (n)) // BG Control
+#define PPU_BGHOFS(n) (0x010 + 4 * (n)) // BG X Offset
+#define PPU_BGVOFS(n) (0x012 + 4 * (n)) // BG Y Offset
+#define PPU_BGPA(n) (0x020 + 0x10 * ((n) - 2)) // BG2/BG3 rotation and scaling, PB-PD follow PA
+#define PPU_BGX(n) (0x028 + 0x10 * ((n) - 2)) // BG2/BG3 reference point, BGY follows BGX
+#define PPU_WINH(n) (0x040 + 2 * (n)) // Window horizontal dimensions
+#define PPU_WINV(n) (0x044 + 2 * (n)) // Window vertical dimensions
+#define PPU_WININ 0x048 // Inside of window 0 and 1
+#define PPU_WINOUT 0x04A // Inside of OBJ window and outside of windows
+#define PPU_BLDCNT 0x050 // Color special effects selection
+#define PPU_BLDALPHA 0x052 // Alpha blending coefficients
+#define PPU_BLDY 0x054 // Brightness coefficient
+
+// DISPCNT bits
+#define PPU_DISPCNT_FRAME 0x0010 // Frame select in modes 4 and 5
+#define PPU_DISPCNT_HBLANK_FREE 0x0020 // Stop drawing sprites during HBlank, which shortens the sprite time
+#define PPU_DISPCNT_OBJ_1D 0x0040 // One dimensional OBJ tile mapping
+#define PPU_DISPCNT_BLANK 0x0080 // Forced blank
+#define PPU_DISPCNT_WIN0 0x2000
+#define PPU_DISPCNT_WIN1 0x4000
+#define PPU_DISPCNT_WINOBJ 0x8000
+
+// DISPSTAT bits
+#define PPU_DISPSTAT_VBLANK 0x0001 // In VBlank (lines 160-226)
+#define PPU_DISPSTAT_HBLANK 0x0002 // In HBlank
+#define PPU_DISPSTAT_VCOUNT 0x0004 // VCOUNT matches the VCount setting in bits 8-15
+#define PPU_DISPSTAT_VBLANK_IRQ 0x0008
+#define PPU_DISPSTAT_HBLANK_IRQ 0x0010
+#define PPU_DISPSTAT_VCOUNT_IRQ 0x0020
+
+// Timing in CPU cycles
+#define PPU_HDRAW_CYCLES 960
+#define PPU_LINE_CYCLES 1232
+#define PPU_LINES 228
+#define PPU_FRAME_CYCLES (PPU_LINE_CYCLES * PPU_LINES)
+
+#define PPU_WIDTH 240
+#define PPU_HEIGHT 160
+
+#define PPU_BG_VRAM 0x10000 // Backgrounds only see the first 64 KBytes of VRAM, OBJ tiles follow
+#define PPU_OBJ_VRAM_SIZE 0x8000 // OBJ tiles, 256 color tiles that run past the end wrap to the start
+#define PPU_TRANSPARENT 0x8000 // Line buffer value where a layer has no pixel
+
+// Layers, the numbers are also the bits used by BLDCNT and the window registers
+#define PPU_LAYER_OBJ 4
+#define PPU_LAYER_BACKDROP 5
+#define PPU_WINDOW_EFFECTS 0x20 // Window bit that enables the color effects
+
+// Tile cache, one entry for every 32 byte VRAM block
+#define PPU_TILES BUS_VRAM_BLOCKS
+
+// Sprites
+#define PPU_OBJ_COUNT BUS_OAM_ENTRIES
+#define PPU_OBJ_LINE_CYCLES 1210 // Sprite drawing time per line, in cycles
+#define PPU_OBJ_LINE_CYCLES_HBLANK_FREE 954
+
+// OBJ line buffer flags
+#define PPU_OBJ_PRIORITY 0x3
+#define PPU_OBJ_SEMI_TRANSPARENT 0x4
+
+typedef struct ppu_tile_cache {
+    uint8_t indices[PPU_TILES][64]; // 4bpp tile decoded to one palette index per pixel, row by row
+    uint32_t valid[PPU_TILES / 32]; // Bitmap of the entries in indices that match VRAM
+} ppu_tile_cache_t;
+
+// Called when a visible line enters HBlank (`vblank` 0) and when the frame enters VBlank (`vblank` 1),
+// this is where DMA starts
+typedef void (*ppu_blank_hook_t)(void* context, int vblank, uint64_t when);
+
+typedef struct ppu {
+    memory_t* memory;
+    bus_t* bus; // Marks the VRAM blocks that are written
+    scheduler_t* scheduler;
+    ppu_tile_cache_t* tiles;
+    uint16_t line; // Current scanline, mirrored in VCOUNT
+    uint32_t frame; // Frames completed, bumped when VBlank starts
+    ppu_blank_hook_t blank_hook; // NULL until something starts DMA on the blanks
+    void* blank_context;
+
+    uint32_t* framebuffer; // XRGB8888 output, NULL (or no tile cache) to only run the timing
+    uint32_t pitch; // Pixels from one framebuffer row to the next
+
+    int32_t affine_x[2]; // BG2 and BG3 internal reference points, 8 fractional bits
+    int32_t affine_y[2];
+
+    uint16_t layers[5][PPU_WIDTH]; // BG0-BG3 and OBJ pixels of the current line
+    uint16_t obj_flags[PPU_WIDTH]; // PPU_OBJ_* flags of the OBJ pixels
+    uint8_t obj_window[PPU_WIDTH]; // 1 where an OBJ window sprite has a pixel
+    uint16_t window[PPU_WIDTH]; // Layer and effect bits enabled by the windows
+    uint16_t tile_line[PPU_WIDTH + 8]; // Text background drawn from the first tile boundary
+
+    uint32_t obj_lines[PPU_HEIGHT][PPU_OBJ_COUNT / 32]; // Bitmap of the sprites on each visible line
+    uint8_t obj_top[PPU_OBJ_COUNT]; // First line of each sprite's bounding box
+    uint8_t obj_height[PPU_OBJ_COUNT]; // Lines in the bounding box, 0 for sprites that are not drawn
+    uint16_t obj_cycles[PPU_OBJ_COUNT]; // Sprite drawing time the sprite uses on each of its lines
+} ppu_t;
+
+ppu_tile_cache_t* ppu_tile_cache_create(void)
+{
+    return (ppu_tile_cache_t*)calloc(1, sizeof(ppu_tile_cache_t));
+}
+
+void ppu_tile_cache_destroy(ppu_tile_cache_t* tiles)
+{
+    free(tiles);
+}
+
+void ppu_hblank(void* context, uint64_t when);
+void ppu_scanline(void* context, uint64_t when);
+
+// Set the framebuffer that lines are rendered into, `pitch` is in pixels
+void ppu_set_framebuffer(ppu_t* ppu, uint32_t* framebuffer, uint32_t pitch)
+{
+    ppu->framebuffer = framebuffer;
+    ppu->pitch = pitch;
+}
+
+static inline uint16_t ppu_io16(const ppu_t* ppu, uint32_t offset)
+{
+    return memory_io_read16(ppu->memory, offset);
+}
+
+static inline uint16_t ppu_vram16(const memory_t* memory, uint32_t address)
+{
+    uint16_t value;
+    memcpy(&value, &memory->vram[address], sizeof(value));
+    return value;
+}
+
+// BGR555 color of a palette entry, OBJ colors start at entry 256
+static inline uint16_t ppu_palette(const memory_t* memory, uint32_t index)
+{
+    uint16_t value;
+    memcpy(&value, &memory->palette[index * 2], sizeof(value));
+    return value & 0x7FFF;
+}
+
+// Copy the BG2/BG3 reference points into the internal registers, done at the start of VBlank
+void ppu_latch_affine(ppu_t* ppu)
+{
+    for (int i = 0; i < 2; i++) {
+        uint32_t x = ppu_io16(ppu, PPU_BGX(i + 2)) | ((uint32_t)ppu_io16(ppu, PPU_BGX(i + 2) + 2) << 16);
+        uint32_t y = ppu_io16(ppu, PPU_BGX(i + 2) + 4) | ((uint32_t)ppu_io16(ppu, PPU_BGX(i + 2) + 6) << 16);
+        ppu->affine_x[i] = sign_extend((int32_t)x, 28);
+        ppu->affine_y[i] = sign_extend((int32_t)y, 28);
+    }
+}
+
+// Drop the cached tiles whose VRAM was written since the last call
+void ppu_sync_tiles(ppu_t* ppu)
+{
+    uint32_t* dirty = ppu->bus->vram_dirty;
+    for (int i = 0; i < PPU_TILES / 32; i++) {
+        ppu->tiles->valid[i] &= ~dirty[i];
+        dirty[i] = 0;
+    }
+}
+
+// Palette indices of the 4bpp tile at VRAM offset `tile` * 32, decoded if the cache has no copy
+static inline const uint8_t* ppu_tile4(ppu_t* ppu, uint32_t tile)
+{
+    uint8_t* indices = ppu->tiles->indices[tile];
+    uint32_t bit = 1u << (tile & 31);
+    if (ppu->tiles->valid[tile >> 5] & bit) {
+        return indices;
+    }
+
+    const uint8_t* vram = (const uint8_t*)&ppu->memory->vram[tile * 32];
+    for (int i = 0; i < 32; i++) {
+        indices[i * 2] = vram[i] & 0xF;
+        indices[i * 2 + 1] = vram[i] >> 4;
+    }
+
+    ppu->tiles->valid[tile >> 5] |= bit;
+    return indices;
+}
+
+// Palette indices of one row of a background tile, `address` is the row in VRAM
+static inline void ppu_tile_row(ppu_t* ppu, uint32_t address, int color256, int hflip, uint8_t* out)
+{
+    if (address >= PPU_BG_VRAM) {
+        memset(out, 0, 8);
+        return;
+    }
+
+    // 4bpp rows are 4 bytes long, and both layouts have 8 indices per row once decoded
+    const uint8_t* row = color256 ? (const uint8_t*)&ppu->memory->vram[address] : ppu_tile4(ppu, address >> 5) + (address & 0x1F) * 2;
+    if (hflip) {
+        for (int i = 0; i < 8; i++) {
+            out[i] = row[7 - i];
+        }
+    } else {
+        memcpy(out, row, 8);
+    }
+}
+
+// Look up the colors of a tile row, index 0 is transparent
+static inline void ppu_tile_colors(const memory_t* memory, const uint8_t* indices, uint32_t palette, uint16_t* out)
+{
+    for (int i = 0; i < 8; i++) {
+        out[i] = indices[i] ? ppu_palette(memory, palette + indices[i]) : PPU_TRANSPARENT;
+    }
+}
+
+// Text background (modes 0 and 1)
+void ppu_render_text(ppu_t* ppu, int bg)
+{
+    const memory_t* memory = ppu->memory;
+    uint16_t control = ppu_io16(ppu, PPU_BGCNT(bg));
+    uint32_t char_base = ((control >> 2) & 0x3) * 0x4000;
+    uint32_t screen_base = ((control >> 8) & 0x1F) * 0x800;
+    int color256 = (control >> 7) & 0x1;
+    uint32_t size = control >> 14; // 0: 256x256, 1: 512x256, 2: 256x512, 3: 512x512
+    uint32_t width_mask = (size & 1) ? 511 : 255;
+    uint32_t x = ppu_io16(ppu, PPU_BGHOFS(bg)) & 0x1FF;
+    uint32_t y = (ppu->line + (ppu_io16(ppu, PPU_BGVOFS(bg)) & 0x1FF)) & ((size & 2) ? 511 : 255);
+
+    // Screen blocks are 32x32 entries, the second row of blocks follows one or two blocks later
+    uint32_t row_base = screen_base + ((y >> 3) & 31) * 64;
+    if (y >= 256) {
+        row_base += size == 3 ? 0x1000 : 0x800;
+    }
+
+    uint32_t tile_y = y & 7;
+    for (int i = 0; i < PPU_WIDTH + 8; i += 8) {
+        uint32_t tx = ((x & ~7) + i) & width_mask;
+        uint32_t entry_address = row_base + ((tx >> 3) & 31) * 2;
+        if (tx >= 256) {
+            entry_address += 0x800;
+        }
+
+        // Screen entry: tile (0-9), horizontal flip (10), vertical flip (11), palette (12-15)
+        uint16_t entry = ppu_vram16(memory, entry_address);
+        uint32_t row_y = (entry & 0x800) ? 7 - tile_y : tile_y;
+        uint32_t row = color256 ? char_base + (entry & 0x3FF) * 64 + row_y * 8 : char_base + (entry & 0x3FF) * 32 + row_y * 4;
+
+        uint8_t indices[8];
+        ppu_tile_row(ppu, row, color256, entry & 0x400, indices);
+        ppu_tile_colors(memory, indices, color256 ? 0 : (entry >> 12) << 4, &ppu->tile_line[i]);
+    }
+
+    memcpy(ppu->layers[bg], &ppu->tile_line[x & 7], sizeof(ppu->layers[bg]));
+}
+
+// Rotation/scaling background (modes 1 and 2), and the bitmap of modes 3-5 which is also BG2
+void ppu_render_affine(ppu_t* ppu, int bg, uint8_t mode, uint16_t dispcnt)
+{
+    const memory_t* memory = ppu->memory;
+    uint16_t control = ppu_io16(ppu, PPU_BGCNT(bg));
+    int32_t pa = (int16_t)ppu_io16(ppu, PPU_BGPA(bg));
+    int32_t pc = (int16_t)ppu_io16(ppu, PPU_BGPA(bg) + 4);
+    int32_t x = ppu->affine_x[bg - 2];
+    int32_t y = ppu->affine_y[bg - 2];
+    uint16_t* out = ppu->layers[bg];
+
+    if (mode >= 3) {
+        uint32_t width = mode == 5 ? 160 : PPU_WIDTH;
+        uint32_t height = mode == 5 ? 128 : PPU_HEIGHT;
+        uint32_t base = (mode != 3 && (dispcnt & PPU_DISPCNT_FRAME)) ? 0xA000 : 0;
+
+        for (int i = 0; i < PPU_WIDTH; i++, x += pa, y += pc) {
+            uint32_t tx = (uint32_t)(x >> 8);
+            uint32_t ty = (uint32_t)(y >> 8);
+            if (tx >= width || ty >= height) {
+                out[i] = PPU_TRANSPARENT;
+            } else if (mode == 4) {
+                uint8_t index = (uint8_t)memory->vram[base + ty * width + tx];
+                out[i] = index ? ppu_palette(memory, index) : PPU_TRANSPARENT;
+            } else {
+                out[i] = ppu_vram16(memory, base + (ty * width + tx) * 2) & 0x7FFF;
+            }
+        }
+        return;
+    }
+
+    uint32_t char_base = ((control >> 2) & 0x3) * 0x4000;
+    uint32_t screen_base = ((control >> 8) & 0x1F) * 0x800;
+    uint32_t size = 128u << (control >> 14);
+    int wrap = (control >> 13) & 0x1;
+
+    for (int i = 0; i < PPU_WIDTH; i++, x += pa, y += pc) {
+        uint32_t tx = (uint32_t)(x >> 8);
+        uint32_t ty = (uint32_t)(y >> 8);
+        if (wrap) {
+            tx &= size - 1;
+            ty &= size - 1;
+        } else if (tx >= size || ty >= size) {
+            out[i] = PPU_TRANSPARENT;
+            continue;
+        }
+
+        // The map is one byte per tile and the tiles are always 256 colors
+        uint8_t tile = (uint8_t)memory->vram[(screen_base + (ty >> 3) * (size >> 3) + (tx >> 3)) & (PPU_BG_VRAM - 1)];
+        uint32_t address = char_base + tile * 64 + (ty & 7) * 8 + (tx & 7);
+        uint8_t index = address < PPU_BG_VRAM ? (uint8_t)memory->vram[address] : 0;
+        out[i] = index ? ppu_palette(memory, index) : PPU_TRANSPARENT;
+    }
+}
+
+// OBJ width and height in pixels, indexed by shape and size
+static const uint8_t ppu_obj_sizes[3][4][2] = {
+    { { 8, 8 }, { 16, 16 }, { 32, 32 }, { 64, 64 } }, // Square
+    { { 16, 8 }, { 32, 8 }, { 32, 16 }, { 64, 32 } }, // Horizontal
+    { { 8, 16 }, { 8, 32 }, { 16, 32 }, { 32, 64 } }, // Vertical
+};
+
+static inline uint16_t ppu_obj_attribute(const memory_t* memory, int n, int attribute)
+{
+    return (uint16_t)((uint8_t)memory->oam[n * 8 + attribute * 2] | ((uint8_t)memory->oam[n * 8 + attribute * 2 + 1] << 8));
+}
+
+// Add or remove sprite `n` on the visible lines of its bounding box
+static inline void ppu_obj_mark_lines(ppu_t* ppu, int n, int add)
+{
+    uint32_t bit = 1u << (n & 31);
+    for (int i = 0; i < ppu->obj_height[n]; i++) {
+        // Y wraps at 256, so a sprite near the bottom also shows at the top
+        uint8_t line = (uint8_t)(ppu->obj_top[n] + i);
+        if (line >= PPU_HEIGHT) {
+            continue;
+        }
+        if (add) {
+            ppu->obj_lines[line][n >> 5] |= bit;
+        } else {
+            ppu->obj_lines[line][n >> 5] &= ~bit;
+        }
+    }
+}
+
+// Move the sprites whose OAM entries were written since the last call to their new lines
+void ppu_sync_sprites(ppu_t* ppu)
+{
+    uint32_t* dirty = ppu->bus->oam_dirty;
+    for (int word = 0; word < PPU_OBJ_COUNT / 32; word++) {
+        for (; dirty[word] != 0; dirty[word] &= dirty[word] - 1) {
+            int n = word * 32 + (int)ctz32(dirty[word]);
+            ppu_obj_mark_lines(ppu, n, 0);
+
+            uint16_t attr0 = ppu_obj_attribute(ppu->memory, n, 0);
+            uint16_t attr1 = ppu_obj_attribute(ppu->memory, n, 1);
+            int affine = (attr0 >> 8) & 0x1;
+            int double_size = affine && ((attr0 >> 9) & 0x1);
+            uint8_t obj_mode = (attr0 >> 10) & 0x3;
+            uint8_t shape = attr0 >> 14;
+
+            // Bit 9 disables regular sprites, mode 3 and shape 3 are prohibited
+            if ((!affine && ((attr0 >> 9) & 0x1)) || obj_mode == 3 || shape == 3) {
+                ppu->obj_height[n] = 0;
+                continue;
+            }
+
+            // Regular sprites take a cycle per pixel, rotation/scaling ones 2 per pixel of the
+            // bounding box plus 10 to set up
+            int width = ppu_obj_sizes[shape][attr1 >> 14][0];
+            ppu->obj_top[n] = (uint8_t)attr0;
+            ppu->obj_height[n] = (uint8_t)(ppu_obj_sizes[shape][attr1 >> 14][1] << double_size);
+            ppu->obj_cycles[n] = (uint16_t)(affine ? 10 + 2 * (width << double_size) : width);
+            ppu_obj_mark_lines(ppu, n, 1);
+        }
+    }
+}
+
+// Draw the sprites on the current line into the OBJ layer and the OBJ window
+void ppu_render_sprites(ppu_t* ppu, uint8_t mode, uint16_t dispcnt)
+{
+    const memory_t* memory = ppu->memory;
+    uint16_t* out = ppu->layers[PPU_LAYER_OBJ];
+
+    for (int i = 0; i < PPU_WIDTH; i++) {
+        out[i] = PPU_TRANSPARENT;
+    }
+    memset(ppu->obj_flags, 0, sizeof(ppu->obj_flags));
+    memset(ppu->obj_window, 0, sizeof(ppu->obj_window));
+
+    // In the bitmap modes the first half of the OBJ tiles is covered by the bitmap
+    uint32_t first_tile = mode >= 3 ? 512 : 0;
+
+    // The hardware goes through the sprites in OAM order until the line's drawing time runs out
+    // A sprite that does not fit is dropped as a whole
+    uint8_t visible[PPU_OBJ_COUNT];
+    int count = 0;
+    int budget = (dispcnt & PPU_DISPCNT_HBLANK_FREE) ? PPU_OBJ_LINE_CYCLES_HBLANK_FREE : PPU_OBJ_LINE_CYCLES;
+    for (int word = 0; word < PPU_OBJ_COUNT / 32; word++) {
+        for (uint32_t bits = ppu->obj_lines[ppu->line][word]; bits != 0 && budget > 0; bits &= bits - 1) {
+            int n = word * 32 + (int)ctz32(bits);
+            budget -= ppu->obj_cycles[n];
+            if (budget >= 0) {
+                visible[count++] = (uint8_t)n;
+            }
+        }
+    }
+
+    // Lower numbered sprites are drawn on top, so draw them last
+    while (count > 0) {
+        int n = visible[--count];
+        uint16_t attr0 = ppu_obj_attribute(memory, n, 0);
+        uint16_t attr1 = ppu_obj_attribute(memory, n, 1);
+        uint16_t attr2 = ppu_obj_attribute(memory, n, 2);
+
+        int affine = (attr0 >> 8) & 0x1;
+        int double_size = affine && ((attr0 >> 9) & 0x1);
+        uint8_t obj_mode = (attr0 >> 10) & 0x3;
+        uint8_t shape = attr0 >> 14;
+
+        int width = ppu_obj_sizes[shape][attr1 >> 14][0];
+        int height = ppu_obj_sizes[shape][attr1 >> 14][1];
+        int box_width = width << double_size;
+        int box_height = height << double_size;
+
+        // The line lists already handle Y, X is a signed 9 bit value
+        int dy = (ppu->line - (attr0 & 0xFF)) & 0xFF;
+        int x = attr1 & 0x1FF;
+        if (x >= 256) {
+            x -= 512;
+        }
+
+        uint32_t tile = attr2 & 0x3FF;
+        if (tile < first_tile) {
+            continue;
+        }
+
+        int color256 = (attr0 >> 13) & 0x1;
+        uint16_t priority = (attr2 >> 10) & 0x3;
+        uint32_t palette = color256 ? 256 : 256 + ((attr2 >> 12) << 4);
+        uint16_t flags = priority | (obj_mode == 1 ? PPU_OBJ_SEMI_TRANSPARENT : 0);
+
+        // Tiles per row of the sprite in 32 byte units
+        uint32_t stride = (dispcnt & PPU_DISPCNT_OBJ_1D) ? (uint32_t)(width >> 3) << color256 : 32;
+
+        // Rotation/scaling parameters, the identity (with flips) for regular sprites
+        int32_t pa = 256, pb = 0, pc = 0, pd = 256;
+        if (affine) {
+            uint32_t group = ((attr1 >> 9) & 0x1F) * 32;
+            pa = (int16_t)((uint8_t)memory->oam[group + 6] | ((uint8_t)memory->oam[group + 7] << 8));
+            pb = (int16_t)((uint8_t)memory->oam[group + 14] | ((uint8_t)memory->oam[group + 15] << 8));
+            pc = (int16_t)((uint8_t)memory->oam[group + 22] | ((uint8_t)memory->oam[group + 23] << 8));
+            pd = (int16_t)((uint8_t)memory->oam[group + 30] | ((uint8_t)memory->oam[group + 31] << 8));
+        }
+
+        int start = x < 0 ? 0 : x;
+        int end = x + box_width > PPU_WIDTH ? PPU_WIDTH : x + box_width;
+        for (int px = start; px < end; px++) {
+            int tx;
+            int ty;
+            if (affine) {
+                // Texture coordinates relative to the center of the bounding box
+                int32_t ix = px - x - box_width / 2;
+                int32_t iy = dy - box_height / 2;
+                tx = ((pa * ix + pb * iy) >> 8) + width / 2;
+                ty = ((pc * ix + pd * iy) >> 8) + height / 2;
+                if (tx < 0 || tx >= width || ty < 0 || ty >= height) {
+                    continue;
+                }
+            } else {
+                tx = (attr1 & 0x1000) ? width - 1 - (px - x) : px - x;
+                ty = (attr1 & 0x2000) ? height - 1 - dy : dy;
+            }
+
+            uint32_t index;
+            if (color256) {
+                uint32_t t = (tile + (ty >> 3) * stride + (tx >> 3) * 2) & 0x3FF;
+                index = (uint8_t)memory->vram[PPU_BG_VRAM + ((t * 32 + (ty & 7) * 8 + (tx & 7)) & (PPU_OBJ_VRAM_SIZE - 1))];
+            } else {
+                uint32_t t = (tile + (ty >> 3) * stride + (tx >> 3)) & 0x3FF;
+                index = ppu_tile4(ppu, (PPU_BG_VRAM >> 5) + t)[(ty & 7) * 8 + (tx & 7)];
+            }
+
+            if (index == 0) {
+                continue;
+            }
+            if (obj_mode == 2) {
+                ppu->obj_window[px] = 1;
+                continue;
+            }
+
+            out[px] = ppu_palette(memory, palette + index);
+            ppu->obj_flags[px] = flags;
+        }
+    }
+}
+
+// Return 1 if `position` is inside the window range [start, end), which wraps when start > end
+static inline int ppu_window_contains(uint32_t position, uint32_t start, uint32_t end)
+{
+    return start <= end ? position >= start && position < end : position >= start || position < end;
+}
+
+// Work out which layers and effects each pixel of the line shows
+void ppu_render_window(ppu_t* ppu, uint16_t dispcnt)
+{
+    if ((dispcnt & (PPU_DISPCNT_WIN0 | PPU_DISPCNT_WIN1 | PPU_DISPCNT_WINOBJ)) == 0) {
+        for (int i = 0; i < PPU_WIDTH; i++) {
+            ppu->window[i] = 0x3F;
+        }
+        return;
+    }
+
+    uint16_t winin = ppu_io16(ppu, PPU_WININ);
+    uint16_t winout = ppu_io16(ppu, PPU_WINOUT);
+
+    for (int i = 0; i < PPU_WIDTH; i++) {
+        ppu->window[i] = winout & 0x3F;
+    }
+
+    if (dispcnt & PPU_DISPCNT_WINOBJ) {
+        for (int i = 0; i < PPU_WIDTH; i++) {
+            if (ppu->obj_window[i]) {
+                ppu->window[i] = (winout >> 8) & 0x3F;
+            }
+        }
+    }
+
+    // Window 0 has priority over window 1
+    for (int n = 1; n >= 0; n--) {
+        if (!(dispcnt & (PPU_DISPCNT_WIN0 << n))) {
+            continue;
+        }
+
+        uint16_t h = ppu_io16(ppu, PPU_WINH(n));
+        uint16_t v = ppu_io16(ppu, PPU_WINV(n));
+        if (!ppu_window_contains(ppu->line, v >> 8, v & 0xFF)) {
+            continue;
+        }
+
+        uint32_t left = h >> 8;
+        uint32_t right = (h & 0xFF) > PPU_WIDTH ? PPU_WIDTH : (h & 0xFF);
+        uint16_t bits = (winin >> (n * 8)) & 0x3F;
+        for (uint32_t i = 0; i < PPU_WIDTH; i++) {
+            if (ppu_window_contains(i, left, right)) {
+                ppu->window[i] = bits;
+            }
+        }
+    }
+}
+
+// Alpha blend each 5 bit channel, (a * eva + b * evb) / 16 clamped to 31
+static inline simd_u16_t ppu_blend_alpha(simd_u16_t a, simd_u16_t b, simd_u16_t eva, simd_u16_t evb)
+{
+    simd_u16_t mask = simd_set1(0x1F);
+    simd_u16_t result = simd_set1(0);
+
+    for (int shift = 0; shift < 15; shift += 5) {
+        simd_u16_t ca = simd_and(simd_shr(a, shift), mask);
+        simd_u16_t cb = simd_and(simd_shr(b, shift), mask);
+        simd_u16_t c = simd_min(simd_shr(simd_add(simd_mul(ca, eva), simd_mul(cb, evb)), 4), mask);
+        result = simd_or(result, simd_shl(c, shift));
+    }
+
+    return result;
+}
+
+// Brightness increase c + (31 - c) * evy / 16, or decrease c - c * evy / 16
+static inline simd_u16_t ppu_blend_brightness(simd_u16_t a, simd_u16_t evy, int increase)
+{
+    simd_u16_t mask = simd_set1(0x1F);
+    simd_u16_t result = simd_set1(0);
+
+    for (int shift = 0; shift < 15; shift += 5) {
+        simd_u16_t c = simd_and(simd_shr(a, shift), mask);
+        if (increase) {
+            c = simd_add(c, simd_shr(simd_mul(simd_sub(mask, c), evy), 4));
+        } else {
+            c = simd_sub(c, simd_shr(simd_mul(c, evy), 4));
+        }
+        result = simd_or(result, simd_shl(c, shift));
+    }
+
+    return result;
+}
+
+// BGR555 to XRGB8888, the top 3 bits of each channel are repeated in the low bits
+static inline void ppu_store_xrgb8888(uint32_t* out, simd_u16_t color)
+{
+    simd_u16_t mask = simd_set1(0x1F);
+    simd_u16_t r = simd_and(color, mask);
+    simd_u16_t g = simd_and(simd_shr(color, 5), mask);
+    simd_u16_t b = simd_and(simd_shr(color, 10), mask);
+    r = simd_or(simd_shl(r, 3), simd_shr(r, 2));
+    g = simd_or(simd_shl(g, 3), simd_shr(g, 2));
+    b = simd_or(simd_shl(b, 3), simd_shr(b, 2));
+
+    simd_store_interleaved(out, simd_or(b, simd_shl(g, 8)), simd_or(r, simd_set1(0xFF00)));
+}
+
+// Sort the layers by priority and apply the color effects, `layers` has a bit for each drawn layer
+void ppu_compose(ppu_t* ppu, uint8_t layers, uint32_t* out)
+{
+    uint16_t bldcnt = ppu_io16(ppu, PPU_BLDCNT);
+    uint16_t bldalpha = ppu_io16(ppu, PPU_BLDALPHA);
+    uint16_t bldy = ppu_io16(ppu, PPU_BLDY);
+    uint8_t effect = (bldcnt >> 6) & 0x3; // 0: none, 1: alpha blending, 2: brighter, 3: darker
+
+    simd_u16_t zero = simd_set1(0);
+    simd_u16_t transparent = simd_set1(PPU_TRANSPARENT);
+    simd_u16_t backdrop = simd_set1(ppu_palette(ppu->memory, 0));
+    simd_u16_t backdrop_bit = simd_set1(1 << PPU_LAYER_BACKDROP);
+    simd_u16_t first_targets = simd_set1(bldcnt & 0x3F);
+    simd_u16_t second_targets = simd_set1((bldcnt >> 8) & 0x3F);
+    simd_u16_t eva = simd_set1((bldalpha & 0x1F) > 16 ? 16 : (bldalpha & 0x1F));
+    simd_u16_t evb = simd_set1(((bldalpha >> 8) & 0x1F) > 16 ? 16 : ((bldalpha >> 8) & 0x1F));
+    simd_u16_t evy = simd_set1((bldy & 0x1F) > 16 ? 16 : (bldy & 0x1F));
+
+    // Painting order, back to front: within a priority BG3 is below BG0, and OBJ is above both
+    uint8_t order[20];
+    uint8_t order_priority[20];
+    int count = 0;
+    for (int priority = 3; priority >= 0; priority--) {
+        for (int bg = 3; bg >= 0; bg--) {
+            if ((layers & (1 << bg)) && (ppu_io16(ppu, PPU_BGCNT(bg)) & 0x3) == priority) {
+                order[count] = (uint8_t)bg;
+                order_priority[count++] = (uint8_t)priority;
+            }
+        }
+        if (layers & (1 << PPU_LAYER_OBJ)) {
+            order[count] = PPU_LAYER_OBJ;
+            order_priority[count++] = (uint8_t)priority;
+        }
+    }
+
+    for (int x = 0; x < PPU_WIDTH; x += SIMD_LANES) {
+        simd_u16_t window = simd_load(&ppu->window[x]);
+        simd_u16_t top = backdrop;
+        simd_u16_t top_bit = backdrop_bit;
+        simd_u16_t below = backdrop;
+        simd_u16_t below_bit = backdrop_bit;
+        simd_u16_t semi_transparent = zero;
+
+        for (int i = 0; i < count; i++) {
+            uint8_t layer = order[i];
+            simd_u16_t bit = simd_set1(1 << layer);
+            simd_u16_t color = simd_load(&ppu->layers[layer][x]);
+
+            // Drawn, and enabled in this pixel's window
+            simd_u16_t mask = simd_not(simd_or(simd_eq(color, transparent), simd_eq(simd_and(window, bit), zero)));
+
+            simd_u16_t flags = zero;
+            if (layer == PPU_LAYER_OBJ) {
+                flags = simd_load(&ppu->obj_flags[x]);
+                mask = simd_and(mask, simd_eq(simd_and(flags, simd_set1(PPU_OBJ_PRIORITY)), simd_set1(order_priority[i])));
+            }
+
+            below = simd_select(mask, top, below);
+            below_bit = simd_select(mask, top_bit, below_bit);
+            top = simd_select(mask, color, top);
+            top_bit = simd_select(mask, bit, top_bit);
+            semi_transparent = simd_select(mask, simd_and(flags, simd_set1(PPU_OBJ_SEMI_TRANSPARENT)), semi_transparent);
+        }
+
+        // Semi-transparent sprites always alpha blend with a second target below them
+        simd_u16_t effects = simd_not(simd_eq(simd_and(window, simd_set1(PPU_WINDOW_EFFECTS)), zero));
+        simd_u16_t first = simd_and(effects, simd_not(simd_eq(simd_and(top_bit, first_targets), zero)));
+        simd_u16_t second = simd_not(simd_eq(simd_and(below_bit, second_targets), zero));
+        simd_u16_t semi = simd_and(effects, simd_and(second, simd_not(simd_eq(semi_transparent, zero))));
+
+        simd_u16_t color = top;
+        if (effect == 1) {
+            simd_u16_t blend = simd_or(semi, simd_and(first, second));
+            color = simd_select(blend, ppu_blend_alpha(top, below, eva, evb), color);
+        } else {
+            if (effect >= 2) {
+                color = simd_select(first, ppu_blend_brightness(top, evy, effect == 2), color);
+            }
+            color = simd_select(semi, ppu_blend_alpha(top, below, eva, evb), color);
+        }
+
+        ppu_store_xrgb8888(&out[x], color);
+    }
+}
+
+// Render the current line into the framebuffer
+void ppu_render_line(ppu_t* ppu)
+{
+    uint16_t dispcnt = ppu_io16(ppu, PPU_DISPCNT);
+    uint32_t* out = ppu->framebuffer + ppu->line * ppu->pitch;
+
+    if (dispcnt & PPU_DISPCNT_BLANK) {
+        for (int i = 0; i < PPU_WIDTH; i++) {
+            out[i] = 0xFFFFFFFF;
+        }
+        return;
+    }
+
+    ppu_sync_tiles(ppu);
+    ppu_sync_sprites(ppu);
+
+    // Backgrounds that exist in each mode: 0 has four text BGs, 1 has two text BGs and BG2 as a
+    // rotation/scaling BG, 2 has BG2 and BG3 as rotation/scaling BGs, 3-5 only have the BG2 bitmap
+    static const uint8_t mode_layers[8] = { 0x1F, 0x17, 0x1C, 0x14, 0x14, 0x14, 0x10, 0x10 };
+    uint8_t mode = dispcnt & 0x7;
+    uint8_t layers = ((dispcnt >> 8) & 0x1F) & mode_layers[mode];
+
+    for (int bg = 0; bg < 4; bg++) {
+        if (!(layers & (1 << bg))) {
+            continue;
+        }
+        if (mode == 0 || (mode == 1 && bg < 2)) {
+            ppu_render_text(ppu, bg);
+        } else {
+            ppu_render_affine(ppu, bg, mode, dispcnt);
+        }
+    }
+
+    // The OBJ window needs the sprites even when the OBJ layer itself is off
+    if (dispcnt & ((1 << (8 + PPU_LAYER_OBJ)) | PPU_DISPCNT_WINOBJ)) {
+        ppu_render_sprites(ppu, mode, dispcnt);
+    }
+
+    ppu_render_window(ppu, dispcnt);
+    ppu_compose(ppu, layers, out);
+}
+
+// Start the LCD at the beginning of line 0, `now` is the current CPU cycle
+void ppu_reset(ppu_t* ppu, bus_t* bus, scheduler_t* scheduler, uint64_t now)
+{
+    memory_t* memory = bus->memory;
+    ppu->memory = memory;
+    ppu->bus = bus;
+    ppu->scheduler = scheduler;
+    ppu->line = 0;
+    if (ppu->tiles != NULL) {
+        memset(ppu->tiles->valid, 0, sizeof(ppu->tiles->valid));
+    }
+
+    // Rebuild the sprite lists from scratch before the first line
+    memset(ppu->obj_lines, 0, sizeof(ppu->obj_lines));
+    memset(ppu->obj_height, 0, sizeof(ppu->obj_height));
+    memset(bus->oam_dirty, 0xFF, sizeof(bus->oam_dirty));
+
+    memory_io_write16(memory, PPU_DISPSTAT, memory_io_read16(memory, PPU_DISPSTAT) & ~(PPU_DISPSTAT_VBLANK | PPU_DISPSTAT_HBLANK | PPU_DISPSTAT_VCOUNT));
+    memory_io_write16(memory, PPU_VCOUNT, 0);
+    ppu_latch_affine(ppu);
+
+    scheduler_schedule(scheduler, SCHEDULER_EVENT_HBLANK, now + PPU_HDRAW_CYCLES, ppu_hblank, ppu);
+}
+
+// HDraw has ended on the current line
+void ppu_hblank(void* context, uint64_t when)
+{
+    ppu_t* ppu = (ppu_t*)context;
+    uint16_t dispstat = memory_io_read16(ppu->memory, PPU_DISPSTAT) | PPU_DISPSTAT_HBLANK;
+    memory_io_write16(ppu->memory, PPU_DISPSTAT, dispstat);
+
+    if (ppu->line < PPU_HEIGHT) {
+        if (ppu->framebuffer != NULL && ppu->tiles != NULL) {
+            ppu_render_line(ppu);
+        }
+
+        // The rotation/scaling reference points move by PB/PD every line
+        for (int i = 0; i < 2; i++) {
+            ppu->affine_x[i] += (int16_t)ppu_io16(ppu, PPU_BGPA(i + 2) + 2);
+            ppu->affine_y[i] += (int16_t)ppu_io16(ppu, PPU_BGPA(i + 2) + 6);
+        }
+
+        if (ppu->blank_hook != NULL) {
+            ppu->blank_hook(ppu->blank_context, 0, when);
+        }
+    }
+
+    if (dispstat & PPU_DISPSTAT_HBLANK_IRQ) {
+        irq_request(ppu->memory, IRQ_HBLANK);
+    }
+
+    scheduler_schedule(ppu->scheduler, SCHEDULER_EVENT_SCANLINE, when + (PPU_LINE_CYCLES - PPU_HDRAW_CYCLES), ppu_scanline, ppu);
+}
+
+// HBlank has ended, move to the next line
+void ppu_scanline(void* context, uint64_t when)
+{
+    ppu_t* ppu = (ppu_t*)context;
+    uint16_t dispstat = memory_io_read16(ppu->memory, PPU_DISPSTAT) & ~PPU_DISPSTAT_HBLANK;
+
+    if (++ppu->line == PPU_LINES) {
+        ppu->line = 0;
+    }
+    memory_io_write16(ppu->memory, PPU_VCOUNT, ppu->line);
+
+    // The VBlank flag is already clear on the last line
+    if (ppu->line == PPU_HEIGHT) {
+        dispstat |= PPU_DISPSTAT_VBLANK;
+        ppu->frame++;
+        ppu_latch_affine(ppu);
+        if (dispstat & PPU_DISPSTAT_VBLANK_IRQ) {
+            irq_request(ppu->memory, IRQ_VBLANK);
+        }
+        if (ppu->blank_hook != NULL) {
+            ppu->blank_hook(ppu->blank_context, 1, when);
+        }
+    } else if (ppu->line == PPU_LINES - 1) {
+        dispstat &= ~PPU_DISPSTAT_VBLANK;
+    }
+
+    if (ppu->line == (dispstat >> 8)) {
+        dispstat |= PPU_DISPSTAT_VCOUNT;
+        if (dispstat & PPU_DISPSTAT_VCOUNT_IRQ) {
+            irq_request(ppu->memory, IRQ_VCOUNT);
+        }
+    } else {
+        dispstat &= ~PPU_DISPSTAT_VCOUNT;
+    }
+
+    memory_io_write16(ppu->memory, PPU_DISPSTAT, dispstat);
+    scheduler_schedule(ppu->scheduler, SCHEDULER_EVENT_HBLANK, when + PPU_HDRAW_CYCLES, ppu_hblank, ppu);
+}
+
+#endif // PPU_H_
@@ -0,0 +1,434 @@
+// Guest code profiler
+// Built in when GBA_PROFILE is set, and only active while gba_t::profile points at a profile.
+// Every `interval`-th block the CPU enters is sampled: it is run one instruction at a time, and
+// its instructions and cycles are counted against the block's address, the instruction classes
+// and the routine the CPU is in. An interval of 1 counts every block, larger intervals keep the
+// cost down to a counter and a few compares per block. Reported counts are scaled by the interval,
+// so they estimate the whole run.
+//
+// Routines are followed on a shadow call stack built from calls (a jump that leaves the return
+// address in LR, BL or MOV LR, PC + BX) and returns to the address on top of the stack. Each path
+// through the calls is a node of a call tree, which is written out as a stack collapse file for
+// flamegraph.pl.
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include "block.h"
+#include "cpu.h"
+#include "jit.h"
+
+#include <stdint.h> // for uint32_t
+#include <stdio.h> // for fprintf
+#include <stdlib.h> // for calloc, qsort
+#include <string.h> // for memset
+
+#ifndef GBA_PROFILE
+#define GBA_PROFILE 0
+#endif
+
+#define PROFILE_INTERVAL 97 // Sample every 97th block by default, prime so loops do not alias with it
+#define PROFILE_ADDRESSES 65536 // Slots in the block address table, must be a power of 2
+#define PROFILE_PROBES 32 // Slots looked at for an address before the sample is dropped
+#define PROFILE_NODES 32768 // Call tree nodes, must be a power of 2
+#define PROFILE_DEPTH 64 // Deepest call stack that is followed, deeper calls stay in the caller
+#define PROFILE_REPORT_BLOCKS 40 // Hottest blocks listed by profile_report
+
+// Instruction classes
+typedef enum profile_class {
+    PROFILE_ARM_DATA, // Data processing
+    PROFILE_ARM_MULTIPLY,
+    PROFILE_ARM_PSR, // MRS, MSR
+    PROFILE_ARM_LOAD_STORE, // LDR, STR, LDRB, STRB
+    PROFILE_ARM_HALFWORD, // LDRH, STRH, LDRSB, LDRSH
+    PROFILE_ARM_SWAP,
+    PROFILE_ARM_BLOCK, // LDM, STM
+    PROFILE_ARM_BRANCH, // B, BL, BX
+    PROFILE_ARM_OTHER, // SWI, coprocessor
+    PROFILE_THUMB_SHIFT, // Shift by immediate, add and subtract
+    PROFILE_THUMB_IMMEDIATE, // MOV, CMP, ADD, SUB with an 8 bit immediate
+    PROFILE_THUMB_ALU,
+    PROFILE_THUMB_HI, // Hi register operations and BX
+    PROFILE_THUMB_LOAD_STORE, // Every single load and store
+    PROFILE_THUMB_ADDRESS, // Load address, add offset to SP
+    PROFILE_THUMB_BLOCK, // PUSH, POP, LDMIA, STMIA
+    PROFILE_THUMB_BRANCH, // Conditional, unconditional and long branches
+    PROFILE_THUMB_SWI,
+    PROFILE_CLASSES,
+} profile_class_t;
+
+static const char* const profile_class_names[PROFILE_CLASSES] = {
+    "arm data processing", "arm multiply", "arm psr transfer", "arm load/store", "arm halfword load/store",
+    "arm swap", "arm ldm/stm", "arm branch", "arm swi/coprocessor", "thumb shift/add", "thumb immediate",
+    "thumb alu", "thumb hi register/bx", "thumb load/store", "thumb address", "thumb push/pop/ldm/stm",
+    "thumb branch", "thumb swi",
+};
+
+typedef struct profile_entry {
+    uint32_t address; // Address of the block, bit 0 is set for Thumb blocks
+    uint32_t samples; // Times the block was sampled, 0 if the slot is empty
+    uint64_t instructions;
+    uint64_t cycles;
+} profile_entry_t;
+
+typedef struct profile_node {
+    uint32_t address; // Entry point of the routine
+    uint32_t parent; // Node of the caller, the root is node 0
+    uint64_t cycles; // Sampled cycles spent in the routine itself, not in its callees
+} profile_node_t;
+
+typedef struct profile_frame {
+    uint32_t node; // Node of the caller
+    uint32_t ret; // Address the call returns to, without the Thumb bit
+} profile_frame_t;
+
+typedef struct profile {
+    uint32_t interval; // Blocks per sample
+    uint32_t countdown; // Blocks left until the next sample
+    uint64_t blocks; // Blocks entered
+    uint64_t samples; // Blocks sampled
+    uint64_t dropped; // Samples not counted against a block because the address table was too full
+    uint64_t class_instructions[PROFILE_CLASSES];
+    uint64_t class_cycles[PROFILE_CLASSES];
+    profile_entry_t* entries; // PROFILE_ADDRESSES slots
+    profile_node_t* nodes; // PROFILE_NODES nodes
+    uint32_t* children; // Open addressed map of (parent, address) to node, 0 when the slot is empty
+    uint32_t node_count;
+    uint32_t node; // Node of the routine the CPU is in
+    uint32_t depth;
+    profile_frame_t stack[PROFILE_DEPTH];
+} profile_t;
+
+void profile_free(profile_t* profile)
+{
+    free(profile->entries);
+    free(profile->nodes);
+    free(profile->children);
+    profile->entries = NULL;
+    profile->nodes = NULL;
+    profile->children = NULL;
+}
+
+// Start an empty profile sampling one block in `interval`
+// Returns 0 on success, 1 if the tables could not be allocated
+int profile_init(profile_t* profile, uint32_t interval)
+{
+    memset(profile, 0, sizeof(profile_t));
+    profile->interval = interval > 0 ? interval : 1;
+    profile->countdown = profile->interval;
+    profile->entries = (profile_entry_t*)calloc(PROFILE_ADDRESSES, sizeof(profile_entry_t));
+    profile->nodes = (profile_node_t*)calloc(PROFILE_NODES, sizeof(profile_node_t));
+    profile->children = (uint32_t*)calloc(PROFILE_NODES * 2, sizeof(uint32_t));
+    profile->node_count = 1;
+
+    if (profile->entries == NULL || profile->nodes == NULL || profile->children == NULL) {
+        profile_free(profile);
+        return 1;
+    }
+    return 0;
+}
+
+static inline uint32_t profile_hash(uint32_t key)
+{
+    return key * 0x9E3779B1u;
+}
+
+profile_class_t profile_arm_class(cpu_arm_instruction_t instruction)
+{
+    switch ((instruction >> 25) & 0x7) {
+    case 0x0:
+        if ((instruction & 0x0FFFFFF0) == 0x012FFF10) {
+            return PROFILE_ARM_BRANCH;
+        }
+        if ((instruction & 0x90) == 0x90) {
+            if ((instruction & 0x0FB000F0) == 0x01000090) {
+                return PROFILE_ARM_SWAP;
+            }
+            return (instruction & 0x60) == 0 ? PROFILE_ARM_MULTIPLY : PROFILE_ARM_HALFWORD;
+        }
+        // The register and immediate forms share the PSR transfer encodings
+        // fall through
+    case 0x1:
+        return (instruction & 0x01900000) == 0x01000000 ? PROFILE_ARM_PSR : PROFILE_ARM_DATA;
+    case 0x2:
+    case 0x3:
+        return PROFILE_ARM_LOAD_STORE;
+    case 0x4:
+        return PROFILE_ARM_BLOCK;
+    case 0x5:
+        return PROFILE_ARM_BRANCH;
+    default:
+        return PROFILE_ARM_OTHER;
+    }
+}
+
+profile_class_t profile_thumb_class(cpu_thumb_instruction_t instruction)
+{
+    switch (instruction >> 13) {
+    case 0x0:
+        return PROFILE_THUMB_SHIFT;
+    case 0x1:
+        return PROFILE_THUMB_IMMEDIATE;
+    case 0x2:
+        if ((instruction & 0x1C00) == 0x0000) {
+            return PROFILE_THUMB_ALU;
+        }
+        return (instruction & 0x1C00) == 0x0400 ? PROFILE_THUMB_HI : PROFILE_THUMB_LOAD_STORE;
+    case 0x3:
+    case 0x4:
+        return PROFILE_THUMB_LOAD_STORE;
+    case 0x5:
+        return (instruction & 0x1400) == 0x1400 ? PROFILE_THUMB_BLOCK : PROFILE_THUMB_ADDRESS;
+    case 0x6:
+        if ((instruction & 0x1000) == 0) {
+            return PROFILE_THUMB_BLOCK;
+        }
+        return (instruction & 0x0F00) == 0x0F00 ? PROFILE_THUMB_SWI : PROFILE_THUMB_BRANCH;
+    default:
+        return PROFILE_THUMB_BRANCH;
+    }
+}
+
+// Entry of the block at `address` (bit 0 set for Thumb), NULL if the table is too full
+static profile_entry_t* profile_entry(profile_t* profile, uint32_t address)
+{
+    uint32_t slot = profile_hash(address) >> 16;
+    for (uint32_t probe = 0; probe < PROFILE_PROBES; probe++) {
+        profile_entry_t* entry = &profile->entries[(slot + probe) & (PROFILE_ADDRESSES - 1)];
+        if (entry->samples == 0) {
+            entry->address = address;
+            return entry;
+        }
+        if (entry->address == address) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Node for a call from node `parent` to `address`, `parent` itself when the tree is full
+static uint32_t profile_child(profile_t* profile, uint32_t parent, uint32_t address)
+{
+    uint32_t mask = PROFILE_NODES * 2 - 1;
+    uint32_t slot = profile_hash(address ^ profile_hash(parent + 1)) & mask;
+    for (;; slot = (slot + 1) & mask) {
+        uint32_t index = profile->children[slot];
+        if (index == 0) {
+            break;
+        }
+        if (profile->nodes[index].parent == parent && profile->nodes[index].address == address) {
+            return index;
+        }
+    }
+
+    // The map is twice the size of the tree, so there is always an empty slot
+    if (profile->node_count == PROFILE_NODES) {
+        return parent;
+    }
+
+    uint32_t index = profile->node_count++;
+    profile->nodes[index].address = address;
+    profile->nodes[index].parent = parent;
+    profile->children[slot] = index;
+    return index;
+}
+
+// Follow calls and returns made by the block that started at `pc` with `lr` in LR
+static inline void profile_track_calls(profile_t* profile, const cpu_t* cpu, uint32_t pc, uint32_t lr)
+{
+    uint32_t now = cpu->registers.pc;
+    uint32_t link = cpu->registers.lr & ~0x1u;
+
+    // A call writes the address just past its last instruction into LR, and jumps anywhere but there
+    if (cpu->registers.lr != lr && link > pc && link - pc <= BLOCK_MAX_OPS * 4 && (now <= pc || now > link)) {
+        if (profile->depth < PROFILE_DEPTH) {
+            profile->stack[profile->depth].node = profile->node;
+            profile->stack[profile->depth].ret = link;
+            profile->depth++;
+            profile->node = profile_child(profile, profile->node, now);
+        }
+    } else if (profile->depth > 0 && now == profile->stack[profile->depth - 1].ret) {
+        profile->node = profile->stack[--profile->depth].node;
+    }
+}
+
+// Run the block at PC one instruction at a time, counting it in the profile
+// Stops where block_replay would, returns 1 if the instructions were executed, 0 if there was an error
+int profile_sample(profile_t* profile, block_cache_t* cache, cpu_t* cpu)
+{
+    uint32_t pc = cpu->registers.pc;
+    uint8_t thumb = (cpu->registers.cpsr & 0x20) == 0;
+    uint32_t size = thumb ? 2 : 4;
+    uint64_t start = cpu->cycles;
+
+    // Uncacheable code is sampled one instruction at a time
+    block_t* block = block_lookup(cache, cpu);
+    int count = block != NULL ? block->length : 1;
+    uint32_t code_writes = cpu->bus->code_writes;
+
+    int result = 1;
+    int executed = 0;
+    while (executed < count) {
+        uint32_t instruction = block != NULL ? block_instruction(block, executed)
+            : thumb                          ? bus_read16(cpu->bus, cpu->registers.pc)
+                                             : bus_read32(cpu->bus, cpu->registers.pc);
+        profile_class_t type = thumb ? profile_thumb_class((cpu_thumb_instruction_t)instruction) : profile_arm_class(instruction);
+        uint64_t before = cpu->cycles;
+        uint32_t next = cpu->registers.pc + size;
+
+        if (!cpu_step(cpu)) {
+            result = 0;
+            break;
+        }
+
+        executed++;
+        profile->class_instructions[type]++;
+        profile->class_cycles[type] += cpu->cycles - before;
+        if (cpu->registers.pc != next || cpu->bus->code_writes != code_writes) {
+            break;
+        }
+    }
+
+    uint64_t cycles = cpu->cycles - start;
+    profile->samples++;
+    profile->nodes[profile->node].cycles += cycles;
+
+    profile_entry_t* entry = profile_entry(profile, pc | thumb);
+    if (entry == NULL) {
+        profile->dropped++;
+    } else {
+        entry->samples++;
+        entry->instructions += (uint64_t)executed;
+        entry->cycles += cycles;
+    }
+
+    return result;
+}
+
+// Execute the block at PC like gba_run_frame does, sampling it when its turn has come
+// Returns 1 if the instructions were executed, 0 if there was an error
+static inline int profile_execute(profile_t* profile, jit_t* jit, block_cache_t* cache, cpu_t* cpu)
+{
+    uint32_t pc = cpu->registers.pc;
+    uint32_t lr = cpu->registers.lr;
+
+    int result;
+    if (--profile->countdown == 0) {
+        profile->countdown = profile->interval;
+        result = profile_sample(profile, cache, cpu);
+    } else {
+        result = jit != NULL ? jit_execute(jit, cache, cpu) : block_cache_execute(cache, cpu);
+    }
+
+    profile->blocks++;
+    profile_track_calls(profile, cpu, pc, lr);
+    return result;
+}
+
+static int profile_compare_entries(const void* a, const void* b)
+{
+    uint64_t x = ((const profile_entry_t*)a)->cycles;
+    uint64_t y = ((const profile_entry_t*)b)->cycles;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Write the hottest blocks and the cost of each instruction class
+// Returns 0 on success, 1 if the report could not be sorted
+int profile_report(const profile_t* profile, FILE* file)
+{
+    profile_entry_t* sorted = (profile_entry_t*)malloc(PROFILE_ADDRESSES * sizeof(profile_entry_t));
+    if (sorted == NULL) {
+        return 1;
+    }
+
+    uint32_t count = 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < PROFILE_ADDRESSES; i++) {
+        if (profile->entries[i].samples != 0) {
+            sorted[count++] = profile->entries[i];
+            total += profile->entries[i].cycles;
+        }
+    }
+    qsort(sorted, count, sizeof(profile_entry_t), profile_compare_entries);
+
+    uint64_t scale = profile->interval;
+    fprintf(file, "%llu blocks entered, %llu sampled (1 in %u), %u distinct blocks, %llu samples dropped\n\n",
+        (unsigned long long)profile->blocks, (unsigned long long)profile->samples, profile->interval, count,
+        (unsigned long long)profile->dropped);
+
+    fprintf(file, "%-10s  %-5s  %10s  %14s  %14s  %6s  %6s\n", "block", "mode", "samples", "instructions", "cycles", "%", "cpi");
+    for (uint32_t i = 0; i < count && i < PROFILE_REPORT_BLOCKS; i++) {
+        const profile_entry_t* entry = &sorted[i];
+        fprintf(file, "0x%08X  %-5s  %10u  %14llu  %14llu  %6.2f  %6.2f\n", entry->address & ~0x1u,
+            (entry->address & 0x1) ? "thumb" : "arm", entry->samples, (unsigned long long)(entry->instructions * scale),
+            (unsigned long long)(entry->cycles * scale), total > 0 ? entry->cycles * 100.0 / total : 0.0,
+            entry->instructions > 0 ? (double)entry->cycles / entry->instructions : 0.0);
+    }
+
+    uint64_t class_total = 0;
+    for (int c = 0; c < PROFILE_CLASSES; c++) {
+        class_total += profile->class_cycles[c];
+    }
+
+    fprintf(file, "\n%-24s  %14s  %14s  %6s  %6s\n", "class", "instructions", "cycles", "%", "cpi");
+    for (int c = 0; c < PROFILE_CLASSES; c++) {
+        if (profile->class_instructions[c] == 0) {
+            continue;
+        }
+        fprintf(file, "%-24s  %14llu  %14llu  %6.2f  %6.2f\n", profile_class_names[c],
+            (unsigned long long)(profile->class_instructions[c] * scale), (unsigned long long)(profile->class_cycles[c] * scale),
+            class_total > 0 ? profile->class_cycles[c] * 100.0 / class_total : 0.0,
+            (double)profile->class_cycles[c] / profile->class_instructions[c]);
+    }
+
+    free(sorted);
+    return 0;
+}
+
+// Write the call tree in the stack collapse format of flamegraph.pl, one line per routine that
+// was sampled: the routines from the root to it separated by ';', then its own (estimated) cycles
+void profile_write_collapsed(const profile_t* profile, FILE* file)
+{
+    uint32_t path[PROFILE_DEPTH + 1];
+
+    for (uint32_t i = 0; i < profile->node_count; i++) {
+        if (profile->nodes[i].cycles == 0) {
+            continue;
+        }
+
+        uint32_t depth = 0;
+        for (uint32_t node = i; node != 0 && depth < PROFILE_DEPTH + 1; node = profile->nodes[node].parent) {
+            path[depth++] = node;
+        }
+
+        fprintf(file, "reset");
+        while (depth > 0) {
+            fprintf(file, ";0x%08X", profile->nodes[path[--depth]].address);
+        }
+        fprintf(file, " %llu\n", (unsigned long long)(profile->nodes[i].cycles * profile->interval));
+    }
+}
+
+// Write the report to `report_path` and the call tree to `collapsed_path`
+// Returns 0 on success, 1 if a file could not be written
+int profile_write_files(const profile_t* profile, const char* report_path, const char* collapsed_path)
+{
+    FILE* report = fopen(report_path, "w");
+    if (report == NULL) {
+        return 1;
+    }
+    int error = profile_report(profile, report);
+    error |= ferror(report) != 0;
+    fclose(report);
+
+    FILE* collapsed = fopen(collapsed_path, "w");
+    if (collapsed == NULL) {
+        return 1;
+    }
+    profile_write_collapsed(profile, collapsed);
+    error |= ferror(collapsed) != 0;
+    fclose(collapsed);
+    return error;
+}
+
+#endif // PROFILE_H_
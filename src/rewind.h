@@ -0,0 +1,350 @@
+// Rewind
+// Keeps the recent past as a chain of snapshots taken every `interval` frames. Only the most recent
+// snapshot is kept whole. Each older one is stored as the XOR of two consecutive snapshots, which
+// is mostly zeros, packed into runs. XOR is its own inverse, so applying the newest delta to the
+// whole snapshot gives the one before it, and rewinding walks the chain backwards.
+//
+// Memory is compared in the bus write tracking units: a unit that was not written since the last
+// snapshot cannot have changed, so it is neither compared nor copied. The machine state and the I/O
+// registers are small and always compared. Deltas live in a byte ring of fixed capacity, and the
+// oldest ones are dropped to make room, so memory use is bounded by the capacity plus three buffers
+// the size of a state.
+//
+// Everything that changes memory must go through the bus (or gba_load_state, which marks every
+// unit as written), otherwise the change is missed until the unit is written again.
+
+#ifndef REWIND_H_
+#define REWIND_H_
+
+#include "bus.h"
+#include "gba.h"
+#include "state.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+#include <stdlib.h> // for malloc
+#include <string.h> // for memcpy
+
+#define REWIND_INTERVAL 4 // Frames between two snapshots by default
+#define REWIND_CAPACITY (64 << 20) // Bytes of deltas by default, about a minute of typical play
+
+// Packed runs are 16 bit little endian tokens. A token with the top bit set stands for 1-32768
+// bytes that did not change, otherwise it is followed by 1-32768 bytes of XOR data.
+#define REWIND_RUN_SAME 0x8000
+#define REWIND_RUN_MAX 0x8000
+#define REWIND_RUN_MIN_SAME 4 // Shorter runs of unchanged bytes are stored as data
+
+// Parts of a state that are compared as a whole
+typedef struct rewind_segment {
+    uint32_t offset; // In state_t
+    uint32_t source; // In memory_t, REWIND_MACHINE for the part of the state that is not memory
+    uint32_t size;
+    int unit; // BUS_UNIT_* of the memory, -1 if the segment is always compared
+} rewind_segment_t;
+
+#define REWIND_MACHINE UINT32_MAX
+
+#define REWIND_SEGMENTS (2 + BUS_UNITS)
+
+typedef struct rewind {
+    state_t* current; // The most recent snapshot
+    state_t* machine; // Only the machine state, what memory is compared with is in memory_t itself
+    int valid; // 1 once `current` holds a snapshot
+    uint32_t interval;
+    uint32_t countdown; // Frames until the next snapshot
+
+    // Deltas, each stored as its size, its segments and its size again, so the ring can be walked
+    // from both ends
+    uint8_t* ring;
+    size_t capacity;
+    size_t head; // Byte offsets, only ever increase
+    size_t tail;
+    uint32_t count; // Deltas in the ring
+
+    uint8_t* scratch; // The delta being built
+    size_t scratch_size;
+    rewind_segment_t segments[REWIND_SEGMENTS];
+} rewind_t;
+
+void rewind_free(rewind_t* rewind)
+{
+    free(rewind->current);
+    free(rewind->machine);
+    free(rewind->ring);
+    free(rewind->scratch);
+    memset(rewind, 0, sizeof(rewind_t));
+}
+
+// Worst case size of a packed segment, unchanged runs are never shorter than their token
+static inline size_t rewind_packed_bound(size_t size)
+{
+    return size + 2 * (size / REWIND_RUN_MAX + 1);
+}
+
+// Drop every snapshot
+void rewind_clear(rewind_t* rewind)
+{
+    rewind->valid = 0;
+    rewind->countdown = 0;
+    rewind->head = 0;
+    rewind->tail = 0;
+    rewind->count = 0;
+}
+
+// Keep `capacity` bytes of deltas and snapshot every `interval` frames
+// Returns 0 on success, 1 if an allocation failed
+int rewind_init(rewind_t* rewind, size_t capacity, uint32_t interval)
+{
+    memset(rewind, 0, sizeof(rewind_t));
+
+    // The machine state and the I/O registers are always compared, memory only where it was written
+#define REWIND_REGION(name, unit) { offsetof(state_t, name), offsetof(memory_t, name), sizeof(((memory_t*)0)->name), unit }
+    static const rewind_segment_t regions[] = {
+        { 0, REWIND_MACHINE, STATE_MACHINE_SIZE, -1 },
+        REWIND_REGION(io, -1),
+        REWIND_REGION(wram, BUS_UNIT_WRAM),
+        REWIND_REGION(wram_chip, BUS_UNIT_WRAM_CHIP),
+        REWIND_REGION(palette, BUS_UNIT_PALETTE),
+        REWIND_REGION(vram, BUS_UNIT_VRAM),
+        REWIND_REGION(oam, BUS_UNIT_OAM),
+        REWIND_REGION(sram, BUS_UNIT_SRAM),
+    };
+#undef REWIND_REGION
+
+    // Regions larger than a page have a unit for each page
+    int count = 0;
+    for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+        const rewind_segment_t* region = &regions[i];
+        if (region->unit < 0) {
+            rewind->segments[count++] = *region;
+            continue;
+        }
+        for (uint32_t offset = 0; offset < region->size; offset += BUS_PAGE_SIZE) {
+            rewind_segment_t* segment = &rewind->segments[count++];
+            segment->offset = region->offset + offset;
+            segment->source = region->source + offset;
+            segment->size = region->size - offset < BUS_PAGE_SIZE ? region->size - offset : BUS_PAGE_SIZE;
+            segment->unit = region->unit + (int)(offset / BUS_PAGE_SIZE);
+        }
+    }
+
+    // A delta is its two sizes, then the index, size and packed bytes of each segment
+    rewind->scratch_size = 8;
+    for (int i = 0; i < REWIND_SEGMENTS; i++) {
+        rewind->scratch_size += 8 + rewind_packed_bound(rewind->segments[i].size);
+    }
+
+    rewind->interval = interval > 0 ? interval : 1;
+    rewind->capacity = capacity > rewind->scratch_size ? capacity : rewind->scratch_size;
+    rewind->current = (state_t*)malloc(GBA_STATE_SIZE);
+    rewind->machine = (state_t*)malloc(GBA_STATE_SIZE);
+    rewind->ring = (uint8_t*)malloc(rewind->capacity);
+    rewind->scratch = (uint8_t*)malloc(rewind->scratch_size);
+    if (rewind->current == NULL || rewind->machine == NULL || rewind->ring == NULL || rewind->scratch == NULL) {
+        rewind_free(rewind);
+        return 1;
+    }
+
+    rewind_clear(rewind);
+    return 0;
+}
+
+// Pack the XOR of `a` and `b` into `out`, and copy `b` over `a`
+// Returns the number of bytes written, 0 if `a` and `b` are the same
+static size_t rewind_pack(uint8_t* a, const uint8_t* b, size_t size, uint8_t* out)
+{
+    int changed = 0;
+    size_t written = 0;
+    size_t i = 0;
+    while (i < size) {
+        // Unchanged bytes, 8 at a time while possible
+        size_t same = i;
+        while (same + 8 <= size && memcmp(a + same, b + same, 8) == 0) {
+            same += 8;
+        }
+        while (same < size && a[same] == b[same]) {
+            same++;
+        }
+
+        if (same - i >= REWIND_RUN_MIN_SAME || same == size) {
+            while (i < same) {
+                size_t run = same - i < REWIND_RUN_MAX ? same - i : REWIND_RUN_MAX;
+                uint16_t token = (uint16_t)(REWIND_RUN_SAME | (run - 1));
+                out[written++] = (uint8_t)token;
+                out[written++] = (uint8_t)(token >> 8);
+                i += run;
+            }
+            continue;
+        }
+
+        // Changed bytes up to the next run of unchanged ones that is worth a token
+        size_t end = same;
+        size_t matching = 0;
+        while (end < size && end - i < REWIND_RUN_MAX) {
+            matching = a[end] == b[end] ? matching + 1 : 0;
+            end++;
+            if (matching == REWIND_RUN_MIN_SAME) {
+                end -= REWIND_RUN_MIN_SAME;
+                break;
+            }
+        }
+
+        size_t run = end - i;
+        uint16_t token = (uint16_t)(run - 1);
+        changed = 1;
+        out[written++] = (uint8_t)token;
+        out[written++] = (uint8_t)(token >> 8);
+        for (size_t j = 0; j < run; j++) {
+            out[written++] = a[i + j] ^ b[i + j];
+        }
+        memcpy(a + i, b + i, run);
+        i = end;
+    }
+
+    return changed ? written : 0;
+}
+
+// XOR packed runs into `a`
+static void rewind_unpack(uint8_t* a, const uint8_t* in, size_t size)
+{
+    size_t position = 0;
+    size_t read = 0;
+    while (read < size) {
+        uint16_t token = (uint16_t)(in[read] | (in[read + 1] << 8));
+        size_t run = (size_t)(token & ~REWIND_RUN_SAME) + 1;
+        read += 2;
+
+        if (!(token & REWIND_RUN_SAME)) {
+            for (size_t j = 0; j < run; j++) {
+                a[position + j] ^= in[read + j];
+            }
+            read += run;
+        }
+        position += run;
+    }
+}
+
+// Copy to and from the ring, `position` wraps around the capacity
+static void rewind_ring_put(rewind_t* rewind, size_t position, const uint8_t* data, size_t size)
+{
+    size_t offset = position % rewind->capacity;
+    size_t first = size < rewind->capacity - offset ? size : rewind->capacity - offset;
+    memcpy(rewind->ring + offset, data, first);
+    memcpy(rewind->ring, data + first, size - first);
+}
+
+static void rewind_ring_get(const rewind_t* rewind, size_t position, uint8_t* data, size_t size)
+{
+    size_t offset = position % rewind->capacity;
+    size_t first = size < rewind->capacity - offset ? size : rewind->capacity - offset;
+    memcpy(data, rewind->ring + offset, first);
+    memcpy(data + first, rewind->ring, size - first);
+}
+
+static inline uint32_t rewind_get32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void rewind_put32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+// Take a snapshot now, between two frames
+void rewind_push(rewind_t* rewind, gba_t* gba)
+{
+    bus_t* bus = gba->bus;
+    uint8_t* current = (uint8_t*)rewind->current;
+
+    if (!rewind->valid) {
+        gba_save_state(gba, current, GBA_STATE_SIZE);
+        bus_track_writes(bus);
+        rewind->valid = 1;
+        return;
+    }
+
+    state_save_machine(gba, rewind->machine);
+
+    uint8_t* out = rewind->scratch;
+    size_t size = 4;
+    for (int i = 0; i < REWIND_SEGMENTS; i++) {
+        const rewind_segment_t* segment = &rewind->segments[i];
+        if (segment->unit >= 0 && !(bus->written & (1u << segment->unit))) {
+            continue;
+        }
+
+        const uint8_t* source = segment->source == REWIND_MACHINE ? (const uint8_t*)rewind->machine : (const uint8_t*)gba->memory + segment->source;
+        size_t packed = rewind_pack(current + segment->offset, source, segment->size, out + size + 8);
+        if (packed == 0) {
+            continue;
+        }
+        rewind_put32(out + size, (uint32_t)i);
+        rewind_put32(out + size + 4, (uint32_t)packed);
+        size += 8 + packed;
+    }
+    bus_track_writes(bus);
+
+    rewind_put32(out, (uint32_t)size);
+    rewind_put32(out + size, (uint32_t)size);
+    size += 4;
+
+    // Make room by dropping the oldest deltas
+    while (rewind->count > 0 && rewind->head + size - rewind->tail > rewind->capacity) {
+        uint8_t header[4];
+        rewind_ring_get(rewind, rewind->tail, header, 4);
+        rewind->tail += rewind_get32(header) + 4;
+        rewind->count--;
+    }
+
+    rewind_ring_put(rewind, rewind->head, out, size);
+    rewind->head += size;
+    rewind->count++;
+}
+
+// Call after every frame, takes a snapshot every `interval` frames
+void rewind_frame(rewind_t* rewind, gba_t* gba)
+{
+    if (rewind->countdown == 0) {
+        rewind_push(rewind, gba);
+        rewind->countdown = rewind->interval;
+    }
+    rewind->countdown--;
+}
+
+// Go back to the most recent snapshot, and make the one before it the next to go back to
+// Returns 0 on success, 1 if there is nothing to go back to
+int rewind_step(rewind_t* rewind, gba_t* gba)
+{
+    if (!rewind->valid || gba_load_state(gba, rewind->current, GBA_STATE_SIZE) != STATE_LOAD_OK) {
+        return 1;
+    }
+
+    // Once the oldest snapshot is reached the machine stays there
+    rewind->countdown = rewind->interval;
+    if (rewind->count == 0) {
+        return 0;
+    }
+
+    uint8_t footer[4];
+    rewind_ring_get(rewind, rewind->head - 4, footer, 4);
+    size_t size = rewind_get32(footer);
+    rewind->head -= size + 4;
+    rewind->count--;
+
+    uint8_t* delta = rewind->scratch;
+    rewind_ring_get(rewind, rewind->head, delta, size);
+    for (size_t read = 4; read < size;) {
+        const rewind_segment_t* segment = &rewind->segments[rewind_get32(delta + read)];
+        size_t packed = rewind_get32(delta + read + 4);
+        rewind_unpack((uint8_t*)rewind->current + segment->offset, delta + read + 8, packed);
+        read += 8 + packed;
+    }
+
+    return 0;
+}
+
+#endif // REWIND_H_
@@ -0,0 +1,148 @@
+// Event scheduler
+// Devices register an event for the cycle at which they next need attention (end of a scanline, a
+// timer overflow, ...). The events are kept in a binary min-heap keyed on their timestamp, so the run
+// loop only has to compare the CPU cycle counter against the earliest one, and devices are never
+// polled between their deadlines.
+//
+// Each event id is scheduled at most once; scheduling it again moves it.
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h> // for uint64_t
+#include <string.h> // for memset
+
+typedef enum scheduler_event_id {
+    SCHEDULER_EVENT_HBLANK, // HDraw ends on the current scanline
+    SCHEDULER_EVENT_SCANLINE, // HBlank ends, VCOUNT moves to the next line
+    SCHEDULER_EVENT_TIMER0, // Timer overflows, only scheduled while the timer interrupt is enabled
+    SCHEDULER_EVENT_TIMER1,
+    SCHEDULER_EVENT_TIMER2,
+    SCHEDULER_EVENT_TIMER3,
+    SCHEDULER_EVENT_AUDIO, // Mix the samples played since the last batch
+    SCHEDULER_EVENT_DMA0, // DMA channel starts a transfer
+    SCHEDULER_EVENT_DMA1,
+    SCHEDULER_EVENT_DMA2,
+    SCHEDULER_EVENT_DMA3,
+    SCHEDULER_EVENT_COUNT
+} scheduler_event_id_t;
+
+#define SCHEDULER_NEVER UINT64_MAX // Timestamp of an empty scheduler
+
+// Called when the event is due, `when` is the cycle it was scheduled for (the CPU may be a few
+// cycles past it), so devices can schedule their next deadline without drifting
+typedef void (*scheduler_callback_t)(void* context, uint64_t when);
+
+typedef struct scheduler_event {
+    uint64_t when;
+    scheduler_callback_t callback;
+    void* context;
+} scheduler_event_t;
+
+typedef struct scheduler {
+    scheduler_event_t events[SCHEDULER_EVENT_COUNT];
+    uint8_t heap[SCHEDULER_EVENT_COUNT]; // Event ids, heap[0] is the earliest
+    int8_t position[SCHEDULER_EVENT_COUNT]; // Index of each event in heap, -1 if not scheduled
+    int count;
+} scheduler_t;
+
+void scheduler_init(scheduler_t* scheduler)
+{
+    memset(scheduler, 0, sizeof(scheduler_t));
+    memset(scheduler->position, -1, sizeof(scheduler->position));
+}
+
+// Timestamp of the earliest event, SCHEDULER_NEVER if nothing is scheduled
+static inline uint64_t scheduler_next(const scheduler_t* scheduler)
+{
+    return scheduler->count > 0 ? scheduler->events[scheduler->heap[0]].when : SCHEDULER_NEVER;
+}
+
+static inline uint64_t scheduler_when(const scheduler_t* scheduler, int index)
+{
+    return scheduler->events[scheduler->heap[index]].when;
+}
+
+static inline void scheduler_swap(scheduler_t* scheduler, int a, int b)
+{
+    uint8_t id = scheduler->heap[a];
+    scheduler->heap[a] = scheduler->heap[b];
+    scheduler->heap[b] = id;
+    scheduler->position[scheduler->heap[a]] = (int8_t)a;
+    scheduler->position[scheduler->heap[b]] = (int8_t)b;
+}
+
+// Restore the heap order around `index` after its timestamp changed
+void scheduler_fix(scheduler_t* scheduler, int index)
+{
+    while (index > 0 && scheduler_when(scheduler, (index - 1) / 2) > scheduler_when(scheduler, index)) {
+        scheduler_swap(scheduler, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+
+    for (;;) {
+        int smallest = index;
+        int left = 2 * index + 1;
+        int right = left + 1;
+
+        if (left < scheduler->count && scheduler_when(scheduler, left) < scheduler_when(scheduler, smallest)) {
+            smallest = left;
+        }
+        if (right < scheduler->count && scheduler_when(scheduler, right) < scheduler_when(scheduler, smallest)) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            return;
+        }
+
+        scheduler_swap(scheduler, index, smallest);
+        index = smallest;
+    }
+}
+
+// Schedule event `id` at cycle `when`, replacing any earlier schedule of the same event
+void scheduler_schedule(scheduler_t* scheduler, scheduler_event_id_t id, uint64_t when, scheduler_callback_t callback, void* context)
+{
+    scheduler_event_t* event = &scheduler->events[id];
+    event->when = when;
+    event->callback = callback;
+    event->context = context;
+
+    int index = scheduler->position[id];
+    if (index < 0) {
+        index = scheduler->count++;
+        scheduler->heap[index] = (uint8_t)id;
+        scheduler->position[id] = (int8_t)index;
+    }
+
+    scheduler_fix(scheduler, index);
+}
+
+void scheduler_cancel(scheduler_t* scheduler, scheduler_event_id_t id)
+{
+    int index = scheduler->position[id];
+    if (index < 0) {
+        return;
+    }
+
+    scheduler->position[id] = -1;
+    if (--scheduler->count > index) {
+        scheduler->heap[index] = scheduler->heap[scheduler->count];
+        scheduler->position[scheduler->heap[index]] = (int8_t)index;
+        scheduler_fix(scheduler, index);
+    }
+}
+
+// Fire every event that is due at cycle `now`, in timestamp order
+// Callbacks may schedule further events, including ones that are already due
+void scheduler_run(scheduler_t* scheduler, uint64_t now)
+{
+    while (scheduler->count > 0 && scheduler_when(scheduler, 0) <= now) {
+        uint8_t id = scheduler->heap[0];
+        scheduler_event_t event = scheduler->events[id];
+        scheduler_cancel(scheduler, (scheduler_event_id_t)id);
+        event.callback(event.context, event.when);
+    }
+}
+
+#endif // SCHEDULER_H_
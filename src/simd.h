@@ -0,0 +1,295 @@
+// Vectors of eight 16 bit lanes
+// The PPU composes scanlines eight BGR555 pixels at a time, and the sound mixer sums channels eight
+// samples at a time, through these helpers. They map onto SSE2 on x86 (always present on x86-64),
+// NEON on ARM, and plain loops everywhere else, so each is written once.
+
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <stdint.h> // for uint16_t
+
+#define SIMD_LANES 8
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE2 1
+#include <emmintrin.h>
+typedef __m128i simd_u16_t;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SIMD_NEON 1
+#include <arm_neon.h>
+typedef uint16x8_t simd_u16_t;
+#else
+typedef struct simd_u16 {
+    uint16_t lane[SIMD_LANES];
+} simd_u16_t;
+#endif
+
+#if SIMD_SSE2
+
+static inline simd_u16_t simd_load(const uint16_t* p)
+{
+    return _mm_loadu_si128((const __m128i*)p);
+}
+
+static inline void simd_store(uint16_t* p, simd_u16_t a)
+{
+    _mm_storeu_si128((__m128i*)p, a);
+}
+
+static inline simd_u16_t simd_set1(uint16_t value)
+{
+    return _mm_set1_epi16((short)value);
+}
+
+static inline simd_u16_t simd_and(simd_u16_t a, simd_u16_t b)
+{
+    return _mm_and_si128(a, b);
+}
+
+static inline simd_u16_t simd_or(simd_u16_t a, simd_u16_t b)
+{
+    return _mm_or_si128(a, b);
+}
+
+static inline simd_u16_t simd_not(simd_u16_t a)
+{
+    return _mm_xor_si128(a, _mm_set1_epi16(-1));
+}
+
+static inline simd_u16_t simd_eq(simd_u16_t a, simd_u16_t b)
+{
+    return _mm_cmpeq_epi16(a, b);
+}
+
+static inline simd_u16_t simd_add(simd_u16_t a, simd_u16_t b)
+{
+    return _mm_add_epi16(a, b);
+}
+
+static inline simd_u16_t simd_sub(simd_u16_t a, simd_u16_t b)
+{
+    return _mm_sub_epi16(a, b);
+}
+
+static inline simd_u16_t simd_mul(simd_u16_t a, simd_u16_t b)
+{
+    return _mm_mullo_epi16(a, b);
+}
+
+static inline simd_u16_t simd_shl(simd_u16_t a, int n)
+{
+    return _mm_slli_epi16(a, n);
+}
+
+static inline simd_u16_t simd_shr(simd_u16_t a, int n)
+{
+    return _mm_srli_epi16(a, n);
+}
+
+// Lanes must be below 0x8000, SSE2 only has a signed minimum
+static inline simd_u16_t simd_min(simd_u16_t a, simd_u16_t b)
+{
+    return _mm_min_epi16(a, b);
+}
+
+// Lanes must be below 0x8000, SSE2 only has a signed maximum
+static inline simd_u16_t simd_max(simd_u16_t a, simd_u16_t b)
+{
+    return _mm_max_epi16(a, b);
+}
+
+// mask ? a : b, every lane of the mask must be all ones or all zeros
+static inline simd_u16_t simd_select(simd_u16_t mask, simd_u16_t a, simd_u16_t b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Store eight 32 bit values lo | hi << 16
+static inline void simd_store_interleaved(uint32_t* p, simd_u16_t lo, simd_u16_t hi)
+{
+    _mm_storeu_si128((__m128i*)p, _mm_unpacklo_epi16(lo, hi));
+    _mm_storeu_si128((__m128i*)(p + 4), _mm_unpackhi_epi16(lo, hi));
+}
+
+#elif SIMD_NEON
+
+static inline simd_u16_t simd_load(const uint16_t* p)
+{
+    return vld1q_u16(p);
+}
+
+static inline void simd_store(uint16_t* p, simd_u16_t a)
+{
+    vst1q_u16(p, a);
+}
+
+static inline simd_u16_t simd_set1(uint16_t value)
+{
+    return vdupq_n_u16(value);
+}
+
+static inline simd_u16_t simd_and(simd_u16_t a, simd_u16_t b)
+{
+    return vandq_u16(a, b);
+}
+
+static inline simd_u16_t simd_or(simd_u16_t a, simd_u16_t b)
+{
+    return vorrq_u16(a, b);
+}
+
+static inline simd_u16_t simd_not(simd_u16_t a)
+{
+    return vmvnq_u16(a);
+}
+
+static inline simd_u16_t simd_eq(simd_u16_t a, simd_u16_t b)
+{
+    return vceqq_u16(a, b);
+}
+
+static inline simd_u16_t simd_add(simd_u16_t a, simd_u16_t b)
+{
+    return vaddq_u16(a, b);
+}
+
+static inline simd_u16_t simd_sub(simd_u16_t a, simd_u16_t b)
+{
+    return vsubq_u16(a, b);
+}
+
+static inline simd_u16_t simd_mul(simd_u16_t a, simd_u16_t b)
+{
+    return vmulq_u16(a, b);
+}
+
+static inline simd_u16_t simd_shl(simd_u16_t a, int n)
+{
+    return vshlq_u16(a, vdupq_n_s16((int16_t)n));
+}
+
+static inline simd_u16_t simd_shr(simd_u16_t a, int n)
+{
+    return vshlq_u16(a, vdupq_n_s16((int16_t)-n));
+}
+
+static inline simd_u16_t simd_min(simd_u16_t a, simd_u16_t b)
+{
+    return vminq_u16(a, b);
+}
+
+static inline simd_u16_t simd_max(simd_u16_t a, simd_u16_t b)
+{
+    return vmaxq_u16(a, b);
+}
+
+static inline simd_u16_t simd_select(simd_u16_t mask, simd_u16_t a, simd_u16_t b)
+{
+    return vbslq_u16(mask, a, b);
+}
+
+static inline void simd_store_interleaved(uint32_t* p, simd_u16_t lo, simd_u16_t hi)
+{
+    uint16x8x2_t pair = { { lo, hi } };
+    vst2q_u16((uint16_t*)p, pair);
+}
+
+#else
+
+// Body of a lane by lane operation, `i` is the lane
+#define SIMD_MAP(expression)                     \
+    simd_u16_t r;                                \
+    for (int i = 0; i < SIMD_LANES; i++) {       \
+        r.lane[i] = (uint16_t)(expression);      \
+    }                                            \
+    return r
+
+static inline simd_u16_t simd_load(const uint16_t* p)
+{
+    SIMD_MAP(p[i]);
+}
+
+static inline void simd_store(uint16_t* p, simd_u16_t a)
+{
+    for (int i = 0; i < SIMD_LANES; i++) {
+        p[i] = a.lane[i];
+    }
+}
+
+static inline simd_u16_t simd_set1(uint16_t value)
+{
+    SIMD_MAP(value);
+}
+
+static inline simd_u16_t simd_and(simd_u16_t a, simd_u16_t b)
+{
+    SIMD_MAP(a.lane[i] & b.lane[i]);
+}
+
+static inline simd_u16_t simd_or(simd_u16_t a, simd_u16_t b)
+{
+    SIMD_MAP(a.lane[i] | b.lane[i]);
+}
+
+static inline simd_u16_t simd_not(simd_u16_t a)
+{
+    SIMD_MAP(~a.lane[i]);
+}
+
+static inline simd_u16_t simd_eq(simd_u16_t a, simd_u16_t b)
+{
+    SIMD_MAP(a.lane[i] == b.lane[i] ? 0xFFFF : 0);
+}
+
+static inline simd_u16_t simd_add(simd_u16_t a, simd_u16_t b)
+{
+    SIMD_MAP(a.lane[i] + b.lane[i]);
+}
+
+static inline simd_u16_t simd_sub(simd_u16_t a, simd_u16_t b)
+{
+    SIMD_MAP(a.lane[i] - b.lane[i]);
+}
+
+static inline simd_u16_t simd_mul(simd_u16_t a, simd_u16_t b)
+{
+    SIMD_MAP(a.lane[i] * b.lane[i]);
+}
+
+static inline simd_u16_t simd_shl(simd_u16_t a, int n)
+{
+    SIMD_MAP(a.lane[i] << n);
+}
+
+static inline simd_u16_t simd_shr(simd_u16_t a, int n)
+{
+    SIMD_MAP(a.lane[i] >> n);
+}
+
+static inline simd_u16_t simd_min(simd_u16_t a, simd_u16_t b)
+{
+    SIMD_MAP(a.lane[i] < b.lane[i] ? a.lane[i] : b.lane[i]);
+}
+
+static inline simd_u16_t simd_max(simd_u16_t a, simd_u16_t b)
+{
+    SIMD_MAP(a.lane[i] > b.lane[i] ? a.lane[i] : b.lane[i]);
+}
+
+static inline simd_u16_t simd_select(simd_u16_t mask, simd_u16_t a, simd_u16_t b)
+{
+    SIMD_MAP((mask.lane[i] & a.lane[i]) | (~mask.lane[i] & b.lane[i]));
+}
+
+static inline void simd_store_interleaved(uint32_t* p, simd_u16_t lo, simd_u16_t hi)
+{
+    for (int i = 0; i < SIMD_LANES; i++) {
+        p[i] = lo.lane[i] | ((uint32_t)hi.lane[i] << 16);
+    }
+}
+
+#undef SIMD_MAP
+
+#endif
+
+#endif // SIMD_H_
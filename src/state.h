@@ -0,0 +1,340 @@
+// Savestates
+// A state holds what the program can change: the CPU registers, the device state and the writable
+// memory regions. The BIOS and cartridge are read only, so a state only records their hashes, and
+// can only be loaded while the same images are mapped.
+//
+// The format is a fixed layout of fixed width fields in host byte order, starting with a header that
+// carries the format version and total size. Saving and loading are a series of copies into and out
+// of a caller provided buffer of GBA_STATE_SIZE bytes, about 460 KB, with no allocation or I/O, so
+// states can be taken every frame. Caches derived from memory (decoded blocks, tiles, sprite lists)
+// are not saved and are rebuilt after a load.
+
+#ifndef STATE_H_
+#define STATE_H_
+
+#include "gba.h"
+
+#include <stddef.h> // for offsetof
+#include <stdint.h> // for uint64_t
+#include <string.h> // for memcpy
+
+#define STATE_MAGIC 0x54534247 // "GBST"
+#define STATE_VERSION 4 // Bumped whenever the layout below changes
+
+// gba_load_state results
+#define STATE_LOAD_OK 0
+#define STATE_LOAD_INVALID 1 // Not a state, or one from another version of the format
+#define STATE_LOAD_MISMATCH 2 // The state was saved with a different BIOS or cartridge
+
+typedef struct state_header {
+    uint32_t magic; // STATE_MAGIC
+    uint32_t version; // STATE_VERSION
+    uint32_t size; // GBA_STATE_SIZE of the version that wrote the state
+    uint32_t reserved;
+    uint64_t bios_hash; // state_hash of the BIOS image, 0 if none was mapped
+    uint64_t rom_hash; // state_hash of the cartridge image, 0 if none was mapped
+} state_header_t;
+
+typedef struct state_timer {
+    uint64_t ticks;
+    uint64_t start;
+    uint16_t reload;
+    uint16_t control;
+    uint16_t counter;
+    uint16_t reserved;
+} state_timer_t;
+
+typedef struct state_dma {
+    uint32_t source;
+    uint32_t dest;
+    uint32_t count;
+    uint16_t control;
+    uint16_t reserved;
+} state_dma_t;
+
+typedef struct state {
+    state_header_t header;
+
+    // CPU, condition flags are resolved into cpsr before saving
+    cpu_registers_t registers;
+    uint64_t cycles;
+    uint32_t halted;
+    uint32_t intr_wait;
+
+    // PPU
+    uint32_t frame;
+    uint32_t line;
+    int32_t affine_x[2];
+    int32_t affine_y[2];
+
+    // Timers and sound, without the host output rate adjustments
+    state_timer_t timers[TIMER_COUNT];
+    audio_channel_t channels[4];
+    audio_fifo_t fifos[2];
+    uint8_t wave_ram[2][16];
+    uint64_t audio_time;
+    uint64_t fifo_time;
+    uint64_t sequencer;
+    uint32_t sequencer_step;
+
+    // DMA internal registers, the I/O block only holds what was written
+    state_dma_t dma[DMA_COUNT];
+
+    // Timestamp of each scheduler event, SCHEDULER_NEVER when it is not scheduled
+    uint64_t events[SCHEDULER_EVENT_COUNT];
+
+    // Writable memory
+    char wram[sizeof(((memory_t*)0)->wram)];
+    char wram_chip[sizeof(((memory_t*)0)->wram_chip)];
+    char io[sizeof(((memory_t*)0)->io)];
+    char palette[sizeof(((memory_t*)0)->palette)];
+    char vram[sizeof(((memory_t*)0)->vram)];
+    char oam[sizeof(((memory_t*)0)->oam)];
+    char sram[sizeof(((memory_t*)0)->sram)];
+} state_t;
+
+#define GBA_STATE_SIZE sizeof(state_t)
+
+// 64 bit FNV-1a over 8 byte words, then the remaining bytes and the size
+uint64_t state_hash(const char* data, size_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3ull;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * 0x100000001B3ull;
+    }
+    return (hash ^ size) * 0x100000001B3ull;
+}
+
+// Hashes of the mapped images, worked out the first time a state needs them
+// The cartridge is only read in full at that point, not when it is mapped
+static void state_image_hashes(gba_t* gba, uint64_t* bios, uint64_t* rom)
+{
+    if (gba->bios_hash == 0 && gba->memory->bios != NULL) {
+        gba->bios_hash = state_hash(gba->memory->bios, MEMORY_BIOS_SIZE) | 1;
+    }
+    if (gba->rom_hash == 0 && gba->memory->rom != NULL) {
+        gba->rom_hash = state_hash(gba->memory->rom, gba->memory->rom_size) | 1;
+    }
+    *bios = gba->bios_hash;
+    *rom = gba->rom_hash;
+}
+
+// Callback and context of scheduler event `id`, for rescheduling events after a load
+static void state_event_target(gba_t* gba, int id, scheduler_callback_t* callback, void** context)
+{
+    switch (id) {
+    case SCHEDULER_EVENT_HBLANK:
+        *callback = ppu_hblank;
+        *context = &gba->ppu;
+        break;
+    case SCHEDULER_EVENT_SCANLINE:
+        *callback = ppu_scanline;
+        *context = &gba->ppu;
+        break;
+    case SCHEDULER_EVENT_AUDIO:
+        *callback = audio_batch;
+        *context = &gba->audio;
+        break;
+    case SCHEDULER_EVENT_DMA0:
+    case SCHEDULER_EVENT_DMA1:
+    case SCHEDULER_EVENT_DMA2:
+    case SCHEDULER_EVENT_DMA3:
+        *callback = dma_event;
+        *context = &gba->dma.channels[id - SCHEDULER_EVENT_DMA0];
+        break;
+    default:
+        *callback = timer_overflow;
+        *context = &gba->timers.units[id - SCHEDULER_EVENT_TIMER0];
+        break;
+    }
+}
+
+// Bytes at the start of a state that are not memory, everything up to `wram`
+#define STATE_MACHINE_SIZE offsetof(state_t, wram)
+
+// Save everything but the memory regions, the first STATE_MACHINE_SIZE bytes of the state
+void state_save_machine(gba_t* gba, state_t* state)
+{
+    memset(&state->header, 0, sizeof(state_header_t));
+    state->header.magic = STATE_MAGIC;
+    state->header.version = STATE_VERSION;
+    state->header.size = (uint32_t)GBA_STATE_SIZE;
+    state_image_hashes(gba, &state->header.bios_hash, &state->header.rom_hash);
+
+    cpu_flags_resolve(&gba->cpu);
+    state->registers = gba->cpu.registers;
+    state->cycles = gba->cpu.cycles;
+    state->halted = gba->bus->halted;
+    state->intr_wait = gba->bus->intr_wait;
+
+    state->frame = gba->ppu.frame;
+    state->line = gba->ppu.line;
+    memcpy(state->affine_x, gba->ppu.affine_x, sizeof(state->affine_x));
+    memcpy(state->affine_y, gba->ppu.affine_y, sizeof(state->affine_y));
+
+    memset(state->timers, 0, sizeof(state->timers));
+    for (int n = 0; n < TIMER_COUNT; n++) {
+        const timer_unit_t* unit = &gba->timers.units[n];
+        state->timers[n].ticks = unit->ticks;
+        state->timers[n].start = unit->start;
+        state->timers[n].reload = unit->reload;
+        state->timers[n].control = unit->control;
+        state->timers[n].counter = unit->counter;
+    }
+
+    const audio_t* audio = &gba->audio;
+    memcpy(state->channels, audio->channels, sizeof(state->channels));
+    memcpy(state->fifos, audio->fifos, sizeof(state->fifos));
+    memcpy(state->wave_ram, audio->wave_ram, sizeof(state->wave_ram));
+    state->audio_time = audio->time;
+    state->fifo_time = audio->fifo_time;
+    state->sequencer = audio->sequencer;
+    state->sequencer_step = audio->sequencer_step;
+
+    memset(state->dma, 0, sizeof(state->dma));
+    for (int n = 0; n < DMA_COUNT; n++) {
+        const dma_channel_t* channel = &gba->dma.channels[n];
+        state->dma[n].source = channel->source;
+        state->dma[n].dest = channel->dest;
+        state->dma[n].count = channel->count;
+        state->dma[n].control = channel->control;
+    }
+
+    for (int id = 0; id < SCHEDULER_EVENT_COUNT; id++) {
+        state->events[id] = gba->scheduler.position[id] >= 0 ? gba->scheduler.events[id].when : SCHEDULER_NEVER;
+    }
+}
+
+// Save the state of `gba` into `buffer`, which holds `size` bytes, between two CPU steps
+// The devices must have been reset with gba_reset first
+// Returns 0 on success, 1 if the buffer is smaller than GBA_STATE_SIZE
+int gba_save_state(gba_t* gba, void* buffer, size_t size)
+{
+    if (size < GBA_STATE_SIZE) {
+        return 1;
+    }
+
+    state_t* state = (state_t*)buffer;
+    memory_t* memory = gba->memory;
+
+    state_save_machine(gba, state);
+    memcpy(state->wram, memory->wram, sizeof(state->wram));
+    memcpy(state->wram_chip, memory->wram_chip, sizeof(state->wram_chip));
+    memcpy(state->io, memory->io, sizeof(state->io));
+    memcpy(state->palette, memory->palette, sizeof(state->palette));
+    memcpy(state->vram, memory->vram, sizeof(state->vram));
+    memcpy(state->oam, memory->oam, sizeof(state->oam));
+    memcpy(state->sram, memory->sram, sizeof(state->sram));
+    return 0;
+}
+
+// Check that `buffer` holds a state that can be loaded into `gba`
+// Returns one of the STATE_LOAD_* results
+int gba_check_state(gba_t* gba, const void* buffer, size_t size)
+{
+    const state_t* state = (const state_t*)buffer;
+    if (size < sizeof(state_header_t) || state->header.magic != STATE_MAGIC || state->header.version != STATE_VERSION
+        || state->header.size != GBA_STATE_SIZE || size < GBA_STATE_SIZE) {
+        return STATE_LOAD_INVALID;
+    }
+
+    uint64_t bios;
+    uint64_t rom;
+    state_image_hashes(gba, &bios, &rom);
+    if (state->header.bios_hash != bios || state->header.rom_hash != rom) {
+        return STATE_LOAD_MISMATCH;
+    }
+
+    return STATE_LOAD_OK;
+}
+
+// Replace the state of `gba` with the one in `buffer`, between two CPU steps
+// The devices must have been reset with gba_reset first, the keys currently held are kept
+// Returns one of the STATE_LOAD_* results, `gba` is unchanged unless it is STATE_LOAD_OK
+int gba_load_state(gba_t* gba, const void* buffer, size_t size)
+{
+    int result = gba_check_state(gba, buffer, size);
+    if (result != STATE_LOAD_OK) {
+        return result;
+    }
+
+    const state_t* state = (const state_t*)buffer;
+    memory_t* memory = gba->memory;
+    bus_t* bus = gba->bus;
+
+    uint16_t keys = memory_io_read16(memory, INPUT_KEYINPUT);
+    memcpy(memory->wram, state->wram, sizeof(state->wram));
+    memcpy(memory->wram_chip, state->wram_chip, sizeof(state->wram_chip));
+    memcpy(memory->io, state->io, sizeof(state->io));
+    memcpy(memory->palette, state->palette, sizeof(state->palette));
+    memcpy(memory->vram, state->vram, sizeof(state->vram));
+    memcpy(memory->oam, state->oam, sizeof(state->oam));
+    memcpy(memory->sram, state->sram, sizeof(state->sram));
+    memory_io_write16(memory, INPUT_KEYINPUT, keys);
+
+    gba->cpu.registers = state->registers;
+    memset(&gba->cpu.flags, 0, sizeof(cpu_flags_t));
+    gba->cpu.cycles = state->cycles;
+    bus->halted = (uint8_t)state->halted;
+    bus->intr_wait = (uint8_t)state->intr_wait;
+
+    ppu_t* ppu = &gba->ppu;
+    ppu->frame = state->frame;
+    ppu->line = (uint16_t)state->line;
+    memcpy(ppu->affine_x, state->affine_x, sizeof(ppu->affine_x));
+    memcpy(ppu->affine_y, state->affine_y, sizeof(ppu->affine_y));
+
+    for (int n = 0; n < TIMER_COUNT; n++) {
+        timer_unit_t* unit = &gba->timers.units[n];
+        unit->ticks = state->timers[n].ticks;
+        unit->start = state->timers[n].start;
+        unit->reload = state->timers[n].reload;
+        unit->control = state->timers[n].control;
+        unit->counter = state->timers[n].counter;
+    }
+
+    audio_t* audio = &gba->audio;
+    memcpy(audio->channels, state->channels, sizeof(audio->channels));
+    memcpy(audio->fifos, state->fifos, sizeof(audio->fifos));
+    memcpy(audio->wave_ram, state->wave_ram, sizeof(audio->wave_ram));
+    audio->time = state->audio_time;
+    audio->fifo_time = state->fifo_time;
+    audio->sequencer = state->sequencer;
+    audio->sequencer_step = (uint8_t)state->sequencer_step;
+
+    for (int n = 0; n < DMA_COUNT; n++) {
+        dma_channel_t* channel = &gba->dma.channels[n];
+        channel->source = state->dma[n].source;
+        channel->dest = state->dma[n].dest;
+        channel->count = state->dma[n].count;
+        channel->control = state->dma[n].control;
+    }
+
+    scheduler_init(&gba->scheduler);
+    for (int id = 0; id < SCHEDULER_EVENT_COUNT; id++) {
+        if (state->events[id] != SCHEDULER_NEVER) {
+            scheduler_callback_t callback;
+            void* context;
+            state_event_target(gba, id, &callback, &context);
+            scheduler_schedule(&gba->scheduler, (scheduler_event_id_t)id, state->events[id], callback, context);
+        }
+    }
+
+    // Everything decoded from memory is stale
+    memset(bus->vram_dirty, 0xFF, sizeof(bus->vram_dirty));
+    memset(bus->oam_dirty, 0xFF, sizeof(bus->oam_dirty));
+    memset(ppu->obj_lines, 0, sizeof(ppu->obj_lines));
+    memset(ppu->obj_height, 0, sizeof(ppu->obj_height));
+    bus->written = BUS_UNITS_ALL;
+    bus->code_writes++;
+    block_cache_flush(gba->blocks);
+    return STATE_LOAD_OK;
+}
+
+#endif // STATE_H_
@@ -0,0 +1,150 @@
+// Threads, atomics and timing
+// Thin wrappers over Win32 and POSIX. The atomics are only what the single producer / single
+// consumer structures need: 32 bit loads with acquire and stores and exchanges with release ordering.
+
+#ifndef THREAD_H_
+#define THREAD_H_
+
+#include <stdint.h> // for uint32_t
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+typedef int (*thread_function_t)(void* argument);
+
+typedef struct thread {
+    thread_function_t function;
+    void* argument;
+    int result;
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+} thread_t;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_entry(LPVOID context)
+#else
+static void* thread_entry(void* context)
+#endif
+{
+    thread_t* thread = (thread_t*)context;
+    thread->result = thread->function(thread->argument);
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// Run `function(argument)` on a new thread, `thread` must stay valid until thread_join
+// Returns 0 on success, 1 if the thread could not be created
+int thread_start(thread_t* thread, thread_function_t function, void* argument)
+{
+    thread->function = function;
+    thread->argument = argument;
+    thread->result = 0;
+
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, thread_entry, thread, 0, NULL);
+    return thread->handle == NULL;
+#else
+    return pthread_create(&thread->handle, NULL, thread_entry, thread) != 0;
+#endif
+}
+
+// Wait for the thread to finish, returns the value its function returned
+int thread_join(thread_t* thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+    return thread->result;
+}
+
+static inline uint32_t atomic_load32(volatile uint32_t* p)
+{
+#ifdef _WIN32
+    return (uint32_t)InterlockedCompareExchange((volatile LONG*)p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void atomic_store32(volatile uint32_t* p, uint32_t value)
+{
+#ifdef _WIN32
+    InterlockedExchange((volatile LONG*)p, (LONG)value);
+#else
+    __atomic_store_n(p, value, __ATOMIC_RELEASE);
+#endif
+}
+
+// Store `value` and return what was there before
+static inline uint32_t atomic_exchange32(volatile uint32_t* p, uint32_t value)
+{
+#ifdef _WIN32
+    return (uint32_t)InterlockedExchange((volatile LONG*)p, (LONG)value);
+#else
+    return __atomic_exchange_n(p, value, __ATOMIC_ACQ_REL);
+#endif
+}
+
+// Number of logical processors, at least 1
+uint32_t thread_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (uint32_t)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t)count : 1;
+#endif
+}
+
+// Monotonic clock in nanoseconds
+uint64_t thread_time_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000 + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000 / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Sleep until thread_time_ns reaches `deadline`, returns at once if it already has
+void thread_sleep_until(uint64_t deadline)
+{
+    uint64_t now = thread_time_ns();
+    if (now >= deadline) {
+        return;
+    }
+
+#ifdef _WIN32
+    // Sleep only has millisecond resolution, so it may return a little late
+    Sleep((DWORD)((deadline - now) / 1000000));
+#else
+    struct timespec duration;
+    duration.tv_sec = (time_t)((deadline - now) / 1000000000);
+    duration.tv_nsec = (long)((deadline - now) % 1000000000);
+    nanosleep(&duration, NULL);
+#endif
+}
+
+#endif // THREAD_H_
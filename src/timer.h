@@ -0,0 +1,183 @@
+// Timers
+// The four 16 bit timers are not ticked. A running timer only records the cycle at which its counter
+// held the reload value, and the counter and its overflows are worked out from the cycle counter when
+// something asks for them: a read of TMxCNT_L, the sound FIFOs, or the scheduler event that raises
+// the timer interrupt (only scheduled while the interrupt is enabled).
+//
+// A count-up timer counts with a period equal to the overflow period of the timer below it, starting
+// from the moment it was started, and stands still while that timer is stopped.
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include "irq.h"
+#include "memory.h"
+#include "scheduler.h"
+
+#include <stdint.h> // for uint16_t
+#include <string.h> // for memset
+
+// I/O register offsets
+#define TIMER_CNT_L(n) (0x100 + 4 * (n)) // Counter when read, reload value when written
+#define TIMER_CNT_H(n) (0x102 + 4 * (n)) // Control
+
+// TMxCNT_H bits
+#define TIMER_PRESCALER 0x0003 // 1, 64, 256 or 1024 cycles per count
+#define TIMER_COUNT_UP 0x0004 // Count overflows of the previous timer instead of cycles
+#define TIMER_IRQ 0x0040
+#define TIMER_START 0x0080
+
+#define TIMER_COUNT 4
+
+struct timers;
+
+typedef struct timer_unit {
+    struct timers* timers;
+    int index;
+    uint16_t reload; // Value written to TMxCNT_L, loaded on start and on overflow
+    uint16_t control; // TMxCNT_H
+    uint16_t counter; // Counter while the timer is not counting
+    uint64_t ticks; // Cycles per count, 0 while the timer is not counting
+    uint64_t start; // While counting, cycle at which the counter held `reload`
+} timer_unit_t;
+
+typedef struct timers {
+    timer_unit_t units[TIMER_COUNT];
+    memory_t* memory;
+    scheduler_t* scheduler;
+} timers_t;
+
+static const uint8_t timer_prescaler_shift[4] = { 0, 6, 8, 10 };
+
+void timers_reset(timers_t* timers, memory_t* memory, scheduler_t* scheduler)
+{
+    memset(timers, 0, sizeof(timers_t));
+    timers->memory = memory;
+    timers->scheduler = scheduler;
+    for (int n = 0; n < TIMER_COUNT; n++) {
+        timers->units[n].timers = timers;
+        timers->units[n].index = n;
+    }
+}
+
+// Cycles from one overflow of a counting timer to the next
+static inline uint64_t timer_period(const timer_unit_t* unit)
+{
+    return (0x10000 - (uint64_t)unit->reload) * unit->ticks;
+}
+
+// Counter value at cycle `now`
+uint16_t timer_counter(const timers_t* timers, int n, uint64_t now)
+{
+    const timer_unit_t* unit = &timers->units[n];
+    if (unit->ticks == 0 || now < unit->start) {
+        return unit->counter;
+    }
+
+    return (uint16_t)(unit->reload + (now - unit->start) / unit->ticks % (0x10000 - (uint32_t)unit->reload));
+}
+
+// Number of times timer `n` overflowed in the cycles (from, to]
+uint64_t timer_overflows(const timers_t* timers, int n, uint64_t from, uint64_t to)
+{
+    const timer_unit_t* unit = &timers->units[n];
+    if (unit->ticks == 0 || to <= unit->start || to <= from) {
+        return 0;
+    }
+
+    uint64_t period = timer_period(unit);
+    uint64_t before = from > unit->start ? (from - unit->start) / period : 0;
+    return (to - unit->start) / period - before;
+}
+
+void timer_overflow(void* context, uint64_t when);
+
+// Schedule the interrupt for the next overflow, or cancel it
+static void timer_schedule(timers_t* timers, int n, uint64_t now)
+{
+    timer_unit_t* unit = &timers->units[n];
+    scheduler_event_id_t event = (scheduler_event_id_t)(SCHEDULER_EVENT_TIMER0 + n);
+
+    if (unit->ticks != 0 && (unit->control & TIMER_IRQ)) {
+        uint64_t period = timer_period(unit);
+        uint64_t next = now < unit->start ? unit->start + period : now + period - (now - unit->start) % period;
+        scheduler_schedule(timers->scheduler, event, next, timer_overflow, unit);
+    } else {
+        scheduler_cancel(timers->scheduler, event);
+    }
+}
+
+// Start counting from `counter` at cycle `now`, or stop if the timer is off or has nothing to count
+static void timer_anchor(timers_t* timers, int n, uint16_t counter, uint64_t now)
+{
+    timer_unit_t* unit = &timers->units[n];
+    unit->counter = counter;
+    unit->ticks = 0;
+
+    if (unit->control & TIMER_START) {
+        if (n > 0 && (unit->control & TIMER_COUNT_UP)) {
+            unit->ticks = timers->units[n - 1].ticks != 0 ? timer_period(&timers->units[n - 1]) : 0;
+        } else {
+            unit->ticks = (uint64_t)1 << timer_prescaler_shift[unit->control & TIMER_PRESCALER];
+        }
+    }
+
+    // A counter below the reload value is treated as if it had just been reloaded
+    if (counter < unit->reload) {
+        counter = unit->reload;
+    }
+    unit->start = now - (uint64_t)(counter - unit->reload) * unit->ticks;
+    timer_schedule(timers, n, now);
+}
+
+// Scheduler event, a timer with its interrupt enabled overflowed
+void timer_overflow(void* context, uint64_t when)
+{
+    timer_unit_t* unit = (timer_unit_t*)context;
+    irq_request(unit->timers->memory, (uint16_t)(IRQ_TIMER0 << unit->index));
+    timer_schedule(unit->timers, unit->index, when);
+}
+
+// Bring TMxCNT_L up to date before it is read
+void timers_read(timers_t* timers, uint32_t offset, uint64_t now)
+{
+    int n = (int)((offset - TIMER_CNT_L(0)) / 4);
+    memory_io_write16(timers->memory, TIMER_CNT_L(n), timer_counter(timers, n, now));
+}
+
+// `size` bytes of timer registers were written at `offset`, the access is aligned to its size
+void timers_write(timers_t* timers, uint32_t offset, int size, uint64_t now)
+{
+    int n = (int)((offset - TIMER_CNT_L(0)) / 4);
+    timer_unit_t* unit = &timers->units[n];
+
+    // The count-up timers above this one count its overflows, so they are moved with it
+    int last = n;
+    uint16_t counters[TIMER_COUNT];
+    counters[n] = timer_counter(timers, n, now);
+    while (last + 1 < TIMER_COUNT && (timers->units[last + 1].control & TIMER_COUNT_UP)) {
+        last++;
+        counters[last] = timer_counter(timers, last, now);
+    }
+
+    // TMxCNT_L writes set the reload value, a running timer counts in the new range from now
+    // The I/O block holds the counter there, so only the bytes that were written are taken
+    for (uint32_t byte = offset & 3; byte < (offset & 3) + (uint32_t)size && byte < 2; byte++) {
+        uint16_t value = (uint8_t)timers->memory->io[TIMER_CNT_L(n) + byte];
+        unit->reload = (uint16_t)((unit->reload & ~(0xFF << (byte * 8))) | (value << (byte * 8)));
+    }
+    uint16_t control = memory_io_read16(timers->memory, TIMER_CNT_H(n));
+    if (!(unit->control & TIMER_START) && (control & TIMER_START)) {
+        counters[n] = unit->reload;
+    }
+    unit->control = control;
+
+    for (int i = n; i <= last; i++) {
+        timer_anchor(timers, i, counters[i], now);
+    }
+
+    // TMxCNT_L reads back the counter, not the reload value
+    memory_io_write16(timers->memory, TIMER_CNT_L(n), timer_counter(timers, n, now));
+}
+
+#endif // TIMER_H_
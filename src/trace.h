@@ -0,0 +1,243 @@
+// Tracing for the CPU core
+// Text tracing is selected at build time with GBA_TRACE_LEVEL, anything above the
+// level is compiled out. Binary tracing records every instruction into an in-memory
+// ring buffer when GBA_TRACE_RING is set, see tracedump.c for the offline decoder.
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <fcntl.h> // for open
+#include <signal.h>
+#include <stdint.h> // for uint32_t
+#include <stdio.h> // for printf
+#include <stdlib.h> // for malloc
+#include <string.h> // for memcpy
+
+#ifdef _WIN32
+#include <io.h> // for _write
+#include <sys/stat.h> // for _S_IWRITE
+#else
+#include <unistd.h> // for write
+#endif
+
+// Trace levels
+#define TRACE_LEVEL_NONE 0 // No text output from the core
+#define TRACE_LEVEL_EVENT 1 // Rare events (crashes, unhandled instructions)
+#define TRACE_LEVEL_INSTRUCTION 2 // One line per executed instruction
+#define TRACE_LEVEL_DETAIL 3 // Operands and results of each instruction
+
+#ifndef GBA_TRACE_LEVEL
+#define GBA_TRACE_LEVEL TRACE_LEVEL_NONE
+#endif
+
+#ifndef GBA_TRACE_RING
+#define GBA_TRACE_RING 0
+#endif
+
+// Disabled trace calls are dead code, so the compiler removes them but still checks the arguments
+#define TRACE_DISABLED(...) do { if (0) printf(__VA_ARGS__); } while (0)
+
+#if GBA_TRACE_LEVEL >= TRACE_LEVEL_EVENT
+#define TRACE_EVENT(...) printf(__VA_ARGS__)
+#else
+#define TRACE_EVENT(...) TRACE_DISABLED(__VA_ARGS__)
+#endif
+
+#if GBA_TRACE_LEVEL >= TRACE_LEVEL_INSTRUCTION
+#define TRACE_INSTRUCTION(...) printf(__VA_ARGS__)
+#else
+#define TRACE_INSTRUCTION(...) TRACE_DISABLED(__VA_ARGS__)
+#endif
+
+#if GBA_TRACE_LEVEL >= TRACE_LEVEL_DETAIL
+#define TRACE_DETAIL(...) printf(__VA_ARGS__)
+#else
+#define TRACE_DETAIL(...) TRACE_DISABLED(__VA_ARGS__)
+#endif
+
+// Ring buffer file format
+// A trace_file_header_t followed by `count` trace_record_t, oldest first
+#define TRACE_FILE_MAGIC 0x4543415254414247ULL // "GBATRACE"
+#define TRACE_FILE_VERSION 1
+
+// Record flags
+#define TRACE_RECORD_THUMB 0x1 // The instruction was a Thumb instruction
+#define TRACE_RECORD_FAILED 0x2 // The instruction could not be executed
+
+typedef struct trace_file_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count; // Number of records in the file
+    uint64_t total; // Number of instructions recorded, including ones that were overwritten
+} trace_file_header_t;
+
+// One executed instruction
+typedef struct trace_record {
+    uint32_t pc; // Address of the instruction
+    uint32_t opcode; // Instruction (Thumb instructions use the low 16 bits)
+    uint32_t cpsr; // CPSR after the instruction
+    uint16_t written; // Mask of r0-r15 that were changed by the instruction
+    uint16_t flags; // TRACE_RECORD_* flags
+    uint32_t r[16]; // r0-r15 after the instruction
+} trace_record_t;
+
+typedef struct trace_ring {
+    trace_record_t* records;
+    uint32_t mask; // Capacity - 1, the capacity is a power of 2
+    uint64_t head; // Number of records written so far
+} trace_ring_t;
+
+// Allocate a ring that holds the last `capacity` instructions
+// The capacity is rounded up to a power of 2
+// Returns 0 on success, 1 if the buffer could not be allocated
+int trace_ring_init(trace_ring_t* ring, uint32_t capacity)
+{
+    uint32_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring->records = (trace_record_t*)calloc(size, sizeof(trace_record_t));
+    ring->mask = size - 1;
+    ring->head = 0;
+
+    return ring->records == NULL;
+}
+
+void trace_ring_free(trace_ring_t* ring)
+{
+    free(ring->records);
+    ring->records = NULL;
+}
+
+// Record an instruction
+// `before` and `after` are r0-r15 before and after the instruction was executed
+static inline void trace_ring_record(trace_ring_t* ring, uint32_t pc, uint32_t opcode, uint16_t flags, uint32_t cpsr, const uint32_t* before, const uint32_t* after)
+{
+    trace_record_t* record = &ring->records[ring->head & ring->mask];
+    uint16_t written = 0;
+
+    for (int i = 0; i < 16; i++) {
+        written |= (uint16_t)((before[i] != after[i]) << i);
+    }
+
+    record->pc = pc;
+    record->opcode = opcode;
+    record->cpsr = cpsr;
+    record->written = written;
+    record->flags = flags;
+    memcpy(record->r, after, sizeof(record->r));
+
+    ring->head++;
+}
+
+// Write the ring to a file, oldest record first
+// Returns 0 on success, 1 if the file could not be written
+int trace_ring_dump(const trace_ring_t* ring, const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return 1;
+    }
+
+    uint64_t capacity = (uint64_t)ring->mask + 1;
+    uint64_t count = ring->head < capacity ? ring->head : capacity;
+
+    trace_file_header_t header;
+    header.magic = TRACE_FILE_MAGIC;
+    header.version = TRACE_FILE_VERSION;
+    header.record_size = sizeof(trace_record_t);
+    header.count = count;
+    header.total = ring->head;
+    fwrite(&header, sizeof(header), 1, file);
+
+    // The oldest record is at head when the ring has wrapped, otherwise at 0
+    for (uint64_t i = ring->head - count; i < ring->head; i++) {
+        fwrite(&ring->records[i & ring->mask], sizeof(trace_record_t), 1, file);
+    }
+
+    int error = ferror(file);
+    fclose(file);
+    return error != 0;
+}
+
+// Ring and file written by the crash handler
+// The file is opened up front, since only async signal safe calls can be made in the handler
+const trace_ring_t* trace_crash_ring;
+int trace_crash_file = -1;
+
+// Write all of `data` to the crash file with the raw system call
+// Returns 0 on success, 1 if the data could not be written
+static int trace_crash_write(const void* data, size_t size)
+{
+    const char* bytes = (const char*)data;
+
+    while (size > 0) {
+#ifdef _WIN32
+        int written = _write(trace_crash_file, bytes, size > 0x40000000 ? 0x40000000 : (unsigned int)size);
+#else
+        ssize_t written = write(trace_crash_file, bytes, size);
+#endif
+        if (written <= 0) {
+            return 1;
+        }
+        bytes += written;
+        size -= (size_t)written;
+    }
+
+    return 0;
+}
+
+// Writes the same file as trace_ring_dump, the records are written in at most two runs
+void trace_crash_handler(int signal_number)
+{
+    const trace_ring_t* ring = trace_crash_ring;
+
+    if (ring != NULL && trace_crash_file >= 0) {
+        uint64_t capacity = (uint64_t)ring->mask + 1;
+        uint64_t count = ring->head < capacity ? ring->head : capacity;
+        uint64_t start = (ring->head - count) & ring->mask;
+        uint64_t first = count < capacity - start ? count : capacity - start;
+
+        trace_file_header_t header;
+        header.magic = TRACE_FILE_MAGIC;
+        header.version = TRACE_FILE_VERSION;
+        header.record_size = sizeof(trace_record_t);
+        header.count = count;
+        header.total = ring->head;
+
+        if (!trace_crash_write(&header, sizeof(header))
+            && !trace_crash_write(&ring->records[start], (size_t)first * sizeof(trace_record_t))) {
+            trace_crash_write(&ring->records[0], (size_t)(count - first) * sizeof(trace_record_t));
+        }
+    }
+
+    // Restore the default handler and re-raise so the process still terminates
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+// Dump the ring to `path` if the process crashes
+// The file is created now, and stays empty unless the process crashes
+// Returns 0 on success, 1 if the file could not be created
+int trace_ring_dump_on_crash(const trace_ring_t* ring, const char* path)
+{
+#ifdef _WIN32
+    trace_crash_file = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    trace_crash_file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (trace_crash_file < 0) {
+        return 1;
+    }
+    trace_crash_ring = ring;
+
+    signal(SIGSEGV, trace_crash_handler);
+    signal(SIGILL, trace_crash_handler);
+    signal(SIGFPE, trace_crash_handler);
+    signal(SIGABRT, trace_crash_handler);
+    return 0;
+}
+
+#endif // TRACE_H_
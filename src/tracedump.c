@@ -0,0 +1,61 @@
+// Offline decoder for the binary instruction trace written by trace_ring_dump
+// Usage: tracedump <trace.bin>
+
+#include <stdio.h>
+
+#include "trace.h"
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        printf("Usage: %s <trace.bin>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        printf("Failed to open trace file %s\n", argv[1]);
+        return 1;
+    }
+
+    // Check the header
+    trace_file_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_FILE_MAGIC) {
+        printf("Not a trace file: %s\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    if (header.version != TRACE_FILE_VERSION || header.record_size != sizeof(trace_record_t)) {
+        printf("Unsupported trace version %u (record size %u)\n", header.version, header.record_size);
+        fclose(file);
+        return 1;
+    }
+
+    printf("%llu records (%llu instructions traced)\n", (unsigned long long)header.count, (unsigned long long)header.total);
+
+    // Print each record, with the registers the instruction changed
+    uint64_t first = header.total - header.count;
+    trace_record_t record;
+    for (uint64_t i = 0; i < header.count && fread(&record, sizeof(record), 1, file) == 1; i++) {
+        if (record.flags & TRACE_RECORD_THUMB) {
+            printf("%10llu [THUMB] PC=0x%08X Instruction=0x%04X     CPSR=0x%08X", (unsigned long long)(first + i), record.pc, record.opcode & 0xFFFF, record.cpsr);
+        } else {
+            printf("%10llu [ARM]   PC=0x%08X Instruction=0x%08X CPSR=0x%08X", (unsigned long long)(first + i), record.pc, record.opcode, record.cpsr);
+        }
+
+        for (int r = 0; r < 16; r++) {
+            if ((record.written >> r) & 0x1) {
+                printf(" r%d=0x%X", r, record.r[r]);
+            }
+        }
+
+        if (record.flags & TRACE_RECORD_FAILED) {
+            printf(" FAILED");
+        }
+        printf("\n");
+    }
+
+    fclose(file);
+    return 0;
+}
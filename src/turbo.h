@@ -0,0 +1,93 @@
+// Turbo and frame skipping
+// Decides which frames are drawn. A skipped frame still runs the whole machine: the PPU keeps its
+// line timing, the blank and VCount interrupts, the blank DMAs and the affine reference points, and
+// only leaves out composing the lines (see ppu_set_framebuffer). The game runs exactly as it would
+// with every frame drawn.
+//
+// One frame is drawn out of every skip + 1. The skip ratio follows the host in two ways:
+// - throttled to real time, turbo_late raises it while frames finish after their deadline and lowers
+//   it again once they have been on time for a while;
+// - unthrottled (fast forward), turbo_measure estimates the speed in whole multiples of real time
+//   and sets the ratio so about as many frames are drawn as at normal speed. The speed is also the
+//   factor the audio is decimated by, see audio_set_speed.
+
+#ifndef TURBO_H_
+#define TURBO_H_
+
+#include <stdint.h> // for uint32_t
+#include <string.h> // for memset
+
+#define TURBO_MAX_SKIP 3 // Highest skip ratio the throttled adaptive mode goes to by default
+#define TURBO_MAX_SPEED 16 // Highest speed the unthrottled mode decimates for
+#define TURBO_CALM_FRAMES 120 // Frames on time before the adaptive ratio goes down again
+#define TURBO_WINDOW_FRAMES 30 // Frames in each speed measurement
+
+typedef struct turbo {
+    uint32_t skip; // Frames skipped after each drawn one
+    uint32_t min_skip; // Bounds of the adaptive ratio, equal for a fixed one
+    uint32_t max_skip;
+    uint32_t countdown; // Frames left to skip before the next drawn one
+    uint32_t calm; // Frames on time since the ratio last changed
+    uint32_t speed; // Measured speed in multiples of real time, at least 1, see turbo_measure
+    uint32_t window_frames; // Frames in the current speed measurement
+    uint64_t window_start; // Time the measurement started, in ns
+} turbo_t;
+
+// Skip between `min_skip` and `max_skip` frames after each drawn one, starting at `min_skip`
+void turbo_init(turbo_t* turbo, uint32_t min_skip, uint32_t max_skip)
+{
+    memset(turbo, 0, sizeof(turbo_t));
+    turbo->skip = min_skip;
+    turbo->min_skip = min_skip;
+    turbo->max_skip = max_skip > min_skip ? max_skip : min_skip;
+    turbo->speed = 1;
+}
+
+// Return 1 if the next frame should be drawn, 0 if it is skipped
+static inline int turbo_draw(turbo_t* turbo)
+{
+    if (turbo->countdown > 0) {
+        turbo->countdown--;
+        return 0;
+    }
+
+    turbo->countdown = turbo->skip;
+    return 1;
+}
+
+// Throttled mode, `late` is 1 when the last frame finished after its real time deadline
+void turbo_late(turbo_t* turbo, int late)
+{
+    if (late) {
+        turbo->calm = 0;
+        if (turbo->skip < turbo->max_skip) {
+            turbo->skip++;
+        }
+    } else if (++turbo->calm >= TURBO_CALM_FRAMES) {
+        turbo->calm = 0;
+        if (turbo->skip > turbo->min_skip) {
+            turbo->skip--;
+        }
+    }
+}
+
+// Unthrottled mode, call once per frame with the current time
+// Returns the speed, which changes at the end of each measurement window
+uint32_t turbo_measure(turbo_t* turbo, uint64_t now_ns, uint64_t frame_ns)
+{
+    if (turbo->window_frames == 0) {
+        turbo->window_start = now_ns;
+    }
+
+    if (++turbo->window_frames > TURBO_WINDOW_FRAMES) {
+        uint64_t elapsed = now_ns - turbo->window_start;
+        uint64_t speed = elapsed > 0 ? (uint64_t)TURBO_WINDOW_FRAMES * frame_ns / elapsed : TURBO_MAX_SPEED;
+        turbo->speed = speed < 1 ? 1 : speed > TURBO_MAX_SPEED ? TURBO_MAX_SPEED : (uint32_t)speed;
+        turbo->skip = turbo->speed - 1;
+        turbo->window_frames = 0;
+    }
+
+    return turbo->speed;
+}
+
+#endif // TURBO_H_
@@ -0,0 +1,427 @@
+// Benchmarks for the CPU core and the memory bus
+// Micro benchmarks run a single instruction handler (or cpu_check_condition) in a tight loop,
+// macro benchmarks interpret fixed instruction streams and cartridges one instruction at a time,
+// and the system benchmark runs cartridges through gba_run_frame with the block cache and JIT.
+//
+// Every result is printed as one JSON object per line, so runs of two builds can be compared by
+// a script. Times are the best of BENCH_REPEATS runs.
+//
+// Usage: gbabench [-f frames] [-b bios] [rom...]
+// Cartridges start with the BIOS intro when a BIOS is given, and straight away otherwise.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gba.h"
+#include "thread.h"
+
+#define BENCH_REPEATS 3
+#define BENCH_OPS (1 << 21) // Handler calls per micro benchmark
+#define BENCH_BATCH 1024 // Handler calls between two register resets
+#define BENCH_STREAM_INSTRUCTIONS 20000000 // Instructions per instruction stream
+#define BENCH_FRAMES 300 // Frames per cartridge by default
+
+// Registers the micro benchmarks start from: low registers hold small values and r4 points at
+// WRAM, so loads and stores hit the fast path
+#define BENCH_BASE 0x02000000
+#define BENCH_STACK 0x03007F00
+
+typedef enum bench_kind {
+    BENCH_ARM, // An ARM instruction through cpu_process_arm_instruction
+    BENCH_THUMB, // A Thumb instruction through cpu_process_thumb_instruction
+    BENCH_CONDITION, // cpu_check_condition on the instruction's condition with the flags resolved
+    BENCH_CONDITION_PENDING, // The same with the flags still pending from a logical instruction
+    BENCH_CONDITION_MIXED, // cpu_check_condition cycling through every condition code
+} bench_kind_t;
+
+typedef struct bench_micro {
+    const char* name;
+    bench_kind_t kind;
+    uint32_t instruction;
+} bench_micro_t;
+
+static const bench_micro_t bench_micros[] = {
+    // Data processing
+    { "arm.mov_imm", BENCH_ARM, 0xE3A00001 }, // mov r0, #1
+    { "arm.add_reg", BENCH_ARM, 0xE0810002 }, // add r0, r1, r2
+    { "arm.adds_reg", BENCH_ARM, 0xE0910002 }, // adds r0, r1, r2
+    { "arm.adc_reg", BENCH_ARM, 0xE0A10002 }, // adc r0, r1, r2
+    { "arm.sub_imm", BENCH_ARM, 0xE2410001 }, // sub r0, r1, #1
+    { "arm.and_reg", BENCH_ARM, 0xE0010002 }, // and r0, r1, r2
+    { "arm.orrs_reg", BENCH_ARM, 0xE1910002 }, // orrs r0, r1, r2
+    { "arm.cmp_reg", BENCH_ARM, 0xE1510002 }, // cmp r1, r2
+    { "arm.addne_skipped", BENCH_ARM, 0x10810002 }, // addne r0, r1, r2 with Z set
+
+    // Barrel shifter
+    { "shift.lsl_imm", BENCH_ARM, 0xE1A00181 }, // mov r0, r1, lsl #3
+    { "shift.lsls_imm", BENCH_ARM, 0xE1B00181 }, // movs r0, r1, lsl #3
+    { "shift.lsr_imm", BENCH_ARM, 0xE1A001A1 }, // mov r0, r1, lsr #3
+    { "shift.asr_imm", BENCH_ARM, 0xE1A001C1 }, // mov r0, r1, asr #3
+    { "shift.ror_imm", BENCH_ARM, 0xE1A001E1 }, // mov r0, r1, ror #3
+    { "shift.rrx", BENCH_ARM, 0xE1A00061 }, // mov r0, r1, rrx
+    { "shift.lsl_reg", BENCH_ARM, 0xE1A00211 }, // mov r0, r1, lsl r2
+    { "shift.lsrs_reg", BENCH_ARM, 0xE1B00231 }, // movs r0, r1, lsr r2
+
+    // Loads and stores
+    { "mem.ldr_imm", BENCH_ARM, 0xE5940004 }, // ldr r0, [r4, #4]
+    { "mem.str_imm", BENCH_ARM, 0xE5840004 }, // str r0, [r4, #4]
+    { "mem.ldrb_imm", BENCH_ARM, 0xE5D40004 }, // ldrb r0, [r4, #4]
+    { "mem.ldr_reg", BENCH_ARM, 0xE7940002 }, // ldr r0, [r4, r2]
+    { "mem.ldr_post", BENCH_ARM, 0xE4940004 }, // ldr r0, [r4], #4
+    { "mem.ldm8", BENCH_ARM, 0xE8941FE0 }, // ldmia r4, {r5-r12}
+    { "mem.stm8", BENCH_ARM, 0xE8841FE0 }, // stmia r4, {r5-r12}
+
+    // Thumb
+    { "thumb.mov_imm", BENCH_THUMB, 0x2001 }, // movs r0, #1
+    { "thumb.add_reg", BENCH_THUMB, 0x1888 }, // adds r0, r1, r2
+    { "thumb.lsl_imm", BENCH_THUMB, 0x0088 }, // lsls r0, r1, #2
+    { "thumb.alu_and", BENCH_THUMB, 0x4008 }, // ands r0, r1
+    { "thumb.alu_eor", BENCH_THUMB, 0x4048 }, // eors r0, r1
+    { "thumb.alu_lsl", BENCH_THUMB, 0x4088 }, // lsls r0, r1
+    { "thumb.alu_lsr", BENCH_THUMB, 0x40C8 }, // lsrs r0, r1
+    { "thumb.alu_asr", BENCH_THUMB, 0x4108 }, // asrs r0, r1
+    { "thumb.alu_adc", BENCH_THUMB, 0x4148 }, // adcs r0, r1
+    { "thumb.alu_sbc", BENCH_THUMB, 0x4188 }, // sbcs r0, r1
+    { "thumb.alu_ror", BENCH_THUMB, 0x41C8 }, // rors r0, r1
+    { "thumb.alu_tst", BENCH_THUMB, 0x4208 }, // tst r0, r1
+    { "thumb.alu_neg", BENCH_THUMB, 0x4248 }, // negs r0, r1
+    { "thumb.alu_cmp", BENCH_THUMB, 0x4288 }, // cmp r0, r1
+    { "thumb.alu_cmn", BENCH_THUMB, 0x42C8 }, // cmn r0, r1
+    { "thumb.alu_orr", BENCH_THUMB, 0x4308 }, // orrs r0, r1
+    { "thumb.alu_mul", BENCH_THUMB, 0x4348 }, // muls r0, r1
+    { "thumb.alu_bic", BENCH_THUMB, 0x4388 }, // bics r0, r1
+    { "thumb.alu_mvn", BENCH_THUMB, 0x43C8 }, // mvns r0, r1
+    { "thumb.ldr_imm", BENCH_THUMB, 0x6860 }, // ldr r0, [r4, #4]
+    { "thumb.str_imm", BENCH_THUMB, 0x6060 }, // str r0, [r4, #4]
+    { "thumb.push4", BENCH_THUMB, 0xB40F }, // push {r0-r3}
+    { "thumb.pop4", BENCH_THUMB, 0xBC0F }, // pop {r0-r3}
+    { "thumb.ldmia4", BENCH_THUMB, 0xCC0F }, // ldmia r4!, {r0-r3}
+
+    // Conditions
+    { "cond.al", BENCH_CONDITION, 0xE0000000 },
+    { "cond.eq", BENCH_CONDITION, 0x00000000 },
+    { "cond.gt_pending", BENCH_CONDITION_PENDING, 0xC0000000 },
+    { "cond.mixed", BENCH_CONDITION_MIXED, 0x00000000 },
+};
+
+// Instruction streams, loops that run until the instruction budget is used up
+// Registers used as shifted operands keep small values, so every stream stays in bounds
+typedef struct bench_stream {
+    const char* name;
+    const uint32_t* code;
+    size_t size; // Bytes
+} bench_stream_t;
+
+static const uint32_t bench_stream_arm_alu[] = {
+    0xE3A01001, // mov r1, #1
+    0xE3A02003, // mov r2, #3
+    0xE0810002, // loop: add r0, r1, r2
+    0xE0903101, // adds r3, r0, r1, lsl #2
+    0xE02341E2, // eor r4, r3, r2, ror #3
+    0xE2445007, // sub r5, r4, #7
+    0xE1856231, // orr r6, r5, r1, lsr r2
+    0xE0067002, // and r7, r6, r2
+    0xE3570005, // cmp r7, #5
+    0x11A000C2, // movne r0, r2, asr #1
+    0xE1C78001, // bic r8, r7, r1
+    0xEAFFFFF5, // b loop
+};
+
+static const uint32_t bench_stream_arm_memory[] = {
+    0xE3A01402, // mov r1, #0x02000000
+    0xE3A02403, // mov r2, #0x03000000
+    0xE5910004, // loop: ldr r0, [r1, #4]
+    0xE5820008, // str r0, [r2, #8]
+    0xE5D13002, // ldrb r3, [r1, #2]
+    0xE5C23001, // strb r3, [r2, #1]
+    0xE8A207F8, // stmia r2!, {r3-r10}
+    0xE93207F8, // ldmdb r2!, {r3-r10}
+    0xE2800001, // add r0, r0, #1
+    0xE5810004, // str r0, [r1, #4]
+    0xEAFFFFF6, // b loop
+};
+
+static const uint32_t bench_stream_thumb_alu[] = {
+    0xE28F0001, // add r0, pc, #1
+    0xE12FFF10, // bx r0
+    0x22032101, // movs r1, #1; movs r2, #3
+    0x00831888, // loop: adds r0, r1, r2; lsls r3, r0, #2
+    0x400B4053, // eors r3, r2; ands r3, r1
+    0x4354431C, // orrs r4, r3; muls r4, r2
+    0x438D2C05, // cmp r4, #5; bics r5, r1
+    0x0000E7F6, // b loop
+};
+
+static const bench_stream_t bench_streams[] = {
+    { "stream.arm_alu", bench_stream_arm_alu, sizeof(bench_stream_arm_alu) },
+    { "stream.arm_memory", bench_stream_arm_memory, sizeof(bench_stream_arm_memory) },
+    { "stream.thumb_alu", bench_stream_thumb_alu, sizeof(bench_stream_thumb_alu) },
+};
+
+static void bench_reset_registers(cpu_t* cpu, uint32_t cpsr)
+{
+    for (int i = 0; i < 13; i++) {
+        cpu->registers.r[i] = (uint32_t)i;
+    }
+    cpu->registers.r[4] = BENCH_BASE;
+    cpu->registers.sp = BENCH_STACK;
+    cpu->registers.lr = 0;
+    cpu->registers.pc = 0;
+    cpu->registers.cpsr = cpsr;
+    memset(&cpu->flags, 0, sizeof(cpu_flags_t));
+}
+
+// Time `BENCH_OPS` runs of one micro benchmark
+// Returns the best time in nanoseconds, 0 if the handler failed
+static uint64_t bench_micro(gba_t* gba, const bench_micro_t* micro)
+{
+    cpu_t* cpu = &gba->cpu;
+
+    // ARM state in system mode, with Z set so conditional instructions are skipped
+    uint32_t cpsr = 0x4000001F | (micro->kind == BENCH_THUMB ? 0 : 0x20);
+    uint64_t best = UINT64_MAX;
+
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+        int ok = 1;
+        volatile int sink = 0;
+        uint64_t start = thread_time_ns();
+
+        for (uint32_t batch = 0; batch < BENCH_OPS / BENCH_BATCH; batch++) {
+            bench_reset_registers(cpu, cpsr);
+            uint32_t instruction = micro->instruction;
+
+            switch (micro->kind) {
+            case BENCH_ARM:
+                for (int i = 0; i < BENCH_BATCH; i++) {
+                    ok &= cpu_process_arm_instruction(cpu, instruction);
+                }
+                break;
+            case BENCH_THUMB:
+                for (int i = 0; i < BENCH_BATCH; i++) {
+                    ok &= cpu_process_thumb_instruction(cpu, (cpu_thumb_instruction_t)instruction);
+                }
+                break;
+            case BENCH_CONDITION:
+                for (int i = 0; i < BENCH_BATCH; i++) {
+                    sink += cpu_check_condition(cpu, instruction);
+                }
+                break;
+            case BENCH_CONDITION_PENDING:
+                for (int i = 0; i < BENCH_BATCH; i++) {
+                    cpu_set_flags_logical(cpu, (uint32_t)i);
+                    sink += cpu_check_condition(cpu, instruction);
+                }
+                break;
+            case BENCH_CONDITION_MIXED:
+                for (int i = 0; i < BENCH_BATCH; i++) {
+                    sink += cpu_check_condition(cpu, (uint32_t)(i % 15) << 28);
+                }
+                break;
+            }
+        }
+
+        uint64_t elapsed = thread_time_ns() - start;
+        if (!ok) {
+            return 0;
+        }
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return best;
+}
+
+// Interpret one instruction at a time until `instructions` have run or `frames` frames have been
+// completed, servicing the devices like gba_run_frame does
+// Returns the number of instructions executed, 0 if the CPU hit an instruction it could not execute
+static uint64_t bench_interpret(gba_t* gba, uint64_t instructions, uint32_t frames)
+{
+    uint64_t executed = 0;
+    uint32_t frame = gba->ppu.frame;
+
+    while (executed < instructions && gba->ppu.frame - frame < frames && cpu_check_running(&gba->cpu)) {
+        if (gba->bus->halted) {
+            if (irq_wakeup(gba->memory)) {
+                gba->bus->halted = 0;
+            } else {
+                gba_skip_to_event(gba);
+            }
+            continue;
+        }
+
+        if (!cpu_step(&gba->cpu)) {
+            return 0;
+        }
+        executed++;
+
+        if (gba->cpu.cycles >= scheduler_next(&gba->scheduler)) {
+            scheduler_run(&gba->scheduler, gba->cpu.cycles);
+        }
+    }
+
+    return executed;
+}
+
+static void bench_print_rate(const char* name, const char* kind, uint64_t instructions, uint64_t ns)
+{
+    printf("{\"benchmark\":\"%s\",\"kind\":\"%s\",\"instructions\":%llu,\"ns\":%llu,\"ns_per_instruction\":%.3f,\"mips\":%.2f}\n",
+        name, kind, (unsigned long long)instructions, (unsigned long long)ns, instructions > 0 ? (double)ns / instructions : 0.0,
+        ns > 0 ? instructions * 1000.0 / ns : 0.0);
+}
+
+static void bench_print_error(const char* name, const char* kind)
+{
+    printf("{\"benchmark\":\"%s\",\"kind\":\"%s\",\"error\":\"instruction failed\"}\n", name, kind);
+}
+
+// Run a cartridge interpreted (for the instruction counts) and through gba_run_frame
+static int bench_rom(const char* path, const file_map_t* bios, uint32_t frames)
+{
+    file_map_t rom;
+    if (file_map_open(&rom, path) || gba_check_rom_header(rom.data, rom.size)) {
+        printf("{\"benchmark\":\"rom.%s\",\"kind\":\"rom\",\"error\":\"invalid ROM file\"}\n", path);
+        file_map_close(&rom);
+        return 1;
+    }
+
+    static gba_t gba;
+    if (gba_init(&gba)) {
+        file_map_close(&rom);
+        return 1;
+    }
+    gba_attach_images(&gba, bios->data, rom.data, (uint32_t)rom.size);
+
+    uint64_t best = UINT64_MAX;
+    uint64_t instructions = 0;
+    uint64_t cycles = 0;
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+        gba_reset(&gba);
+        block_cache_flush(gba.blocks);
+        uint64_t start = thread_time_ns();
+        instructions = bench_interpret(&gba, UINT64_MAX, frames);
+        uint64_t elapsed = thread_time_ns() - start;
+        best = elapsed < best ? elapsed : best;
+        cycles = gba.cpu.cycles;
+    }
+
+    if (instructions == 0) {
+        printf("{\"benchmark\":\"rom.%s\",\"kind\":\"rom\",\"error\":\"instruction failed\"}\n", path);
+    } else {
+        printf("{\"benchmark\":\"rom.%s\",\"kind\":\"rom\",\"frames\":%u,\"instructions\":%llu,\"cycles\":%llu,\"ns\":%llu,"
+               "\"ns_per_instruction\":%.3f,\"mips\":%.2f,\"fps\":%.1f}\n",
+            path, frames, (unsigned long long)instructions, (unsigned long long)cycles, (unsigned long long)best,
+            (double)best / instructions, instructions * 1000.0 / best, frames * 1e9 / best);
+    }
+
+    // The whole system with the block cache and the JIT, which do not count instructions
+    best = UINT64_MAX;
+    int result = GBA_RUN_FRAME;
+    for (int repeat = 0; repeat < BENCH_REPEATS && result == GBA_RUN_FRAME; repeat++) {
+        gba_reset(&gba);
+        block_cache_flush(gba.blocks);
+        uint64_t start = thread_time_ns();
+        for (uint32_t frame = 0; frame < frames && result == GBA_RUN_FRAME; frame++) {
+            result = gba_run_frame(&gba);
+        }
+        uint64_t elapsed = thread_time_ns() - start;
+        best = elapsed < best ? elapsed : best;
+        cycles = gba.cpu.cycles;
+    }
+
+    if (result == GBA_RUN_ERROR) {
+        printf("{\"benchmark\":\"system.%s\",\"kind\":\"system\",\"error\":\"instruction failed\"}\n", path);
+    } else {
+        printf("{\"benchmark\":\"system.%s\",\"kind\":\"system\",\"frames\":%u,\"cycles\":%llu,\"ns\":%llu,\"fps\":%.1f,\"speed\":%.2f}\n",
+            path, frames, (unsigned long long)cycles, (unsigned long long)best, frames * 1e9 / best,
+            cycles * 1e9 / best / GBA_CYCLES_PER_SECOND);
+    }
+
+    gba_free(&gba);
+    file_map_close(&rom);
+    return instructions == 0 || result == GBA_RUN_ERROR;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* bios_path = NULL;
+    uint32_t frames = BENCH_FRAMES;
+    int first_rom = argc;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-f") == 0) {
+            frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (i + 1 < argc && strcmp(argv[i], "-b") == 0) {
+            bios_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            printf("Usage: %s [-f frames] [-b bios] [rom...]\n", argv[0]);
+            return 1;
+        } else {
+            first_rom = i;
+            break;
+        }
+    }
+
+    cpu_init_tables();
+
+    static gba_t gba;
+    if (gba_init(&gba)) {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+
+    // The streams run from a BIOS image of their own
+    static char bios[MEMORY_BIOS_SIZE];
+    gba_attach_images(&gba, bios, NULL, 0);
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(bench_micros) / sizeof(bench_micros[0]); i++) {
+        uint64_t ns = bench_micro(&gba, &bench_micros[i]);
+        if (ns == 0) {
+            bench_print_error(bench_micros[i].name, "micro");
+            failed = 1;
+        } else {
+            bench_print_rate(bench_micros[i].name, "micro", BENCH_OPS, ns);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(bench_streams) / sizeof(bench_streams[0]); i++) {
+        memset(bios, 0, sizeof(bios));
+        memcpy(bios, bench_streams[i].code, bench_streams[i].size);
+        block_cache_flush(gba.blocks);
+
+        uint64_t best = UINT64_MAX;
+        uint64_t instructions = 0;
+        for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+            gba_reset(&gba);
+            uint64_t start = thread_time_ns();
+            instructions = bench_interpret(&gba, BENCH_STREAM_INSTRUCTIONS, UINT32_MAX);
+            uint64_t elapsed = thread_time_ns() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+
+        if (instructions == 0) {
+            bench_print_error(bench_streams[i].name, "stream");
+            failed = 1;
+        } else {
+            bench_print_rate(bench_streams[i].name, "stream", instructions, best);
+        }
+    }
+    gba_free(&gba);
+
+    if (first_rom < argc) {
+        file_map_t bios_file = { 0 };
+        if (bios_path != NULL && (file_map_open(&bios_file, bios_path) || bios_file.size != MEMORY_BIOS_SIZE)) {
+            printf("{\"benchmark\":\"rom\",\"kind\":\"rom\",\"error\":\"invalid BIOS file\"}\n");
+            file_map_close(&bios_file);
+            return 1;
+        }
+        for (int i = first_rom; i < argc; i++) {
+            failed |= bench_rom(argv[i], &bios_file, frames);
+        }
+        file_map_close(&bios_file);
+    }
+
+    return failed;
+}
@@ -0,0 +1,543 @@
+// CPU core tests
+// Each case loads a few instructions into WRAM, runs them through the interpreter (cpu_step) and
+// through the block cache, and checks the registers afterwards. Failures are printed one per line
+// and the exit code is the number of failed checks.
+//
+// Usage: gbatest
+
+#include <stdio.h>
+#include <string.h>
+
+#include "gba.h"
+#include "rewind.h"
+#include "state.h"
+
+#define TEST_BASE 0x02000000 // Address the code of each case is loaded to
+
+static gba_t gba;
+static int failures;
+
+// Print a failed check, `mode` is 0 for the interpreter, 1 for the block cache and 2 for the JIT
+static void test_check(const char* name, int mode, const char* what, uint32_t actual, uint32_t expected)
+{
+    static const char* const modes[] = { "interpreter", "blocks", "jit" };
+
+    if (actual != expected) {
+        printf("FAIL %s (%s): %s = 0x%08X, expected 0x%08X\n", name, modes[mode], what, actual, expected);
+        failures++;
+    }
+}
+
+// Load Thumb code at TEST_BASE and start the CPU on it in System mode
+static void test_load_thumb(const uint16_t* code, size_t size)
+{
+    cpu_reset(&gba.cpu);
+    block_cache_flush(gba.blocks);
+    memcpy(gba.memory->wram, code, size);
+    cpu_write_cpsr(&gba.cpu, 0x1F);
+    gba.cpu.registers.pc = TEST_BASE;
+}
+
+// Load ARM code at TEST_BASE and start the CPU on it in `mode`
+static void test_load_arm(const uint32_t* code, size_t size, uint32_t mode)
+{
+    cpu_reset(&gba.cpu);
+    block_cache_flush(gba.blocks);
+    memcpy(gba.memory->wram, code, size);
+    cpu_write_cpsr(&gba.cpu, 0x20 | mode);
+    gba.cpu.registers.pc = TEST_BASE;
+}
+
+// Run `count` instructions, or blocks with `mode` set
+static void test_run(int mode, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (mode ? !block_cache_execute(gba.blocks, &gba.cpu) : !cpu_step(&gba.cpu)) {
+            printf("FAIL: instruction at 0x%08X was not executed\n", gba.cpu.registers.pc);
+            failures++;
+            return;
+        }
+    }
+}
+
+// Hi register operations with R15 as the source or the destination
+static void test_thumb_hi_pc(void)
+{
+    for (int mode = 0; mode < 2; mode++) {
+        // mov r0, pc reads the address of the instruction + 4
+        static const uint16_t mov_from_pc[] = { 0x4678 };
+        test_load_thumb(mov_from_pc, sizeof(mov_from_pc));
+        test_run(mode, 1);
+        test_check("mov r0, pc", mode, "r0", gba.cpu.registers.r[0], TEST_BASE + 4);
+
+        // mov pc, r1 branches to r1 with bit 0 cleared
+        static const uint16_t mov_to_pc[] = { 0x468F };
+        test_load_thumb(mov_to_pc, sizeof(mov_to_pc));
+        gba.cpu.registers.r[1] = TEST_BASE + 0x11;
+        test_run(mode, 1);
+        test_check("mov pc, r1", mode, "pc", gba.cpu.registers.pc, TEST_BASE + 0x10);
+        test_check("mov pc, r1", mode, "thumb", gba.cpu.registers.cpsr & 0x20, 0);
+
+        // add pc, r1 adds to the address of the instruction + 4
+        static const uint16_t add_to_pc[] = { 0x448F };
+        test_load_thumb(add_to_pc, sizeof(add_to_pc));
+        gba.cpu.registers.r[1] = 8;
+        test_run(mode, 1);
+        test_check("add pc, r1", mode, "pc", gba.cpu.registers.pc, TEST_BASE + 12);
+
+        // A jump table: add pc, r0 over a nop, then the case that sets r2
+        static const uint16_t table[] = { 0x4487, 0x46C0, 0x2201, 0x2202 };
+        test_load_thumb(table, sizeof(table));
+        gba.cpu.registers.r[0] = 2;
+        test_run(mode, 2);
+        test_check("add pc, r0 table", mode, "r2", gba.cpu.registers.r[2], 2);
+    }
+}
+
+// MSR only writes the fields in its mask, and only the control field switches banks
+static void test_arm_msr(void)
+{
+    for (int mode = 0; mode < 2; mode++) {
+        // msr cpsr_f, r0 in IRQ mode sets the flags and leaves the mode and SP alone
+        static const uint32_t flags[] = { 0xE128F000 };
+        test_load_arm(flags, sizeof(flags), 0x12);
+        gba.cpu.registers.sp = 0x03007FA0;
+        gba.cpu.registers.r[0] = 0xF0000013;
+        test_run(mode, 1);
+        cpu_flags_resolve(&gba.cpu);
+        test_check("msr cpsr_f, r0", mode, "cpsr", gba.cpu.registers.cpsr, 0xF0000032);
+        test_check("msr cpsr_f, r0", mode, "sp", gba.cpu.registers.sp, 0x03007FA0);
+
+        // msr cpsr_c, #0x1F in Supervisor mode switches to System mode and its bank, staying in ARM state
+        static const uint32_t control[] = { 0xE321F01F };
+        test_load_arm(control, sizeof(control), 0x1F);
+        gba.cpu.registers.sp = 0x03007F00;
+        cpu_write_cpsr(&gba.cpu, 0x33);
+        gba.cpu.registers.sp = 0x03007FE0;
+        test_run(mode, 1);
+        test_check("msr cpsr_c, #0x1F", mode, "cpsr", gba.cpu.registers.cpsr & 0xFF, 0x3F);
+        test_check("msr cpsr_c, #0x1F", mode, "sp", gba.cpu.registers.sp, 0x03007F00);
+        test_check("msr cpsr_c, #0x1F", mode, "pc", gba.cpu.registers.pc, TEST_BASE + 4);
+
+        // msr spsr_f, r0 only replaces the flags of the SPSR
+        static const uint32_t spsr[] = { 0xE168F000 };
+        test_load_arm(spsr, sizeof(spsr), 0x12);
+        gba.cpu.registers.spsr = 0x0000003F;
+        gba.cpu.registers.r[0] = 0x80000010;
+        test_run(mode, 1);
+        test_check("msr spsr_f, r0", mode, "spsr", gba.cpu.registers.spsr, 0x8000003F);
+    }
+}
+
+// Polling loops are only skipped while they read I/O registers that change at device events
+static void test_idle(void)
+{
+    // ldr r0, [r1, #4]; lsr r0, r0, #1; bcc back to the load, waiting for VBlank in DISPSTAT
+    static const uint16_t poll[] = { 0x6848, 0x0840, 0xD3FC };
+    static const struct {
+        const char* name;
+        uint32_t base;
+        int idle;
+    } cases[] = {
+        { "poll DISPSTAT", 0x04000000, 1 },
+        { "poll a WRAM flag", TEST_BASE + 0x100, 0 },
+        { "poll TM0CNT_L", 0x04000100 - 4, 0 },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        test_load_thumb(poll, sizeof(poll));
+        memset(gba.memory->wram + 0x100, 0, 8);
+        gba.cpu.registers.r[1] = cases[i].base;
+        test_run(1, 1);
+        test_check(cases[i].name, 1, "pc", gba.cpu.registers.pc, TEST_BASE);
+        test_check(cases[i].name, 1, "idle", (uint32_t)block_idle_at(gba.blocks, &gba.cpu), (uint32_t)cases[i].idle);
+    }
+
+    // mov r1, #0x04000000; ldr r0, [r1, #4]; tst r0, #1; beq back to the mov, the base is set in the loop
+    static const uint32_t arm_poll[] = { 0xE3A01301, 0xE5910004, 0xE3100001, 0x0AFFFFFB };
+    test_load_arm(arm_poll, sizeof(arm_poll), 0x1F);
+    test_run(1, 1);
+    test_check("poll DISPSTAT in ARM", 1, "idle", (uint32_t)block_idle_at(gba.blocks, &gba.cpu), 1);
+
+    // The base is set to WRAM for the load, then to the I/O registers before the branch back
+    // mov r1, #2; lsl r1, r1, #24; ldr r0, [r1, #4]; mov r1, #4; lsl r1, r1, #24; lsr r0, r0, #1; bcc
+    static const uint16_t moving[] = { 0x2102, 0x0609, 0x6848, 0x2104, 0x0609, 0x0840, 0xD3F8 };
+    test_load_thumb(moving, sizeof(moving));
+    test_run(1, 1);
+    test_check("poll with a moving base", 1, "idle", (uint32_t)block_idle_at(gba.blocks, &gba.cpu), 0);
+}
+
+// Registers, resolved flags, cycles and data memory after a block ran once
+typedef struct test_state {
+    uint32_t r[16];
+    uint32_t cpsr;
+    uint32_t cycles;
+    uint8_t data[0x40];
+} test_state_t;
+
+// Run the block at TEST_BASE once, compiled by `jit` or replayed without it
+static void test_run_block(jit_t* jit, test_state_t* state)
+{
+    block_t* block = block_lookup(gba.blocks, &gba.cpu);
+    gba.cpu.cycles = 0;
+    memset(gba.memory->wram + 0x100, 0x5A, sizeof(state->data));
+    gba.cpu.registers.r[3] = TEST_BASE + 0x100;
+    gba.cpu.registers.r[4] = TEST_BASE + 0x100;
+
+    if (jit != NULL) {
+        block->hits = JIT_THRESHOLD - 1;
+        jit_execute(jit, gba.blocks, &gba.cpu);
+        test_check("compile", 2, "native", block->native != NULL, 1);
+    } else {
+        block_replay(&gba.cpu, block);
+    }
+
+    cpu_flags_resolve(&gba.cpu);
+    memcpy(state->r, gba.cpu.registers.r, sizeof(state->r));
+    state->cpsr = gba.cpu.registers.cpsr;
+    state->cycles = (uint32_t)gba.cpu.cycles;
+    memcpy(state->data, gba.memory->wram + 0x100, sizeof(state->data));
+}
+
+// Compare a compiled run of a block with a replayed one
+static void test_compare(const char* name, const test_state_t* compiled, const test_state_t* replayed)
+{
+    static const char* const names[] = { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11",
+        "r12", "sp", "lr", "pc" };
+
+    for (int n = 0; n < 16; n++) {
+        test_check(name, 2, names[n], compiled->r[n], replayed->r[n]);
+    }
+    test_check(name, 2, "cpsr", compiled->cpsr, replayed->cpsr);
+    test_check(name, 2, "cycles", compiled->cycles, replayed->cycles);
+    for (size_t i = 0; i < sizeof(compiled->data); i += 4) {
+        uint32_t a, b;
+        memcpy(&a, compiled->data + i, 4);
+        memcpy(&b, replayed->data + i, 4);
+        test_check(name, 2, "memory", a, b);
+    }
+}
+
+// Compiled blocks leave the same state as replayed ones
+static void test_jit(void)
+{
+    jit_t* jit = jit_create();
+    if (jit == NULL) {
+        return; // Not built for this host
+    }
+
+    // Data processing with and without flags, word and byte loads and stores around r3, b .
+    static const uint32_t arm[] = {
+        0xE3A00005, // mov r0, #5
+        0xE2901003, // adds r1, r0, #3
+        0xE2512008, // subs r2, r1, #8
+        0xE5831000, // str r1, [r3]
+        0xE5934000, // ldr r4, [r3]
+        0xE5C30005, // strb r0, [r3, #5]
+        0xE5D35005, // ldrb r5, [r3, #5]
+        0xE3856C0F, // orr r6, r5, #0xF00
+        0xE2707000, // rsbs r7, r0, #0
+        0xE2A08001, // adc r8, r0, #1
+        0xE2109004, // ands r9, r0, #4
+        0xEAFFFFFE, // b .
+    };
+    // The same for Thumb around r4, ending in a fused cmp / bne
+    static const uint16_t thumb[] = {
+        0x20C8, // mov r0, #200
+        0x0101, // lsl r1, r0, #4
+        0x180A, // add r2, r1, r0
+        0x1FD3, // sub r3, r2, #7
+        0x6022, // str r2, [r4]
+        0x6825, // ldr r5, [r4]
+        0x71A0, // strb r0, [r4, #6]
+        0x79A6, // ldrb r6, [r4, #6]
+        0x4005, // and r5, r0
+        0x2B55, // cmp r3, #0x55
+        0xD1FE, // bne .
+    };
+
+    test_state_t compiled, replayed;
+    for (int mode = 0; mode < 2; mode++) {
+        test_load_arm(arm, sizeof(arm), 0x1F);
+        test_run_block(mode ? jit : NULL, mode ? &compiled : &replayed);
+    }
+    test_compare("arm block", &compiled, &replayed);
+
+    for (int mode = 0; mode < 2; mode++) {
+        test_load_thumb(thumb, sizeof(thumb));
+        test_run_block(mode ? jit : NULL, mode ? &compiled : &replayed);
+    }
+    test_compare("thumb block", &compiled, &replayed);
+
+    jit_destroy(jit);
+}
+
+// A saved state brings back the registers, flags, memory and I/O registers, and is only loaded
+// into the version and images it was saved with
+static void test_state(void)
+{
+    static uint8_t buffer[GBA_STATE_SIZE];
+    state_t* state = (state_t*)buffer;
+
+    // adds r1, r0, #1 leaves Z and C pending in the lazy flags
+    static const uint32_t code[] = { 0xE2901001 };
+    test_load_arm(code, sizeof(code), 0x1F);
+    gba.cpu.registers.r[0] = 0xFFFFFFFF;
+    test_run(0, 1);
+    memset(gba.memory->wram + 0x100, 0xA5, 0x100);
+    memory_io_write16(gba.memory, PPU_BGCNT(0), 0x1234);
+    gba.cpu.cycles = 123456;
+    test_check("save", 0, "result", (uint32_t)gba_save_state(&gba, buffer, sizeof(buffer)), 0);
+
+    gba.cpu.registers.r[1] = 0xDEADBEEF;
+    cpu_write_cpsr(&gba.cpu, 0xF000003F);
+    memset(gba.memory->wram + 0x100, 0, 0x100);
+    memory_io_write16(gba.memory, PPU_BGCNT(0), 0);
+    gba.cpu.cycles = 1;
+
+    // A state from another version of the format or another cartridge is refused and changes nothing
+    state->header.version++;
+    test_check("load other version", 0, "result", (uint32_t)gba_load_state(&gba, buffer, sizeof(buffer)), STATE_LOAD_INVALID);
+    state->header.version--;
+    state->header.rom_hash ^= 1;
+    test_check("load other cartridge", 0, "result", (uint32_t)gba_load_state(&gba, buffer, sizeof(buffer)), STATE_LOAD_MISMATCH);
+    state->header.rom_hash ^= 1;
+    test_check("load short buffer", 0, "result", (uint32_t)gba_load_state(&gba, buffer, sizeof(buffer) - 1), STATE_LOAD_INVALID);
+    test_check("refused load", 0, "r1", gba.cpu.registers.r[1], 0xDEADBEEF);
+
+    test_check("load", 0, "result", (uint32_t)gba_load_state(&gba, buffer, sizeof(buffer)), STATE_LOAD_OK);
+    cpu_flags_resolve(&gba.cpu);
+    test_check("load", 0, "r1", gba.cpu.registers.r[1], 0);
+    test_check("load", 0, "cpsr", gba.cpu.registers.cpsr, 0x6000003F);
+    test_check("load", 0, "pc", gba.cpu.registers.pc, TEST_BASE + 4);
+    test_check("load", 0, "cycles", (uint32_t)gba.cpu.cycles, 123456);
+    test_check("load", 0, "wram", (uint8_t)gba.memory->wram[0x100], 0xA5);
+    test_check("load", 0, "wram", (uint8_t)gba.memory->wram[0x1FF], 0xA5);
+    test_check("load", 0, "BG0CNT", memory_io_read16(gba.memory, PPU_BGCNT(0)), 0x1234);
+}
+
+// Each rewind step goes back one snapshot, bringing back the WRAM and the registers of that frame
+static void test_rewind(void)
+{
+    static rewind_t rewind;
+    if (rewind_init(&rewind, 1 << 20, 1)) {
+        printf("FAIL: rewind buffers could not be allocated\n");
+        failures++;
+        return;
+    }
+
+    // Three frames, memory is written through the bus so the snapshots see the change
+    static const uint32_t code[] = { 0xE1A00000 }; // nop
+    test_load_arm(code, sizeof(code), 0x1F);
+    for (uint32_t frame = 1; frame <= 3; frame++) {
+        gba.cpu.registers.r[0] = frame;
+        bus_write32(gba.bus, TEST_BASE + 0x200, 0x11111111 * frame);
+        if (frame < 3) {
+            rewind_push(&rewind, &gba);
+        }
+    }
+
+    for (uint32_t frame = 2; frame >= 1; frame--) {
+        test_check("rewind step", 0, "result", (uint32_t)rewind_step(&rewind, &gba), 0);
+        test_check("rewind step", 0, "r0", gba.cpu.registers.r[0], frame);
+        test_check("rewind step", 0, "wram", bus_read32(gba.bus, TEST_BASE + 0x200), 0x11111111 * frame);
+    }
+
+    // The oldest snapshot is where rewinding stops
+    test_check("rewind past the oldest", 0, "result", (uint32_t)rewind_step(&rewind, &gba), 0);
+    test_check("rewind past the oldest", 0, "r0", gba.cpu.registers.r[0], 1);
+
+    rewind_free(&rewind);
+}
+
+// Start an immediate transfer on DMA 3 from `source` to `dest` and run it
+static void test_dma_run(uint32_t source, uint32_t dest, uint16_t count, uint16_t control)
+{
+    memory_io_write16(gba.memory, IRQ_IF, 0);
+    bus_write32(gba.bus, BUS_IO + DMA_SAD(3), source);
+    bus_write32(gba.bus, BUS_IO + DMA_DAD(3), dest);
+    bus_write16(gba.bus, BUS_IO + DMA_CNT_L(3), count);
+    bus_write16(gba.bus, BUS_IO + DMA_CNT_H(3), control | DMA_ENABLE);
+    scheduler_run(&gba.scheduler, gba.cpu.cycles + DMA_CYCLES_START);
+}
+
+// Immediate DMA copies and fills, requests its interrupt and turns itself off at the end
+static void test_dma(void)
+{
+    uint32_t source = TEST_BASE + 0x400;
+    uint32_t dest = TEST_BASE + 0x800;
+
+    // 16 words counting up, the CPU is stalled for the transfer
+    for (uint32_t i = 0; i < 16; i++) {
+        bus_write32(gba.bus, source + 4 * i, 0x01010101 * i);
+    }
+    uint64_t start = gba.cpu.cycles;
+    test_dma_run(source, dest, 16, DMA_WORD | DMA_IRQ);
+    for (uint32_t i = 0; i < 16; i++) {
+        test_check("dma copy", 0, "word", bus_read32(gba.bus, dest + 4 * i), 0x01010101 * i);
+    }
+    test_check("dma copy", 0, "IF", memory_io_read16(gba.memory, IRQ_IF) & IRQ_DMA3, IRQ_DMA3);
+    test_check("dma copy", 0, "DMA3CNT_H", bus_read16(gba.bus, BUS_IO + DMA_CNT_H(3)) & DMA_ENABLE, 0);
+    test_check("dma copy", 0, "cycles", (uint32_t)(gba.cpu.cycles - start), DMA_CYCLES_START + 16 * DMA_CYCLES_UNIT);
+
+    // 8 halfwords from a fixed source, stopping at the count and without an interrupt
+    bus_write16(gba.bus, source, 0xBEEF);
+    test_dma_run(source, dest, 8, DMA_ADDRESS_FIXED << 7);
+    for (uint32_t i = 0; i < 8; i++) {
+        test_check("dma fill", 0, "halfword", bus_read16(gba.bus, dest + 2 * i), 0xBEEF);
+    }
+    test_check("dma fill", 0, "after the count", bus_read32(gba.bus, dest + 16), 0x04040404);
+    test_check("dma fill", 0, "IF", memory_io_read16(gba.memory, IRQ_IF) & IRQ_DMA3, 0);
+    test_check("dma fill", 0, "DMA3CNT_H", bus_read16(gba.bus, BUS_IO + DMA_CNT_H(3)) & DMA_ENABLE, 0);
+}
+
+// Run the Thumb `swi #number`
+static void test_swi(int mode, uint8_t number)
+{
+    uint16_t swi[] = { (uint16_t)(0xDF00 | number) };
+    uint32_t r[4];
+    memcpy(r, gba.cpu.registers.r, sizeof(r));
+    test_load_thumb(swi, sizeof(swi));
+    memcpy(gba.cpu.registers.r, r, sizeof(r));
+    test_run(mode, 1);
+}
+
+// The BIOS calls done in bios.h give the results of the BIOS
+static void test_bios(void)
+{
+    for (int mode = 0; mode < 2; mode++) {
+        // Div rounds towards zero, the remainder has the sign of the numerator
+        gba.cpu.registers.r[0] = (uint32_t)-7;
+        gba.cpu.registers.r[1] = 2;
+        test_swi(mode, 0x06);
+        test_check("Div -7 / 2", mode, "r0", gba.cpu.registers.r[0], (uint32_t)-3);
+        test_check("Div -7 / 2", mode, "r1", gba.cpu.registers.r[1], (uint32_t)-1);
+        test_check("Div -7 / 2", mode, "r3", gba.cpu.registers.r[3], 3);
+        test_check("Div -7 / 2", mode, "pc", gba.cpu.registers.pc, TEST_BASE + 2);
+
+        gba.cpu.registers.r[0] = 1000000;
+        test_swi(mode, 0x08);
+        test_check("Sqrt 1000000", mode, "r0", gba.cpu.registers.r[0], 1000);
+        gba.cpu.registers.r[0] = 99;
+        test_swi(mode, 0x08);
+        test_check("Sqrt 99", mode, "r0", gba.cpu.registers.r[0], 9);
+
+        // Angles in 1/65536 turns of 1.14 fixed point vectors
+        static const struct {
+            int16_t x;
+            int16_t y;
+            uint32_t angle;
+        } angles[] = {
+            { 0x4000, 0x4000, 0x2000 },
+            { -0x4000, 0, 0x8000 },
+            { 0x4000, -0x4000, 0xE000 },
+        };
+        for (size_t i = 0; i < sizeof(angles) / sizeof(angles[0]); i++) {
+            gba.cpu.registers.r[0] = (uint32_t)angles[i].x;
+            gba.cpu.registers.r[1] = (uint32_t)angles[i].y;
+            test_swi(mode, 0x0A);
+            test_check("ArcTan2", mode, "r0", gba.cpu.registers.r[0], angles[i].angle);
+        }
+
+        // "ABC", then 5 bytes copied from 3 back
+        static const uint8_t lz77[] = { 0x10, 0x08, 0x00, 0x00, 0x10, 'A', 'B', 'C', 0x20, 0x02 };
+        // A run of four 'x', then "abc" as they are
+        static const uint8_t run_length[] = { 0x30, 0x07, 0x00, 0x00, 0x81, 'x', 0x02, 'a', 'b', 'c' };
+        static const struct {
+            const char* name;
+            uint8_t number;
+            const uint8_t* data;
+            size_t size;
+            const char* expected;
+        } streams[] = {
+            { "LZ77UnCompWram", 0x11, lz77, sizeof(lz77), "ABCABCAB" },
+            { "RLUnCompWram", 0x14, run_length, sizeof(run_length), "xxxxabc" },
+        };
+        for (size_t i = 0; i < sizeof(streams) / sizeof(streams[0]); i++) {
+            memcpy(gba.memory->wram + 0x400, streams[i].data, streams[i].size);
+            memset(gba.memory->wram + 0x800, 0, 16);
+            gba.cpu.registers.r[0] = TEST_BASE + 0x400;
+            gba.cpu.registers.r[1] = TEST_BASE + 0x800;
+            test_swi(mode, streams[i].number);
+            for (size_t n = 0; n <= strlen(streams[i].expected); n++) {
+                test_check(streams[i].name, mode, "byte", (uint8_t)gba.memory->wram[0x800 + n], (uint8_t)streams[i].expected[n]);
+            }
+        }
+    }
+}
+
+// Fused Thumb pairs leave the same registers and flags as the two instructions run one by one
+static void test_fusion(void)
+{
+    // Each pair is followed by b . so that the block ends in the same place either way
+    static const struct {
+        const char* name;
+        uint16_t code[3];
+        uint32_t r0;
+        uint32_t r1;
+        int steps; // Instructions the interpreter runs for the block
+    } cases[] = {
+        { "cmp r0, #5; beq taken", { 0x2805, 0xD0FE, 0xE7FE }, 5, 0, 2 },
+        { "cmp r0, #5; beq not taken", { 0x2805, 0xD0FE, 0xE7FE }, 6, 0, 2 },
+        { "cmp r0, #5; bgt signed", { 0x2805, 0xDCFE, 0xE7FE }, 0xFFFFFFFF, 0, 2 },
+        { "cmp r0, #5; bcs unsigned", { 0x2805, 0xD2FE, 0xE7FE }, 0xFFFFFFFF, 0, 2 },
+        { "cmp r0, r1; blt overflow", { 0x4288, 0xDBFE, 0xE7FE }, 0x80000000, 1, 2 },
+        { "cmp r0, r1; bvs overflow", { 0x4288, 0xD6FE, 0xE7FE }, 0x80000000, 1, 2 },
+        { "lsl r0, #24; lsr r0, #24", { 0x0600, 0x0E00, 0xE7FE }, 0x12345680, 0, 3 },
+        { "add r2, r0, r1; ldr r3, [r2, #4]", { 0x1842, 0x6853, 0xE7FE }, TEST_BASE + 0x320, (uint32_t)-0x10, 3 },
+        { "add r2, r0, r1; ldrb r3, [r2, #1]", { 0x1842, 0x7853, 0xE7FE }, TEST_BASE + 0x300, 0x10, 3 },
+        { "bl", { 0xF000, 0xF802, 0xE7FE }, 0, 0, 2 },
+    };
+    static const char* const names[] = { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7" };
+
+    static const uint8_t data[] = { 0x0D, 0xF0, 0xFE, 0xCA, 0x0D, 0xF0, 0xFE, 0xCA };
+    memcpy(gba.memory->wram + 0x310, data, sizeof(data));
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        cpu_registers_t unfused;
+        for (int mode = 0; mode < 2; mode++) {
+            test_load_thumb(cases[i].code, sizeof(cases[i].code));
+            gba.cpu.registers.r[0] = cases[i].r0;
+            gba.cpu.registers.r[1] = cases[i].r1;
+            test_run(mode, mode ? 1 : cases[i].steps);
+            cpu_flags_resolve(&gba.cpu);
+            if (mode == 0) {
+                unfused = gba.cpu.registers;
+            }
+        }
+
+        test_check(cases[i].name, 1, "fused", gba.blocks->blocks[(TEST_BASE >> 1) & (BLOCK_CACHE_SIZE - 1)].ops[0].length, 2);
+        for (int n = 0; n < 8; n++) {
+            test_check(cases[i].name, 1, names[n], gba.cpu.registers.r[n], unfused.r[n]);
+        }
+        test_check(cases[i].name, 1, "lr", gba.cpu.registers.lr, unfused.lr);
+        test_check(cases[i].name, 1, "pc", gba.cpu.registers.pc, unfused.pc);
+        test_check(cases[i].name, 1, "cpsr", gba.cpu.registers.cpsr, unfused.cpsr);
+    }
+}
+
+int main(void)
+{
+    cpu_init_tables();
+    if (gba_init(&gba)) {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+    gba_reset(&gba);
+
+    test_thumb_hi_pc();
+    test_arm_msr();
+    test_idle();
+    test_jit();
+    test_state();
+    test_rewind();
+    test_dma();
+    test_bios();
+    test_fusion();
+
+    gba_free(&gba);
+    if (failures == 0) {
+        printf("All tests passed\n");
+    }
+    return failures;
+}